@@ -165,6 +165,31 @@ struct ptm_getconfig {
 #define CONFIG_FLAG_FILE_KEY        0x1
 #define CONFIG_FLAG_MIGRATION_KEY   0x2
 
+/*
+ * PTM_SNAPSHOT: Data structure to create a point-in-time copy of the TPM
+ * state files in a directory. The volatile state is stored first if the
+ * TPM is running.
+ * PTM_RESTORE: Data structure to replace the TPM state files with those
+ * of a snapshot; the TPM must not be running.
+ * The path must be absolute and NUL-terminated.
+ */
+#define SNAPSHOT_PATH_MAX (4 * 1024)
+
+struct ptm_snapshot {
+    union {
+        struct {
+            uint32_t flags; /* currently unused; must be 0 */
+            char path[SNAPSHOT_PATH_MAX];
+        } req;
+        struct {
+            ptm_res tpm_result;
+            uint32_t flags;
+        } resp;
+    } u;
+};
+
+#define SNAPSHOT_FLAG_REFLINKED   1 /* on output: all files were cloned */
+
 
 typedef uint64_t ptm_cap;
 typedef struct ptm_est ptm_est;
@@ -175,6 +200,7 @@ typedef struct ptm_init ptm_init;
 typedef struct ptm_getstate ptm_getstate;
 typedef struct ptm_setstate ptm_setstate;
 typedef struct ptm_getconfig ptm_getconfig;
+typedef struct ptm_snapshot ptm_snapshot;
 
 /* capability flags returned by PTM_GET_CAPABILITY */
 #define PTM_CAP_INIT               (1)
@@ -189,6 +215,8 @@ typedef struct ptm_getconfig ptm_getconfig;
 #define PTM_CAP_SET_STATEBLOB      (1<<9)
 #define PTM_CAP_STOP               (1<<10)
 #define PTM_CAP_GET_CONFIG         (1<<11)
+#define PTM_CAP_SNAPSHOT           (1<<12)
+#define PTM_CAP_HASH_WRITE         (1<<13)
 
 enum {
     PTM_GET_CAPABILITY     = _IOR('P', 0, ptm_cap),
@@ -206,4 +234,11 @@ enum {
     PTM_SET_STATEBLOB      = _IOWR('P', 12, ptm_setstate),
     PTM_STOP               = _IOR('P', 13, ptm_res),
     PTM_GET_CONFIG         = _IOR('P', 14, ptm_getconfig),
+    PTM_SNAPSHOT           = _IOWR('P', 15, ptm_snapshot),
+    PTM_RESTORE            = _IOWR('P', 16, ptm_snapshot),
+    /*
+     * switch the write() interface of the device to hashing: all data
+     * written to it are hashed until PTM_HASH_END
+     */
+    PTM_HASH_WRITE         = _IOR('P', 17, ptm_res),
 };
@@ -51,6 +51,7 @@
 #include "key.h"
 #include "logging.h"
 #include "swtpm_nvfile.h"
+#include "swtpm_startup.h"
 
 /* --log %s */
 static const OptionDesc logging_opt_desc[] = {
@@ -85,6 +86,51 @@ static const OptionDesc key_opt_desc[] = {
     END_OPTION_DESC
 };
 
+/* --tpmstate %s */
+static const OptionDesc tpmstate_opt_desc[] = {
+    {
+        .name = "backend",
+        .type = OPT_TYPE_STRING,
+    }, {
+        .name = "objects",
+        .type = OPT_TYPE_STRING,
+    }, {
+        .name = "seed",
+        .type = OPT_TYPE_STRING,
+    }, {
+        .name = "persist",
+        .type = OPT_TYPE_STRING,
+    }, {
+        .name = "number",
+        .type = OPT_TYPE_INT,
+    },
+    END_OPTION_DESC
+};
+
+/* --startup %s */
+static const OptionDesc startup_opt_desc[] = {
+    {
+        .name = "clear",
+        .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "state",
+        .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "deactivated",
+        .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "enable",
+        .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "activate",
+        .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "selftest",
+        .type = OPT_TYPE_BOOLEAN,
+    },
+    END_OPTION_DESC
+};
+
 /*
  * handle_log_options:
  * Parse and act upon the parsed log options. Initialize the logging.
@@ -181,6 +227,10 @@ parse_key_options(char *options, unsigned char *key, size_t maxkeylen,
     if (*encmode == ENCRYPTION_MODE_UNKNOWN)
         goto error;
 
+    /* the key length is determined by the encryption mode */
+    if (maxkeylen > encryption_mode_key_length(*encmode))
+        maxkeylen = encryption_mode_key_length(*encmode);
+
     if (keyfile != NULL) {
         if (key_load_key(keyfile, keyformat,
                          key, keylen, maxkeylen) < 0)
@@ -221,7 +271,7 @@ int
 handle_key_options(char *options)
 {
     enum encryption_mode encmode = ENCRYPTION_MODE_UNKNOWN;
-    unsigned char key[128/8];
+    unsigned char key[256/8];
     size_t maxkeylen = sizeof(key);
     size_t keylen;
 
@@ -249,7 +299,7 @@ int
 handle_migration_key_options(char *options)
 {
     enum encryption_mode encmode = ENCRYPTION_MODE_UNKNOWN;
-    unsigned char key[128/8];
+    unsigned char key[256/8];
     size_t maxkeylen = sizeof(key);
     size_t keylen;
 
@@ -264,3 +314,167 @@ handle_migration_key_options(char *options)
 
     return 0;
 }
+
+/*
+ * handle_new_key_options:
+ * Parse the options of the key that the TPM state is to be re-encrypted
+ * with and set it.
+ * @options: the key options to parse
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+handle_new_key_options(char *options)
+{
+    enum encryption_mode encmode = ENCRYPTION_MODE_UNKNOWN;
+    unsigned char key[256/8];
+    size_t maxkeylen = sizeof(key);
+    size_t keylen;
+
+    if (!options)
+        return 0;
+
+    if (parse_key_options(options, key, maxkeylen, &keylen, &encmode) < 0)
+        return -1;
+
+    if (SWTPM_NVRAM_Set_NewFileKey(key, keylen, encmode) != TPM_SUCCESS)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * handle_tpmstate_options:
+ * Parse and act upon the parsed TPM state options. Select the storage
+ * backend for the TPM state.
+ * @options: the TPM state options to parse
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+handle_tpmstate_options(char *options)
+{
+    OptionValues *ovs = NULL;
+    char *error = NULL;
+    const char *backend, *objects, *seed, *persist;
+    enum nvram_backend nvbackend;
+    int number;
+
+    if (!options)
+        return 0;
+
+    ovs = options_parse(options, tpmstate_opt_desc, &error);
+    if (!ovs) {
+        fprintf(stderr, "Error parsing tpmstate options: %s\n",
+                error);
+        return -1;
+    }
+
+    backend = option_get_string(ovs, "backend", "dir");
+    nvbackend = nvram_backend_from_string(backend);
+    if (nvbackend == NVRAM_BACKEND_UNKNOWN) {
+        fprintf(stderr, "Unknown TPM state backend '%s'.\n", backend);
+        goto error;
+    }
+
+    objects = option_get_string(ovs, "objects", NULL);
+    if (objects) {
+        if (nvbackend != NVRAM_BACKEND_CAS) {
+            fprintf(stderr, "The objects option requires the cas backend.\n");
+            goto error;
+        }
+        if (SWTPM_NVRAM_CAS_Set_ObjectDir(objects) != TPM_SUCCESS)
+            goto error;
+    }
+
+    seed = option_get_string(ovs, "seed", NULL);
+    persist = option_get_string(ovs, "persist", NULL);
+    if (seed || persist) {
+        if (nvbackend != NVRAM_BACKEND_MEMORY) {
+            fprintf(stderr,
+                    "The seed and persist options require the memory "
+                    "backend.\n");
+            goto error;
+        }
+        if (SWTPM_NVRAM_Memory_Set_SeedDir(seed) != TPM_SUCCESS ||
+            SWTPM_NVRAM_Memory_Set_PersistDir(persist) != TPM_SUCCESS)
+            goto error;
+    }
+
+    number = option_get_int(ovs, "number", 0);
+    if (number < 0) {
+        fprintf(stderr, "The TPM number must not be negative.\n");
+        goto error;
+    }
+    SWTPM_NVRAM_Set_TPMNumber(number);
+
+    if (SWTPM_NVRAM_Set_Backend(nvbackend) != TPM_SUCCESS)
+        goto error;
+
+    option_values_free(ovs);
+
+    return 0;
+
+error:
+    option_values_free(ovs);
+
+    return -1;
+}
+
+/*
+ * handle_startup_options:
+ * Parse the startup options, which select the TPM commands to run
+ * right after the TPM has been initialized.
+ * @options: the startup options to parse
+ * @startup_flags: pointer to an unsigned int to return the STARTUP_FLAG_*
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int
+handle_startup_options(char *options, unsigned int *startup_flags)
+{
+    OptionValues *ovs = NULL;
+    char *error = NULL;
+    unsigned int types = 0;
+
+    *startup_flags = 0;
+
+    if (!options)
+        return 0;
+
+    ovs = options_parse(options, startup_opt_desc, &error);
+    if (!ovs) {
+        fprintf(stderr, "Error parsing startup options: %s\n",
+                error);
+        return -1;
+    }
+
+    if (option_get_bool(ovs, "clear", false)) {
+        *startup_flags |= STARTUP_FLAG_CLEAR;
+        types++;
+    }
+    if (option_get_bool(ovs, "state", false)) {
+        *startup_flags |= STARTUP_FLAG_STATE;
+        types++;
+    }
+    if (option_get_bool(ovs, "deactivated", false)) {
+        *startup_flags |= STARTUP_FLAG_DEACTIVATED;
+        types++;
+    }
+    if (option_get_bool(ovs, "enable", false))
+        *startup_flags |= STARTUP_FLAG_ENABLE;
+    if (option_get_bool(ovs, "activate", false))
+        *startup_flags |= STARTUP_FLAG_ACTIVATE;
+    if (option_get_bool(ovs, "selftest", false))
+        *startup_flags |= STARTUP_FLAG_SELFTEST;
+
+    option_values_free(ovs);
+
+    if (types > 1) {
+        fprintf(stderr,
+                "Only one of clear, state and deactivated may be given.\n");
+        return -1;
+    }
+
+    return 0;
+}
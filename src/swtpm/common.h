@@ -40,6 +40,9 @@
 int handle_log_options(char *options);
 int handle_key_options(char *options);
 int handle_migration_key_options(char *options);
+int handle_new_key_options(char *options);
+int handle_tpmstate_options(char *options);
+int handle_startup_options(char *options, unsigned int *startup_flags);
 
 #endif /* _SWTPM_COMMON_H_ */
 
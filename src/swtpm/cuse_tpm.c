@@ -62,6 +62,7 @@
 #include "logging.h"
 #include "main.h"
 #include "common.h"
+#include "swtpm_startup.h"
 
 #include <glib.h>
 
@@ -73,6 +74,7 @@ static int tpm_running;
 static int thread_busy;
 static GThreadPool *pool;
 static struct passwd *passwd;
+static unsigned int startup_flags;
 
 #if GLIB_MAJOR_VERSION >= 2
 # if GLIB_MINOR_VERSION >= 32
@@ -110,6 +112,8 @@ struct ptm_param {
     char *logging;
     char *keydata;
     char *migkeydata;
+    char *tpmstatedata;
+    char *startupdata;
 };
 
 
@@ -127,23 +131,22 @@ struct thread_message {
 
 struct stateblob {
     uint8_t type;
-    uint8_t *data;
-    uint32_t length;
-    TPM_BOOL is_encrypted;
+    struct stateblob_writer *writer;
 };
 
 typedef struct stateblob_desc {
     uint32_t blobtype;
     TPM_BOOL decrypt;
     TPM_BOOL is_encrypted;
-    unsigned char *data;
-    uint32_t data_length;
+    struct stateblob_reader *reader;
+    uint32_t totlength;
 } stateblob_desc;
 
 typedef enum tx_state_type {
     TX_STATE_RW_COMMAND = 1,
     TX_STATE_SET_STATE_BLOB = 2,
     TX_STATE_GET_STATE_BLOB = 3,
+    TX_STATE_HASH_DATA = 4,
 } tx_state_type;
 
 typedef struct transfer_state {
@@ -162,9 +165,12 @@ ptm_set_stateblob_append(uint32_t blobtype,
                          const unsigned char *data, uint32_t length,
                          bool is_encrypted, bool is_last);
 
+static uint32_t
+cached_stateblob_get_bloblength(void);
+
 static int
-cached_stateblob_get(uint32_t offset,
-                     unsigned char **bufptr, size_t *length);
+cached_stateblob_copy(void *dest, size_t destlen, uint32_t srcoffset,
+                      uint32_t *copied, TPM_BOOL *is_encrypted);
 
 
 static const char *usage =
@@ -175,30 +181,45 @@ static const char *usage =
 "-n NAME|--name=NAME :  device name (mandatory)\n"
 "-M MAJ|--maj=MAJ    :  device major number\n"
 "-m MIN|--min=MIN    :  device minor number\n"
-"--key file=<path>[,mode=aes-cbc][,format=hex|binary][,remove=[true|false]]\n"
+"--key file=<path>[,mode=aes-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
 "                    :  use an AES key for the encryption of the TPM's state\n"
 "                       files; use the given mode for the block encryption;\n"
 "                       the key is to be provided as a hex string or in binary\n"
 "                       format; the keyfile can be automatically removed using\n"
 "                       the remove parameter\n"
-"--key pwdfile=<path>[,mode=aes-cbc][,remove=[true|false]]\n"
+"--key pwdfile=<path>[,mode=aes-cbc|aes-256-gcm][,remove=[true|false]]\n"
 "                    :  provide a passphrase in a file; the AES key will be\n"
 "                       derived from this passphrase\n"
-"--migration-key file=<path>,[,mode=aes-cbc][,format=hex|binary][,remove=[true|false]]\n"
+"--migration-key file=<path>,[,mode=aes-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
 "                    :  use an AES key for the encryption of the TPM's state\n"
 "                       when it is retrieved from the TPM via ioctls;\n"
 "                       Setting this key ensures that the TPM's state will always\n"
 "                       be encrypted when migrated\n"
-"--migration-key pwdfile=<path>[,mode=aes-cbc][,remove=[true|false]]\n"
+"--migration-key pwdfile=<path>[,mode=aes-cbc|aes-256-gcm][,remove=[true|false]]\n"
 "                    :  provide a passphrase in a file; the AES key will be\n"
 "                       derived from this passphrase\n"
 "--log file=<path>|fd=<filedescriptor>\n"
 "                    :  write the TPM's log into the given file rather than\n"
 "                       to the console; provide '-' for path to avoid logging\n"
+"--tpmstate backend=dir|container|cas|journal|memory[,objects=<dir>]\n"
+"           [,seed=<dir>][,persist=<dir>][,number=<n>]\n"
+"                    :  store the TPM state blobs in one file each (dir),\n"
+"                       in a single container file per TPM (container),\n"
+"                       deduplicated in a shared object directory (cas),\n"
+"                       as a base image and a journal of changes (journal)\n"
+"                       or only in memory (memory); an ephemeral TPM may\n"
+"                       read its state from a seed directory at startup\n"
+"                       and write it to a persist directory at shutdown;\n"
+"                       several TPMs with different numbers may share\n"
+"                       one state directory\n"
+"--startup [clear|state|deactivated][,enable][,activate][,selftest]\n"
+"                    :  run TPM_Startup with the given type, enable and\n"
+"                       activate the TPM using physical presence and run\n"
+"                       TPM_ContinueSelfTest whenever the TPM is initialized\n"
 "-h|--help           :  display this help screen and terminate\n"
 "\n"
 "Make sure that TPM_PATH environment variable points to directory\n"
-"where TPM's NV storage file is kept\n"
+"where TPM's NV storage file is kept, unless the memory backend is used\n"
 "\n";
 
 const static unsigned char TPM_Resp_FatalError[] = {
@@ -371,19 +392,23 @@ static int tpm_start(uint32_t flags)
 {
     DIR *dir;
     char * tpmdir = NULL;
+    struct timespec init_start;
 
     /* temporary - the backend script lacks the perms to do this */
     if (tpmdir == NULL) {
         tpmdir = getenv("TPM_PATH");
-        if (!tpmdir) {
+        if (!tpmdir && SWTPM_NVRAM_Is_Ephemeral()) {
+            /* the state is kept in memory */
+        } else if (!tpmdir) {
             logprintf(STDOUT_FILENO,
                       "Error: TPM_PATH is not set\n");
             return -1;
         }
     }
-    dir = opendir(tpmdir);
-    if (dir) {
-        closedir(dir);
+    dir = tpmdir ? opendir(tpmdir) : NULL;
+    if (dir || !tpmdir) {
+        if (dir)
+            closedir(dir);
     } else {
         if (mkdir(tpmdir, 0775)) {
             logprintf(STDERR_FILENO,
@@ -409,6 +434,8 @@ static int tpm_start(uint32_t flags)
         goto error_del_pool;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &init_start);
+
     if (TPMLIB_MainInit() != TPM_SUCCESS) {
         logprintf(STDERR_FILENO,
                   "Error: Could not start the CUSE TPM.\n");
@@ -436,6 +463,12 @@ static int tpm_start(uint32_t flags)
         goto error_terminate;
     }
 
+    if (SWTPM_Startup_Run(startup_flags, &init_start) != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not run the startup sequence.\n");
+        goto error_terminate;
+    }
+
     logprintf(STDOUT_FILENO,
               "CUSE TPM successfully initialized.\n");
 
@@ -525,23 +558,35 @@ static void ptm_read_cmd(fuse_req_t req, size_t size)
  */
 static void ptm_read_stateblob(fuse_req_t req, size_t size)
 {
-    unsigned char *bufptr = NULL;
-    size_t numbytes;
+    unsigned char *buffer = NULL;
     size_t tocopy;
+    uint32_t copied;
+    TPM_BOOL is_encrypted;
 
-    if (cached_stateblob_get(tx_state.offset, &bufptr, &numbytes) < 0) {
+    /*
+     * the blob is produced piece by piece, so we need a buffer; it is
+     * never larger than what is left of the blob
+     */
+    tocopy = 0;
+    if (tx_state.offset < cached_stateblob_get_bloblength())
+        tocopy = min(size, cached_stateblob_get_bloblength() - tx_state.offset);
+
+    if (TPM_Malloc(&buffer, tocopy ? tocopy : 1) != TPM_SUCCESS ||
+        cached_stateblob_copy(buffer, tocopy, tx_state.offset,
+                              &copied, &is_encrypted) < 0) {
         fuse_reply_err(req, EIO);
         tx_state.state = TX_STATE_RW_COMMAND;
     } else {
-        tocopy = MIN(size, numbytes);
-        tx_state.offset += tocopy;
+        tx_state.offset += copied;
 
-        fuse_reply_buf(req, (char *)bufptr, tocopy);
+        fuse_reply_buf(req, (char *)buffer, copied);
         /* last transfer indicated by less bytes available than requested */
-        if (numbytes < size) {
+        if (copied < size) {
             tx_state.state = TX_STATE_RW_COMMAND;
         }
     }
+
+    TPM_Free(buffer);
 }
 
 static void ptm_read(fuse_req_t req, size_t size, off_t off,
@@ -552,6 +597,7 @@ static void ptm_read(fuse_req_t req, size_t size, off_t off,
         ptm_read_cmd(req, size);
         break;
     case TX_STATE_SET_STATE_BLOB:
+    case TX_STATE_HASH_DATA:
         fuse_reply_err(req, EIO);
         tx_state.state = TX_STATE_RW_COMMAND;
         break;
@@ -627,6 +673,29 @@ static void ptm_write_stateblob(fuse_req_t req, const char *buf, size_t size)
     }
 }
 
+/*
+ * ptm_write_hash: Hash the data written using the write() interface
+ *
+ * @req: the fuse_req_t
+ * @buf: the buffer with the data
+ * @size: the number of bytes in the buffer
+ *
+ * The hash was started with PTM_HASH_START and is finished with
+ * PTM_HASH_END.
+ */
+static void ptm_write_hash(fuse_req_t req, const char *buf, size_t size)
+{
+    TPM_RESULT res;
+
+    res = TPM_IO_Hash_Data((const unsigned char *)buf, size);
+    if (res) {
+        tx_state.state = TX_STATE_RW_COMMAND;
+        fuse_reply_err(req, EIO);
+    } else {
+        fuse_reply_write(req, size);
+    }
+}
+
 /*
  * ptm_write: low-level write() interface; calls approriate function depending
  *            on what is being transferred using the write()
@@ -645,6 +714,9 @@ static void ptm_write(fuse_req_t req, const char *buf, size_t size,
     case TX_STATE_SET_STATE_BLOB:
         ptm_write_stateblob(req, buf, size);
         break;
+    case TX_STATE_HASH_DATA:
+        ptm_write_hash(req, buf, size);
+        break;
     }
 }
 
@@ -653,7 +725,7 @@ static stateblob_desc cached_stateblob;
 static bool
 cached_stateblob_is_loaded(uint32_t blobtype, TPM_BOOL decrypt)
 {
-    return (cached_stateblob.data != NULL) &&
+    return (cached_stateblob.reader != NULL) &&
            (cached_stateblob.blobtype == blobtype) &&
            (cached_stateblob.decrypt == decrypt);
 }
@@ -664,9 +736,9 @@ cached_stateblob_is_loaded(uint32_t blobtype, TPM_BOOL decrypt)
 static void
 cached_stateblob_free(void)
 {
-    TPM_Free(cached_stateblob.data);
-    cached_stateblob.data = NULL;
-    cached_stateblob.data_length = 0;
+    SWTPM_NVRAM_StateBlobReader_Close(cached_stateblob.reader);
+    cached_stateblob.reader = NULL;
+    cached_stateblob.totlength = 0;
 }
 
 /*
@@ -675,32 +747,12 @@ cached_stateblob_free(void)
 static uint32_t
 cached_stateblob_get_bloblength(void)
 {
-    return cached_stateblob.data_length;
+    return cached_stateblob.totlength;
 }
 
 /*
- * cached_statblob_get: get stateblob data without copying them
- *
- * @offset: at which offset to get the data
- * @bufptr: pointer to a buffer pointer used to return buffer start
- * @length: pointer used to return number of available bytes in returned buffer
- */
-static int
-cached_stateblob_get(uint32_t offset,
-                     unsigned char **bufptr, size_t *length)
-{
-    if (cached_stateblob.data == NULL ||
-        offset > cached_stateblob.data_length)
-        return -1;
-
-    *bufptr = &cached_stateblob.data[offset];
-    *length = cached_stateblob.data_length - offset;
-
-    return 0;
-}
-
-/*
- * cached_stateblob_load: load a state blob into the cache
+ * cached_stateblob_load: open a reader for a state blob; the blob is
+ *                        produced piece by piece as it is read
  *
  * blobtype: the type of blob
  * decrypt: whether the blob is to be decrypted
@@ -721,10 +773,10 @@ cached_stateblob_load(uint32_t blobtype, TPM_BOOL decrypt)
         res = SWTPM_NVRAM_Store_Volatile();
 
     if (res == 0)
-        res = SWTPM_NVRAM_GetStateBlob(&cached_stateblob.data,
-                                       &cached_stateblob.data_length,
-                                       tpm_number, blobname, decrypt,
-                                       &cached_stateblob.is_encrypted);
+        res = SWTPM_NVRAM_StateBlobReader_Open(&cached_stateblob.reader,
+                                               tpm_number, blobname, decrypt,
+                                               &cached_stateblob.is_encrypted,
+                                               &cached_stateblob.totlength);
 
     /* make sure the volatile state file is gone */
     if (blobtype == PTM_BLOB_TYPE_VOLATILE)
@@ -755,12 +807,13 @@ cached_stateblob_copy(void *dest, size_t destlen, uint32_t srcoffset,
 
     *copied = 0;
 
-    if (cached_stateblob.data != NULL && cached_stateblob.data_length > 0) {
-
-        if (srcoffset < cached_stateblob.data_length) {
-            *copied = min(cached_stateblob.data_length - srcoffset, destlen);
+    if (cached_stateblob.reader != NULL && cached_stateblob.totlength > 0) {
 
-            memcpy(dest, &cached_stateblob.data[srcoffset], *copied);
+        if (srcoffset < cached_stateblob.totlength) {
+            if (SWTPM_NVRAM_StateBlobReader_Read(cached_stateblob.reader,
+                                                 srcoffset, dest, destlen,
+                                                 copied) != TPM_SUCCESS)
+                return -1;
 
             *is_encrypted = cached_stateblob.is_encrypted;
         }
@@ -787,8 +840,9 @@ ptm_get_stateblob_part(uint32_t blobtype,
     }
 
     if (res == 0) {
-        cached_stateblob_copy(buffer, buffer_size,
-                              offset, copied, is_encrypted);
+        if (cached_stateblob_copy(buffer, buffer_size,
+                                  offset, copied, is_encrypted) < 0)
+            res = TPM_FAIL;
     }
 
     return res;
@@ -863,11 +917,20 @@ ptm_set_stateblob_append(uint32_t blobtype,
 
     if (stateblob.type != blobtype) {
         /* clear old data */
-        TPM_Free(stateblob.data);
-        stateblob.data = NULL;
-        stateblob.length = 0;
+        SWTPM_NVRAM_StateBlobWriter_Close(stateblob.writer, FALSE);
+        stateblob.writer = NULL;
+        stateblob.type = 0;
+
+        blobname = ptm_get_blobname(blobtype);
+        if (!blobname)
+            return TPM_BAD_PARAMETER;
+
+        res = SWTPM_NVRAM_StateBlobWriter_Open(&stateblob.writer,
+                                               0 /* tpm_number */,
+                                               blobname, is_encrypted);
+        if (res != 0)
+            return res;
         stateblob.type = blobtype;
-        stateblob.is_encrypted = is_encrypted;
 
         /*
          * on the first call for a new state blob we allow 0 bytes to be written
@@ -877,40 +940,16 @@ ptm_set_stateblob_append(uint32_t blobtype,
             return 0;
     }
 
-    /* append */
-    res = TPM_Realloc(&stateblob.data, stateblob.length + length);
-    if (res != 0) {
-        /* error */
-        TPM_Free(stateblob.data);
-        stateblob.data = NULL;
-        stateblob.length = 0;
-        stateblob.type = 0;
+    /* the data are decrypted and passed on as they arrive */
+    res = SWTPM_NVRAM_StateBlobWriter_Write(stateblob.writer, data, length);
 
-        return res;
-    }
-
-    memcpy(&stateblob.data[stateblob.length], data, length);
-    stateblob.length += length;
-
-    if (!is_last) {
+    if (!is_last && res == 0) {
         /* full packet -- expecting more data */
         return res;
     }
-    blobname = ptm_get_blobname(blobtype);
-
-    if (blobname) {
-        res = SWTPM_NVRAM_SetStateBlob(stateblob.data,
-                                       stateblob.length,
-                                       stateblob.is_encrypted,
-                                       0 /* tpm_number */,
-                                       blobname);
-    } else {
-        res = TPM_BAD_PARAMETER;
-    }
 
-    TPM_Free(stateblob.data);
-    stateblob.data = NULL;
-    stateblob.length = 0;
+    res = SWTPM_NVRAM_StateBlobWriter_Close(stateblob.writer, res == 0);
+    stateblob.writer = NULL;
     stateblob.type = 0;
 
     /* transfer of blob is complete */
@@ -966,6 +1005,25 @@ ptm_set_stateblob(fuse_req_t req, ptm_setstate *pss)
  * out_bufsz: size of the output buffer; provided by fuse and has size of
  *            needed buffer
  */
+/*
+ * ptm_snapshot_check_path: check the snapshot directory passed by the
+ *                          client; it must be an absolute path since the
+ *                          CUSE TPM's working directory is unrelated to
+ *                          the client's
+ */
+static TPM_RESULT
+ptm_snapshot_check_path(ptm_snapshot *ps)
+{
+    if (!memchr(ps->u.req.path, 0, sizeof(ps->u.req.path)) ||
+        ps->u.req.path[0] != '/') {
+        logprintf(STDERR_FILENO,
+                  "Error: The snapshot directory must be an absolute "
+                  "path.\n");
+        return TPM_BAD_PARAMETER;
+    }
+    return TPM_SUCCESS;
+}
+
 static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
                       struct fuse_file_info *fi, unsigned flags,
                       const void *in_buf, size_t in_bufsz, size_t out_bufsz)
@@ -993,10 +1051,13 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
     case PTM_RESET_TPMESTABLISHED:
     case PTM_HASH_START:
     case PTM_HASH_DATA:
+    case PTM_HASH_WRITE:
     case PTM_HASH_END:
     case PTM_STORE_VOLATILE:
     case PTM_GET_STATEBLOB:
     case PTM_SET_STATEBLOB:
+    case PTM_SNAPSHOT:
+    case PTM_RESTORE:
         if (tpm_running)
             worker_thread_wait_done();
         break;
@@ -1022,7 +1083,9 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
                 | PTM_CAP_GET_STATEBLOB
                 | PTM_CAP_SET_STATEBLOB
                 | PTM_CAP_STOP
-                | PTM_CAP_GET_CONFIG;
+                | PTM_CAP_GET_CONFIG
+                | PTM_CAP_SNAPSHOT
+                | PTM_CAP_HASH_WRITE;
             fuse_reply_ioctl(req, 0, &ptm_caps, sizeof(ptm_caps));
         }
         break;
@@ -1047,8 +1110,9 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
     case PTM_STOP:
         worker_thread_end();
 
-        res = TPM_SUCCESS;
         TPMLIB_Terminate();
+        /* an ephemeral TPM may persist its state now */
+        res = SWTPM_NVRAM_Shutdown();
 
         tpm_running = 0;
 
@@ -1148,10 +1212,23 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
         }
         break;
 
+    case PTM_HASH_WRITE:
+        if (!tpm_running)
+            goto error_not_running;
+
+        /* the data will be written using the write() interface */
+        tx_state.state = TX_STATE_HASH_DATA;
+        res = TPM_SUCCESS;
+        fuse_reply_ioctl(req, 0, &res, sizeof(res));
+        break;
+
     case PTM_HASH_END:
         if (!tpm_running)
             goto error_not_running;
 
+        if (tx_state.state == TX_STATE_HASH_DATA)
+            tx_state.state = TX_STATE_RW_COMMAND;
+
         res = TPM_IO_Hash_End();
         fuse_reply_ioctl(req, 0, &res, sizeof(res));
         break;
@@ -1205,6 +1282,61 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
         }
         break;
 
+    case PTM_SNAPSHOT:
+        if (in_bufsz != sizeof(ptm_snapshot)) {
+            struct iovec iov = { arg, sizeof(ptm_snapshot) };
+            fuse_reply_ioctl_retry(req, &iov, 1, &iov, 1);
+        } else {
+            ptm_snapshot *ps = (ptm_snapshot *)in_buf;
+            TPM_BOOL reflinked = FALSE;
+
+            res = ptm_snapshot_check_path(ps);
+            if (res == 0) {
+                if (tpm_running) {
+                    /* the snapshot includes the volatile state */
+                    res = SWTPM_NVRAM_Store_Volatile();
+                    cached_stateblob_free();
+                } else {
+                    /* tpm state dir must be set */
+                    res = SWTPM_NVRAM_Init();
+                }
+            }
+            if (res == 0)
+                res = SWTPM_NVRAM_Snapshot(ps->u.req.path, 0, &reflinked);
+            /* the running TPM must not find the volatile state on restart */
+            if (tpm_running)
+                SWTPM_NVRAM_DeleteName(0, TPM_VOLATILESTATE_NAME, FALSE);
+
+            ps->u.resp.tpm_result = res;
+            ps->u.resp.flags = reflinked ? SNAPSHOT_FLAG_REFLINKED : 0;
+            fuse_reply_ioctl(req, 0, ps, sizeof(*ps));
+        }
+        break;
+
+    case PTM_RESTORE:
+        if (tpm_running)
+            goto error_running;
+
+        if (in_bufsz != sizeof(ptm_snapshot)) {
+            struct iovec iov = { arg, sizeof(ptm_snapshot) };
+            fuse_reply_ioctl_retry(req, &iov, 1, &iov, 1);
+        } else {
+            ptm_snapshot *ps = (ptm_snapshot *)in_buf;
+
+            res = ptm_snapshot_check_path(ps);
+            /* tpm state dir must be set */
+            if (res == 0)
+                res = SWTPM_NVRAM_Init();
+            if (res == 0)
+                res = SWTPM_NVRAM_Restore(ps->u.req.path, 0);
+            cached_stateblob_free();
+
+            ps->u.resp.tpm_result = res;
+            ps->u.resp.flags = 0;
+            fuse_reply_ioctl(req, 0, ps, sizeof(*ps));
+        }
+        break;
+
     case PTM_GET_CONFIG:
         if (out_bufsz != sizeof(ptm_getconfig)) {
             struct iovec iov = { arg, sizeof(uint32_t) };
@@ -1289,6 +1421,8 @@ static const struct fuse_opt ptm_opts[] = {
     PTM_OPT("--log %s",   logging),
     PTM_OPT("--key %s",   keydata),
     PTM_OPT("--migration-key %s",   migkeydata),
+    PTM_OPT("--tpmstate %s", tpmstatedata),
+    PTM_OPT("--startup %s", startupdata),
     FUSE_OPT_KEY("-h",        0),
     FUSE_OPT_KEY("--help",    0),
     FUSE_OPT_KEY("-v",        1),
@@ -1333,6 +1467,8 @@ int main(int argc, char **argv)
         .logging = NULL,
         .keydata = NULL,
         .migkeydata = NULL,
+        .tpmstatedata = NULL,
+        .startupdata = NULL,
     };
     char dev_name[128] = "DEVNAME=";
     const char *dev_info_argv[] = { dev_name };
@@ -1356,7 +1492,9 @@ int main(int argc, char **argv)
 
     if (handle_log_options(param.logging) < 0 ||
         handle_key_options(param.keydata) < 0 ||
-        handle_migration_key_options(param.migkeydata) < 0)
+        handle_migration_key_options(param.migkeydata) < 0 ||
+        handle_tpmstate_options(param.tpmstatedata) < 0 ||
+        handle_startup_options(param.startupdata, &startup_flags) < 0)
         return -3;
 
     if (setuid(0)) {
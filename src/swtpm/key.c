@@ -91,11 +91,35 @@ encryption_mode_from_string(const char *mode)
 {
     if (!strcmp(mode, "aes-cbc")) {
         return ENCRYPTION_MODE_AES_CBC;
+    } else if (!strcmp(mode, "aes-256-gcm")) {
+        return ENCRYPTION_MODE_AES_256_GCM;
     }
 
     return ENCRYPTION_MODE_UNKNOWN;
 }
 
+/*
+ * encryption_mode_key_length:
+ * Get the length of the key needed for an encryption mode
+ * @mode: the encryption mode
+ *
+ * Returns the key length in bytes, 0 for an unknown mode
+ */
+size_t
+encryption_mode_key_length(enum encryption_mode mode)
+{
+    switch (mode) {
+    case ENCRYPTION_MODE_AES_CBC:
+        return 128/8;
+    case ENCRYPTION_MODE_AES_256_GCM:
+        return 256/8;
+    case ENCRYPTION_MODE_UNKNOWN:
+        break;
+    }
+
+    return 0;
+}
+
 /*
  * key_stream_to_bin
  * Convert a stream of ASCII hex digits into a key; convert a maximum of
@@ -156,6 +180,8 @@ key_parse_as_hexkey(const char *rawkey,
         return -1;
     } else if (digits == 128/4) {
         *keylen = 128/8;
+    } else if (digits == 256/4) {
+        *keylen = 256/8;
     } else {
         fprintf(stderr, "Unsupported key length with %zu digits.\n",
                 digits);
@@ -183,7 +209,7 @@ key_load_key(const char *filename, enum key_format keyformat,
 {
     int ret = -1;
     int fd;
-    char filebuffer[2 + 128/4 + 1 + 1];
+    char filebuffer[2 + 256/4 + 1 + 1];
     ssize_t len;
 
     fd = open(filename, O_RDONLY);
@@ -47,10 +47,12 @@ enum key_format {
 enum encryption_mode {
     ENCRYPTION_MODE_UNKNOWN = 0,
     ENCRYPTION_MODE_AES_CBC = 1,
+    ENCRYPTION_MODE_AES_256_GCM = 2,
 };
 
 enum key_format key_format_from_string(const char *format);
 enum encryption_mode encryption_mode_from_string(const char *mode);
+size_t encryption_mode_key_length(enum encryption_mode mode);
 int key_load_key(const char *filename, enum key_format keyformat,
                  unsigned char *key, size_t *keylen, size_t maxkeylen);
 int key_from_pwdfile(const char *pwdfile, unsigned char *key, size_t *keylen,
@@ -47,6 +47,7 @@
 #include <assert.h>
 #include <getopt.h>
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
 #include <sys/stat.h>
 
@@ -58,10 +59,17 @@
 #include "swtpm_debug.h"
 #include "swtpm_io.h"
 #include "swtpm_nvfile.h"
+#include "swtpm_startup.h"
 #include "common.h"
 #include "logging.h"
 
 
+#define MAIN_LOOP_FLAG_TERMINATE  (1 << 0)
+#define MAIN_LOOP_FLAG_USE_FD     (1 << 1)
+
+/* seconds a connection may stay idle while other clients wait */
+#define MAIN_LOOP_IDLE_TIMEOUT    10
+
 /* local variables */
 int notify_fd[2] = {-1, -1};
 static TPM_BOOL terminate;
@@ -105,31 +113,48 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "-i|--dir <dir>   : use the given directory\n"
     "-f|--fd <fd>     : use the given socket file descriptor\n"
     "-t|--terminate   : terminate the TPM once a connection has been lost\n"
+    "--idle-timeout <seconds>\n"
+    "                 : close a connection on which no command arrived for\n"
+    "                   the given time so that other clients can be served;\n"
+    "                   0 disables the timeout; the default is %u seconds\n"
     "-d|--daemon      : daemonize the TPM\n"
     "--log file=<path>|fd=<filedescriptor>\n"
     "                 :  write the TPM's log into the given file rather than\n"
     "                    to the console; provide '-' for path to avoid logging\n"
-    "--key file=<path>[,mode=aes-cbc][,format=hex|binary][,remove=[true|false]]\n"
+    "--key file=<path>[,mode=aes-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
     "                 : use an AES key for the encryption of the TPM's state\n"
     "                   files; use the given mode for the block encryption;\n"
     "                   the key is to be provided as a hex string or in binary\n"
     "                   format; the keyfile can be automatically removed using\n"
     "                   the remove parameter\n"
-    "--key pwdfile=<path>[,mode=aes-cbc][,remove=[true|false]]\n"
+    "--key pwdfile=<path>[,mode=aes-cbc|aes-256-gcm][,remove=[true|false]]\n"
     "                 :  provide a passphrase in a file; the AES key will be\n"
     "                    derived from this passphrase\n"
+    "--tpmstate backend=dir|container|cas|journal|memory[,objects=<dir>]\n"
+    "           [,seed=<dir>][,persist=<dir>][,number=<n>]\n"
+    "                 : store the TPM state blobs in one file each (dir),\n"
+    "                   in a single container file per TPM (container),\n"
+    "                   deduplicated in a shared object directory (cas),\n"
+    "                   as a base image and a journal of changes (journal)\n"
+    "                   or only in memory (memory); an ephemeral TPM may\n"
+    "                   read its state from a seed directory at startup\n"
+    "                   and write it to a persist directory at shutdown;\n"
+    "                   several TPMs with different numbers may share\n"
+    "                   one state directory\n"
+    "--startup [clear|state|deactivated][,enable][,activate][,selftest]\n"
+    "                 : run TPM_Startup with the given type, enable and\n"
+    "                   activate the TPM using physical presence and run\n"
+    "                   TPM_ContinueSelfTest before accepting connections\n"
     "-h|--help        : display this help screen and terminate\n"
     "\n",
-    prgname, iface);
+    prgname, iface, MAIN_LOOP_IDLE_TIMEOUT);
 }
 
 
-#define MAIN_LOOP_FLAG_TERMINATE  (1 << 0)
-#define MAIN_LOOP_FLAG_USE_FD     (1 << 1)
-
 struct mainLoopParams {
     uint32_t flags;
     int fd;
+    unsigned int idle_timeout;  /* in seconds; 0 for none */
 };
 
 int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
@@ -140,6 +165,7 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     struct stat statbuf;
     struct mainLoopParams mlp = {
         .flags = 0,
+        .idle_timeout = MAIN_LOOP_IDLE_TIMEOUT,
     };
     int initialized = FALSE;
     unsigned long val;
@@ -147,6 +173,10 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     char buf[20];
     char *keydata = NULL;
     char *logdata = NULL;
+    char *tpmstatedata = NULL;
+    char *startupdata = NULL;
+    unsigned int startup_flags;
+    struct timespec init_start;
 #ifdef DEBUG
     time_t              start_time;
 #endif
@@ -159,6 +189,9 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
         {"terminate" ,       no_argument, 0, 't'},
         {"log"       , required_argument, 0, 'l'},
         {"key"       , required_argument, 0, 'k'},
+        {"tpmstate"  , required_argument, 0, 's'},
+        {"startup"   , required_argument, 0, 'S'},
+        {"idle-timeout", required_argument, 0, 'I'},
         {NULL        , 0                , 0, 0  },
     };
 
@@ -233,6 +266,25 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
             logdata = optarg;
             break;
 
+        case 's':
+            tpmstatedata = optarg;
+            break;
+
+        case 'S':
+            startupdata = optarg;
+            break;
+
+        case 'I':
+            errno = 0;
+            val = strtoul(optarg, &end_ptr, 10);
+            if (val > INT_MAX / 1000 || errno || end_ptr == optarg ||
+                end_ptr[0] != '\0') {
+                fprintf(stderr, "Cannot parse idle timeout '%s'.\n", optarg);
+                exit(1);
+            }
+            mlp.idle_timeout = val;
+            break;
+
         case 'h':
             usage(stdout, prgname, iface);
             exit(EXIT_SUCCESS);
@@ -244,7 +296,9 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     }
 
     if (handle_log_options(logdata) < 0 ||
-        handle_key_options(keydata) < 0)
+        handle_key_options(keydata) < 0 ||
+        handle_tpmstate_options(tpmstatedata) < 0 ||
+        handle_startup_options(startupdata, &startup_flags) < 0)
         return EXIT_FAILURE;
 
     if (daemonize) {
@@ -292,11 +346,16 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
        initialization process.  TPM_Init could be the result of power being applied to the platform
        or a hard reset. */
     if (rc == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &init_start);
         rc = TPMLIB_MainInit();
     }
     if (rc == 0) {
         initialized = TRUE;
     }
+    /* the TPM is started up before the first client can connect */
+    if (rc == 0) {
+        rc = SWTPM_Startup_Run(startup_flags, &init_start);
+    }
     if (rc == 0) {
         rc = install_sighandlers();
     }
@@ -305,6 +364,9 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     }
     if (initialized) {
         TPMLIB_Terminate();
+        /* an ephemeral TPM may persist its state now */
+        if (SWTPM_NVRAM_Shutdown() != TPM_SUCCESS && rc == 0)
+            rc = TPM_FAIL;
     }
 
     close(notify_fd[0]);
@@ -331,6 +393,7 @@ static int mainLoop(struct mainLoopParams *mlp)
 {
     TPM_RESULT          rc = 0;
     TPM_CONNECTION_FD   connection_fd;             /* file descriptor for read/write */
+    int                 timeout = -1;              /* poll() timeout in ms */
     unsigned char       *command = NULL;           /* command buffer */
     uint32_t            command_length;            /* actual length of command bytes */
     uint32_t            max_command_length;        /* command buffer size */
@@ -352,6 +415,14 @@ static int mainLoop(struct mainLoopParams *mlp)
 
     connection_fd.fd = -1;
 
+    /*
+     * A client may keep its connection for many commands, but the TPM
+     * serves one connection at a time; an idle client must not lock out
+     * the others. A passed file descriptor is the only client there is.
+     */
+    if (mlp->idle_timeout && !(mlp->flags & MAIN_LOOP_FLAG_USE_FD))
+        timeout = mlp->idle_timeout * 1000;
+
     while (!terminate) {
         /* connect to the client */
         if (rc == 0) {
@@ -373,9 +444,10 @@ static int mainLoop(struct mainLoopParams *mlp)
 
             /*
              * all these check (seem to) prevent that we get
-             * stuck with a closed connection.
+             * stuck with a closed connection; poll() returns 0 once the
+             * connection was idle for too long
              */
-            if (poll(&pollfds, 1, -1) < 0 ||
+            if (poll(&pollfds, 1, timeout) <= 0 ||
                 (pollfds.revents & POLLHUP) != 0 ||
                 (pollfds.revents & POLLIN) == 0 ) {
                 SWTPM_IO_Disconnect(&connection_fd);
@@ -400,14 +472,16 @@ static int mainLoop(struct mainLoopParams *mlp)
             }
             /* write the results */
             if (rc == 0) {
-                /* ignore return value since we will close anyway */
+                /*
+                 * ignore return value; the poll() above notices a broken
+                 * connection
+                 */
                 SWTPM_IO_Write(&connection_fd, rbuffer, rlength);
             }
             /*
-             * only allow a single command per connection, otherwise
-             * we may get stuck in the poll() above.
+             * serve further commands on this connection until the client
+             * closes it, which ends the read of the next command
              */
-            break;
         }
         SWTPM_IO_Disconnect(&connection_fd);
         /* clear the response buffer, does not deallocate memory */
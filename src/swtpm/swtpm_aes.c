@@ -43,254 +43,255 @@
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef USE_FREEBL_CRYPTO_LIBRARY
-# include <blapi.h>
-#else
-# ifdef USE_OPENSSL_CRYPTO_LIBRARY
-#  include <openssl/aes.h>
-# else
-#  error "Unsupported crypto library."
-# endif
-#endif
-
 #include <libtpms/tpm_types.h>
 #include <libtpms/tpm_error.h>
 #include <libtpms/tpm_memory.h>
 
 #include "swtpm_aes.h"
+#include "swtpm_crypto.h"
 
+#define TPM_AES_ENCRYPT TRUE
+#define TPM_AES_DECRYPT FALSE
 
-#ifdef USE_FREEBL_CRYPTO_LIBRARY
-/* TPM_SymmetricKeyData_Encrypt() is AES non-portable code to CBC encrypt 'decrypt_data' to
-   'encrypt_data'
+/* TPM_SymmetricKeyData_Pad() pads 'data' of 'data_length' as per PKCS#7 / RFC2630.
 
-   The stream is padded as per PKCS#7 / RFC2630
+   'data' must have room for TPM_AES_PADDED_LENGTH(data_length) bytes.
 
-   'encrypt_data' must be free by the caller
+   Returns the padded length.
 */
 
-TPM_RESULT TPM_SymmetricKeyData_Encrypt(unsigned char **encrypt_data,   /* output, caller frees */
-                                        uint32_t *encrypt_length,		/* output */
-                                        const unsigned char *decrypt_data,	/* input */
-                                        uint32_t decrypt_length,		/* input */
-                                        const TPM_SYMMETRIC_KEY_DATA
-					*tpm_symmetric_key_token) 		/* input */
+static uint32_t TPM_SymmetricKeyData_Pad(unsigned char *data,
+                                         uint32_t data_length)
+{
+    uint32_t pad_length;
+
+    /* calculate the PKCS#7 / RFC2630 pad length */
+    pad_length = TPM_AES_BLOCK_SIZE - (data_length % TPM_AES_BLOCK_SIZE);
+    printf("  TPM_SymmetricKeyData_Encrypt: Padded length %u pad length %u\n",
+           data_length + pad_length, pad_length);
+    /* last gets pad = pad length */
+    memset(data + data_length, pad_length, pad_length);
+
+    return data_length + pad_length;
+}
+
+/* TPM_SymmetricKeyData_CheckPad() checks the PKCS#7 / RFC2630 padding of the
+   decrypted 'data' of 'data_length' and returns the unpadded length.
+*/
+
+static TPM_RESULT TPM_SymmetricKeyData_CheckPad(const unsigned char *data,
+                                                uint32_t data_length,
+                                                uint32_t *unpadded_length)
 {
     TPM_RESULT          rc = 0;
-    SECStatus 		rv;
-    AESContext 		*cx;
     uint32_t		pad_length;
-    uint32_t		output_length;			/* dummy */
-    unsigned char       *decrypt_data_pad;
-    unsigned char       ivec[TPM_AES_BLOCK_SIZE];       /* initial chaining vector */
-    TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data =
-	(TPM_SYMMETRIC_KEY_DATA *)tpm_symmetric_key_token;
+    uint32_t		i;
+    const unsigned char *pad_data;
 
-    printf(" TPM_SymmetricKeyData_Encrypt: Length %u\n", decrypt_length);
-    decrypt_data_pad = NULL;    /* freed @1 */
-    cx = NULL;    		/* freed @2 */
-    
-    /* sanity check that the AES key has previously been generated */
-    if (rc == 0) {
-	if (!tpm_symmetric_key_data->valid) {
-	    printf("TPM_SymmetricKeyData_Encrypt: Error (fatal), AES key not valid\n");
-	    rc = TPM_FAIL;
-	}
-    }
-    if (rc == 0) {
-        /* calculate the PKCS#7 / RFC2630 pad length and padded data length */
-        pad_length = TPM_AES_BLOCK_SIZE - (decrypt_length % TPM_AES_BLOCK_SIZE);
-        *encrypt_length = decrypt_length + pad_length;
-        printf("  TPM_SymmetricKeyData_Encrypt: Padded length %u pad length %u\n",
-               *encrypt_length, pad_length);
-        /* allocate memory for the encrypted response */
-        rc = TPM_Malloc(encrypt_data, *encrypt_length);
+    /* get the pad length from the last byte */
+    pad_length = (uint32_t)data[data_length - 1];
+    /* sanity check the pad length */
+    printf(" TPM_SymmetricKeyData_Decrypt: Pad length %u\n", pad_length);
+    if ((pad_length == 0) ||
+        (pad_length > TPM_AES_BLOCK_SIZE)) {
+        printf("TPM_SymmetricKeyData_Decrypt: Error, illegal pad length\n");
+        rc = TPM_DECRYPT_ERROR;
     }
-    /* allocate memory for the padded decrypted data */
-    if (rc == 0) {
-        rc = TPM_Malloc(&decrypt_data_pad, *encrypt_length);
-    }
-    if (rc == 0) {
-        /* set the IV */
-        memset(ivec, 0, sizeof(ivec));
-	/* create a new AES context */
-	cx = AES_CreateContext(tpm_symmetric_key_data->userKey,
-			       ivec, 			/* CBC initialization vector */
-			       NSS_AES_CBC,		/* CBC mode */
-			       TRUE,			/* encrypt */
-			       TPM_AES_BLOCK_SIZE,	/* key length */
-			       TPM_AES_BLOCK_SIZE);	/* AES  block length */
-	if (cx == NULL) {
-	    printf("TPM_SymmetricKeyData_Encrypt: Error creating AES context\n");
-	    rc = TPM_SIZE;
-	}
-    }
-    /* pad the decrypted clear text data */
     if (rc == 0) {
-        /* unpadded original data */
-        memcpy(decrypt_data_pad, decrypt_data, decrypt_length);
-        /* last gets pad = pad length */
-        memset(decrypt_data_pad + decrypt_length, pad_length, pad_length);
-        /* encrypt the padded input to the output */
-        //TPM_PrintFour("  TPM_SymmetricKeyData_Encrypt: Input", decrypt_data_pad);
-	/* perform the AES encryption */
-	rv = AES_Encrypt(cx,
-			 *encrypt_data, &output_length, *encrypt_length,	/* output */
-			 decrypt_data_pad, *encrypt_length);			/* input */
-
-	if (rv != SECSuccess) {
-	    printf("TPM_SymmetricKeyData_Encrypt: Error, rv %d\n", rv);
-	    rc = TPM_ENCRYPT_ERROR;
-	}
+        /* get the unpadded length */
+        *unpadded_length = data_length - pad_length;
+        /* pad starting point */
+        pad_data = data + *unpadded_length;
+        /* sanity check the pad */
+        for (i = 0 ; i < pad_length ; i++, pad_data++) {
+            if (*pad_data != pad_length) {
+                printf("TPM_SymmetricKeyData_Decrypt: Error, bad pad %02x at index %u\n",
+                       *pad_data, i);
+                rc = TPM_DECRYPT_ERROR;
+            }
+        }
     }
+    return rc;
+}
+
+/* TPM_SymmetricKeyData_Init() initializes the key data with 'key' of 'keylen'
+   bytes for use with the given mode.
+
+   The fastest crypto provider for the mode and key length is selected and
+   the key schedule is expanded once here, so that it does not need to be
+   expanded for every operation.
+*/
+
+TPM_RESULT TPM_SymmetricKeyData_Init(TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data,
+                                     const unsigned char *key,
+                                     uint32_t keylen,
+                                     enum swtpm_cipher_mode mode)
+{
+    TPM_RESULT          rc = 0;
+    const struct swtpm_crypto_provider *provider;
+    void                *schedule = NULL;
+
+    if (keylen > sizeof(tpm_symmetric_key_data->userKey))
+        return TPM_BAD_KEY_PROPERTY;
+
+    provider = SWTPM_Crypto_SelectProvider(mode, keylen);
+    if (!provider)
+        return TPM_BAD_MODE;
+
+    rc = provider->key_init(&schedule, mode, key, keylen);
     if (rc == 0) {
-       //TPM_PrintFour("  TPM_SymmetricKeyData_Encrypt: Output", *encrypt_data);
-    }	
-    free(decrypt_data_pad);     	/* @1 */
-    if (cx != NULL) {
-	/* due to a FreeBL bug, must zero the context before destroying it */
-	unsigned char dummy_key[TPM_AES_BLOCK_SIZE];
-	unsigned char dummy_ivec[TPM_AES_BLOCK_SIZE];
-	memset(dummy_key, 0x00, TPM_AES_BLOCK_SIZE);
-	memset(dummy_ivec, 0x00, TPM_AES_BLOCK_SIZE);
-	rv = AES_InitContext(cx,			/* AES context */
-			     dummy_key,			/* AES key */
-			     TPM_AES_BLOCK_SIZE,	/* key length */
-			     dummy_ivec, 		/* ivec */
-			     NSS_AES_CBC,		/* CBC mode */
-			     TRUE,			/* encrypt */
-			     TPM_AES_BLOCK_SIZE);	/* AES  block length */
-	AES_DestroyContext(cx, PR_TRUE);	/* @2 */
+        TPM_SymmetricKeyData_Free(tpm_symmetric_key_data);
+
+        memcpy(tpm_symmetric_key_data->userKey, key, keylen);
+        tpm_symmetric_key_data->userKeyLength = keylen;
+        tpm_symmetric_key_data->provider = provider;
+        tpm_symmetric_key_data->schedule = schedule;
+        tpm_symmetric_key_data->valid = TRUE;
     }
     return rc;
 }
 
-/* TPM_SymmetricKeyData_Decrypt() is AES non-portable code to CBC decrypt 'encrypt_data' to
-   'decrypt_data'
+/* TPM_SymmetricKeyData_Free() releases the key schedule and invalidates the key
+*/
 
-   The stream must be padded as per PKCS#7 / RFC2630
+void TPM_SymmetricKeyData_Free(TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data)
+{
+    if (tpm_symmetric_key_data->provider && tpm_symmetric_key_data->schedule)
+        tpm_symmetric_key_data->provider->key_free(tpm_symmetric_key_data->schedule);
+    tpm_symmetric_key_data->provider = NULL;
+    tpm_symmetric_key_data->schedule = NULL;
+    tpm_symmetric_key_data->valid = FALSE;
+    memset(tpm_symmetric_key_data->userKey, 0,
+           sizeof(tpm_symmetric_key_data->userKey));
+    tpm_symmetric_key_data->userKeyLength = 0;
+}
 
-   decrypt_data must be free by the caller
+/* TPM_SymmetricKeyData_Crypt() CBC encrypts or decrypts 'input' of 'length'
+   to 'output' using an all-zero IV. 'input' and 'output' may point to the
+   same buffer.
 */
 
-TPM_RESULT TPM_SymmetricKeyData_Decrypt(unsigned char **decrypt_data,   /* output, caller frees */
-                                        uint32_t *decrypt_length,		/* output */
-                                        const unsigned char *encrypt_data,	/* input */
-                                        uint32_t encrypt_length,		/* input */
-                                        const TPM_SYMMETRIC_KEY_DATA
-					*tpm_symmetric_key_token) 		/* input */
+static TPM_RESULT TPM_SymmetricKeyData_Crypt(unsigned char *output,
+                                             const unsigned char *input,
+                                             uint32_t length,
+                                             const TPM_SYMMETRIC_KEY_DATA
+                                             *tpm_symmetric_key_data,
+                                             TPM_BOOL encrypt)
 {
-    TPM_RESULT          rc = 0;
-    SECStatus 		rv;
-    AESContext 		*cx;
-    uint32_t		pad_length;
-    uint32_t		output_length;			/* dummy */
-    uint32_t		i;
-    unsigned char       *pad_data;
     unsigned char       ivec[TPM_AES_BLOCK_SIZE];       /* initial chaining vector */
-    TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data =
-	(TPM_SYMMETRIC_KEY_DATA *)tpm_symmetric_key_token;
-    
-    printf(" TPM_SymmetricKeyData_Decrypt: Length %u\n", encrypt_length);
-    cx = NULL;    /* freed @1 */
 
-    /* sanity check encrypted length */
-    if (rc == 0) {
-        if (encrypt_length < TPM_AES_BLOCK_SIZE) {
-            printf("TPM_SymmetricKeyData_Decrypt: Error, bad length\n");
-            rc = TPM_DECRYPT_ERROR;
-        }
-    }
     /* sanity check that the AES key has previously been generated */
-    if (rc == 0) {
-	if (!tpm_symmetric_key_data->valid) {
-	    printf("TPM_SymmetricKeyData_Decrypt: Error (fatal), AES key not valid\n");
-	    rc = TPM_FAIL;
-	}
-    }
-    /* allocate memory for the PKCS#7 / RFC2630 padded decrypted data */
-    if (rc == 0) {
-        rc = TPM_Malloc(decrypt_data, encrypt_length);
+    if (!tpm_symmetric_key_data->valid || !tpm_symmetric_key_data->provider) {
+	printf("TPM_SymmetricKeyData_Crypt: Error (fatal), AES key not valid\n");
+	return TPM_FAIL;
     }
-    if (rc == 0) {
-        /* set the IV */
-        memset(ivec, 0, sizeof(ivec));
-	/* create a new AES context */
-	cx = AES_CreateContext(tpm_symmetric_key_data->userKey,
-			       ivec, 			/* CBC initialization vector */ 
-			       NSS_AES_CBC,		/* CBC mode */
-			       FALSE,			/* decrypt */
-			       TPM_AES_BLOCK_SIZE,	/* key length */
-			       TPM_AES_BLOCK_SIZE);	/* AES  block length */
-	if (cx == NULL) {
-	    printf("TPM_SymmetricKeyData_Decrypt: Error creating AES context\n");
-	    rc = TPM_SIZE;
-	}
-    }
-    /* decrypt the input to the PKCS#7 / RFC2630 padded output */
-    if (rc == 0) {
-        //TPM_PrintFour("  TPM_SymmetricKeyData_Decrypt: Input", encrypt_data);
-	/* perform the AES decryption */
-	rv = AES_Decrypt(cx,
-			 *decrypt_data, &output_length, encrypt_length,	/* output */
-			 encrypt_data, encrypt_length);			/* input */
-	if (rv != SECSuccess) {
-	    printf("TPM_SymmetricKeyData_Decrypt: Error, rv %d\n", rv);
-	    rc = TPM_DECRYPT_ERROR;
-	}
+
+    /* set the IV */
+    memset(ivec, 0, sizeof(ivec));
+
+    return tpm_symmetric_key_data->provider->cbc_crypt(
+                                             tpm_symmetric_key_data->schedule,
+                                             output, input, length,
+                                             ivec, encrypt);
+}
+
+/* TPM_SymmetricKeyData_GCM_Crypt() GCM encrypts or decrypts 'input' of 'length'
+   to 'output' using the given 'nonce'.
+
+   When encrypting, the tag is written following the ciphertext in 'output'.
+   When decrypting, the tag must follow the ciphertext in 'input' and is
+   verified.
+
+   The caller must never use the same nonce twice with the same key.
+*/
+
+TPM_RESULT TPM_SymmetricKeyData_GCM_Crypt(unsigned char *output,
+                                                 const unsigned char *input,
+                                                 uint32_t length,
+                                                 const unsigned char *nonce,
+                                                 const TPM_SYMMETRIC_KEY_DATA
+                                                 *tpm_symmetric_key_data,
+                                                 TPM_BOOL encrypt)
+{
+    TPM_RESULT          rc;
+
+    if (!tpm_symmetric_key_data->valid || !tpm_symmetric_key_data->provider ||
+        !tpm_symmetric_key_data->provider->gcm_crypt) {
+	printf("TPM_SymmetricKeyData_GCM_Crypt: Error (fatal), AES key not valid\n");
+	return TPM_FAIL;
     }
-    if (rc == 0) {
-        //TPM_PrintFour("  TPM_SymmetricKeyData_Decrypt: Output", *decrypt_data);
+
+    rc = tpm_symmetric_key_data->provider->gcm_crypt(
+                                             tpm_symmetric_key_data->schedule,
+                                             output, input, length,
+                                             nonce, encrypt);
+    if (rc != 0 && !encrypt)
+        printf("TPM_SymmetricKeyData_GCM_Crypt: Error, authentication failed\n");
+
+    return rc;
+}
+
+/* TPM_SymmetricKeyData_EncryptBuffer() pads and encrypts 'data' of 'data_length'
+   in place.
+
+   The stream is padded as per PKCS#7 / RFC2630. 'data' must have room for
+   TPM_AES_PADDED_LENGTH(data_length) bytes.
+*/
+
+TPM_RESULT TPM_SymmetricKeyData_EncryptBuffer(unsigned char *data,             /* input/output */
+                                              uint32_t data_length,            /* input */
+                                              uint32_t *encrypt_length,        /* output */
+                                              const TPM_SYMMETRIC_KEY_DATA
+                                              *tpm_symmetric_key_token)        /* input */
+{
+    printf(" TPM_SymmetricKeyData_Encrypt: Length %u\n", data_length);
+
+    /* pad the decrypted clear text data */
+    *encrypt_length = TPM_SymmetricKeyData_Pad(data, data_length);
+
+    /* encrypt the padded input in place */
+    return TPM_SymmetricKeyData_Crypt(data, data, *encrypt_length,
+                                      tpm_symmetric_key_token,
+                                      TPM_AES_ENCRYPT);
+}
+
+/* TPM_SymmetricKeyData_DecryptBuffer() decrypts 'encrypt_data' of 'encrypt_length' to
+   'decrypt_data' and checks and removes the padding.
+
+   'decrypt_data' must have room for 'encrypt_length' bytes; it may point to
+   'encrypt_data' to decrypt in place.
+*/
+
+TPM_RESULT TPM_SymmetricKeyData_DecryptBuffer(unsigned char *decrypt_data,       /* output */
+                                              uint32_t *decrypt_length,          /* output */
+                                              const unsigned char *encrypt_data, /* input */
+                                              uint32_t encrypt_length,           /* input */
+                                              const TPM_SYMMETRIC_KEY_DATA
+                                              *tpm_symmetric_key_token)          /* input */
+{
+    TPM_RESULT          rc = 0;
+
+    printf(" TPM_SymmetricKeyData_Decrypt: Length %u\n", encrypt_length);
+    /* sanity check encrypted length */
+    if (encrypt_length < TPM_AES_BLOCK_SIZE ||
+        (encrypt_length % TPM_AES_BLOCK_SIZE) != 0) {
+        printf("TPM_SymmetricKeyData_Decrypt: Error, bad length\n");
+        rc = TPM_DECRYPT_ERROR;
     }
-    /* get the pad length */
     if (rc == 0) {
-        /* get the pad length from the last byte */
-        pad_length = (uint32_t)*(*decrypt_data + encrypt_length - 1);
-        /* sanity check the pad length */
-        printf(" TPM_SymmetricKeyData_Decrypt: Pad length %u\n", pad_length);
-        if ((pad_length == 0) ||
-            (pad_length > TPM_AES_BLOCK_SIZE)) {
-            printf("TPM_SymmetricKeyData_Decrypt: Error, illegal pad length\n");
-            rc = TPM_DECRYPT_ERROR;
-        }
+        rc = TPM_SymmetricKeyData_Crypt(decrypt_data, encrypt_data,
+                                        encrypt_length,
+                                        tpm_symmetric_key_token,
+                                        TPM_AES_DECRYPT);
     }
     if (rc == 0) {
-        /* get the unpadded length */
-        *decrypt_length = encrypt_length - pad_length;
-        /* pad starting point */
-        pad_data = *decrypt_data + *decrypt_length;
-        /* sanity check the pad */
-        for (i = 0 ; i < pad_length ; i++, pad_data++) {
-            if (*pad_data != pad_length) {
-                printf("TPM_SymmetricKeyData_Decrypt: Error, bad pad %02x at index %u\n",
-                       *pad_data, i);
-                rc = TPM_DECRYPT_ERROR;
-            }
-        }
-    }
-    if (cx != NULL) {
-	/* due to a FreeBL bug, must zero the context before destroying it */
-	unsigned char dummy_key[TPM_AES_BLOCK_SIZE];
-	unsigned char dummy_ivec[TPM_AES_BLOCK_SIZE];
-	memset(dummy_key, 0x00, TPM_AES_BLOCK_SIZE);
-	memset(dummy_ivec, 0x00, TPM_AES_BLOCK_SIZE);
-	rv = AES_InitContext(cx,			/* AES context */
-			     dummy_key,			/* AES key */
-			     TPM_AES_BLOCK_SIZE,	/* key length */
-			     dummy_ivec, 		/* ivec */
-			     NSS_AES_CBC,		/* CBC mode */
-			     TRUE,			/* encrypt */
-			     TPM_AES_BLOCK_SIZE);	/* AES  block length */
-	AES_DestroyContext(cx, PR_TRUE);	/* @1 */
+        rc = TPM_SymmetricKeyData_CheckPad(decrypt_data, encrypt_length,
+                                           decrypt_length);
     }
     return rc;
 }
 
-#endif /* USE_FREEBL_CRYPTO_LIBRARY */
-
-#ifdef USE_OPENSSL_CRYPTO_LIBRARY
-/* TPM_SymmetricKeyData_Encrypt() is AES non-portable code to encrypt 'decrypt_data' to
-   'encrypt_data'
+/* TPM_SymmetricKeyData_Encrypt() encrypts 'decrypt_data' to 'encrypt_data'
 
    The stream is padded as per PKCS#7 / RFC2630
 
@@ -305,61 +306,23 @@ TPM_RESULT TPM_SymmetricKeyData_Encrypt(unsigned char **encrypt_data,   /* outpu
 					*tpm_symmetric_key_token) 		/* input */
 {
     TPM_RESULT          rc = 0;
-    uint32_t              pad_length;
-    unsigned char       *decrypt_data_pad;
-    unsigned char       ivec[TPM_AES_BLOCK_SIZE];       /* initial chaining vector */
-    TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data =
-	(TPM_SYMMETRIC_KEY_DATA *)tpm_symmetric_key_token;
-    AES_KEY key;
 
-    printf(" TPM_SymmetricKeyData_Encrypt: Length %u\n", decrypt_length);
-    decrypt_data_pad = NULL;    /* freed @1 */
+    /* allocate memory for the encrypted response */
+    rc = TPM_Malloc(encrypt_data, TPM_AES_PADDED_LENGTH(decrypt_length));
     if (rc == 0) {
-        /* calculate the pad length and padded data length */
-        pad_length = TPM_AES_BLOCK_SIZE - (decrypt_length % TPM_AES_BLOCK_SIZE);
-        *encrypt_length = decrypt_length + pad_length;
-        printf("  TPM_SymmetricKeyData_Encrypt: Padded length %u pad length %u\n",
-               *encrypt_length, pad_length);
-        /* allocate memory for the encrypted response */
-        rc = TPM_Malloc(encrypt_data, *encrypt_length);
+        memcpy(*encrypt_data, decrypt_data, decrypt_length);
+        rc = TPM_SymmetricKeyData_EncryptBuffer(*encrypt_data, decrypt_length,
+                                                encrypt_length,
+                                                tpm_symmetric_key_token);
     }
-    /* allocate memory for the padded decrypted data */
-    if (rc == 0) {
-        rc = TPM_Malloc(&decrypt_data_pad, *encrypt_length);
+    if (rc != 0) {
+        TPM_Free(*encrypt_data);
+        *encrypt_data = NULL;
     }
-
-    if (rc == 0) {
-        if (AES_set_encrypt_key(tpm_symmetric_key_data->userKey,
-                                sizeof(tpm_symmetric_key_data->userKey) * 8,
-                                &key) < 0) {
-            rc = TPM_FAIL;
-        }
-    }
-
-    /* pad the decrypted clear text data */
-    if (rc == 0) {
-        /* unpadded original data */
-        memcpy(decrypt_data_pad, decrypt_data, decrypt_length);
-        /* last gets pad = pad length */
-        memset(decrypt_data_pad + decrypt_length, pad_length, pad_length);
-        /* set the IV */
-        memset(ivec, 0, sizeof(ivec));
-        /* encrypt the padded input to the output */
-        //TPM_PrintFour("  TPM_SymmetricKeyData_Encrypt: Input", decrypt_data_pad);
-        AES_cbc_encrypt(decrypt_data_pad,
-                        *encrypt_data,
-                        *encrypt_length,
-                        &key,
-                        ivec,
-                        AES_ENCRYPT);
-        //TPM_PrintFour("  TPM_SymmetricKeyData_Encrypt: Output", *encrypt_data);
-    }
-    free(decrypt_data_pad);     /* @1 */
     return rc;
 }
 
-/* TPM_SymmetricKeyData_Decrypt() is AES non-portable code to decrypt 'encrypt_data' to
-   'decrypt_data'
+/* TPM_SymmetricKeyData_Decrypt() decrypts 'encrypt_data' to 'decrypt_data'
 
    The stream must be padded as per PKCS#7 / RFC2630
 
@@ -374,75 +337,88 @@ TPM_RESULT TPM_SymmetricKeyData_Decrypt(unsigned char **decrypt_data,   /* outpu
 					*tpm_symmetric_key_token) 		/* input */
 {
     TPM_RESULT          rc = 0;
-    uint32_t		pad_length;
-    uint32_t		i;
-    unsigned char       *pad_data;
-    unsigned char       ivec[TPM_AES_BLOCK_SIZE];       /* initial chaining vector */
-    TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data =
-	(TPM_SYMMETRIC_KEY_DATA *)tpm_symmetric_key_token;
-    AES_KEY             key;
 
-    printf(" TPM_SymmetricKeyData_Decrypt: Length %u\n", encrypt_length);
-    /* sanity check encrypted length */
-    if (rc == 0) {
-        if (encrypt_length < TPM_AES_BLOCK_SIZE) {
-            printf("TPM_SymmetricKeyData_Decrypt: Error, bad length\n");
-            rc = TPM_DECRYPT_ERROR;
-        }
-    }
     /* allocate memory for the padded decrypted data */
+    rc = TPM_Malloc(decrypt_data, encrypt_length);
     if (rc == 0) {
-        rc = TPM_Malloc(decrypt_data, encrypt_length);
+        rc = TPM_SymmetricKeyData_DecryptBuffer(*decrypt_data, decrypt_length,
+                                                encrypt_data, encrypt_length,
+                                                tpm_symmetric_key_token);
     }
-
-    if (rc == 0) {
-        if (AES_set_decrypt_key(tpm_symmetric_key_data->userKey,
-                                sizeof(tpm_symmetric_key_data->userKey) * 8,
-                                &key) < 0) {
-            rc = TPM_FAIL;
-        }
+    if (rc != 0) {
+        TPM_Free(*decrypt_data);
+        *decrypt_data = NULL;
     }
+    return rc;
+}
+
+/* TPM_SymmetricKeyData_GCM_EncryptBuffer() encrypts the data in 'buffer' in place
+   using AES-GCM with a random nonce.
+
+   On input the data of 'data_length' start at offset TPM_AES_GCM_NONCE_SIZE
+   and 'buffer' must have room for TPM_AES_GCM_TAG_SIZE bytes following the data.
+   On output 'buffer' holds the nonce, the ciphertext and the tag.
+*/
 
-    /* decrypt the input to the padded output */
+TPM_RESULT TPM_SymmetricKeyData_GCM_EncryptBuffer(unsigned char *buffer,           /* input/output */
+                                                  uint32_t data_length,            /* input */
+                                                  uint32_t *encrypt_length,        /* output */
+                                                  const TPM_SYMMETRIC_KEY_DATA
+                                                  *tpm_symmetric_key_token)        /* input */
+{
+    TPM_RESULT          rc = 0;
+    unsigned char       *data = &buffer[TPM_AES_GCM_NONCE_SIZE];
+
+    rc = SWTPM_Crypto_GetRandom(buffer, TPM_AES_GCM_NONCE_SIZE);
     if (rc == 0) {
-        /* set the IV */
-        memset(ivec, 0, sizeof(ivec));
-        /* decrypt the padded input to the output */
-        //TPM_PrintFour("  TPM_SymmetricKeyData_Decrypt: Input", encrypt_data);
-        AES_cbc_encrypt(encrypt_data,
-                        *decrypt_data,
-                        encrypt_length,
-                        &key,
-                        ivec,
-                        AES_DECRYPT);
-        //TPM_PrintFour("  TPM_SymmetricKeyData_Decrypt: Output", *decrypt_data);
+        rc = TPM_SymmetricKeyData_GCM_Crypt(data, data, data_length, buffer,
+                                            tpm_symmetric_key_token,
+                                            TPM_AES_ENCRYPT);
     }
-    /* get the pad length */
     if (rc == 0) {
-        /* get the pad length from the last byte */
-        pad_length = (uint32_t)*(*decrypt_data + encrypt_length - 1);
-        /* sanity check the pad length */
-        printf(" TPM_SymmetricKeyData_Decrypt: Pad length %u\n", pad_length);
-        if ((pad_length == 0) ||
-            (pad_length > TPM_AES_BLOCK_SIZE)) {
-            printf("TPM_SymmetricKeyData_Decrypt: Error, illegal pad length\n");
-            rc = TPM_DECRYPT_ERROR;
-        }
+        *encrypt_length = TPM_AES_GCM_NONCE_SIZE + data_length +
+                          TPM_AES_GCM_TAG_SIZE;
     }
+    return rc;
+}
+
+/* TPM_SymmetricKeyData_GCM_DecryptBuffer() decrypts and authenticates
+   'encrypt_data' of 'encrypt_length' holding the nonce, the ciphertext and
+   the tag into 'decrypt_data'.
+
+   'decrypt_data' must have room for 'encrypt_length' bytes; it may point to
+   'encrypt_data' to decrypt in place.
+*/
+
+TPM_RESULT TPM_SymmetricKeyData_GCM_DecryptBuffer(unsigned char *decrypt_data,       /* output */
+                                                  uint32_t *decrypt_length,          /* output */
+                                                  const unsigned char *encrypt_data, /* input */
+                                                  uint32_t encrypt_length,           /* input */
+                                                  const TPM_SYMMETRIC_KEY_DATA
+                                                  *tpm_symmetric_key_token)          /* input */
+{
+    TPM_RESULT          rc = 0;
+    unsigned char       nonce[TPM_AES_GCM_NONCE_SIZE];
+    uint32_t            data_length;
+
+    if (encrypt_length < TPM_AES_GCM_NONCE_SIZE + TPM_AES_GCM_TAG_SIZE) {
+        printf("TPM_SymmetricKeyData_GCM_Decrypt: Error, bad length\n");
+        return TPM_DECRYPT_ERROR;
+    }
+    data_length = encrypt_length - TPM_AES_GCM_NONCE_SIZE - TPM_AES_GCM_TAG_SIZE;
+
+    /* the nonce may be overwritten when decrypting in place */
+    memcpy(nonce, encrypt_data, sizeof(nonce));
+
+    rc = TPM_SymmetricKeyData_GCM_Crypt(&decrypt_data[TPM_AES_GCM_NONCE_SIZE],
+                                        &encrypt_data[TPM_AES_GCM_NONCE_SIZE],
+                                        data_length, nonce,
+                                        tpm_symmetric_key_token,
+                                        TPM_AES_DECRYPT);
     if (rc == 0) {
-        /* get the unpadded length */
-        *decrypt_length = encrypt_length - pad_length;
-        /* pad starting point */
-        pad_data = *decrypt_data + *decrypt_length;
-        /* sanity check the pad */
-        for (i = 0 ; i < pad_length ; i++, pad_data++) {
-            if (*pad_data != pad_length) {
-                printf("TPM_SymmetricKeyData_Decrypt: Error, bad pad %02x at index %u\n",
-                       *pad_data, i);
-                rc = TPM_DECRYPT_ERROR;
-            }
-        }
+        memmove(decrypt_data, &decrypt_data[TPM_AES_GCM_NONCE_SIZE],
+                data_length);
+        *decrypt_length = data_length;
     }
     return rc;
 }
-#endif /* USE_OPENSSL_CRYPTO_LIBRARY */
@@ -41,15 +41,37 @@
 
 #include <libtpms/tpm_types.h>
 
+#include "swtpm_crypto.h"
+
 #define TPM_AES_BLOCK_SIZE 16
+#define TPM_AES_MAX_KEY_SIZE 32
+
+/* AES-GCM: size of the nonce and the authentication tag */
+#define TPM_AES_GCM_NONCE_SIZE 12
+#define TPM_AES_GCM_TAG_SIZE 16
+
+/* the length of data of length 'len' after PKCS#7 padding */
+#define TPM_AES_PADDED_LENGTH(len) \
+    ((len) + TPM_AES_BLOCK_SIZE - ((len) % TPM_AES_BLOCK_SIZE))
 
 typedef struct tdTPM_SYMMETRIC_KEY_DATA {
     TPM_TAG tag;
     TPM_BOOL valid;
     TPM_BOOL fill;
-    unsigned char userKey[TPM_AES_BLOCK_SIZE];
+    unsigned char userKey[TPM_AES_MAX_KEY_SIZE];
+    uint32_t userKeyLength;
+    /* the crypto provider and its expanded key schedule */
+    const struct swtpm_crypto_provider *provider;
+    void *schedule;
 } TPM_SYMMETRIC_KEY_DATA;
 
+TPM_RESULT TPM_SymmetricKeyData_Init(TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data,
+                                     const unsigned char *key,
+                                     uint32_t keylen,
+                                     enum swtpm_cipher_mode mode);
+
+void TPM_SymmetricKeyData_Free(TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data);
+
 TPM_RESULT TPM_SymmetricKeyData_Encrypt(unsigned char **encrypt_data,
                                         uint32_t *encrypt_length,
                                         const unsigned char *decrypt_data,
@@ -64,5 +86,39 @@ TPM_RESULT TPM_SymmetricKeyData_Decrypt(unsigned char **decrypt_data,
                                         const TPM_SYMMETRIC_KEY_DATA
 					*tpm_symmetric_key_token);
 
+TPM_RESULT TPM_SymmetricKeyData_EncryptBuffer(unsigned char *data,
+                                              uint32_t data_length,
+                                              uint32_t *encrypt_length,
+                                              const TPM_SYMMETRIC_KEY_DATA
+                                              *tpm_symmetric_key_token);
+
+TPM_RESULT TPM_SymmetricKeyData_DecryptBuffer(unsigned char *decrypt_data,
+                                              uint32_t *decrypt_length,
+                                              const unsigned char *encrypt_data,
+                                              uint32_t encrypt_length,
+                                              const TPM_SYMMETRIC_KEY_DATA
+                                              *tpm_symmetric_key_token);
+
+TPM_RESULT TPM_SymmetricKeyData_GCM_Crypt(unsigned char *output,
+                                          const unsigned char *input,
+                                          uint32_t length,
+                                          const unsigned char *nonce,
+                                          const TPM_SYMMETRIC_KEY_DATA
+                                          *tpm_symmetric_key_data,
+                                          TPM_BOOL encrypt);
+
+TPM_RESULT TPM_SymmetricKeyData_GCM_EncryptBuffer(unsigned char *buffer,
+                                                  uint32_t data_length,
+                                                  uint32_t *encrypt_length,
+                                                  const TPM_SYMMETRIC_KEY_DATA
+                                                  *tpm_symmetric_key_token);
+
+TPM_RESULT TPM_SymmetricKeyData_GCM_DecryptBuffer(unsigned char *decrypt_data,
+                                                  uint32_t *decrypt_length,
+                                                  const unsigned char *encrypt_data,
+                                                  uint32_t encrypt_length,
+                                                  const TPM_SYMMETRIC_KEY_DATA
+                                                  *tpm_symmetric_key_token);
+
 #endif /* _SWTPM_AES_H_ */
 
@@ -0,0 +1,172 @@
+/*
+ * swtpm_cas.c -- Manage the content-addressed TPM state store
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <libtpms/tpm_error.h>
+
+#include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
+
+static void usage(FILE *file, const char *prgname)
+{
+    fprintf(file,
+    "Usage: %s [options]\n"
+    "\n"
+    "Manage the content-addressed object store used by the cas storage\n"
+    "backend of swtpm and swtpm_cuse.\n"
+    "\n"
+    "The following options are supported:\n"
+    "\n"
+    "-i|--dir <dir>        : the TPM state directory; defaults to TPM_PATH\n"
+    "-o|--objects <dir>    : the object directory; defaults to the objects\n"
+    "                        subdirectory of the TPM state directory\n"
+    "-c|--clone <dir>      : create the TPM state in the state directory by\n"
+    "                        reference to the state in the given directory\n"
+    "-g|--gc               : remove objects that are not referenced anymore\n"
+    "-s|--stats            : show statistics about the object directory\n"
+    "-h|--help             : display this help screen and terminate\n"
+    "\n",
+    prgname);
+}
+
+static void print_stats(const struct swtpm_cas_stats *stats)
+{
+    printf("objects: %llu\n"
+           "bytes: %llu\n"
+           "references: %llu\n"
+           "referenced bytes: %llu\n"
+           "unreferenced objects: %llu\n",
+           (unsigned long long)stats->objects,
+           (unsigned long long)stats->bytes,
+           (unsigned long long)stats->references,
+           (unsigned long long)stats->referenced_bytes,
+           (unsigned long long)stats->unreferenced);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, longindex;
+    const char *clone = NULL;
+    TPM_BOOL gc = FALSE, stats = FALSE;
+    struct swtpm_cas_stats cas_stats;
+    static struct option longopts[] = {
+        {"dir"       , required_argument, 0, 'i'},
+        {"objects"   , required_argument, 0, 'o'},
+        {"clone"     , required_argument, 0, 'c'},
+        {"gc"        ,       no_argument, 0, 'g'},
+        {"stats"     ,       no_argument, 0, 's'},
+        {"help"      ,       no_argument, 0, 'h'},
+        {NULL        , 0                , 0, 0  },
+    };
+
+    while (TRUE) {
+        opt = getopt_long(argc, argv, "i:o:c:gsh", longopts, &longindex);
+
+        if (opt == -1)
+            break;
+
+        switch (opt) {
+        case 'i':
+            if (setenv("TPM_PATH", optarg, 1) != 0) {
+                fprintf(stderr, "Could not set path: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'o':
+            if (SWTPM_NVRAM_CAS_Set_ObjectDir(optarg) != TPM_SUCCESS)
+                exit(EXIT_FAILURE);
+            break;
+
+        case 'c':
+            clone = optarg;
+            break;
+
+        case 'g':
+            gc = TRUE;
+            break;
+
+        case 's':
+            stats = TRUE;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            exit(EXIT_SUCCESS);
+
+        default:
+            usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!clone && !gc && !stats) {
+        fprintf(stderr, "Missing --clone, --gc or --stats option.\n");
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (SWTPM_NVRAM_Init() != TPM_SUCCESS)
+        return EXIT_FAILURE;
+
+    if (clone &&
+        SWTPM_NVRAM_CAS_Clone(clone, state_directory, 0) != TPM_SUCCESS) {
+        fprintf(stderr, "Could not clone the TPM state from %s.\n", clone);
+        return EXIT_FAILURE;
+    }
+
+    if (gc) {
+        if (SWTPM_NVRAM_CAS_Scan(TRUE, &cas_stats) != TPM_SUCCESS)
+            return EXIT_FAILURE;
+        printf("Removed %llu file(s) freeing %llu bytes.\n",
+               (unsigned long long)cas_stats.removed,
+               (unsigned long long)cas_stats.removed_bytes);
+    }
+
+    if (stats) {
+        if (SWTPM_NVRAM_CAS_Scan(FALSE, &cas_stats) != TPM_SUCCESS)
+            return EXIT_FAILURE;
+        print_stats(&cas_stats);
+    }
+
+    return EXIT_SUCCESS;
+}
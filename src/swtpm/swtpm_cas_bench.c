@@ -0,0 +1,294 @@
+/*
+ * swtpm_cas_bench.c -- Benchmark cloning TPM state by reference
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+#include <libtpms/tpm_nvfilename.h>
+
+#include "swtpm_crypto.h"
+#include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
+#include "swtpm_time.h"
+
+static const char *blobnames[] = {
+    TPM_PERMANENT_ALL_NAME,
+    TPM_VOLATILESTATE_NAME,
+};
+
+/* disk usage of a directory tree; files with several links are only
+   counted once */
+static struct {
+    uint64_t bytes;
+    uint64_t allocated;
+    uint64_t files;
+    struct {
+        dev_t dev;
+        ino_t ino;
+    } *seen;
+    size_t n_seen;
+} du;
+
+static int du_visit(const char *fpath, const struct stat *sb,
+                    int typeflag, struct FTW *ftwbuf)
+{
+    size_t i;
+    void *p;
+
+    (void)fpath;
+    (void)ftwbuf;
+
+    if (typeflag != FTW_F)
+        return 0;
+
+    if (sb->st_nlink > 1) {
+        for (i = 0; i < du.n_seen; i++)
+            if (du.seen[i].dev == sb->st_dev && du.seen[i].ino == sb->st_ino)
+                return 0;
+        p = realloc(du.seen, (du.n_seen + 1) * sizeof(du.seen[0]));
+        if (!p)
+            return -1;
+        du.seen = p;
+        du.seen[du.n_seen].dev = sb->st_dev;
+        du.seen[du.n_seen].ino = sb->st_ino;
+        du.n_seen++;
+    }
+    du.files++;
+    du.bytes += sb->st_size;
+    du.allocated += (uint64_t)sb->st_blocks * 512;
+
+    return 0;
+}
+
+static void du_reset(void)
+{
+    free(du.seen);
+    memset(&du, 0, sizeof(du));
+}
+
+static int rm_visit(const char *fpath, const struct stat *sb,
+                    int typeflag, struct FTW *ftwbuf)
+{
+    (void)sb;
+    (void)typeflag;
+    (void)ftwbuf;
+
+    return remove(fpath);
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    return SWTPM_Time_Elapsed_Ns(start) / 1E9;
+}
+
+static void print_result(const char *what, unsigned int instances,
+                         double elapsed)
+{
+    printf("%-10s %10.3f %12.1f %8llu %12llu %12llu\n",
+           what, elapsed, elapsed * 1E6 / instances,
+           (unsigned long long)du.files,
+           (unsigned long long)du.bytes,
+           (unsigned long long)du.allocated);
+}
+
+static void usage(FILE *file, const char *prgname)
+{
+    fprintf(file,
+    "Usage: %s [options]\n"
+    "\n"
+    "Measure the time and disk space needed to create TPM instances from a\n"
+    "template by copying its state with the dir backend and by cloning it\n"
+    "by reference with the cas backend.\n"
+    "\n"
+    "-n <num>  : the number of instances to create; defaults to 1000\n"
+    "-s <size> : the size of each state blob; defaults to 4096\n"
+    "-d <dir>  : the directory to create the instances in; a temporary\n"
+    "            directory is used by default\n"
+    "-h        : display this help screen and terminate\n"
+    "\n",
+    prgname);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int instances = 1000, i;
+    uint32_t blobsize = 4096;
+    char basedir[FILENAME_MAX] = "/tmp/swtpm_cas_bench.XXXXXX";
+    char template[FILENAME_MAX], objects[FILENAME_MAX];
+    char path[FILENAME_MAX], dir[FILENAME_MAX], copy[FILENAME_MAX];
+    unsigned char *blobs[sizeof(blobnames) / sizeof(blobnames[0])] = { NULL, };
+    struct swtpm_cas_stats stats;
+    struct timespec start;
+    double elapsed;
+    size_t b;
+    int opt, ret = EXIT_FAILURE;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "n:s:d:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            instances = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            blobsize = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            if ((size_t)snprintf(basedir, sizeof(basedir),
+                                 "%s/swtpm_cas_bench.XXXXXX", optarg) >=
+                sizeof(basedir)) {
+                fprintf(stderr, "Directory path is too long.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (instances == 0 || blobsize == 0) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!mkdtemp(basedir)) {
+        fprintf(stderr, "Could not create directory: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    snprintf(template, sizeof(template), "%s/template", basedir);
+    snprintf(objects, sizeof(objects), "%s/objects", basedir);
+    snprintf(path, sizeof(path), "%s/copies", basedir);
+    snprintf(dir, sizeof(dir), "%s/clones", basedir);
+    if (mkdir(template, 0750) < 0 || mkdir(path, 0750) < 0 ||
+        mkdir(dir, 0750) < 0 || setenv("TPM_PATH", template, 1) < 0 ||
+        SWTPM_NVRAM_Init() != TPM_SUCCESS ||
+        SWTPM_NVRAM_CAS_Set_ObjectDir(objects) != TPM_SUCCESS)
+        goto cleanup;
+
+    /* the template with random, hence incompressible, blobs */
+    for (b = 0; rc == TPM_SUCCESS && b < sizeof(blobs) / sizeof(blobs[0]);
+         b++) {
+        rc = TPM_Malloc(&blobs[b], blobsize);
+        if (rc == TPM_SUCCESS)
+            rc = SWTPM_Crypto_GetRandom(blobs[b], blobsize);
+        if (rc == TPM_SUCCESS)
+            rc = nvram_cas_ops.store(blobs[b], blobsize, 0, blobnames[b]);
+    }
+    if (rc != TPM_SUCCESS)
+        goto cleanup;
+
+    printf("instances: %u, blobs per instance: %zu, blob size: %u\n\n",
+           instances, sizeof(blobs) / sizeof(blobs[0]), blobsize);
+    printf("%-10s %10s %12s %8s %12s %12s\n",
+           "method", "time [s]", "per inst [us]", "files", "bytes",
+           "allocated");
+
+    /* copies of the template using the dir backend */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; rc == TPM_SUCCESS && i < instances; i++) {
+        if ((size_t)snprintf(copy, sizeof(copy), "%s/%u", path, i) >=
+            sizeof(copy) || mkdir(copy, 0750) < 0 ||
+            SWTPM_NVRAM_Set_StateDir(copy) != TPM_SUCCESS) {
+            rc = TPM_FAIL;
+            break;
+        }
+        for (b = 0; rc == TPM_SUCCESS && b < sizeof(blobs) / sizeof(blobs[0]);
+             b++)
+            rc = nvram_dir_ops.store(blobs[b], blobsize, 0, blobnames[b]);
+    }
+    elapsed = elapsed_since(&start);
+    if (rc != TPM_SUCCESS ||
+        nftw(path, du_visit, 16, FTW_PHYS) != 0)
+        goto cleanup;
+    print_result("dir copy", instances, elapsed);
+    du_reset();
+
+    /* clones of the template by reference */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; rc == TPM_SUCCESS && i < instances; i++) {
+        if ((size_t)snprintf(path, sizeof(path), "%s/%u", dir, i) >=
+            sizeof(path))
+            rc = TPM_FAIL;
+        else
+            rc = SWTPM_NVRAM_CAS_Clone(template, path, 0);
+    }
+    elapsed = elapsed_since(&start);
+    if (rc != TPM_SUCCESS ||
+        nftw(objects, du_visit, 16, FTW_PHYS) != 0 ||
+        nftw(dir, du_visit, 16, FTW_PHYS) != 0)
+        goto cleanup;
+    print_result("cas clone", instances, elapsed);
+    du_reset();
+
+    /* drop all references and collect the garbage */
+    if (nftw(dir, rm_visit, 16, FTW_DEPTH | FTW_PHYS) != 0 ||
+        nftw(template, rm_visit, 16, FTW_DEPTH | FTW_PHYS) != 0)
+        goto cleanup;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (SWTPM_NVRAM_CAS_Scan(TRUE, &stats) != TPM_SUCCESS)
+        goto cleanup;
+    printf("\ngc after removing all instances: %.3fs, removed %llu "
+           "object(s), %llu bytes\n",
+           elapsed_since(&start), (unsigned long long)stats.removed,
+           (unsigned long long)stats.removed_bytes);
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, "Benchmark failed.\n");
+    for (b = 0; b < sizeof(blobs) / sizeof(blobs[0]); b++)
+        TPM_Free(blobs[b]);
+    du_reset();
+    nftw(basedir, rm_visit, 16, FTW_DEPTH | FTW_PHYS);
+
+    return ret;
+}
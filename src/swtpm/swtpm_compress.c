@@ -0,0 +1,264 @@
+/*
+ * swtpm_compress.c -- Compression of the TPM state blobs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef USE_ZLIB_COMPRESSION
+# include <zlib.h>
+#endif
+#ifdef USE_ZSTD_COMPRESSION
+# include <zstd.h>
+#endif
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_compress.h"
+#include "logging.h"
+
+enum swtpm_compression SWTPM_Compression_Default(void)
+{
+#if defined(USE_ZSTD_COMPRESSION)
+    return SWTPM_COMPRESSION_ZSTD;
+#elif defined(USE_ZLIB_COMPRESSION)
+    return SWTPM_COMPRESSION_ZLIB;
+#else
+    return SWTPM_COMPRESSION_NONE;
+#endif
+}
+
+TPM_BOOL SWTPM_Compression_Supported(enum swtpm_compression comp)
+{
+    switch (comp) {
+    case SWTPM_COMPRESSION_NONE:
+        return TRUE;
+    case SWTPM_COMPRESSION_ZLIB:
+#ifdef USE_ZLIB_COMPRESSION
+        return TRUE;
+#else
+        return FALSE;
+#endif
+    case SWTPM_COMPRESSION_ZSTD:
+#ifdef USE_ZSTD_COMPRESSION
+        return TRUE;
+#else
+        return FALSE;
+#endif
+    }
+    return FALSE;
+}
+
+const char *SWTPM_Compression_Name(enum swtpm_compression comp)
+{
+    switch (comp) {
+    case SWTPM_COMPRESSION_NONE:
+        return "none";
+    case SWTPM_COMPRESSION_ZLIB:
+        return "zlib";
+    case SWTPM_COMPRESSION_ZSTD:
+        return "zstd";
+    }
+    return "unknown";
+}
+
+#ifdef USE_ZLIB_COMPRESSION
+
+static TPM_RESULT zlib_compress(unsigned char *out, uint32_t *out_length,
+                                const unsigned char *data, uint32_t length)
+{
+    uLongf destlen = *out_length;
+
+    if (compress2(out, &destlen, data, length, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return TPM_SIZE;
+
+    *out_length = destlen;
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT zlib_decompress(unsigned char *out, uint32_t out_length,
+                                  const unsigned char *data, uint32_t length)
+{
+    uLongf destlen = out_length;
+    int ret;
+
+    ret = uncompress(out, &destlen, data, length);
+    if (ret != Z_OK || destlen != out_length) {
+        logprintf(STDERR_FILENO, "Could not decompress the state blob: %s\n",
+                  ret != Z_OK ? zError(ret) : "bad length");
+        return TPM_FAIL;
+    }
+
+    return TPM_SUCCESS;
+}
+
+#endif /* USE_ZLIB_COMPRESSION */
+
+#ifdef USE_ZSTD_COMPRESSION
+
+/* level 3 is zstd's default and much faster than zlib at a better ratio */
+#define SWTPM_ZSTD_LEVEL 3
+
+static TPM_RESULT zstd_compress(unsigned char *out, uint32_t *out_length,
+                                const unsigned char *data, uint32_t length)
+{
+    size_t n;
+
+    n = ZSTD_compress(out, *out_length, data, length, SWTPM_ZSTD_LEVEL);
+    if (ZSTD_isError(n))
+        return TPM_SIZE;
+
+    *out_length = n;
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT zstd_decompress(unsigned char *out, uint32_t out_length,
+                                  const unsigned char *data, uint32_t length)
+{
+    size_t n;
+
+    n = ZSTD_decompress(out, out_length, data, length);
+    if (ZSTD_isError(n) || n != out_length) {
+        logprintf(STDERR_FILENO, "Could not decompress the state blob: %s\n",
+                  ZSTD_isError(n) ? ZSTD_getErrorName(n) : "bad length");
+        return TPM_FAIL;
+    }
+
+    return TPM_SUCCESS;
+}
+
+#endif /* USE_ZSTD_COMPRESSION */
+
+TPM_RESULT SWTPM_Compress(enum swtpm_compression comp,
+                          uint32_t hdrsize,
+                          unsigned char **out,
+                          uint32_t *out_length,
+                          const unsigned char *data,
+                          uint32_t length)
+{
+    TPM_RESULT rc;
+    uint32_t n;
+
+    *out = NULL;
+    *out_length = 0;
+
+    if (!SWTPM_Compression_Supported(comp) || comp == SWTPM_COMPRESSION_NONE)
+        return TPM_BAD_MODE;
+
+    /* it is only worth it if the data become smaller */
+    if (length <= hdrsize)
+        return TPM_SIZE;
+    n = length - hdrsize;
+
+    rc = TPM_Malloc(out, hdrsize + n);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    rc = TPM_BAD_MODE;
+    switch (comp) {
+    case SWTPM_COMPRESSION_NONE:
+        break;
+    case SWTPM_COMPRESSION_ZLIB:
+#ifdef USE_ZLIB_COMPRESSION
+        rc = zlib_compress(&(*out)[hdrsize], &n, data, length);
+#endif
+        break;
+    case SWTPM_COMPRESSION_ZSTD:
+#ifdef USE_ZSTD_COMPRESSION
+        rc = zstd_compress(&(*out)[hdrsize], &n, data, length);
+#endif
+        break;
+    }
+
+    if (rc == TPM_SUCCESS) {
+        *out_length = hdrsize + n;
+    } else {
+        TPM_Free(*out);
+        *out = NULL;
+    }
+
+    return rc;
+}
+
+TPM_RESULT SWTPM_Decompress(enum swtpm_compression comp,
+                            unsigned char **out,
+                            uint32_t out_length,
+                            const unsigned char *data,
+                            uint32_t length)
+{
+    TPM_RESULT rc;
+
+    *out = NULL;
+
+    if (!SWTPM_Compression_Supported(comp) || comp == SWTPM_COMPRESSION_NONE) {
+        logprintf(STDERR_FILENO, "The state blob is compressed with %s, "
+                  "which is not supported by this build.\n",
+                  SWTPM_Compression_Name(comp));
+        return TPM_BAD_MODE;
+    }
+
+    /* TPM_Malloc() does not allocate 0 bytes */
+    rc = TPM_Malloc(out, out_length ? out_length : 1);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    rc = TPM_BAD_MODE;
+    switch (comp) {
+    case SWTPM_COMPRESSION_NONE:
+        break;
+    case SWTPM_COMPRESSION_ZLIB:
+#ifdef USE_ZLIB_COMPRESSION
+        rc = zlib_decompress(*out, out_length, data, length);
+#endif
+        break;
+    case SWTPM_COMPRESSION_ZSTD:
+#ifdef USE_ZSTD_COMPRESSION
+        rc = zstd_decompress(*out, out_length, data, length);
+#endif
+        break;
+    }
+
+    if (rc != TPM_SUCCESS) {
+        TPM_Free(*out);
+        *out = NULL;
+    }
+
+    return rc;
+}
@@ -0,0 +1,76 @@
+/*
+ * swtpm_compress.h -- Compression of the TPM state blobs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_COMPRESS_H_
+#define _SWTPM_COMPRESS_H_
+
+#include <libtpms/tpm_types.h>
+
+enum swtpm_compression {
+    SWTPM_COMPRESSION_NONE = 0,
+    SWTPM_COMPRESSION_ZLIB,
+    SWTPM_COMPRESSION_ZSTD,
+};
+
+/* the compression the state blobs are written with */
+enum swtpm_compression SWTPM_Compression_Default(void);
+
+TPM_BOOL SWTPM_Compression_Supported(enum swtpm_compression comp);
+
+const char *SWTPM_Compression_Name(enum swtpm_compression comp);
+
+/*
+ * Compress 'length' bytes of 'data' into a newly allocated buffer that
+ * starts with 'hdrsize' bytes reserved for the caller. TPM_SIZE is
+ * returned if the data do not become smaller.
+ */
+TPM_RESULT SWTPM_Compress(enum swtpm_compression comp,
+                          uint32_t hdrsize,
+                          unsigned char **out,
+                          uint32_t *out_length,
+                          const unsigned char *data,
+                          uint32_t length);
+
+/*
+ * Decompress 'length' bytes of 'data' into a newly allocated buffer of
+ * exactly 'out_length' bytes.
+ */
+TPM_RESULT SWTPM_Decompress(enum swtpm_compression comp,
+                            unsigned char **out,
+                            uint32_t out_length,
+                            const unsigned char *data,
+                            uint32_t length);
+
+#endif /* _SWTPM_COMPRESS_H_ */
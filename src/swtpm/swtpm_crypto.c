@@ -0,0 +1,682 @@
+/*
+ * swtpm_crypto.c -- Crypto providers for the AES primitives
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef USE_FREEBL_CRYPTO_LIBRARY
+# include <blapi.h>
+# include <pkcs11t.h>
+#else
+# ifdef USE_OPENSSL_CRYPTO_LIBRARY
+#  include <openssl/aes.h>
+#  include <openssl/evp.h>
+#  include <openssl/rand.h>
+#  include <openssl/sha.h>
+# else
+#  error "Unsupported crypto library."
+# endif
+#endif
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_aes.h"
+#include "swtpm_crypto.h"
+#include "swtpm_time.h"
+#include "logging.h"
+
+#ifdef USE_FREEBL_CRYPTO_LIBRARY
+
+/*
+ * FreeBL: the AES contexts hold the IV and cannot be reused across
+ * operations, so the 'key schedule' only holds a copy of the key and
+ * a context is created for every operation.
+ */
+struct freebl_schedule {
+    unsigned char key[TPM_AES_MAX_KEY_SIZE];
+    uint32_t keylen;
+};
+
+static TPM_BOOL freebl_supports(enum swtpm_cipher_mode mode)
+{
+    switch (mode) {
+    case SWTPM_CIPHER_AES_CBC:
+    case SWTPM_CIPHER_AES_GCM:
+        return TRUE;
+    case SWTPM_CIPHER_NUM_MODES:
+        break;
+    }
+    return FALSE;
+}
+
+static TPM_RESULT freebl_key_init(void **schedule,
+                                  enum swtpm_cipher_mode mode,
+                                  const unsigned char *key,
+                                  uint32_t keylen)
+{
+    struct freebl_schedule *s = NULL;
+    TPM_RESULT rc;
+
+    (void)mode;
+
+    if (keylen > sizeof(s->key))
+        return TPM_BAD_KEY_PROPERTY;
+
+    rc = TPM_Malloc((unsigned char **)&s, sizeof(*s));
+    if (rc == 0) {
+        memcpy(s->key, key, keylen);
+        s->keylen = keylen;
+        *schedule = s;
+    }
+    return rc;
+}
+
+static void freebl_key_free(void *schedule)
+{
+    struct freebl_schedule *s = schedule;
+
+    if (s) {
+        memset(s, 0, sizeof(*s));
+        TPM_Free((unsigned char *)s);
+    }
+}
+
+static void freebl_destroy_context(AESContext *cx)
+{
+    /* due to a FreeBL bug, must zero the context before destroying it */
+    unsigned char dummy_key[TPM_AES_BLOCK_SIZE];
+    unsigned char dummy_ivec[TPM_AES_BLOCK_SIZE];
+
+    memset(dummy_key, 0x00, TPM_AES_BLOCK_SIZE);
+    memset(dummy_ivec, 0x00, TPM_AES_BLOCK_SIZE);
+    AES_InitContext(cx,				/* AES context */
+		    dummy_key,			/* AES key */
+		    TPM_AES_BLOCK_SIZE,		/* key length */
+		    dummy_ivec, 		/* ivec */
+		    NSS_AES_CBC,		/* CBC mode */
+		    TRUE,			/* encrypt */
+		    TPM_AES_BLOCK_SIZE);	/* AES  block length */
+    AES_DestroyContext(cx, PR_TRUE);
+}
+
+static TPM_RESULT freebl_cbc_crypt(const void *schedule,
+                                   unsigned char *output,
+                                   const unsigned char *input,
+                                   uint32_t length,
+                                   unsigned char *ivec,
+                                   TPM_BOOL encrypt)
+{
+    const struct freebl_schedule *s = schedule;
+    TPM_RESULT rc = 0;
+    SECStatus rv;
+    AESContext *cx;
+    unsigned int output_length;
+    unsigned char next_ivec[TPM_AES_BLOCK_SIZE];
+
+    cx = AES_CreateContext(s->key,
+			   ivec, 			/* CBC initialization vector */
+			   NSS_AES_CBC,			/* CBC mode */
+			   encrypt,			/* encrypt or decrypt */
+			   s->keylen,			/* key length */
+			   TPM_AES_BLOCK_SIZE);		/* AES  block length */
+    if (cx == NULL)
+	return TPM_SIZE;
+
+    /* when decrypting in place, the last input block is overwritten */
+    memcpy(next_ivec, &input[length - TPM_AES_BLOCK_SIZE], sizeof(next_ivec));
+
+    if (encrypt)
+	rv = AES_Encrypt(cx,
+			 output, &output_length, length,	/* output */
+			 input, length);			/* input */
+    else
+	rv = AES_Decrypt(cx,
+			 output, &output_length, length,	/* output */
+			 input, length);			/* input */
+    if (rv != SECSuccess) {
+	rc = encrypt ? TPM_ENCRYPT_ERROR : TPM_DECRYPT_ERROR;
+    } else if (encrypt) {
+        memcpy(ivec, &output[length - TPM_AES_BLOCK_SIZE], TPM_AES_BLOCK_SIZE);
+    } else {
+        memcpy(ivec, next_ivec, TPM_AES_BLOCK_SIZE);
+    }
+
+    freebl_destroy_context(cx);
+
+    return rc;
+}
+
+static TPM_RESULT freebl_gcm_crypt(const void *schedule,
+                                   unsigned char *output,
+                                   const unsigned char *input,
+                                   uint32_t length,
+                                   const unsigned char *nonce,
+                                   TPM_BOOL encrypt)
+{
+    const struct freebl_schedule *s = schedule;
+    TPM_RESULT rc = 0;
+    SECStatus rv;
+    AESContext *cx;
+    unsigned int output_length;
+    CK_GCM_PARAMS gcm_params = {
+        .pIv = (unsigned char *)nonce,
+        .ulIvLen = TPM_AES_GCM_NONCE_SIZE,
+        .ulTagBits = TPM_AES_GCM_TAG_SIZE * 8,
+    };
+
+    cx = AES_CreateContext(s->key,
+			   (unsigned char *)&gcm_params,
+			   NSS_AES_GCM,			/* GCM mode */
+			   encrypt,			/* encrypt or decrypt */
+			   s->keylen,			/* key length */
+			   TPM_AES_BLOCK_SIZE);		/* AES  block length */
+    if (cx == NULL)
+	return TPM_SIZE;
+
+    if (encrypt)
+	rv = AES_Encrypt(cx,
+			 output, &output_length,
+			 length + TPM_AES_GCM_TAG_SIZE,		/* output */
+			 input, length);			/* input */
+    else
+	rv = AES_Decrypt(cx,
+			 output, &output_length, length,	/* output */
+			 input, length + TPM_AES_GCM_TAG_SIZE);	/* input */
+    if (rv != SECSuccess)
+	rc = encrypt ? TPM_ENCRYPT_ERROR : TPM_DECRYPT_ERROR;
+
+    AES_DestroyContext(cx, PR_TRUE);
+
+    return rc;
+}
+
+static const struct swtpm_crypto_provider freebl_provider = {
+    .name      = "freebl",
+    .supports  = freebl_supports,
+    .key_init  = freebl_key_init,
+    .key_free  = freebl_key_free,
+    .cbc_crypt = freebl_cbc_crypt,
+    .gcm_crypt = freebl_gcm_crypt,
+};
+
+const struct swtpm_crypto_provider *swtpm_crypto_providers[] = {
+    &freebl_provider,
+    NULL,
+};
+
+TPM_RESULT SWTPM_Crypto_Digest(const unsigned char *data, uint32_t length,
+                               unsigned char *digest)
+{
+    if (SHA256_HashBuf(digest, data, length) != SECSuccess)
+        return TPM_FAIL;
+    return TPM_SUCCESS;
+}
+
+TPM_RESULT SWTPM_Crypto_GetRandom(unsigned char *buffer, uint32_t length)
+{
+    if (RNG_GenerateGlobalRandomBytes(buffer, length) != SECSuccess)
+        return TPM_FAIL;
+    return TPM_SUCCESS;
+}
+
+#endif /* USE_FREEBL_CRYPTO_LIBRARY */
+
+#ifdef USE_OPENSSL_CRYPTO_LIBRARY
+
+/*
+ * OpenSSL EVP: the EVP interface picks the fastest implementation for the
+ * CPU, such as AES-NI, by itself. The contexts in the key schedule hold
+ * the expanded key and are copied for every operation.
+ */
+struct evp_schedule {
+    EVP_CIPHER_CTX *ctx[2]; /* [0]: decrypt, [1]: encrypt */
+    enum swtpm_cipher_mode mode;
+};
+
+static TPM_BOOL evp_supports(enum swtpm_cipher_mode mode)
+{
+    switch (mode) {
+    case SWTPM_CIPHER_AES_CBC:
+    case SWTPM_CIPHER_AES_GCM:
+        return TRUE;
+    case SWTPM_CIPHER_NUM_MODES:
+        break;
+    }
+    return FALSE;
+}
+
+static void evp_key_free(void *schedule)
+{
+    struct evp_schedule *s = schedule;
+
+    if (s) {
+        EVP_CIPHER_CTX_free(s->ctx[0]);
+        EVP_CIPHER_CTX_free(s->ctx[1]);
+        TPM_Free((unsigned char *)s);
+    }
+}
+
+static TPM_RESULT evp_key_init(void **schedule,
+                               enum swtpm_cipher_mode mode,
+                               const unsigned char *key,
+                               uint32_t keylen)
+{
+    struct evp_schedule *s = NULL;
+    const EVP_CIPHER *cipher = NULL;
+    TPM_RESULT rc;
+    int enc;
+
+    switch (mode) {
+    case SWTPM_CIPHER_AES_CBC:
+        if (keylen == 128/8)
+            cipher = EVP_aes_128_cbc();
+        else if (keylen == 256/8)
+            cipher = EVP_aes_256_cbc();
+        break;
+    case SWTPM_CIPHER_AES_GCM:
+        if (keylen == 128/8)
+            cipher = EVP_aes_128_gcm();
+        else if (keylen == 256/8)
+            cipher = EVP_aes_256_gcm();
+        break;
+    case SWTPM_CIPHER_NUM_MODES:
+        break;
+    }
+    if (!cipher)
+        return TPM_BAD_KEY_PROPERTY;
+
+    rc = TPM_Malloc((unsigned char **)&s, sizeof(*s));
+    if (rc)
+        return rc;
+    memset(s, 0, sizeof(*s));
+    s->mode = mode;
+
+    for (enc = 0; enc < 2 && rc == 0; enc++) {
+        s->ctx[enc] = EVP_CIPHER_CTX_new();
+        if (!s->ctx[enc] ||
+            EVP_CipherInit_ex(s->ctx[enc], cipher, NULL, NULL, NULL, enc) != 1)
+            rc = TPM_FAIL;
+        if (rc == 0 && mode == SWTPM_CIPHER_AES_GCM &&
+            EVP_CIPHER_CTX_ctrl(s->ctx[enc], EVP_CTRL_GCM_SET_IVLEN,
+                                TPM_AES_GCM_NONCE_SIZE, NULL) != 1)
+            rc = TPM_FAIL;
+        if (rc == 0 &&
+            EVP_CipherInit_ex(s->ctx[enc], NULL, NULL, key, NULL, enc) != 1)
+            rc = TPM_FAIL;
+    }
+
+    if (rc == 0)
+        *schedule = s;
+    else
+        evp_key_free(s);
+
+    return rc;
+}
+
+/*
+ * Get a context for an operation from the key schedule and set the IV
+ */
+static EVP_CIPHER_CTX *evp_get_ctx(const struct evp_schedule *s,
+                                   const unsigned char *iv,
+                                   TPM_BOOL encrypt)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int enc = encrypt ? 1 : 0;
+
+    if (!ctx)
+        return NULL;
+    if (EVP_CIPHER_CTX_copy(ctx, s->ctx[enc]) != 1 ||
+        EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, enc) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static TPM_RESULT evp_cbc_crypt(const void *schedule,
+                                unsigned char *output,
+                                const unsigned char *input,
+                                uint32_t length,
+                                unsigned char *ivec,
+                                TPM_BOOL encrypt)
+{
+    TPM_RESULT rc = 0;
+    EVP_CIPHER_CTX *ctx;
+    unsigned char next_ivec[TPM_AES_BLOCK_SIZE];
+    int outl;
+
+    ctx = evp_get_ctx(schedule, ivec, encrypt);
+    if (!ctx)
+        return TPM_FAIL;
+
+    /* we do the padding ourselves */
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    /* when decrypting in place, the last input block is overwritten */
+    memcpy(next_ivec, &input[length - TPM_AES_BLOCK_SIZE], sizeof(next_ivec));
+
+    if (EVP_CipherUpdate(ctx, output, &outl, input, length) != 1 ||
+        (uint32_t)outl != length) {
+        rc = encrypt ? TPM_ENCRYPT_ERROR : TPM_DECRYPT_ERROR;
+    } else if (encrypt) {
+        memcpy(ivec, &output[length - TPM_AES_BLOCK_SIZE], TPM_AES_BLOCK_SIZE);
+    } else {
+        memcpy(ivec, next_ivec, TPM_AES_BLOCK_SIZE);
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return rc;
+}
+
+static TPM_RESULT evp_gcm_crypt(const void *schedule,
+                                unsigned char *output,
+                                const unsigned char *input,
+                                uint32_t length,
+                                const unsigned char *nonce,
+                                TPM_BOOL encrypt)
+{
+    TPM_RESULT rc = 0;
+    EVP_CIPHER_CTX *ctx;
+    int outl;
+
+    ctx = evp_get_ctx(schedule, nonce, encrypt);
+    if (!ctx)
+        return TPM_FAIL;
+
+    if (encrypt) {
+        if (EVP_EncryptUpdate(ctx, output, &outl, input, length) != 1 ||
+            EVP_EncryptFinal_ex(ctx, &output[outl], &outl) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG,
+                                TPM_AES_GCM_TAG_SIZE, &output[length]) != 1)
+            rc = TPM_ENCRYPT_ERROR;
+    } else {
+        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG,
+                                TPM_AES_GCM_TAG_SIZE,
+                                (unsigned char *)&input[length]) != 1 ||
+            EVP_DecryptUpdate(ctx, output, &outl, input, length) != 1 ||
+            EVP_DecryptFinal_ex(ctx, &output[outl], &outl) != 1)
+            rc = TPM_DECRYPT_ERROR;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return rc;
+}
+
+static const struct swtpm_crypto_provider evp_provider = {
+    .name      = "openssl-evp",
+    .supports  = evp_supports,
+    .key_init  = evp_key_init,
+    .key_free  = evp_key_free,
+    .cbc_crypt = evp_cbc_crypt,
+    .gcm_crypt = evp_gcm_crypt,
+};
+
+/*
+ * OpenSSL low-level AES functions; only CBC is supported. Both the
+ * encryption and decryption key schedules are expanded up front.
+ */
+struct aes_schedule {
+    AES_KEY key[2]; /* [0]: decrypt, [1]: encrypt */
+};
+
+static TPM_BOOL aes_supports(enum swtpm_cipher_mode mode)
+{
+    return mode == SWTPM_CIPHER_AES_CBC;
+}
+
+static void aes_key_free(void *schedule)
+{
+    struct aes_schedule *s = schedule;
+
+    if (s) {
+        memset(s, 0, sizeof(*s));
+        TPM_Free((unsigned char *)s);
+    }
+}
+
+static TPM_RESULT aes_key_init(void **schedule,
+                               enum swtpm_cipher_mode mode,
+                               const unsigned char *key,
+                               uint32_t keylen)
+{
+    struct aes_schedule *s = NULL;
+    TPM_RESULT rc;
+
+    if (!aes_supports(mode))
+        return TPM_BAD_MODE;
+
+    rc = TPM_Malloc((unsigned char **)&s, sizeof(*s));
+    if (rc)
+        return rc;
+
+    if (AES_set_decrypt_key(key, keylen * 8, &s->key[0]) < 0 ||
+        AES_set_encrypt_key(key, keylen * 8, &s->key[1]) < 0) {
+        aes_key_free(s);
+        return TPM_BAD_KEY_PROPERTY;
+    }
+    *schedule = s;
+
+    return 0;
+}
+
+static TPM_RESULT aes_cbc_crypt(const void *schedule,
+                                unsigned char *output,
+                                const unsigned char *input,
+                                uint32_t length,
+                                unsigned char *ivec,
+                                TPM_BOOL encrypt)
+{
+    const struct aes_schedule *s = schedule;
+
+    AES_cbc_encrypt(input, output, length,
+                    &s->key[encrypt ? 1 : 0], ivec,
+                    encrypt ? AES_ENCRYPT : AES_DECRYPT);
+
+    return 0;
+}
+
+static const struct swtpm_crypto_provider aes_provider = {
+    .name      = "openssl-aes",
+    .supports  = aes_supports,
+    .key_init  = aes_key_init,
+    .key_free  = aes_key_free,
+    .cbc_crypt = aes_cbc_crypt,
+    .gcm_crypt = NULL,
+};
+
+const struct swtpm_crypto_provider *swtpm_crypto_providers[] = {
+    &evp_provider,
+    &aes_provider,
+    NULL,
+};
+
+TPM_RESULT SWTPM_Crypto_Digest(const unsigned char *data, uint32_t length,
+                               unsigned char *digest)
+{
+    SHA256(data, length, digest);
+    return TPM_SUCCESS;
+}
+
+TPM_RESULT SWTPM_Crypto_GetRandom(unsigned char *buffer, uint32_t length)
+{
+    if (RAND_bytes(buffer, length) != 1)
+        return TPM_FAIL;
+    return TPM_SUCCESS;
+}
+
+#endif /* USE_OPENSSL_CRYPTO_LIBRARY */
+
+/*
+ * Measure the encryption throughput of a provider for the given mode
+ * by encrypting a buffer of 'bufsize' bytes 'iterations' times.
+ */
+TPM_RESULT SWTPM_Crypto_Measure(const struct swtpm_crypto_provider *provider,
+                                enum swtpm_cipher_mode mode,
+                                uint32_t keylen,
+                                uint32_t bufsize,
+                                unsigned int iterations,
+                                double *mbps)
+{
+    unsigned char key[TPM_AES_MAX_KEY_SIZE] = { 0, };
+    unsigned char ivec[TPM_AES_BLOCK_SIZE] = { 0, };
+    unsigned char *buffer = NULL;
+    void *schedule = NULL;
+    struct timespec start, end;
+    double elapsed;
+    unsigned int i;
+    TPM_RESULT rc;
+
+    if (!provider->supports(mode) || keylen > sizeof(key) ||
+        bufsize % TPM_AES_BLOCK_SIZE)
+        return TPM_BAD_MODE;
+
+    /* a scratch buffer that need not fit the limit of TPM_Malloc() */
+    buffer = calloc(1, bufsize + TPM_AES_GCM_TAG_SIZE);
+    if (!buffer)
+        return TPM_SIZE;
+    rc = provider->key_init(&schedule, mode, key, keylen);
+
+    if (rc == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < iterations && rc == 0; i++) {
+            switch (mode) {
+            case SWTPM_CIPHER_AES_CBC:
+                rc = provider->cbc_crypt(schedule, buffer, buffer, bufsize,
+                                         ivec, TRUE);
+                break;
+            case SWTPM_CIPHER_AES_GCM:
+                rc = provider->gcm_crypt(schedule, buffer, buffer, bufsize,
+                                         ivec, TRUE);
+                break;
+            case SWTPM_CIPHER_NUM_MODES:
+                rc = TPM_BAD_MODE;
+                break;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        elapsed = SWTPM_Time_Diff_Ns(&start, &end) / 1E9;
+        if (elapsed <= 0)
+            elapsed = 1E-9;
+        *mbps = ((double)bufsize * iterations) / (1024 * 1024) / elapsed;
+    }
+
+    if (schedule)
+        provider->key_free(schedule);
+    free(buffer);
+
+    return rc;
+}
+
+/*
+ * The providers are compared by encrypting CRYPTO_SELECT_ROUNDS times
+ * CRYPTO_SELECT_ITERATIONS buffers of CRYPTO_SELECT_BUFSIZE bytes; the
+ * best round of each provider counts, so that a round that was disturbed
+ * by other work on the host does not decide the choice.
+ */
+#define CRYPTO_SELECT_BUFSIZE    (64 * 1024)
+#define CRYPTO_SELECT_ITERATIONS 16
+#define CRYPTO_SELECT_ROUNDS     3
+
+/*
+ * Select the fastest provider for the given mode and key length in bytes.
+ * The providers are measured with that mode and key length once and the
+ * result is remembered.
+ */
+const struct swtpm_crypto_provider *
+SWTPM_Crypto_SelectProvider(enum swtpm_cipher_mode mode, uint32_t keylen)
+{
+    static const struct swtpm_crypto_provider *
+        selected[SWTPM_CIPHER_NUM_MODES][TPM_AES_MAX_KEY_SIZE / 8 + 1];
+    const struct swtpm_crypto_provider *provider, **sel;
+    double mbps, provider_mbps, best_mbps = 0;
+    unsigned int i, r, candidates = 0;
+
+    if (mode >= SWTPM_CIPHER_NUM_MODES || keylen > TPM_AES_MAX_KEY_SIZE ||
+        keylen % 8)
+        return NULL;
+
+    sel = &selected[mode][keylen / 8];
+    if (*sel)
+        return *sel;
+
+    for (i = 0; swtpm_crypto_providers[i]; i++) {
+        if (swtpm_crypto_providers[i]->supports(mode))
+            candidates++;
+    }
+
+    for (i = 0; swtpm_crypto_providers[i]; i++) {
+        provider = swtpm_crypto_providers[i];
+        if (!provider->supports(mode))
+            continue;
+        if (!*sel) {
+            /* first one is the default if measuring fails */
+            *sel = provider;
+        }
+        if (candidates == 1)
+            break;
+        provider_mbps = 0;
+        for (r = 0; r < CRYPTO_SELECT_ROUNDS; r++) {
+            if (SWTPM_Crypto_Measure(provider, mode, keylen,
+                                     CRYPTO_SELECT_BUFSIZE,
+                                     CRYPTO_SELECT_ITERATIONS,
+                                     &mbps) != TPM_SUCCESS) {
+                logprintf(STDERR_FILENO,
+                          "Measuring the crypto provider %s failed; it is "
+                          "not selected.\n", provider->name);
+                break;
+            }
+            if (mbps > provider_mbps)
+                provider_mbps = mbps;
+        }
+        if (r == CRYPTO_SELECT_ROUNDS && provider_mbps > best_mbps) {
+            best_mbps = provider_mbps;
+            *sel = provider;
+        }
+    }
+
+    if (candidates > 1 && best_mbps == 0)
+        logprintf(STDERR_FILENO, "No crypto provider could be measured; "
+                  "using %s.\n", (*sel)->name);
+
+    return *sel;
+}
@@ -0,0 +1,110 @@
+/*
+ * swtpm_crypto.h -- Crypto provider interface
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_CRYPTO_H_
+#define _SWTPM_CRYPTO_H_
+
+#include <libtpms/tpm_types.h>
+
+/* size of the digest produced by SWTPM_Crypto_Digest (SHA-256) */
+#define SWTPM_CRYPTO_DIGEST_SIZE 32
+
+enum swtpm_cipher_mode {
+    SWTPM_CIPHER_AES_CBC = 0,
+    SWTPM_CIPHER_AES_GCM,
+    SWTPM_CIPHER_NUM_MODES,
+};
+
+/*
+ * A crypto provider implements the AES primitives on top of one of the
+ * crypto libraries. Keys are expanded once into a provider-specific key
+ * schedule that is then used for all operations with that key; the key
+ * schedule is not modified by the operations, so it can be used by
+ * multiple threads.
+ */
+struct swtpm_crypto_provider {
+    const char *name;
+    /* whether the provider implements the given mode */
+    TPM_BOOL (*supports)(enum swtpm_cipher_mode mode);
+    /* expand 'key' of 'keylen' bytes into a key schedule for 'mode' */
+    TPM_RESULT (*key_init)(void **schedule,
+                           enum swtpm_cipher_mode mode,
+                           const unsigned char *key,
+                           uint32_t keylen);
+    void (*key_free)(void *schedule);
+    /*
+     * CBC encrypt or decrypt 'length' bytes, a multiple of the block size;
+     * 'ivec' is updated so that consecutive calls continue the stream
+     */
+    TPM_RESULT (*cbc_crypt)(const void *schedule,
+                            unsigned char *output,
+                            const unsigned char *input,
+                            uint32_t length,
+                            unsigned char *ivec,
+                            TPM_BOOL encrypt);
+    /*
+     * GCM encrypt or decrypt 'length' bytes; when encrypting the tag is
+     * written following the ciphertext in 'output', when decrypting the
+     * tag must follow the ciphertext in 'input' and is verified
+     */
+    TPM_RESULT (*gcm_crypt)(const void *schedule,
+                            unsigned char *output,
+                            const unsigned char *input,
+                            uint32_t length,
+                            const unsigned char *nonce,
+                            TPM_BOOL encrypt);
+};
+
+/* NULL-terminated list of the providers built in */
+extern const struct swtpm_crypto_provider *swtpm_crypto_providers[];
+
+const struct swtpm_crypto_provider *
+SWTPM_Crypto_SelectProvider(enum swtpm_cipher_mode mode, uint32_t keylen);
+
+TPM_RESULT SWTPM_Crypto_Measure(const struct swtpm_crypto_provider *provider,
+                                enum swtpm_cipher_mode mode,
+                                uint32_t keylen,
+                                uint32_t bufsize,
+                                unsigned int iterations,
+                                double *mbps);
+
+TPM_RESULT SWTPM_Crypto_Digest(const unsigned char *data,
+                               uint32_t length,
+                               unsigned char *digest);
+
+TPM_RESULT SWTPM_Crypto_GetRandom(unsigned char *buffer,
+                                  uint32_t length);
+
+#endif /* _SWTPM_CRYPTO_H_ */
@@ -0,0 +1,156 @@
+/*
+ * swtpm_crypto_bench.c -- Measure the throughput of the crypto providers
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_aes.h"
+#include "swtpm_crypto.h"
+#include "swtpm_time.h"
+
+static const uint32_t bufsizes[] = {
+    4 * 1024,
+    64 * 1024,
+    1024 * 1024,
+};
+
+/* number of bytes to process per measurement */
+#define BENCH_TOTAL_BYTES (64 * 1024 * 1024)
+
+static const struct {
+    enum swtpm_cipher_mode mode;
+    const char *name;
+    uint32_t keylen;
+} modes[] = {
+    { SWTPM_CIPHER_AES_CBC, "aes-cbc", 128/8 },
+    { SWTPM_CIPHER_AES_GCM, "aes-256-gcm", 256/8 },
+};
+
+static int bench_digest(uint32_t bufsize)
+{
+    unsigned char *buffer = NULL;
+    unsigned char digest[SWTPM_CRYPTO_DIGEST_SIZE];
+    unsigned int i, iterations = BENCH_TOTAL_BYTES / bufsize;
+    struct timespec start, end;
+    double elapsed;
+    TPM_RESULT rc;
+
+    rc = TPM_Malloc(&buffer, bufsize);
+    if (rc != 0)
+        return -1;
+    memset(buffer, 0, bufsize);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iterations && rc == 0; i++)
+        rc = SWTPM_Crypto_Digest(buffer, bufsize, digest);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    TPM_Free(buffer);
+
+    if (rc != 0)
+        return -1;
+
+    elapsed = SWTPM_Time_Diff_Ns(&start, &end) / 1E9;
+    if (elapsed <= 0)
+        elapsed = 1E-9;
+
+    printf("%-14s %-12s %8u %10.1f\n", "-", "sha256", bufsize,
+           ((double)bufsize * iterations) / (1024 * 1024) / elapsed);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct swtpm_crypto_provider *provider;
+    size_t i, m, s;
+    double mbps;
+    int ret = EXIT_SUCCESS;
+
+    if (argc > 1) {
+        fprintf(stdout,
+                "Usage: %s\n"
+                "\n"
+                "Measure the throughput of the crypto providers built into\n"
+                "swtpm and show which one is selected for each mode.\n",
+                argv[0]);
+        return (strcmp(argv[1], "-h") && strcmp(argv[1], "--help"))
+               ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    printf("%-14s %-12s %8s %10s\n", "provider", "mode", "bufsize", "MB/s");
+
+    for (i = 0; swtpm_crypto_providers[i]; i++) {
+        provider = swtpm_crypto_providers[i];
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            if (!provider->supports(modes[m].mode))
+                continue;
+            for (s = 0; s < sizeof(bufsizes) / sizeof(bufsizes[0]); s++) {
+                if (SWTPM_Crypto_Measure(provider, modes[m].mode,
+                                         modes[m].keylen, bufsizes[s],
+                                         BENCH_TOTAL_BYTES / bufsizes[s],
+                                         &mbps) != TPM_SUCCESS) {
+                    fprintf(stderr, "%s: %s failed\n",
+                            provider->name, modes[m].name);
+                    ret = EXIT_FAILURE;
+                    continue;
+                }
+                printf("%-14s %-12s %8u %10.1f\n",
+                       provider->name, modes[m].name, bufsizes[s], mbps);
+            }
+        }
+    }
+
+    for (s = 0; s < sizeof(bufsizes) / sizeof(bufsizes[0]); s++)
+        if (bench_digest(bufsizes[s]) < 0)
+            ret = EXIT_FAILURE;
+
+    printf("\n");
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        provider = SWTPM_Crypto_SelectProvider(modes[m].mode,
+                                               modes[m].keylen);
+        printf("selected for %-12s: %s\n", modes[m].name,
+               provider ? provider->name : "none");
+    }
+
+    return ret;
+}
@@ -0,0 +1,238 @@
+/*
+ * swtpm_dir_bench.c -- Benchmark the access to state files in deep directories
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _XOPEN_SOURCE 700
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+#include <libtpms/tpm_nvfilename.h>
+
+#include "swtpm_crypto.h"
+#include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
+#include "swtpm_time.h"
+
+/* depths of the state directory below the base directory */
+static const unsigned int depths[] = {
+    1,
+    32,
+    120,
+};
+
+#define BLOB_SIZE    1024
+/* name of each directory between the base and the state directory */
+#define SUBDIR_NAME  "swtpm_dir_bench_subdirectory"
+
+static int rm_visit(const char *fpath, const struct stat *sb,
+                    int typeflag, struct FTW *ftwbuf)
+{
+    (void)sb;
+    (void)typeflag;
+    (void)ftwbuf;
+
+    return remove(fpath);
+}
+
+/*
+ * make_state_dir: create a state directory 'depth' levels below 'basedir'
+ *                 and make it the state directory of the TPM
+ *
+ * Returns the length of the path of the state directory or -1 on error.
+ */
+static int make_state_dir(const char *basedir, unsigned int depth)
+{
+    char path[FILENAME_MAX];
+    size_t len;
+    unsigned int i;
+
+    len = snprintf(path, sizeof(path), "%s/%u", basedir, depth);
+    for (i = 0; len < sizeof(path) && i < depth; i++) {
+        if (mkdir(path, 0750) < 0 && errno != EEXIST)
+            goto error;
+        len += snprintf(&path[len], sizeof(path) - len, "/%s", SUBDIR_NAME);
+    }
+    if (len >= sizeof(path) ||
+        mkdir(path, 0750) < 0 ||
+        SWTPM_NVRAM_Set_StateDir(path) != TPM_SUCCESS)
+        goto error;
+
+    return len;
+
+error:
+    fprintf(stderr, "Could not create the state directory.\n");
+    return -1;
+}
+
+/*
+ * run_ops: store, load and delete a blob 'iterations' times and return
+ *          the time per operation in microseconds
+ */
+static TPM_RESULT run_ops(const unsigned char *blob, unsigned int iterations,
+                          double us[3])
+{
+    const struct nvram_backend_ops *ops = &nvram_dir_ops;
+    struct timespec start;
+    uint64_t ns[3] = { 0, 0, 0 };
+    unsigned char *data;
+    uint32_t length;
+    unsigned int i;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    for (i = 0; rc == TPM_SUCCESS && i < iterations; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = ops->store(blob, BLOB_SIZE, 0, TPM_PERMANENT_ALL_NAME);
+        ns[0] += SWTPM_Time_Elapsed_Ns(&start);
+        if (rc != TPM_SUCCESS)
+            break;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = ops->load(&data, &length, 0, TPM_PERMANENT_ALL_NAME);
+        ns[1] += SWTPM_Time_Elapsed_Ns(&start);
+        if (rc != TPM_SUCCESS)
+            break;
+        TPM_Free(data);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = ops->delete(0, TPM_PERMANENT_ALL_NAME, TRUE);
+        ns[2] += SWTPM_Time_Elapsed_Ns(&start);
+    }
+    for (i = 0; i < 3; i++)
+        us[i] = ns[i] / 1E3 / iterations;
+
+    return rc;
+}
+
+static void usage(FILE *file, const char *prgname)
+{
+    fprintf(file,
+    "Usage: %s [options]\n"
+    "\n"
+    "Measure the time needed to store, load and delete a state blob with the\n"
+    "dir backend in state directories at different depths below the base\n"
+    "directory. The state files are accessed relative to the file descriptor\n"
+    "of the state directory, so the time should not grow with the length of\n"
+    "its path.\n"
+    "\n"
+    "-n <num>  : the number of iterations per depth; defaults to 10000\n"
+    "-d <dir>  : the directory to create the state in; a temporary\n"
+    "            directory is used by default\n"
+    "-h        : display this help screen and terminate\n"
+    "\n",
+    prgname);
+}
+
+int main(int argc, char *argv[])
+{
+    char basedir[FILENAME_MAX] = "/tmp/swtpm_dir_bench.XXXXXX";
+    unsigned int iterations = 10000;
+    unsigned char blob[BLOB_SIZE];
+    double us[3];
+    size_t i;
+    int opt, len, ret = EXIT_FAILURE;
+    TPM_RESULT rc;
+
+    while ((opt = getopt(argc, argv, "n:d:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            if ((size_t)snprintf(basedir, sizeof(basedir),
+                                 "%s/swtpm_dir_bench.XXXXXX", optarg) >=
+                sizeof(basedir)) {
+                fprintf(stderr, "Directory path is too long.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations == 0) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!mkdtemp(basedir)) {
+        fprintf(stderr, "Could not create directory: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    rc = SWTPM_Crypto_GetRandom(blob, sizeof(blob));
+    if (rc != TPM_SUCCESS)
+        goto cleanup;
+
+    printf("%u iterations with blobs of %u bytes\n\n", iterations, BLOB_SIZE);
+    printf("%-6s %9s %11s %11s %11s\n",
+           "depth", "path len", "store [us]", "load [us]", "delete [us]");
+
+    for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+        len = make_state_dir(basedir, depths[i]);
+        if (len < 0)
+            goto cleanup;
+        rc = run_ops(blob, iterations, us);
+        if (rc != TPM_SUCCESS)
+            goto cleanup;
+        printf("%-6u %9d %11.1f %11.1f %11.1f\n",
+               depths[i], len, us[0], us[1], us[2]);
+    }
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, "Benchmark failed.\n");
+    nftw(basedir, rm_visit, 16, FTW_DEPTH | FTW_PHYS);
+
+    return ret;
+}
@@ -0,0 +1,345 @@
+/*
+ * swtpm_fleet.c -- Run a tool over the state directories of many TPMs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "swtpm_fleet.h"
+
+/* from linux/ioprio.h */
+#define IOPRIO_WHO_PROCESS   1
+#define IOPRIO_CLASS_IDLE    3
+#define IOPRIO_CLASS_SHIFT   13
+
+#define FLEET_WORKERS_MAX    4096
+
+int SWTPM_DirList_Add(struct dirlist *l, const char *dir)
+{
+    char **dirs;
+    size_t size;
+
+    if (l->n == l->size) {
+        size = l->size ? 2 * l->size : 1024;
+        dirs = realloc(l->dirs, size * sizeof(*dirs));
+        if (!dirs)
+            goto err_nomem;
+        l->dirs = dirs;
+        l->size = size;
+    }
+    l->dirs[l->n] = strdup(dir);
+    if (!l->dirs[l->n])
+        goto err_nomem;
+    l->n++;
+
+    return 0;
+
+err_nomem:
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+}
+
+/*
+ * SWTPM_DirList_Read: add the directories listed in the file, one per line,
+ *                     to the list; '-' reads them from stdin and a missing
+ *                     file is ignored if 'may_be_missing'
+ */
+int SWTPM_DirList_Read(struct dirlist *l, const char *filename,
+                       TPM_BOOL may_be_missing)
+{
+    char line[FILENAME_MAX + 2];
+    size_t len;
+    FILE *file;
+    int ret = 0;
+
+    if (!strcmp(filename, "-")) {
+        file = stdin;
+    } else {
+        file = fopen(filename, "r");
+        if (!file) {
+            if (errno == ENOENT && may_be_missing)
+                return 0;
+            fprintf(stderr, "Could not open %s: %s\n",
+                    filename, strerror(errno));
+            return -1;
+        }
+    }
+
+    while (ret == 0 && fgets(line, sizeof(line), file)) {
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        else if (!feof(file)) {
+            fprintf(stderr, "Line in %s is too long.\n", filename);
+            ret = -1;
+            break;
+        }
+        if (len > 0)
+            ret = SWTPM_DirList_Add(l, line);
+    }
+
+    if (file != stdin)
+        fclose(file);
+
+    return ret;
+}
+
+static int cmp_dir(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * SWTPM_DirList_Skip: add the directories of 'dirs' that are not in 'done'
+ *                     to 'work'; 'done' is sorted
+ */
+int SWTPM_DirList_Skip(struct dirlist *work, const struct dirlist *dirs,
+                       struct dirlist *done)
+{
+    size_t i;
+
+    qsort(done->dirs, done->n, sizeof(done->dirs[0]), cmp_dir);
+
+    for (i = 0; i < dirs->n; i++) {
+        if (done->n > 0 &&
+            bsearch(&dirs->dirs[i], done->dirs, done->n,
+                    sizeof(done->dirs[0]), cmp_dir))
+            continue;
+        if (SWTPM_DirList_Add(work, dirs->dirs[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+void SWTPM_DirList_Free(struct dirlist *l)
+{
+    size_t i;
+
+    for (i = 0; i < l->n; i++)
+        free(l->dirs[i]);
+    free(l->dirs);
+    l->dirs = NULL;
+    l->n = l->size = 0;
+}
+
+int SWTPM_Fleet_Parse_Workers(const char *optarg, unsigned long *workers)
+{
+    char *endptr;
+
+    errno = 0;
+    *workers = strtoul(optarg, &endptr, 10);
+    if (*endptr != '\0' || errno != 0 || *workers == 0 ||
+        *workers > FLEET_WORKERS_MAX) {
+        fprintf(stderr, "Invalid number of workers '%s'.\n", optarg);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * SWTPM_Fleet_Set_Low_Priority: give the CPU and the disk to everything else
+ *                               on the host first
+ */
+void SWTPM_Fleet_Set_Low_Priority(void)
+{
+    if (setpriority(PRIO_PROCESS, 0, 19) < 0)
+        fprintf(stderr, "Could not lower the CPU priority: %s\n",
+                strerror(errno));
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+        fprintf(stderr, "Could not lower the I/O priority: %s\n",
+                strerror(errno));
+#endif
+}
+
+/*
+ * fleet_worker: handle the directories of the work list until all of them
+ *               have been taken; 'next' is shared by the workers and holds
+ *               the index of the next directory
+ *
+ * The result of each directory is reported to the parent as a line
+ * '<index> <result>', which is short enough to be written atomically.
+ */
+static void fleet_worker(const struct dirlist *work, size_t *next, int resfd,
+                         const struct fleet_options *opts,
+                         SWTPM_Fleet_Work work_fn)
+{
+    char line[SWTPM_FLEET_RESULT_MAX + 32];
+    char result[SWTPM_FLEET_RESULT_MAX];
+    size_t idx;
+    int n;
+
+    if (opts->worker_init)
+        opts->worker_init();
+
+    if (opts->low_priority)
+        SWTPM_Fleet_Set_Low_Priority();
+
+    while (TRUE) {
+        idx = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+        if (idx >= work->n)
+            break;
+
+        result[0] = '\0';
+        work_fn(idx, work->dirs[idx], result, sizeof(result));
+        result[strcspn(result, "\n")] = '\0';
+
+        n = snprintf(line, sizeof(line), "%zu %s\n", idx, result);
+        if (write(resfd, line, n) != n)
+            _exit(EXIT_FAILURE);
+    }
+
+    if (opts->worker_exit)
+        opts->worker_exit();
+
+    _exit(EXIT_SUCCESS);
+}
+
+/*
+ * SWTPM_Fleet_Run: run 'work_fn' on each directory of 'work' in a pool of
+ *                  worker processes and hand the results to 'result_fn'
+ *
+ * The results arrive in the order the workers finish the directories.
+ * Directories whose worker died are reported with a NULL result once all
+ * workers have terminated. The number of workers that were started is
+ * returned in 'started'.
+ */
+int SWTPM_Fleet_Run(const struct dirlist *work,
+                    const struct fleet_options *opts,
+                    SWTPM_Fleet_Work work_fn,
+                    SWTPM_Fleet_Result result_fn,
+                    void *opaque,
+                    unsigned long *started)
+{
+    char line[SWTPM_FLEET_RESULT_MAX + 32], *endptr;
+    unsigned long workers = opts->workers, i;
+    unsigned char *reported;
+    FILE *results;
+    size_t *next, idx, len;
+    int pipefd[2], status;
+    pid_t pid;
+
+    *started = 0;
+
+    if (work->n == 0)
+        return 0;
+
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? cpus : 1;
+    }
+    if (workers > work->n)
+        workers = work->n;
+
+    reported = calloc(work->n, 1);
+    if (!reported) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (next == MAP_FAILED || pipe(pipefd) < 0) {
+        fprintf(stderr, "Could not set up the workers: %s\n",
+                strerror(errno));
+        free(reported);
+        return -1;
+    }
+    *next = 0;
+
+    /* do not let the workers flush what is buffered for the parent */
+    fflush(NULL);
+
+    for (i = 0; i < workers; i++) {
+        pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Could not start a worker: %s\n",
+                    strerror(errno));
+            /* the running workers take over the work */
+            break;
+        }
+        if (pid == 0) {
+            close(pipefd[0]);
+            fleet_worker(work, next, pipefd[1], opts, work_fn);
+        }
+        (*started)++;
+    }
+    close(pipefd[1]);
+
+    results = *started ? fdopen(pipefd[0], "r") : NULL;
+    if (!results) {
+        if (*started)
+            fprintf(stderr, "Could not read the results: %s\n",
+                    strerror(errno));
+        close(pipefd[0]);
+    }
+
+    while (results && fgets(line, sizeof(line), results)) {
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        idx = strtoul(line, &endptr, 10);
+        if (*endptr != ' ' || idx >= work->n || reported[idx])
+            continue;
+        reported[idx] = 1;
+        result_fn(idx, endptr + 1, opaque);
+    }
+    if (results)
+        fclose(results);
+
+    while (wait(&status) > 0)
+        ;
+
+    for (idx = 0; idx < work->n; idx++)
+        if (!reported[idx])
+            result_fn(idx, NULL, opaque);
+
+    munmap(next, sizeof(*next));
+    free(reported);
+
+    return *started ? 0 : -1;
+}
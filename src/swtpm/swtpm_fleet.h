@@ -0,0 +1,92 @@
+/*
+ * swtpm_fleet.h -- Run a tool over the state directories of many TPMs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_FLEET_H_
+#define _SWTPM_FLEET_H_
+
+#include <stddef.h>
+
+#include <libtpms/tpm_types.h>
+
+/* a list of TPM state directories */
+struct dirlist {
+    char **dirs;
+    size_t n;
+    size_t size;
+};
+
+int SWTPM_DirList_Add(struct dirlist *l, const char *dir);
+int SWTPM_DirList_Read(struct dirlist *l, const char *filename,
+                       TPM_BOOL may_be_missing);
+int SWTPM_DirList_Skip(struct dirlist *work, const struct dirlist *dirs,
+                       struct dirlist *done);
+void SWTPM_DirList_Free(struct dirlist *l);
+
+/* the longest result a worker may report for a directory */
+#define SWTPM_FLEET_RESULT_MAX 1024
+
+/*
+ * Handle the directory 'dir' with index 'idx' in a worker process and write
+ * a one-line result into 'result'.
+ */
+typedef void (*SWTPM_Fleet_Work)(size_t idx, const char *dir, char *result,
+                                 size_t resultlen);
+/*
+ * Receive the result of directory 'idx' in the parent process; 'result' is
+ * NULL if the worker died before it reported the result.
+ */
+typedef void (*SWTPM_Fleet_Result)(size_t idx, const char *result,
+                                   void *opaque);
+
+/* run in a worker process before its first and after its last directory */
+typedef void (*SWTPM_Fleet_Hook)(void);
+
+struct fleet_options {
+    unsigned long workers;  /* 0 for the number of online CPUs */
+    TPM_BOOL low_priority;  /* run the workers with idle CPU and I/O priority */
+    SWTPM_Fleet_Hook worker_init;   /* optional */
+    SWTPM_Fleet_Hook worker_exit;   /* optional */
+};
+
+int SWTPM_Fleet_Parse_Workers(const char *optarg, unsigned long *workers);
+void SWTPM_Fleet_Set_Low_Priority(void);
+int SWTPM_Fleet_Run(const struct dirlist *work,
+                    const struct fleet_options *opts,
+                    SWTPM_Fleet_Work work_fn,
+                    SWTPM_Fleet_Result result_fn,
+                    void *opaque,
+                    unsigned long *started);
+
+#endif /* _SWTPM_FLEET_H_ */
@@ -0,0 +1,333 @@
+/*
+ * swtpm_fsck.c -- Check the integrity of the TPM state of many TPMs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_nvfilename.h>
+
+#include "common.h"
+#include "logging.h"
+#include "swtpm_fleet.h"
+#include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
+#include "swtpm_time.h"
+
+static const char *blobnames[] = {
+    TPM_PERMANENT_ALL_NAME,
+    TPM_VOLATILESTATE_NAME,
+    TPM_SAVESTATE_NAME,
+};
+
+#define NUM_BLOBS (sizeof(blobnames) / sizeof(blobnames[0]))
+
+struct fsck_results {
+    const struct dirlist *work;
+    size_t reported;
+    unsigned int n_ok;
+    unsigned int n_corrupt;
+    unsigned int n_missing;
+    unsigned int n_error;
+};
+
+static void usage(FILE *file, const char *prgname)
+{
+    fprintf(file,
+    "Usage: %s [options] [<dir> ...]\n"
+    "\n"
+    "Check the integrity of the state of TPMs that are not running and\n"
+    "report the result as JSON. The state directories are processed by\n"
+    "several worker processes in parallel.\n"
+    "\n"
+    "The following options are supported:\n"
+    "\n"
+    "--key file=<path>[,mode=aes-cbc|aes-256-gcm][,format=hex|binary]\n"
+    "      pwdfile=<path>[,mode=aes-cbc|aes-256-gcm]\n"
+    "                      : the key the state is encrypted with\n"
+    "--tpmstate backend=dir|container|cas|journal[,objects=<dir>]\n"
+    "           [,number=<n>]\n"
+    "                      : how the state is stored; defaults to dir\n"
+    "--dirs-from <file>    : read further state directories from the file,\n"
+    "                        one per line; '-' reads them from stdin\n"
+    "--workers <n>         : the number of worker processes; defaults to\n"
+    "                        the number of online CPUs\n"
+    "--low-priority        : run the workers with idle CPU and I/O priority\n"
+    "-h|--help             : display this help screen and terminate\n"
+    "\n",
+    prgname);
+}
+
+/*
+ * fsck_worker_init: silence a worker process; the parent reports the result
+ *                   of each directory, and decrypting with the wrong key
+ *                   would also print errors on stdout
+ */
+static void fsck_worker_init(void)
+{
+    int fd;
+
+    log_init("-");
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+        _exit(EXIT_FAILURE);
+    close(fd);
+}
+
+static void fsck_worker_exit(void)
+{
+    SWTPM_NVRAM_Shutdown();
+}
+
+/*
+ * fsck_work: check the state blobs in a directory in a worker process
+ *
+ * The result is '-1' if the state directory cannot be accessed, otherwise
+ * the check result, flags and size of each blob.
+ */
+static void fsck_work(size_t idx, const char *dir, char *result,
+                      size_t resultlen)
+{
+    enum nvram_check_result res;
+    uint32_t flags, length;
+    size_t i, off = 0;
+
+    if (setenv("TPM_PATH", dir, 1) != 0 ||
+        SWTPM_NVRAM_Init() != TPM_SUCCESS) {
+        snprintf(result, resultlen, "-1");
+        return;
+    }
+
+    for (i = 0; i < NUM_BLOBS && off < resultlen; i++) {
+        res = SWTPM_NVRAM_CheckName(0, blobnames[i], &flags, &length);
+        off += snprintf(&result[off], resultlen - off, "%s%d %u %u",
+                        i ? " " : "", (int)res, flags, length);
+    }
+}
+
+/*
+ * json_print_string: print a string as a JSON string
+ */
+static void json_print_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        switch (*s) {
+        case '"':
+        case '\\':
+            printf("\\%c", *s);
+            break;
+        default:
+            if ((unsigned char)*s < 0x20)
+                printf("\\u%04x", (unsigned char)*s);
+            else
+                putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+/*
+ * fsck_result: print the result of a directory as a JSON object
+ */
+static void fsck_result(size_t idx, const char *result, void *opaque)
+{
+    struct fsck_results *fr = opaque;
+    int res[NUM_BLOBS];
+    unsigned int flags[NUM_BLOBS], length[NUM_BLOBS];
+    const char *status = "ok", *error = NULL;
+    size_t i;
+
+    if (!result)
+        error = "the worker terminated unexpectedly";
+    else if (sscanf(result, "%d %u %u %d %u %u %d %u %u",
+                    &res[0], &flags[0], &length[0],
+                    &res[1], &flags[1], &length[1],
+                    &res[2], &flags[2], &length[2]) != 3 * NUM_BLOBS)
+        error = "the state directory could not be accessed";
+
+    if (error) {
+        status = "error";
+        fr->n_error++;
+    } else {
+        for (i = 0; i < NUM_BLOBS; i++) {
+            if (res[i] != NVRAM_CHECK_OK && res[i] != NVRAM_CHECK_MISSING)
+                status = "corrupt";
+        }
+        if (!strcmp(status, "ok") && res[0] == NVRAM_CHECK_MISSING)
+            status = "missing";
+
+        if (!strcmp(status, "ok"))
+            fr->n_ok++;
+        else if (!strcmp(status, "missing"))
+            fr->n_missing++;
+        else
+            fr->n_corrupt++;
+    }
+
+    printf("%s\n    {\"dir\": ", fr->reported++ ? "," : "");
+    json_print_string(fr->work->dirs[idx]);
+    printf(", \"status\": \"%s\"", status);
+
+    if (error) {
+        printf(", \"error\": \"%s\"}", error);
+        return;
+    }
+
+    printf(", \"blobs\": {");
+    for (i = 0; i < NUM_BLOBS; i++) {
+        printf("%s\"%s\": {\"status\": \"%s\"", i ? ", " : "", blobnames[i],
+               SWTPM_NVRAM_CheckResult_String(res[i]));
+        if (res[i] != NVRAM_CHECK_MISSING)
+            printf(", \"size\": %u, \"encrypted\": %s, \"compressed\": %s"
+                   ", \"verified\": %s",
+                   length[i],
+                   flags[i] & NVRAM_CHECK_FLAG_ENCRYPTED ? "true" : "false",
+                   flags[i] & NVRAM_CHECK_FLAG_COMPRESSED ? "true" : "false",
+                   flags[i] & NVRAM_CHECK_FLAG_VERIFIED ? "true" : "false");
+        printf("}");
+    }
+    printf("}}");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, longindex;
+    char *keydata = NULL, *tpmstatedata = NULL;
+    struct dirlist work = { NULL, 0, 0 };
+    struct fleet_options fopts = {
+        .worker_init = fsck_worker_init,
+        .worker_exit = fsck_worker_exit,
+    };
+    struct fsck_results fr = { &work, 0, 0, 0, 0, 0 };
+    struct timespec start;
+    unsigned long started = 0;
+    int ret = EXIT_FAILURE;
+    double elapsed;
+    size_t i;
+    static struct option longopts[] = {
+        {"key"         , required_argument, 0, 'k'},
+        {"tpmstate"    , required_argument, 0, 's'},
+        {"dirs-from"   , required_argument, 0, 'd'},
+        {"workers"     , required_argument, 0, 'w'},
+        {"low-priority",       no_argument, 0, 'l'},
+        {"help"        ,       no_argument, 0, 'h'},
+        {NULL          , 0                , 0, 0  },
+    };
+
+    while (TRUE) {
+        opt = getopt_long(argc, argv, "h", longopts, &longindex);
+
+        if (opt == -1)
+            break;
+
+        switch (opt) {
+        case 'k':
+            keydata = optarg;
+            break;
+
+        case 's':
+            tpmstatedata = optarg;
+            break;
+
+        case 'd':
+            if (SWTPM_DirList_Read(&work, optarg, FALSE) < 0)
+                exit(EXIT_FAILURE);
+            break;
+
+        case 'w':
+            if (SWTPM_Fleet_Parse_Workers(optarg, &fopts.workers) < 0)
+                exit(EXIT_FAILURE);
+            break;
+
+        case 'l':
+            fopts.low_priority = TRUE;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            exit(EXIT_SUCCESS);
+
+        default:
+            usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = optind; i < (size_t)argc; i++)
+        if (SWTPM_DirList_Add(&work, argv[i]) < 0)
+            exit(EXIT_FAILURE);
+
+    if (handle_key_options(keydata) < 0 ||
+        handle_tpmstate_options(tpmstatedata) < 0)
+        exit(EXIT_FAILURE);
+
+    if (SWTPM_NVRAM_Is_Ephemeral()) {
+        fprintf(stderr, "The memory backend keeps no state to check.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    printf("{\n  \"instances\": [");
+
+    /* directories that could not be handed to a worker show up as errors */
+    SWTPM_Fleet_Run(&work, &fopts, fsck_work, fsck_result, &fr, &started);
+
+    elapsed = SWTPM_Time_Elapsed_Ns(&start) / 1E9;
+
+    printf("%s],\n"
+           "  \"summary\": {\"instances\": %zu, \"ok\": %u, \"corrupt\": %u, "
+           "\"missing\": %u, \"error\": %u, \"workers\": %lu, "
+           "\"seconds\": %.3f}\n"
+           "}\n",
+           fr.reported ? "\n  " : "",
+           work.n, fr.n_ok, fr.n_corrupt, fr.n_missing, fr.n_error,
+           started, elapsed);
+
+    if (fr.n_corrupt == 0 && fr.n_missing == 0 && fr.n_error == 0)
+        ret = EXIT_SUCCESS;
+
+    SWTPM_DirList_Free(&work);
+
+    return ret;
+}
@@ -56,6 +56,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/un.h>
 #include <sys/time.h>
 
@@ -336,6 +337,11 @@ TPM_RESULT SWTPM_IO_Connect(TPM_CONNECTION_FD *connection_fd,     /* read/write
                         "SWTPM_IO_Connect: Error, accept() %d %s\n",
                         errno, strerror(errno));
                 rc = TPM_IOERROR;
+            } else {
+                /* do not hold back the responses to pipelined commands */
+                n = 1;
+                setsockopt(connection_fd->fd, IPPROTO_TCP, TCP_NODELAY,
+                           &n, sizeof(n));
             }
             break;
         }
@@ -0,0 +1,267 @@
+/*
+ * swtpm_journal_bench.c -- Benchmark the journaling storage backend
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+#include <libtpms/tpm_nvfilename.h>
+
+#include "swtpm_crypto.h"
+#include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
+#include "swtpm_time.h"
+
+static const uint32_t blobsizes[] = {
+    4 * 1024,
+    64 * 1024,
+    1024 * 1024,
+};
+
+static const unsigned int journal_lengths[] = {
+    100,
+    1000,
+    10000,
+};
+
+/* size of the blob for measuring the recovery time */
+#define RECOVERY_BLOB_SIZE   (64 * 1024)
+/* bytes modified by each update, like a small NV write */
+#define UPDATE_SIZE          32
+
+static int rm_visit(const char *fpath, const struct stat *sb,
+                    int typeflag, struct FTW *ftwbuf)
+{
+    (void)sb;
+    (void)typeflag;
+    (void)ftwbuf;
+
+    return remove(fpath);
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    return SWTPM_Time_Elapsed_Ns(start) / 1E9;
+}
+
+/*
+ * make_state_dir: create an empty state directory for the next run
+ */
+static int make_state_dir(const char *basedir, unsigned int idx)
+{
+    char path[FILENAME_MAX];
+
+    if ((size_t)snprintf(path, sizeof(path),
+                         "%s/%u", basedir, idx) >= sizeof(path) ||
+        mkdir(path, 0750) < 0 ||
+        SWTPM_NVRAM_Set_StateDir(path) != TPM_SUCCESS) {
+        fprintf(stderr, "Could not create the state directory.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * run_updates: store 'blob' and then modify and store it 'updates' times
+ */
+static TPM_RESULT run_updates(const struct nvram_backend_ops *ops,
+                              unsigned char *blob, uint32_t blobsize,
+                              unsigned int updates, double *elapsed)
+{
+    struct timespec start;
+    unsigned int i;
+    uint32_t offset;
+    TPM_RESULT rc;
+
+    rc = ops->store(blob, blobsize, 0, TPM_PERMANENT_ALL_NAME);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; rc == TPM_SUCCESS && i < updates; i++) {
+        offset = (uint32_t)rand() % (blobsize - UPDATE_SIZE);
+        memset(&blob[offset], i, UPDATE_SIZE);
+        rc = ops->store(blob, blobsize, 0, TPM_PERMANENT_ALL_NAME);
+    }
+    *elapsed = elapsed_since(&start);
+
+    return rc;
+}
+
+static void usage(FILE *file, const char *prgname)
+{
+    fprintf(file,
+    "Usage: %s [options]\n"
+    "\n"
+    "Measure the bytes written per small update of the permanent state with\n"
+    "the dir and the journal backends, and the time needed to replay\n"
+    "journals of different lengths.\n"
+    "\n"
+    "-n <num>  : the number of updates per blob size; defaults to 1000\n"
+    "-d <dir>  : the directory to create the state in; a temporary\n"
+    "            directory is used by default\n"
+    "-h        : display this help screen and terminate\n"
+    "\n",
+    prgname);
+}
+
+int main(int argc, char *argv[])
+{
+    char basedir[FILENAME_MAX] = "/tmp/swtpm_journal_bench.XXXXXX";
+    unsigned int updates = 1000, idx = 0, i;
+    struct swtpm_journal_stats before, after;
+    unsigned char *blob = NULL;
+    struct timespec start;
+    const struct timespec compactor_wait = { .tv_nsec = 100000000 };
+    double elapsed;
+    size_t s;
+    int opt, ret = EXIT_FAILURE;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "n:d:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            updates = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            if ((size_t)snprintf(basedir, sizeof(basedir),
+                                 "%s/swtpm_journal_bench.XXXXXX", optarg) >=
+                sizeof(basedir)) {
+                fprintf(stderr, "Directory path is too long.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (updates == 0) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!mkdtemp(basedir)) {
+        fprintf(stderr, "Could not create directory: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    rc = TPM_Malloc(&blob, blobsizes[sizeof(blobsizes) /
+                                     sizeof(blobsizes[0]) - 1]);
+    if (rc != TPM_SUCCESS)
+        goto cleanup;
+
+    printf("%u updates of %u bytes each\n\n", updates, UPDATE_SIZE);
+    printf("%-8s %8s %14s %14s %12s\n",
+           "backend", "blobsize", "bytes/update", "incl. base", "us/update");
+
+    for (s = 0; s < sizeof(blobsizes) / sizeof(blobsizes[0]); s++) {
+        rc = SWTPM_Crypto_GetRandom(blob, blobsizes[s]);
+        if (rc != TPM_SUCCESS || make_state_dir(basedir, idx++) < 0)
+            goto cleanup;
+        rc = run_updates(&nvram_dir_ops, blob, blobsizes[s], updates,
+                         &elapsed);
+        if (rc != TPM_SUCCESS)
+            goto cleanup;
+        printf("%-8s %8u %14u %14u %12.1f\n", "dir", blobsizes[s],
+               blobsizes[s], blobsizes[s], elapsed * 1E6 / updates);
+
+        if (make_state_dir(basedir, idx++) < 0 ||
+            nvram_journal_ops.init(0) != TPM_SUCCESS)
+            goto cleanup;
+        SWTPM_NVRAM_Journal_Get_Stats(&before);
+        rc = run_updates(&nvram_journal_ops, blob, blobsizes[s], updates,
+                         &elapsed);
+        /* let the compactor finish */
+        nanosleep(&compactor_wait, NULL);
+        SWTPM_NVRAM_Journal_Get_Stats(&after);
+        if (rc != TPM_SUCCESS)
+            goto cleanup;
+        printf("%-8s %8u %14.1f %14.1f %12.1f\n", "journal", blobsizes[s],
+               (double)(after.bytes_written - before.bytes_written -
+                        blobsizes[s]) / updates,
+               (double)(after.bytes_written - before.bytes_written -
+                        blobsizes[s] +
+                        after.base_bytes_written -
+                        before.base_bytes_written) / updates,
+               elapsed * 1E6 / updates);
+    }
+
+    printf("\n%-10s %14s %12s\n", "records", "journal bytes", "replay [ms]");
+
+    SWTPM_NVRAM_Journal_Set_CompactSlack(0);
+    for (i = 0; i < sizeof(journal_lengths) / sizeof(journal_lengths[0]);
+         i++) {
+        if (make_state_dir(basedir, idx++) < 0 ||
+            nvram_journal_ops.init(0) != TPM_SUCCESS)
+            goto cleanup;
+        rc = run_updates(&nvram_journal_ops, blob, RECOVERY_BLOB_SIZE,
+                         journal_lengths[i], &elapsed);
+        if (rc != TPM_SUCCESS)
+            goto cleanup;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = nvram_journal_ops.init(0);
+        elapsed = elapsed_since(&start);
+        SWTPM_NVRAM_Journal_Get_Stats(&after);
+        if (rc != TPM_SUCCESS)
+            goto cleanup;
+        printf("%-10u %14llu %12.2f\n", journal_lengths[i] + 1,
+               (unsigned long long)after.journal_length, elapsed * 1E3);
+    }
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, "Benchmark failed.\n");
+    TPM_Free(blob);
+    nftw(basedir, rm_visit, 16, FTW_DEPTH | FTW_PHYS);
+
+    return ret;
+}
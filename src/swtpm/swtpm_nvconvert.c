@@ -0,0 +1,240 @@
+/*
+ * swtpm_nvconvert.c -- Convert TPM state between storage backends
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+#include <libtpms/tpm_nvfilename.h>
+
+#include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
+
+/* the compression marker goes first, like swtpm writes it */
+static const char *blobnames[] = {
+    NVRAM_COMPRESSION_NAME,
+    TPM_PERMANENT_ALL_NAME,
+    TPM_VOLATILESTATE_NAME,
+    TPM_SAVESTATE_NAME,
+};
+
+static void usage(FILE *file, const char *prgname)
+{
+    fprintf(file,
+    "Usage: %s [options]\n"
+    "\n"
+    "Convert the state of a TPM between the directory layout, the\n"
+    "single-file container, the content-addressed object store and the\n"
+    "journal. The blobs are copied as they are, so no keys are needed for\n"
+    "encrypted state.\n"
+    "\n"
+    "The following options are supported:\n"
+    "\n"
+    "-i|--dir <dir>        : the TPM state directory; defaults to TPM_PATH\n"
+    "-t|--to <backend>     : the storage backend to convert the state to;\n"
+    "                        one of dir, container, cas or journal\n"
+    "-f|--from <backend>   : the storage backend to convert the state from;\n"
+    "                        defaults to container when converting to dir\n"
+    "                        and to dir otherwise\n"
+    "-o|--objects <dir>    : the object directory of the cas backend\n"
+    "-n|--number <n>       : the number of the TPM whose state to convert;\n"
+    "                        defaults to 0\n"
+    "-r|--remove           : remove the state from the source backend\n"
+    "-h|--help             : display this help screen and terminate\n"
+    "\n",
+    prgname);
+}
+
+/*
+ * convert_blob: copy the blob with the given name from one backend to
+ *               another one
+ *
+ * Returns 0 on success, 1 if the blob does not exist, -1 on error.
+ */
+static int convert_blob(const struct nvram_backend_ops *src,
+                        const struct nvram_backend_ops *dst,
+                        const char *name, TPM_BOOL remove)
+{
+    unsigned char *data = NULL;
+    uint32_t length = 0;
+    TPM_RESULT rc;
+    uint32_t tpm_number = 0;
+
+    rc = src->load(&data, &length, tpm_number, name);
+    if (rc == TPM_RETRY)
+        return 1;
+    if (rc == TPM_SUCCESS)
+        rc = dst->store(data, length, tpm_number, name);
+    TPM_Free(data);
+
+    if (rc == TPM_SUCCESS && remove)
+        rc = src->delete(tpm_number, name, TRUE);
+
+    if (rc != TPM_SUCCESS) {
+        fprintf(stderr, "Could not convert the %s blob: 0x%x\n",
+                name, rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, longindex;
+    enum nvram_backend to = NVRAM_BACKEND_UNKNOWN;
+    enum nvram_backend from = NVRAM_BACKEND_UNKNOWN;
+    const struct nvram_backend_ops *src, *dst;
+    TPM_BOOL remove = FALSE;
+    size_t i;
+    int n, converted = 0;
+    unsigned long number;
+    char *endptr;
+    static struct option longopts[] = {
+        {"dir"       , required_argument, 0, 'i'},
+        {"to"        , required_argument, 0, 't'},
+        {"from"      , required_argument, 0, 'f'},
+        {"objects"   , required_argument, 0, 'o'},
+        {"number"    , required_argument, 0, 'n'},
+        {"remove"    ,       no_argument, 0, 'r'},
+        {"help"      ,       no_argument, 0, 'h'},
+        {NULL        , 0                , 0, 0  },
+    };
+
+    while (TRUE) {
+        opt = getopt_long(argc, argv, "i:t:f:o:n:rh", longopts, &longindex);
+
+        if (opt == -1)
+            break;
+
+        switch (opt) {
+        case 'i':
+            if (setenv("TPM_PATH", optarg, 1) != 0) {
+                fprintf(stderr, "Could not set path: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 't':
+            to = nvram_backend_from_string(optarg);
+            if (to == NVRAM_BACKEND_UNKNOWN) {
+                fprintf(stderr, "Unknown TPM state backend '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'f':
+            from = nvram_backend_from_string(optarg);
+            if (from == NVRAM_BACKEND_UNKNOWN) {
+                fprintf(stderr, "Unknown TPM state backend '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'o':
+            if (SWTPM_NVRAM_CAS_Set_ObjectDir(optarg) != TPM_SUCCESS)
+                exit(EXIT_FAILURE);
+            break;
+
+        case 'n':
+            errno = 0;
+            number = strtoul(optarg, &endptr, 10);
+            if (!isdigit((unsigned char)optarg[0]) || *endptr != '\0' ||
+                errno != 0 || number > UINT32_MAX) {
+                fprintf(stderr, "Invalid TPM number '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            SWTPM_NVRAM_Set_TPMNumber(number);
+            break;
+
+        case 'r':
+            remove = TRUE;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            exit(EXIT_SUCCESS);
+
+        default:
+            usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (to == NVRAM_BACKEND_UNKNOWN) {
+        fprintf(stderr, "Missing --to option.\n");
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (from == NVRAM_BACKEND_UNKNOWN)
+        from = (to == NVRAM_BACKEND_DIR) ? NVRAM_BACKEND_CONTAINER
+                                         : NVRAM_BACKEND_DIR;
+    if (from == to) {
+        fprintf(stderr, "The source and destination backends are the same.\n");
+        return EXIT_FAILURE;
+    }
+    if (from == NVRAM_BACKEND_MEMORY || to == NVRAM_BACKEND_MEMORY) {
+        fprintf(stderr, "The memory backend keeps no state to convert.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (SWTPM_NVRAM_Init() != TPM_SUCCESS)
+        return EXIT_FAILURE;
+
+    dst = SWTPM_NVRAM_GetBackendOps(to);
+    src = SWTPM_NVRAM_GetBackendOps(from);
+
+    for (i = 0; i < sizeof(blobnames) / sizeof(blobnames[0]); i++) {
+        n = convert_blob(src, dst, blobnames[i], remove);
+        if (n < 0)
+            return EXIT_FAILURE;
+        /* the marker is not a state blob of its own */
+        if (n == 0 && strcmp(blobnames[i], NVRAM_COMPRESSION_NAME))
+            converted++;
+    }
+
+    printf("Converted %d TPM state blob(s).\n", converted);
+
+    return EXIT_SUCCESS;
+}
@@ -39,7 +39,8 @@
 
 /* This module abstracts out all NVRAM read and write operations.
 
-   This implementation uses standard, portable C files.
+   The data are written to a storage backend; by default each blob is
+   stored in its own file in the state directory (swtpm_nvstore_dir.c).
 
    The basic high level abstractions are:
 
@@ -57,6 +58,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <arpa/inet.h>
 
@@ -65,19 +67,12 @@
 #include <libtpms/tpm_nvfilename.h>
 #include <libtpms/tpm_library.h>
 
-#ifdef USE_FREEBL_CRYPTO_LIBRARY
-# include <blapi.h>
-#else
-# ifdef USE_OPENSSL_CRYPTO_LIBRARY
-#  include <openssl/sha.h>
-# else
-#  error "Unsupported crypto library."
-# endif
-#endif
-
 #include "swtpm_aes.h"
+#include "swtpm_compress.h"
+#include "swtpm_crypto.h"
 #include "swtpm_debug.h"
 #include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
 #include "key.h"
 #include "logging.h"
 
@@ -90,11 +85,133 @@ typedef struct {
     uint32_t totlen; /* length of the header and following data */
 } __attribute__((packed)) blobheader;
 
-#define BLOB_HEADER_VERSION 1
+#define BLOB_HEADER_VERSION 4
 
 /* flags for blobheader */
 #define BLOB_FLAG_ENCRYPTED              0x1
 #define BLOB_FLAG_MIGRATION_ENCRYPTED    0x2 /* encrypted with migration key */
+#define BLOB_FLAG_ENCRYPTED_AES_GCM      0x4 /* state encrypted using AES-GCM */
+#define BLOB_FLAG_MIGRATION_AES_GCM      0x8 /* migration encryption is AES-GCM */
+#define BLOB_FLAG_MIGRATION_CHUNKED     0x10 /* migration encryption is chunked */
+#define BLOB_FLAG_COMPRESSED_ZLIB       0x20 /* data are compressed with zlib */
+#define BLOB_FLAG_COMPRESSED_ZSTD       0x40 /* data are compressed with zstd */
+#define BLOB_FLAG_COMPRESSION_FRAME     0x80 /* blobs have a compression frame */
+
+#define BLOB_FLAGS_COMPRESSED \
+    (BLOB_FLAG_COMPRESSED_ZLIB | BLOB_FLAG_COMPRESSED_ZSTD)
+
+/* blobs using any of these flags cannot be read by version 1 readers */
+#define BLOB_FLAGS_VERSION_2 \
+    (BLOB_FLAG_ENCRYPTED_AES_GCM | BLOB_FLAG_MIGRATION_AES_GCM)
+/* blobs using any of these flags cannot be read by version 2 readers */
+#define BLOB_FLAGS_VERSION_3 \
+    (BLOB_FLAG_MIGRATION_CHUNKED)
+/* blobs using any of these flags cannot be read by version 3 readers */
+#define BLOB_FLAGS_VERSION_4 \
+    (BLOB_FLAGS_COMPRESSED | BLOB_FLAG_COMPRESSION_FRAME)
+
+/*
+ * The blobs handed to the backends have no header of their own, so their
+ * content cannot tell whether they are compressed. Instead, a TPM state
+ * that is created while compression is enabled gets the blob
+ * NVRAM_COMPRESSION_NAME, a blobheader with BLOB_FLAG_COMPRESSION_FRAME,
+ * before any other blob is written. Every blob of such a state is
+ * wrapped into a compression frame: a blobheader with
+ * BLOB_FLAG_COMPRESSION_FRAME and the flag of the compression that was
+ * used, if any, followed by the length of the uncompressed data and the
+ * data. The frame is added before the data are encrypted. States created
+ * without compression are never compressed, so their blobs load as they
+ * are.
+ *
+ * Exported state blobs that carry compressed data have the compression
+ * flag set in their own blobheader as well. Blobs that are exported as
+ * they are stored have BLOB_FLAG_COMPRESSION_FRAME set if they come from
+ * a state with compression frames.
+ */
+typedef struct {
+    uint32_t datalen;     /* length of the data after decompression */
+} __attribute__((packed)) blobcompression;
+
+/* the largest blob a compression frame may expand to; well above the
+   size of the state libtpms produces */
+#define BLOB_DATALEN_MAX        (4 * 1024 * 1024)
+
+/*
+ * A blob encrypted with an AES-GCM migration key is split into chunks of
+ * 'chunksize' bytes that are encrypted and authenticated one by one, so
+ * that it can be streamed through a buffer of the size of a chunk. The
+ * chunk index follows the blobheader and is covered by its hdrsize; each
+ * chunk is followed by its tag.
+ *
+ * The nonce of a chunk is the nonce prefix from the index, followed by the
+ * chunk number and a byte that is 1 for the last chunk, so chunks cannot
+ * be reordered, dropped or appended without the authentication failing.
+ */
+#define BLOB_CHUNK_NONCE_PREFIX_SIZE 7
+
+typedef struct {
+    uint32_t chunksize;   /* bytes of data per chunk; the last may be shorter */
+    uint32_t numchunks;
+    uint32_t datalen;     /* total number of bytes of data in the chunks */
+    uint8_t  nonce[BLOB_CHUNK_NONCE_PREFIX_SIZE];
+    uint8_t  reserved;
+} __attribute__((packed)) blobchunkindex;
+
+#define BLOB_CHUNK_SIZE         (16 * 1024)
+#define BLOB_CHUNK_SIZE_MAX     (1024 * 1024)
+
+/*
+ * Exporting a state blob produces the blobheader followed by one of these
+ * encodings of the stored blob.
+ */
+enum stateblob_encoding {
+    STATEBLOB_PLAIN,    /* the stored blob as it is */
+    STATEBLOB_WHOLE,    /* encrypted as a whole with the migration key */
+    STATEBLOB_CHUNKED,  /* encrypted chunk by chunk with the migration key */
+};
+
+struct stateblob_reader {
+    enum stateblob_encoding encoding;
+    /* the stored blob; either mapped by the backend or allocated */
+    const unsigned char *src;
+    uint32_t src_length;
+    TPM_BOOL src_mapped;
+    /* the blobheader and the chunk index */
+    unsigned char hdr[sizeof(blobheader) + sizeof(blobchunkindex)];
+    uint32_t hdr_length;
+    uint32_t totlength;
+    /* STATEBLOB_WHOLE: the complete exported blob */
+    unsigned char *whole;
+    /* STATEBLOB_CHUNKED: the last chunk that was encrypted */
+    uint32_t chunksize;
+    uint32_t numchunks;
+    unsigned char *chunk;
+    uint32_t chunk_idx;
+    uint32_t chunk_length; /* 0 if no chunk was encrypted yet */
+};
+
+struct stateblob_writer {
+    uint32_t tpm_number;
+    const char *name;
+    TPM_BOOL is_encrypted;
+    TPM_RESULT res;        /* the first error that occurred */
+    uint32_t received;     /* number of bytes received so far */
+    /* the blobheader and chunk index as they are received */
+    unsigned char hdr[sizeof(blobheader) + sizeof(blobchunkindex)];
+    uint32_t hdr_length;   /* number of bytes of 'hdr' to receive */
+    uint32_t hdrsize;      /* the header size in the blobheader */
+    uint32_t totlength;    /* 0 until the blobheader was received */
+    uint16_t flags;
+    /* the data following the header; decrypted if they were chunked */
+    unsigned char *data;
+    uint32_t data_length;
+    /* chunked: the chunk currently being received */
+    uint32_t chunksize;
+    uint32_t numchunks;
+    unsigned char *chunk;
+    uint32_t chunk_idx;
+    uint32_t chunk_have;
+};
 
 typedef struct {
     enum encryption_mode data_encmode;
@@ -113,30 +230,99 @@ static encryptionkey migrationkey = {
     },
 };
 
+/* the key that SWTPM_NVRAM_Rekey() re-encrypts the blobs with */
+static encryptionkey newfilekey = {
+    .symkey = {
+        .valid = FALSE,
+    },
+};
+
+/* the storage backend the blobs are written to */
+static const struct nvram_backend_ops *backend_ops = &nvram_dir_ops;
 
-/* local prototypes */
+/*
+ * libtpms frequently asks us to store blobs that are identical to what
+ * we last stored. We remember the digest of the plaintext of the blobs
+ * last written to or read from the backend and skip the encryption and
+ * write if nothing changed.
+ */
+#define NVRAM_DIGEST_CACHE_ENTRIES 8
+
+typedef struct {
+    TPM_BOOL      valid;
+    uint32_t      tpm_number;
+    char          name[32];
+    unsigned char digest[SWTPM_CRYPTO_DIGEST_SIZE];
+} nvram_digest;
+
+static nvram_digest digest_cache[NVRAM_DIGEST_CACHE_ENTRIES];
+static unsigned int digest_cache_next;
+
+/* whether the blobs of the TPM state have compression frames */
+enum nvram_framing {
+    NVRAM_FRAMING_UNKNOWN = 0,
+    NVRAM_FRAMING_NONE,
+    NVRAM_FRAMING_COMPRESSION,
+};
 
-static TPM_RESULT SWTPM_NVRAM_GetFilenameForName(char *filename,
-                                                 size_t bufsize,
-                                                  uint32_t tpm_number,
-                                                 const char *name);
+static enum nvram_framing framing;
+static uint32_t framing_tpm_number;
+
+
+/* local prototypes */
 
 static TPM_RESULT SWTPM_NVRAM_EncryptData(const encryptionkey *key,
+                                          uint32_t hdrsize,
                                           unsigned char **encrypt_data,
                                           uint32_t *encrypt_length,
                                           const unsigned char *decrypt_data,
-                                          uint32_t decrypt_length);
+                                          uint32_t decrypt_length,
+                                          const unsigned char *digest);
 
 static TPM_RESULT SWTPM_NVRAM_DecryptData(const encryptionkey *key,
                                           unsigned char **decrypt_data,
                                           uint32_t *decrypt_length,
                                           const unsigned char *encrypt_data,
-                                          uint32_t encrypt_length);
+                                          uint32_t encrypt_length,
+                                          unsigned char *digest);
+
+static TPM_RESULT SWTPM_NVRAM_DecryptBuffer(const encryptionkey *key,
+                                            unsigned char *decrypt_data,
+                                            uint32_t *decrypt_length,
+                                            const unsigned char *encrypt_data,
+                                            uint32_t encrypt_length,
+                                            unsigned char *digest);
+
+static TPM_RESULT SWTPM_NVRAM_CompressData(unsigned char **out,
+                                           uint32_t *out_length,
+                                           uint16_t *flags,
+                                           const unsigned char *data,
+                                           uint32_t length);
+
+static TPM_RESULT SWTPM_NVRAM_FrameData(unsigned char **out,
+                                        uint32_t *out_length,
+                                        const unsigned char *data,
+                                        uint32_t length);
+
+static TPM_BOOL SWTPM_NVRAM_IsFramed(const unsigned char *data,
+                                     uint32_t length);
+
+static TPM_RESULT SWTPM_NVRAM_GetFraming(uint32_t tpm_number,
+                                         TPM_BOOL create,
+                                         TPM_BOOL *framed);
+
+static TPM_RESULT SWTPM_NVRAM_DecompressData(unsigned char **out,
+                                             uint32_t *out_length,
+                                             const unsigned char *data,
+                                             uint32_t length);
+
+static void SWTPM_NVRAM_DigestCache_Invalidate_All(void);
 
 /* A file name in NVRAM is composed of 3 parts:
 
   1 - 'state_directory' is the rooted path to the TPM state home directory
-  2 = 'tpm_number' is the TPM instance, 00 for a single TPM
+  2 = 'tpm_number' is the TPM instance, 00 for a single TPM; the instance
+      number set with SWTPM_NVRAM_Set_TPMNumber() is added to it
   2 - the file name
 
   For the IBM cryptographic coprocessor version, the root path is hard coded.
@@ -145,27 +331,137 @@ static TPM_RESULT SWTPM_NVRAM_DecryptData(const encryptionkey *key,
   used once in TPM_NVRAM_Init().
 
   One root path is used for all virtual TPM's, so it can be a static variable.
+
+  The backends access the files relative to a file descriptor of the state
+  directory, which is opened once, rather than resolving the rooted path of
+  each file again.
 */
 
-char state_directory[FILENAME_MAX];
+char *state_directory;
+static int state_dir_fd = -1;
+
+/* libtpms only ever uses TPM number 0; the number of the instance lets
+   several TPMs keep their files in the same state directory */
+static uint32_t tpm_instance;
 
 /* TPM_NVRAM_Init() is called once at startup.  It does any NVRAM required initialization.
 
    This function sets some static variables that are used by all TPM's.
 */
 
+/* SWTPM_NVRAM_Set_StateDir() sets the state directory and opens it.
+
+   The directory is only opened again if its path changed, so the TPM keeps
+   using the same directory if it is renamed while the TPM is running.
+   When switching to another directory the backend is quiesced and the
+   digests of the blobs of the previous directory are forgotten.
+*/
+
+TPM_RESULT SWTPM_NVRAM_Set_StateDir(const char *dir)
+{
+    TPM_BOOL suspend;
+    char *path;
+    int fd;
+
+    if (state_dir_fd >= 0 && !strcmp(state_directory, dir))
+        return TPM_SUCCESS;
+
+    path = strdup(dir);
+    if (!path) {
+        fprintf(stderr,
+                "SWTPM_NVRAM_Init: Error (fatal), out of memory\n");
+        return TPM_FAIL;
+    }
+
+    if (SWTPM_NVRAM_Is_Ephemeral() && dir[0] == '\0') {
+        free(state_directory);
+        state_directory = path;
+        return TPM_SUCCESS;
+    }
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr,
+                "SWTPM_NVRAM_Init: Error (fatal) opening the TPM state "
+                "directory %s, %s\n", dir, strerror(errno));
+        free(path);
+        return TPM_FAIL;
+    }
+    suspend = (state_dir_fd >= 0 && backend_ops->suspend);
+    if (suspend)
+        backend_ops->suspend(TRUE);
+    if (state_dir_fd >= 0)
+        close(state_dir_fd);
+    state_dir_fd = fd;
+
+    free(state_directory);
+    state_directory = path;
+    SWTPM_NVRAM_DigestCache_Invalidate_All();
+    framing = NVRAM_FRAMING_UNKNOWN;
+    if (suspend)
+        backend_ops->suspend(FALSE);
+    TPM_DEBUG("TPM_NVRAM_Init: Rooted state path %s\n", state_directory);
+
+    return TPM_SUCCESS;
+}
+
+/* SWTPM_NVRAM_GetStateDirFd() returns the file descriptor of the state
+   directory that files of the TPM are to be accessed relative to.
+*/
+
+int SWTPM_NVRAM_GetStateDirFd(void)
+{
+    return state_dir_fd;
+}
+
+/* SWTPM_NVRAM_SyncStateDir() makes the entries of the state directory
+   durable, for example after a file was renamed into it.
+*/
+
+TPM_RESULT SWTPM_NVRAM_SyncStateDir(void)
+{
+    if (fsync(state_dir_fd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_SyncStateDir: Error (fatal) syncing %s: %s\n",
+                  state_directory, strerror(errno));
+        return TPM_FAIL;
+    }
+    return TPM_SUCCESS;
+}
+
+/* SWTPM_NVRAM_Set_TPMNumber() sets the number of the TPM instance that is
+   used in the names of its files.
+*/
+
+void SWTPM_NVRAM_Set_TPMNumber(uint32_t tpm_number)
+{
+    tpm_instance = tpm_number;
+    framing = NVRAM_FRAMING_UNKNOWN;
+}
+
+/* SWTPM_NVRAM_FileNumber() returns the number of the TPM 'tpm_number' as
+   used in the names of its files, tpm-<number>.<name>.
+*/
+
+unsigned long SWTPM_NVRAM_FileNumber(uint32_t tpm_number)
+{
+    return (unsigned long)tpm_instance + tpm_number;
+}
+
 TPM_RESULT SWTPM_NVRAM_Init(void)
 {
     TPM_RESULT  rc = 0;
     char        *tpm_state_path;
-    size_t      length;
 
     TPM_DEBUG(" SWTPM_NVRAM_Init:\n");
 
     /* TPM_NV_DISK TPM emulation stores in local directory determined by environment variable. */
     if (rc == 0) {
         tpm_state_path = getenv("TPM_PATH");
-        if (tpm_state_path == NULL) {
+        if (tpm_state_path == NULL && SWTPM_NVRAM_Is_Ephemeral()) {
+            /* the blobs are kept in memory; no directory is needed */
+            tpm_state_path = "";
+        } else if (tpm_state_path == NULL) {
             fprintf(stderr,
                     "SWTPM_NVRAM_Init: Error (fatal), TPM_PATH environment "
                     "variable not set\n");
@@ -173,21 +469,60 @@ TPM_RESULT SWTPM_NVRAM_Init(void)
         }
     }
 
-    /* check that the directory name plus a file name will not overflow FILENAME_MAX */
-    if (rc == 0) {
-        length = strlen(tpm_state_path);
-        if ((length + TPM_FILENAME_MAX) > FILENAME_MAX) {
-            fprintf(stderr,
-                    "SWTPM_NVRAM_Init: Error (fatal), TPM state path name "
-                    "%s too large\n", tpm_state_path);
-            rc = TPM_FAIL;
-        }
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Set_StateDir(tpm_state_path);
+    if (rc == 0 && backend_ops->init)
+        rc = backend_ops->init(0);
+    return rc;
+}
+
+static nvram_digest *
+SWTPM_NVRAM_DigestCache_Find(uint32_t tpm_number, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < NVRAM_DIGEST_CACHE_ENTRIES; i++) {
+        if (digest_cache[i].valid &&
+            digest_cache[i].tpm_number == tpm_number &&
+            !strcmp(digest_cache[i].name, name))
+            return &digest_cache[i];
     }
-    if (rc == 0) {
-        strcpy(state_directory, tpm_state_path);
-        TPM_DEBUG("TPM_NVRAM_Init: Rooted state path %s\n", state_directory);
+    return NULL;
+}
+
+static void
+SWTPM_NVRAM_DigestCache_Update(uint32_t tpm_number, const char *name,
+                               const unsigned char *digest)
+{
+    nvram_digest *entry = SWTPM_NVRAM_DigestCache_Find(tpm_number, name);
+
+    if (strlen(name) >= sizeof(entry->name))
+        return;
+
+    if (!entry) {
+        entry = &digest_cache[digest_cache_next];
+        digest_cache_next = (digest_cache_next + 1) %
+                            NVRAM_DIGEST_CACHE_ENTRIES;
+        entry->tpm_number = tpm_number;
+        strcpy(entry->name, name);
     }
-    return rc;
+    memcpy(entry->digest, digest, sizeof(entry->digest));
+    entry->valid = TRUE;
+}
+
+static void
+SWTPM_NVRAM_DigestCache_Invalidate(uint32_t tpm_number, const char *name)
+{
+    nvram_digest *entry = SWTPM_NVRAM_DigestCache_Find(tpm_number, name);
+
+    if (entry)
+        entry->valid = FALSE;
+}
+
+static void
+SWTPM_NVRAM_DigestCache_Invalidate_All(void)
+{
+    memset(digest_cache, 0, sizeof(digest_cache));
 }
 
 /* Load 'data' of 'length' from the 'name'.
@@ -208,124 +543,78 @@ SWTPM_NVRAM_LoadData_Intern(unsigned char **data,     /* freed by caller */
                             TPM_BOOL decrypt)         /* decrypt if key is set */
 {
     TPM_RESULT    rc = 0;
-    long          lrc;
-    size_t        src;
-    int           irc;
-    FILE          *file = NULL;
-    char          filename[FILENAME_MAX]; /* rooted file name from name */
-    unsigned char *decrypt_data = NULL;
-    uint32_t      decrypt_length;
+    const unsigned char *mapped_data = NULL;
+    uint32_t      mapped_length = 0;
+    unsigned char digest[SWTPM_CRYPTO_DIGEST_SIZE];
+    TPM_BOOL      have_digest = FALSE;
+    TPM_BOOL      framed = FALSE;
 
     TPM_DEBUG(" SWTPM_NVRAM_LoadData: From file %s\n", name);
-    *data = NULL;
-    *length = 0;
-    /* open the file */
-    if (rc == 0) {
-        /* map name to the rooted filename */
-        rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
-                                            tpm_number, name);
-    }
 
-    if (rc == 0) {
-        TPM_DEBUG("  SWTPM_NVRAM_LoadData: Opening file %s\n", filename);
-        file = fopen(filename, "rb");                           /* closed @1 */
-        if (file == NULL) {     /* if failure, determine cause */
-            if (errno == ENOENT) {
-                TPM_DEBUG("SWTPM_NVRAM_LoadData: No such file %s\n",
-                         filename);
-                rc = TPM_RETRY;         /* first time start up */
-            }
-            else {
-                fprintf(stderr, "SWTPM_NVRAM_LoadData: Error (fatal) opening "
-                        "%s for read, %s\n", filename, strerror(errno));
-                rc = TPM_FAIL;
-            }
-        }
-    }
-    /* determine the file length */
-    if (rc == 0) {
-        irc = fseek(file, 0L, SEEK_END);        /* seek to end of file */
-        if (irc == -1L) {
-            fprintf(stderr,
-                    "SWTPM_NVRAM_LoadData: Error (fatal) fseek'ing %s, %s\n",
-                   filename, strerror(errno));
-            rc = TPM_FAIL;
-        }
-    }
-    if (rc == 0) {
-        lrc = ftell(file);                      /* get position in the stream */
-        if (lrc == -1L) {
-            fprintf(stderr,
-                    "SWTPM_NVRAM_LoadData: Error (fatal) ftell'ing %s, %s\n",
-                    filename, strerror(errno));
-            rc = TPM_FAIL;
-        }
-        else {
-            *length = (uint32_t)lrc;              /* save the length */
+    if (decrypt && filekey.symkey.valid && backend_ops->map) {
+        /*
+         * The backend can map the blob; decrypt it straight from the
+         * mapping so that the ciphertext is never copied.
+         */
+        *data = NULL;
+        *length = 0;
+        rc = backend_ops->map(&mapped_data, &mapped_length, tpm_number, name);
+        if (rc == 0) {
+            rc = SWTPM_NVRAM_DecryptData(&filekey, data, length,
+                                         mapped_data, mapped_length, digest);
+            TPM_DEBUG(" SWTPM_NVRAM_LoadData: Decrypted %u bytes of "
+                      "mapped data to %u bytes, rc = %d\n",
+                      mapped_length, *length, rc);
+            backend_ops->unmap(mapped_data, mapped_length);
+            have_digest = (rc == 0);
         }
-    }
-    if (rc == 0) {
-        irc = fseek(file, 0L, SEEK_SET);        /* seek back to the beginning of the file */
-        if (irc == -1L) {
-            fprintf(stderr,
-                    "SWTPM_NVRAM_LoadData: Error (fatal) fseek'ing %s, %s\n",
-                    filename, strerror(errno));
-            rc = TPM_FAIL;
+    } else {
+        rc = backend_ops->load(data, length, tpm_number, name);
+
+        if (rc == 0 && decrypt && filekey.symkey.valid) {
+            /* decrypt in place; no second buffer is needed */
+            rc = SWTPM_NVRAM_DecryptBuffer(&filekey, *data, length,
+                                           *data, *length, digest);
+            TPM_DEBUG(" SWTPM_NVRAM_LoadData: SWTPM_NVRAM_DecryptBuffer "
+                      "rc = %d\n", rc);
+            if (rc != 0) {
+                TPM_Free(*data);
+                *data = NULL;
+                *length = 0;
+            }
+            have_digest = (rc == 0);
+        } else if (rc == 0 && decrypt && !SWTPM_NVRAM_Is_Ephemeral()) {
+            have_digest = (SWTPM_Crypto_Digest(*data, *length, digest) == 0);
         }
     }
-    /* allocate a buffer for the actual data */
-    if ((rc == 0) && *length != 0) {
-        TPM_DEBUG(" SWTPM_NVRAM_LoadData: Reading %u bytes of data\n", *length);
-        rc = TPM_Malloc(data, *length);
+
+    if (rc == 0 && decrypt) {
+        rc = SWTPM_NVRAM_GetFraming(tpm_number, FALSE, &framed);
         if (rc != 0) {
-            fprintf(stderr,
-                    "SWTPM_NVRAM_LoadData: Error (fatal) allocating %u "
-                    "bytes\n", *length);
-            rc = TPM_FAIL;
-        }
-    }
-    /* read the contents of the file into the data buffer */
-    if ((rc == 0) && *length != 0) {
-        src = fread(*data, 1, *length, file);
-        if (src != *length) {
-            fprintf(stderr,
-                    "SWTPM_NVRAM_LoadData: Error (fatal), data read of %u "
-                    "only read %lu\n", *length, (unsigned long)src);
-            rc = TPM_FAIL;
-        }
-    }
-    /* close the file */
-    if (file != NULL) {
-        TPM_DEBUG(" SWTPM_NVRAM_LoadData: Closing file %s\n", filename);
-        irc = fclose(file);             /* @1 */
-        if (irc != 0) {
-            fprintf(stderr,
-                    "SWTPM_NVRAM_LoadData: Error (fatal) closing file %s\n",
-                    filename);
-            rc = TPM_FAIL;
-        }
-        else {
-            TPM_DEBUG(" SWTPM_NVRAM_LoadData: Closed file %s\n", filename);
+            TPM_Free(*data);
+            *data = NULL;
+            *length = 0;
         }
     }
 
-    if (rc == 0 && decrypt) {
-        rc = SWTPM_NVRAM_DecryptData(&filekey, &decrypt_data, &decrypt_length,
-                                     *data, *length);
-        TPM_DEBUG(" SWTPM_NVRAM_LoadData: SWTPM_NVRAM_DecryptData rc = %d\n",
-                  rc);
-        if (rc == 0) {
-            if (decrypt_data) {
-                TPM_DEBUG(" SWTPM_NVRAM_LoadData: Decrypted %u bytes of "
-                          "data to %u bytes.\n",
-                          *length, decrypt_length);
-                TPM_Free(*data);
-                *data = decrypt_data;
-                *length = decrypt_length;
-            }
-        }
+    if (rc == 0 && decrypt && framed) {
+        unsigned char *plain = NULL;
+        uint32_t plain_len = 0;
+
+        rc = SWTPM_NVRAM_DecompressData(&plain, &plain_len, *data, *length);
+        TPM_DEBUG(" SWTPM_NVRAM_LoadData: Decompressed %u bytes to %u bytes, "
+                  "rc = %d\n", *length, plain_len, rc);
+        TPM_Free(*data);
+        *data = plain;
+        *length = plain_len;
+        /* the digest is the one of the uncompressed data */
+        have_digest = (rc == 0 && !SWTPM_NVRAM_Is_Ephemeral() &&
+                       SWTPM_Crypto_Digest(*data, *length, digest) == 0);
     }
 
+    if (have_digest)
+        SWTPM_NVRAM_DigestCache_Update(tpm_number, name, digest);
+
     return rc;
 }
 
@@ -337,7 +626,7 @@ TPM_RESULT SWTPM_NVRAM_LoadData(unsigned char **data,     /* freed by caller */
      return SWTPM_NVRAM_LoadData_Intern(data, length, tpm_number, name, TRUE);
 }
 
-/* SWTPM_NVRAM_StoreData stores 'data' of 'length' to the rooted 'filename'
+/* SWTPM_NVRAM_StoreData stores 'data' of 'length' under the given 'name'
 
    Returns
         0 on success
@@ -352,34 +641,56 @@ SWTPM_NVRAM_StoreData_Intern(const unsigned char *data,
                              TPM_BOOL encrypt         /* encrypt if key is set */)
 {
     TPM_RESULT    rc = 0;
-    uint32_t      lrc;
-    int           irc;
-    FILE          *file = NULL;
-    char          filename[FILENAME_MAX]; /* rooted file name from name */
     unsigned char *encrypt_data = NULL;
     uint32_t      encrypt_length = 0;
+    unsigned char *compress_data = NULL;
+    uint32_t      compress_length = 0;
+    unsigned char digest[SWTPM_CRYPTO_DIGEST_SIZE];
+    TPM_BOOL      have_digest = FALSE;
+    nvram_digest  *entry;
+    TPM_BOOL      framed = FALSE;
 
     TPM_DEBUG(" SWTPM_NVRAM_StoreData: To name %s\n", name);
-    if (rc == 0) {
-        /* map name to the rooted filename */
-        rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
-                                            tpm_number, name);
+
+    /*
+     * skip the store if the same plaintext was stored last time; an
+     * in-memory backend compares the blobs cheaper than they are hashed
+     */
+    if (encrypt && !SWTPM_NVRAM_Is_Ephemeral() &&
+        SWTPM_Crypto_Digest(data, length, digest) == 0) {
+        have_digest = TRUE;
+        entry = SWTPM_NVRAM_DigestCache_Find(tpm_number, name);
+        if (entry && !memcmp(entry->digest, digest, sizeof(digest))) {
+            TPM_DEBUG(" SWTPM_NVRAM_StoreData: Skipping store of unchanged "
+                      "%s\n", name);
+            return TPM_SUCCESS;
+        }
     }
-    if (rc == 0) {
-        /* open the file */
-        TPM_DEBUG(" SWTPM_NVRAM_StoreData: Opening file %s\n", filename);
-        file = fopen(filename, "wb");                           /* closed @1 */
-        if (file == NULL) {
-            fprintf(stderr,
-                    "SWTPM_NVRAM_StoreData: Error (fatal) opening %s for "
-                    "write failed, %s\n", filename, strerror(errno));
-            rc = TPM_FAIL;
+
+    /* frame and compress the data before they are encrypted */
+    if (rc == 0 && encrypt)
+        rc = SWTPM_NVRAM_GetFraming(tpm_number,
+                                    SWTPM_Compression_Default() !=
+                                        SWTPM_COMPRESSION_NONE,
+                                    &framed);
+    if (rc == 0 && encrypt && framed) {
+        rc = SWTPM_NVRAM_FrameData(&compress_data, &compress_length,
+                                   data, length);
+        if (compress_data) {
+            TPM_DEBUG("  SWTPM_NVRAM_StoreData: Framed %u bytes in %u "
+                      "bytes\n", length, compress_length);
+            data = compress_data;
+            length = compress_length;
         }
     }
 
     if (rc == 0 && encrypt) {
-        rc = SWTPM_NVRAM_EncryptData(&filekey, &encrypt_data, &encrypt_length,
-                                     data, length);
+        /* the digest is of no use if the data were framed */
+        rc = SWTPM_NVRAM_EncryptData(&filekey, 0,
+                                     &encrypt_data, &encrypt_length,
+                                     data, length,
+                                     (have_digest && !compress_data)
+                                     ? digest : NULL);
         if (encrypt_data) {
             TPM_DEBUG("  SWTPM_NVRAM_StoreData: Encrypted %u bytes before "
                       "write, will write %u bytes\n", length, encrypt_length);
@@ -387,31 +698,18 @@ SWTPM_NVRAM_StoreData_Intern(const unsigned char *data,
         }
     }
 
-    /* write the data to the file */
     if (rc == 0) {
-        TPM_DEBUG("  SWTPM_NVRAM_StoreData: Writing %u bytes of data\n", length);
-        lrc = fwrite(encrypt_data ? encrypt_data : data, 1,
-                     length, file);
-        if (lrc != length) {
-            fprintf(stderr, "TPM_NVRAM_StoreData: Error (fatal), data write "
-                    "of %u only wrote %u\n", length, lrc);
-            rc = TPM_FAIL;
-        }
-    }
-    if (file != NULL) {
-        TPM_DEBUG("  SWTPM_NVRAM_StoreData: Closing file %s\n", filename);
-        irc = fclose(file);             /* @1 */
-        if (irc != 0) {
-            fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) closing "
-                    "file\n");
-            rc = TPM_FAIL;
-        }
-        else {
-            TPM_DEBUG("  SWTPM_NVRAM_StoreData: Closed file %s\n", filename);
-        }
+        rc = backend_ops->store(encrypt_data ? encrypt_data : data, length,
+                                tpm_number, name);
     }
 
+    if (rc == 0 && have_digest)
+        SWTPM_NVRAM_DigestCache_Update(tpm_number, name, digest);
+    else
+        SWTPM_NVRAM_DigestCache_Invalidate(tpm_number, name);
+
     TPM_Free(encrypt_data);
+    TPM_Free(compress_data);
 
     TPM_DEBUG(" SWTPM_NVRAM_StoreData: rc=%d\n", rc);
 
@@ -426,26 +724,29 @@ TPM_RESULT SWTPM_NVRAM_StoreData(const unsigned char *data,
     return SWTPM_NVRAM_StoreData_Intern(data, length, tpm_number, name, TRUE);
 }
 
-/* SWTPM_NVRAM_GetFilenameForName() constructs a rooted file name from the name.
+/* SWTPM_NVRAM_GetFilenameForName() constructs the file name for the name,
+   relative to the state directory.
 
    The filename is of the form:
 
-   state_directory/tpm_number.name
+   tpm-<file number>.name
+
+   where the file number is the tpm_number plus the number of the instance.
 */
 
-static TPM_RESULT SWTPM_NVRAM_GetFilenameForName(char *filename,        /* output: rooted filename */
-                                                 size_t bufsize,
-                                                 uint32_t tpm_number,
-                                                 const char *name)      /* input: abstract name */
+TPM_RESULT SWTPM_NVRAM_GetFilenameForName(char *filename,        /* output: file name */
+                                          size_t bufsize,
+                                          uint32_t tpm_number,
+                                          const char *name)      /* input: abstract name */
 {
     TPM_RESULT res = TPM_SUCCESS;
     int n;
 
     TPM_DEBUG(" SWTPM_NVRAM_GetFilenameForName: For name %s\n", name);
 
-    n = snprintf(filename, bufsize, "%s/tpm-%02lx.%s",
-                 state_directory, (unsigned long)tpm_number, name);
-    if ((size_t)n > bufsize) {
+    n = snprintf(filename, bufsize, "tpm-%02lx.%s",
+                 SWTPM_NVRAM_FileNumber(tpm_number), name);
+    if (n < 0 || (size_t)n >= bufsize) {
         res = TPM_FAIL;
     }
 
@@ -460,35 +761,170 @@ static TPM_RESULT SWTPM_NVRAM_GetFilenameForName(char *filename,        /* outpu
         0 on success, or if the file does not exist and mustExist is FALSE
         TPM_FAIL if the file could not be removed, since this should never occur and there is
                 no recovery
-
-   NOTE: Not portable code, but supported by Linux and Windows
 */
 
 TPM_RESULT SWTPM_NVRAM_DeleteName(uint32_t tpm_number,
                                   const char *name,
                                   TPM_BOOL mustExist)
 {
-    TPM_RESULT  rc = 0;
-    int         irc;
-    char        filename[FILENAME_MAX]; /* rooted file name from name */
-
     TPM_DEBUG(" SWTPM_NVRAM_DeleteName: Name %s\n", name);
-    /* map name to the rooted filename */
-    rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
-                                        tpm_number, name);
-    if (rc == 0) {
-        irc = remove(filename);
-        if ((irc != 0) &&               /* if the remove failed */
-            (mustExist ||               /* if any error is a failure, or */
-             (errno != ENOENT))) {      /* if error other than no such file */
-            fprintf(stderr, "SWTPM_NVRAM_DeleteName: Error, (fatal) file "
-                    "remove failed, errno %d\n", errno);
-            rc = TPM_FAIL;
-        }
+
+    SWTPM_NVRAM_DigestCache_Invalidate(tpm_number, name);
+
+    return backend_ops->delete(tpm_number, name, mustExist);
+}
+
+/*
+ * nvram_backend_from_string:
+ * Convert the string into a storage backend identifier
+ * @backend: one of 'dir', 'container', 'cas', 'journal' or 'memory'
+ *
+ * Returns a storage backend identifier
+ */
+enum nvram_backend
+nvram_backend_from_string(const char *backend)
+{
+    if (!strcmp(backend, "dir")) {
+        return NVRAM_BACKEND_DIR;
+    } else if (!strcmp(backend, "container")) {
+        return NVRAM_BACKEND_CONTAINER;
+    } else if (!strcmp(backend, "cas")) {
+        return NVRAM_BACKEND_CAS;
+    } else if (!strcmp(backend, "journal")) {
+        return NVRAM_BACKEND_JOURNAL;
+    } else if (!strcmp(backend, "memory")) {
+        return NVRAM_BACKEND_MEMORY;
+    }
+
+    return NVRAM_BACKEND_UNKNOWN;
+}
+
+const struct nvram_backend_ops *
+SWTPM_NVRAM_GetBackendOps(enum nvram_backend backend)
+{
+    switch (backend) {
+    case NVRAM_BACKEND_DIR:
+        return &nvram_dir_ops;
+    case NVRAM_BACKEND_CONTAINER:
+        return &nvram_container_ops;
+    case NVRAM_BACKEND_CAS:
+        return &nvram_cas_ops;
+    case NVRAM_BACKEND_JOURNAL:
+        return &nvram_journal_ops;
+    case NVRAM_BACKEND_MEMORY:
+        return &nvram_memory_ops;
+    case NVRAM_BACKEND_UNKNOWN:
+        break;
+    }
+    return NULL;
+}
+
+TPM_RESULT SWTPM_NVRAM_Set_Backend(enum nvram_backend backend)
+{
+    const struct nvram_backend_ops *ops = SWTPM_NVRAM_GetBackendOps(backend);
+
+    if (!ops)
+        return TPM_BAD_PARAMETER;
+
+    backend_ops = ops;
+    SWTPM_NVRAM_DigestCache_Invalidate_All();
+    framing = NVRAM_FRAMING_UNKNOWN;
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * SWTPM_NVRAM_Is_Ephemeral: whether the TPM state is only kept in memory
+ */
+TPM_BOOL SWTPM_NVRAM_Is_Ephemeral(void)
+{
+    return (backend_ops->flags & NVRAM_BACKEND_FLAG_MEMORY) != 0;
+}
+
+/*
+ * SWTPM_NVRAM_Shutdown: called when the TPM shuts down; lets the backend
+ *                       persist the state
+ */
+TPM_RESULT SWTPM_NVRAM_Shutdown(void)
+{
+    if (backend_ops->shutdown)
+        return backend_ops->shutdown(0);
+
+    return TPM_SUCCESS;
+}
+
+
+/*
+ * SWTPM_NVRAM_Snapshot: create a point-in-time copy of the state files of
+ *                       the TPM in the directory 'dir'
+ *
+ * The caller must have stored the volatile state before if it is to be
+ * part of the snapshot.
+ *
+ * @reflinked: set to TRUE if all files could be cloned
+ */
+TPM_RESULT SWTPM_NVRAM_Snapshot(const char *dir, uint32_t tpm_number,
+                                TPM_BOOL *reflinked)
+{
+    TPM_RESULT rc;
+    int fd;
+
+    TPM_DEBUG(" SWTPM_NVRAM_Snapshot: %s\n", dir);
+
+    if (SWTPM_NVRAM_Is_Ephemeral()) {
+        *reflinked = FALSE;
+        return SWTPM_NVRAM_Memory_Dump(dir, tpm_number);
     }
+
+    rc = SWTPM_NVRAM_OpenSnapshotDir(dir, TRUE, &fd);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    if (backend_ops->suspend)
+        backend_ops->suspend(TRUE);
+    rc = SWTPM_NVRAM_CopyStateFiles(state_dir_fd, fd, tpm_number,
+                                    FALSE, reflinked);
+    if (backend_ops->suspend)
+        backend_ops->suspend(FALSE);
+    close(fd);
+
     return rc;
 }
 
+/*
+ * SWTPM_NVRAM_Restore: replace the state files of the TPM with those of the
+ *                      snapshot in 'dir'; the TPM must not be running
+ */
+TPM_RESULT SWTPM_NVRAM_Restore(const char *dir, uint32_t tpm_number)
+{
+    TPM_RESULT rc;
+    int fd;
+
+    TPM_DEBUG(" SWTPM_NVRAM_Restore: %s\n", dir);
+
+    if (SWTPM_NVRAM_Is_Ephemeral())
+        return SWTPM_NVRAM_Memory_Load(dir, tpm_number);
+
+    rc = SWTPM_NVRAM_OpenSnapshotDir(dir, FALSE, &fd);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    if (backend_ops->suspend)
+        backend_ops->suspend(TRUE);
+    rc = SWTPM_NVRAM_CopyStateFiles(fd, state_dir_fd, tpm_number,
+                                    TRUE, NULL);
+    if (backend_ops->suspend)
+        backend_ops->suspend(FALSE);
+    close(fd);
+
+    /* the blobs on disk changed underneath any cached state */
+    SWTPM_NVRAM_DigestCache_Invalidate_All();
+    framing = NVRAM_FRAMING_UNKNOWN;
+    if (rc == TPM_SUCCESS)
+        rc = SWTPM_NVRAM_Init();
+
+    return rc;
+}
 
 TPM_RESULT SWTPM_NVRAM_Store_Volatile(void)
 {
@@ -518,11 +954,11 @@ SWTPM_NVRAM_KeyParamCheck(uint32_t keylen,
 {
     TPM_RESULT rc = 0;
 
-    if (keylen != TPM_AES_BLOCK_SIZE) {
-        rc = TPM_BAD_KEY_PROPERTY;
-    }
     switch (encmode) {
     case ENCRYPTION_MODE_AES_CBC:
+    case ENCRYPTION_MODE_AES_256_GCM:
+        if (keylen != encryption_mode_key_length(encmode))
+            rc = TPM_BAD_KEY_PROPERTY;
         break;
     case ENCRYPTION_MODE_UNKNOWN:
         rc = TPM_BAD_MODE;
@@ -531,6 +967,19 @@ SWTPM_NVRAM_KeyParamCheck(uint32_t keylen,
     return rc;
 }
 
+static enum swtpm_cipher_mode
+SWTPM_NVRAM_CipherMode(enum encryption_mode encmode)
+{
+    switch (encmode) {
+    case ENCRYPTION_MODE_AES_256_GCM:
+        return SWTPM_CIPHER_AES_GCM;
+    case ENCRYPTION_MODE_AES_CBC:
+    case ENCRYPTION_MODE_UNKNOWN:
+        break;
+    }
+    return SWTPM_CIPHER_AES_CBC;
+}
+
 TPM_BOOL SWTPM_NVRAM_Has_FileKey(void)
 {
     return filekey.symkey.valid;
@@ -543,10 +992,14 @@ TPM_RESULT SWTPM_NVRAM_Set_FileKey(const unsigned char *key, uint32_t keylen,
 
     rc = SWTPM_NVRAM_KeyParamCheck(keylen, encmode);
 
+    if (rc == 0)
+        rc = TPM_SymmetricKeyData_Init(&filekey.symkey, key, keylen,
+                                       SWTPM_NVRAM_CipherMode(encmode));
+
     if (rc == 0) {
-        filekey.symkey.valid = TRUE;
-        memcpy(filekey.symkey.userKey, key, keylen);
         filekey.data_encmode = encmode;
+        /* the stored blobs must be re-encrypted with the new key */
+        SWTPM_NVRAM_DigestCache_Invalidate_All();
     }
 
     return rc;
@@ -565,101 +1018,299 @@ TPM_RESULT SWTPM_NVRAM_Set_MigrationKey(const unsigned char *key,
 
     rc = SWTPM_NVRAM_KeyParamCheck(keylen, encmode);
 
+    if (rc == 0)
+        rc = TPM_SymmetricKeyData_Init(&migrationkey.symkey, key, keylen,
+                                       SWTPM_NVRAM_CipherMode(encmode));
+
     if (rc == 0) {
-        migrationkey.symkey.valid = TRUE;
-        memcpy(migrationkey.symkey.userKey, key, keylen);
         migrationkey.data_encmode = encmode;
     }
 
     return rc;
 }
 
-static TPM_RESULT
-SWTPM_PrependHash(const unsigned char *in, uint32_t in_length,
-                  unsigned char **out, uint32_t *out_length)
+TPM_RESULT SWTPM_NVRAM_Set_NewFileKey(const unsigned char *key,
+                                      uint32_t keylen,
+                                      enum encryption_mode encmode)
 {
-    TPM_RESULT rc = 0;
-    unsigned char *dest;
-#ifdef USE_FREEBL_CRYPTO_LIBRARY
-    unsigned char hashbuf[SHA256_LENGTH];
-#else
-    unsigned char hashbuf[SHA256_DIGEST_LENGTH];
-#endif
+    TPM_RESULT rc;
 
-    /* hash the data */
-#ifdef USE_FREEBL_CRYPTO_LIBRARY
-    if (SHA256_HashBuf(hashbuf, in, in_length) != SECSuccess) {
-        logprintf(STDOUT_FILENO, "SHA256_HashBuff failed.\n");
-        rc = TPM_FAIL;
+    rc = SWTPM_NVRAM_KeyParamCheck(keylen, encmode);
+
+    if (rc == 0)
+        rc = TPM_SymmetricKeyData_Init(&newfilekey.symkey, key, keylen,
+                                       SWTPM_NVRAM_CipherMode(encmode));
+
+    if (rc == 0) {
+        newfilekey.data_encmode = encmode;
     }
-#else
-    SHA256(in, in_length, hashbuf);
-#endif
 
-    *out_length = sizeof(hashbuf) + in_length;
-    rc = TPM_Malloc(out, *out_length);
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_Rekey: re-encrypt the state blob 'name' of the TPM with the
+ *                    key set with SWTPM_NVRAM_Set_NewFileKey()
+ *
+ * The blob is decrypted with the file key first and re-encrypted with the
+ * new key. Only if that fails is the blob taken to have been re-encrypted
+ * already by an interrupted earlier run, and then only if it decrypts with
+ * the new key: both encryption modes authenticate the data (the digest in
+ * front of AES-CBC data, the tag of AES-GCM data), so a blob is never
+ * taken to be re-encrypted because a wrong key happened to produce valid
+ * padding. If no file key is set, the plaintext blob cannot be told apart
+ * from ciphertext, so the new key is checked first in that case.
+ *
+ * @rekeyed: set to TRUE if the blob was re-encrypted
+ *
+ * Returns TPM_RETRY if the blob does not exist.
+ */
+TPM_RESULT SWTPM_NVRAM_Rekey(uint32_t tpm_number, const char *name,
+                             TPM_BOOL *rekeyed)
+{
+    encryptionkey oldkey = filekey;
+    unsigned char *data = NULL;
+    uint32_t length = 0;
+    TPM_RESULT rc;
+
+    *rekeyed = FALSE;
+
+    if (!newfilekey.symkey.valid)
+        return TPM_BAD_KEY_PROPERTY;
+
+    if (!oldkey.symkey.valid) {
+        /* the load and store functions use the file key */
+        filekey = newfilekey;
+        rc = SWTPM_NVRAM_LoadData_Intern(&data, &length, tpm_number, name,
+                                         TRUE);
+        filekey = oldkey;
+        TPM_Free(data);
+        data = NULL;
+        if (rc == TPM_SUCCESS || rc == TPM_RETRY)
+            goto exit;
+    }
 
+    rc = SWTPM_NVRAM_LoadData_Intern(&data, &length, tpm_number, name, TRUE);
     if (rc == TPM_SUCCESS) {
-        dest = *out;
-        memcpy(dest, hashbuf, sizeof(hashbuf));
-        memcpy(&dest[sizeof(hashbuf)], in, in_length);
+        /* the plaintext is unchanged, so the store must not be skipped */
+        SWTPM_NVRAM_DigestCache_Invalidate(tpm_number, name);
+        filekey = newfilekey;
+        rc = SWTPM_NVRAM_StoreData_Intern(data, length, tpm_number, name,
+                                          TRUE);
+        filekey = oldkey;
+        *rekeyed = (rc == TPM_SUCCESS);
+    } else if (rc != TPM_RETRY && oldkey.symkey.valid) {
+        TPM_RESULT rc2;
+
+        filekey = newfilekey;
+        rc2 = SWTPM_NVRAM_LoadData_Intern(&data, &length, tpm_number, name,
+                                          TRUE);
+        filekey = oldkey;
+        if (rc2 == TPM_SUCCESS)
+            rc = TPM_SUCCESS;
     }
+    TPM_Free(data);
+
+exit:
+    /* the blob is no longer encrypted with the file key */
+    SWTPM_NVRAM_DigestCache_Invalidate(tpm_number, name);
 
     return rc;
 }
 
+/*
+ * SWTPM_NVRAM_CheckHeader: check the framing of a stored blob
+ *
+ * Before decryption 'key' is the key the blob is encrypted with and the
+ * length must fit its encryption mode. After decryption, or for blobs that
+ * are not encrypted, 'key' is NULL and the blobs of a state with
+ * compression frames must start with a valid frame.
+ */
+static enum nvram_check_result
+SWTPM_NVRAM_CheckHeader(const encryptionkey *key, TPM_BOOL framed,
+                        const unsigned char *data, uint32_t length)
+{
+    if (key) {
+        switch (key->data_encmode) {
+        case ENCRYPTION_MODE_UNKNOWN:
+            break;
+        case ENCRYPTION_MODE_AES_CBC:
+            if (length < TPM_AES_PADDED_LENGTH(SWTPM_CRYPTO_DIGEST_SIZE) ||
+                length % TPM_AES_BLOCK_SIZE != 0)
+                return NVRAM_CHECK_BAD_LENGTH;
+            break;
+        case ENCRYPTION_MODE_AES_256_GCM:
+            if (length < TPM_AES_GCM_NONCE_SIZE + TPM_AES_GCM_TAG_SIZE)
+                return NVRAM_CHECK_BAD_LENGTH;
+            break;
+        }
+        return NVRAM_CHECK_OK;
+    }
+
+    if (framed && !SWTPM_NVRAM_IsFramed(data, length))
+        return NVRAM_CHECK_BAD_HEADER;
+
+    return NVRAM_CHECK_OK;
+}
+
+/*
+ * SWTPM_NVRAM_CheckName: check the integrity of the blob stored under 'name'
+ * without handing it to the TPM
+ *
+ * The blob is decrypted with the file key, which verifies its digest or
+ * authentication tag, and decompressed. NVRAM_CHECK_FLAG_VERIFIED is set
+ * if a digest, tag or checksum covered the data; plain blobs carry none,
+ * so only their framing can be checked.
+ *
+ * @flags: NVRAM_CHECK_FLAG_* describing the blob
+ * @length: the size of the stored blob
+ */
+enum nvram_check_result
+SWTPM_NVRAM_CheckName(uint32_t tpm_number, const char *name,
+                      uint32_t *flags, uint32_t *length)
+{
+    enum nvram_check_result res = NVRAM_CHECK_OK;
+    unsigned char *data = NULL, *plain = NULL;
+    uint32_t plain_len = 0;
+    TPM_BOOL framed = FALSE;
+    uint16_t compflags;
+    blobheader bh;
+    TPM_RESULT rc;
+
+    *flags = 0;
+    *length = 0;
+
+    rc = backend_ops->load(&data, length, tpm_number, name);
+    if (rc == TPM_RETRY)
+        return NVRAM_CHECK_MISSING;
+    if (rc == TPM_SUCCESS)
+        rc = SWTPM_NVRAM_GetFraming(tpm_number, FALSE, &framed);
+    if (rc != TPM_SUCCESS) {
+        TPM_Free(data);
+        return NVRAM_CHECK_UNREADABLE;
+    }
+
+    if (filekey.symkey.valid) {
+        *flags |= NVRAM_CHECK_FLAG_ENCRYPTED;
+        res = SWTPM_NVRAM_CheckHeader(&filekey, FALSE, data, *length);
+        if (res == NVRAM_CHECK_OK) {
+            plain_len = *length;
+            rc = SWTPM_NVRAM_DecryptBuffer(&filekey, data, &plain_len,
+                                           data, *length, NULL);
+            if (rc != TPM_SUCCESS)
+                res = NVRAM_CHECK_BAD_INTEGRITY;
+            else
+                *flags |= NVRAM_CHECK_FLAG_VERIFIED;
+        }
+    } else {
+        plain_len = *length;
+    }
+
+    if (res == NVRAM_CHECK_OK)
+        res = SWTPM_NVRAM_CheckHeader(NULL, framed, data, plain_len);
+
+    if (res == NVRAM_CHECK_OK && framed) {
+        memcpy(&bh, data, sizeof(bh));
+        compflags = ntohs(bh.flags) & BLOB_FLAGS_COMPRESSED;
+        if (compflags)
+            *flags |= NVRAM_CHECK_FLAG_COMPRESSED;
+        rc = SWTPM_NVRAM_DecompressData(&plain, &plain_len, data, plain_len);
+        if (rc != TPM_SUCCESS)
+            res = NVRAM_CHECK_BAD_COMPRESSION;
+        /* zlib streams carry a checksum, zstd frames as written do not */
+        else if (compflags == BLOB_FLAG_COMPRESSED_ZLIB)
+            *flags |= NVRAM_CHECK_FLAG_VERIFIED;
+        TPM_Free(plain);
+    }
+
+    TPM_Free(data);
+
+    return res;
+}
+
+const char *SWTPM_NVRAM_CheckResult_String(enum nvram_check_result res)
+{
+    switch (res) {
+    case NVRAM_CHECK_OK:
+        return "ok";
+    case NVRAM_CHECK_MISSING:
+        return "missing";
+    case NVRAM_CHECK_UNREADABLE:
+        return "unreadable";
+    case NVRAM_CHECK_BAD_HEADER:
+        return "bad header";
+    case NVRAM_CHECK_BAD_LENGTH:
+        return "bad length";
+    case NVRAM_CHECK_BAD_INTEGRITY:
+        return "decryption or digest check failed";
+    case NVRAM_CHECK_BAD_COMPRESSION:
+        return "bad compressed data";
+    }
+    return "unknown";
+}
+
+/*
+ * Check the digest in front of the decrypted data in 'in' and move the
+ * data to the beginning of the buffer.
+ */
 static TPM_RESULT
-SWTPM_CheckHash(const unsigned char *in, uint32_t in_length,
-                unsigned char **out, uint32_t *out_length)
+SWTPM_CheckHash(unsigned char *in, uint32_t in_length,
+                uint32_t *out_length, unsigned char *digest)
 {
     TPM_RESULT rc = 0;
-    unsigned char *dest = NULL;
-#ifdef USE_FREEBL_CRYPTO_LIBRARY
-    unsigned char hashbuf[SHA256_LENGTH];
-#else
-    unsigned char hashbuf[SHA256_DIGEST_LENGTH];
-#endif
-    const unsigned char *data = &in[sizeof(hashbuf)];
-    uint32_t data_length = in_length - sizeof(hashbuf);
+    unsigned char hashbuf[SWTPM_CRYPTO_DIGEST_SIZE];
+    uint32_t data_length;
+
+    if (in_length < sizeof(hashbuf)) {
+        logprintf(STDOUT_FILENO, "Decrypted data are too short.\n");
+        return TPM_FAIL;
+    }
+    data_length = in_length - sizeof(hashbuf);
 
     /* hash the data */
-#ifdef USE_FREEBL_CRYPTO_LIBRARY
-    if (SHA256_HashBuf(hashbuf, data, data_length) != SECSuccess) {
-        logprintf(STDOUT_FILENO, "SHA256_HashBuff failed.\n");
+    if (SWTPM_Crypto_Digest(&in[sizeof(hashbuf)], data_length, hashbuf) !=
+        TPM_SUCCESS) {
+        logprintf(STDOUT_FILENO, "Hashing the data failed.\n");
         rc = TPM_FAIL;
     }
-#else
-    SHA256(data, data_length, hashbuf);
-#endif
 
-    if (memcmp(in, hashbuf, sizeof(hashbuf))) {
+    if (rc == TPM_SUCCESS && memcmp(in, hashbuf, sizeof(hashbuf))) {
         logprintf(STDOUT_FILENO, "Verification of hash failed. "
                   "Data integrity is compromised\n");
         rc = TPM_FAIL;
     }
 
     if (rc == TPM_SUCCESS) {
-        rc = TPM_Malloc(&dest, data_length);
-        if (rc == TPM_SUCCESS) {
-            *out = dest;
-            *out_length = data_length;
-            memcpy(dest, data, data_length);
-        }
+        if (digest)
+            memcpy(digest, hashbuf, sizeof(hashbuf));
+        memmove(in, &in[sizeof(hashbuf)], data_length);
+        *out_length = data_length;
     }
 
     return rc;
 }
 
+/*
+ * Encrypt the data with the given key. The result is written into a single
+ * newly allocated buffer that starts with 'hdrsize' bytes reserved for the
+ * caller's header, followed by the digest of the data, the data and the
+ * padding, which are then encrypted in place. If the caller already has the
+ * digest of the data, it can pass it in 'digest'.
+ *
+ * No buffer is returned if the key is not set.
+ */
 static TPM_RESULT 
 SWTPM_NVRAM_EncryptData(const encryptionkey *key,
+                        uint32_t hdrsize,
                         unsigned char **encrypt_data,
                         uint32_t *encrypt_length,
                         const unsigned char *decrypt_data,
-                        uint32_t decrypt_length)
+                        uint32_t decrypt_length,
+                        const unsigned char *digest)
 {
     TPM_RESULT rc = 0;
-    unsigned char *hashed_data = NULL;
-    uint32_t hashed_length = 0;
+    unsigned char *dest;
+    uint32_t hashed_length = SWTPM_CRYPTO_DIGEST_SIZE + decrypt_length;
 
     if (rc == 0) {
         if (key->symkey.valid) {
@@ -668,16 +1319,61 @@ SWTPM_NVRAM_EncryptData(const encryptionkey *key,
                 rc = TPM_BAD_MODE;
                 break;
             case ENCRYPTION_MODE_AES_CBC:
-                rc = SWTPM_PrependHash(decrypt_data, decrypt_length,
-                                       &hashed_data, &hashed_length);
+                if (decrypt_length > UINT32_MAX - hdrsize -
+                                     SWTPM_CRYPTO_DIGEST_SIZE - TPM_AES_BLOCK_SIZE) {
+                    rc = TPM_SIZE;
+                    break;
+                }
+                rc = TPM_Malloc(encrypt_data,
+                                hdrsize + TPM_AES_PADDED_LENGTH(hashed_length));
+                if (rc)
+                    break;
+                dest = &(*encrypt_data)[hdrsize];
+                if (digest)
+                    memcpy(dest, digest, SWTPM_CRYPTO_DIGEST_SIZE);
+                else
+                    rc = SWTPM_Crypto_Digest(decrypt_data, decrypt_length, dest);
+                if (rc == 0) {
+                    memcpy(&dest[SWTPM_CRYPTO_DIGEST_SIZE], decrypt_data,
+                           decrypt_length);
+                    rc = TPM_SymmetricKeyData_EncryptBuffer(dest,
+                                                            hashed_length,
+                                                            encrypt_length,
+                                                            &key->symkey);
+                }
+                if (rc == 0) {
+                    *encrypt_length += hdrsize;
+                } else {
+                    TPM_Free(*encrypt_data);
+                    *encrypt_data = NULL;
+                }
+                break;
+            case ENCRYPTION_MODE_AES_256_GCM:
+                /* GCM authenticates the data, so no digest is needed */
+                if (decrypt_length > UINT32_MAX - hdrsize -
+                                     TPM_AES_GCM_NONCE_SIZE -
+                                     TPM_AES_GCM_TAG_SIZE) {
+                    rc = TPM_SIZE;
+                    break;
+                }
+                rc = TPM_Malloc(encrypt_data,
+                                hdrsize + TPM_AES_GCM_NONCE_SIZE +
+                                decrypt_length + TPM_AES_GCM_TAG_SIZE);
                 if (rc)
-                     break;
-                rc = TPM_SymmetricKeyData_Encrypt(encrypt_data,
-                                                  encrypt_length,
-                                                  hashed_data,
-                                                  hashed_length,
-                                                  &key->symkey);
-                TPM_Free(hashed_data);
+                    break;
+                dest = &(*encrypt_data)[hdrsize];
+                memcpy(&dest[TPM_AES_GCM_NONCE_SIZE], decrypt_data,
+                       decrypt_length);
+                rc = TPM_SymmetricKeyData_GCM_EncryptBuffer(dest,
+                                                            decrypt_length,
+                                                            encrypt_length,
+                                                            &key->symkey);
+                if (rc == 0) {
+                    *encrypt_length += hdrsize;
+                } else {
+                    TPM_Free(*encrypt_data);
+                    *encrypt_data = NULL;
+                }
                 break;
             }
         }
@@ -686,35 +1382,76 @@ SWTPM_NVRAM_EncryptData(const encryptionkey *key,
     return rc;
 }
 
+/*
+ * Decrypt the data with the given key into 'decrypt_data', which must be
+ * large enough to hold 'encrypt_length' bytes. 'decrypt_data' may point to
+ * 'encrypt_data' to decrypt in place. The digest of the decrypted data is
+ * returned in 'digest' if it is not NULL.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_DecryptBuffer(const encryptionkey *key,
+                          unsigned char *decrypt_data,
+                          uint32_t *decrypt_length,
+                          const unsigned char *encrypt_data,
+                          uint32_t encrypt_length,
+                          unsigned char *digest)
+{
+    TPM_RESULT rc = 0;
+    uint32_t hashed_length = 0;
+
+    switch (key->data_encmode) {
+    case ENCRYPTION_MODE_UNKNOWN:
+        rc = TPM_BAD_MODE;
+        break;
+    case ENCRYPTION_MODE_AES_CBC:
+        rc = TPM_SymmetricKeyData_DecryptBuffer(decrypt_data,
+                                                &hashed_length,
+                                                encrypt_data,
+                                                encrypt_length,
+                                                &key->symkey);
+        if (rc == TPM_SUCCESS) {
+            rc = SWTPM_CheckHash(decrypt_data, hashed_length,
+                                 decrypt_length, digest);
+        }
+        break;
+    case ENCRYPTION_MODE_AES_256_GCM:
+        rc = TPM_SymmetricKeyData_GCM_DecryptBuffer(decrypt_data,
+                                                    decrypt_length,
+                                                    encrypt_data,
+                                                    encrypt_length,
+                                                    &key->symkey);
+        if (rc == TPM_SUCCESS && digest)
+            rc = SWTPM_Crypto_Digest(decrypt_data, *decrypt_length, digest);
+        break;
+    }
+
+    return rc;
+}
+
+/*
+ * Decrypt the data with the given key into a newly allocated buffer.
+ *
+ * No buffer is returned if the key is not set.
+ */
 static TPM_RESULT 
 SWTPM_NVRAM_DecryptData(const encryptionkey *key,
                         unsigned char **decrypt_data,
                         uint32_t *decrypt_length,
                         const unsigned char *encrypt_data,
-                        uint32_t encrypt_length)
+                        uint32_t encrypt_length,
+                        unsigned char *digest)
 {
     TPM_RESULT rc = 0;
-    unsigned char *hashed_data = NULL;
-    uint32_t hashed_length = 0;
 
-    if (rc == 0) {
-        if (key->symkey.valid) {
-            switch (key->data_encmode) {
-            case ENCRYPTION_MODE_UNKNOWN:
-                rc = TPM_BAD_MODE;
-                break;
-            case ENCRYPTION_MODE_AES_CBC:
-                rc = TPM_SymmetricKeyData_Decrypt(&hashed_data,
-                                                  &hashed_length,
-                                                  encrypt_data,
-                                                  encrypt_length,
-                                                  &key->symkey);
-                if (rc == TPM_SUCCESS) {
-                    rc = SWTPM_CheckHash(hashed_data, hashed_length,
-                                         decrypt_data, decrypt_length);
-                    TPM_Free(hashed_data);
-                }
-                break;
+    if (key->symkey.valid) {
+        rc = TPM_Malloc(decrypt_data, encrypt_length);
+        if (rc == TPM_SUCCESS) {
+            rc = SWTPM_NVRAM_DecryptBuffer(key, *decrypt_data, decrypt_length,
+                                           encrypt_data, encrypt_length,
+                                           digest);
+            if (rc != TPM_SUCCESS) {
+                TPM_Free(*decrypt_data);
+                *decrypt_data = NULL;
             }
         }
     }
@@ -722,88 +1459,356 @@ SWTPM_NVRAM_DecryptData(const encryptionkey *key,
     return rc;
 }
 
-
 /*
- * Prepend a header in front of the state blob
+ * Write the header at the beginning of the state blob
  */
-static TPM_RESULT
-SWTPM_NVRAM_PrependHeader(unsigned char **data, uint32_t *length,
-                          uint16_t flags)
+static void
+SWTPM_NVRAM_WriteHeader(unsigned char *data, uint32_t hdrsize,
+                        uint32_t length, uint16_t flags)
 {
-    unsigned char *out = NULL;
-    uint32_t out_len = sizeof(blobheader) + *length;
     blobheader bh = {
         .version = BLOB_HEADER_VERSION,
-        .min_version = BLOB_HEADER_VERSION,
-        .hdrsize = htons(sizeof(bh)),
+        .min_version = (flags & BLOB_FLAGS_VERSION_4) ? 4 :
+                       (flags & BLOB_FLAGS_VERSION_3) ? 3 :
+                       (flags & BLOB_FLAGS_VERSION_2) ? 2 : 1,
+        .hdrsize = htons(hdrsize),
         .flags = htons(flags),
-        .totlen = htonl(out_len),
+        .totlen = htonl(length),
     };
-    TPM_RESULT res;
 
-    res = TPM_Malloc(&out, out_len);
-    if (res != TPM_SUCCESS)
-        goto error;
+    memcpy(data, &bh, sizeof(bh));
+}
 
-    memcpy(out, &bh, sizeof(bh));
-    memcpy(&out[sizeof(bh)], *data, *length);
+/*
+ * Map between the compression algorithms and the blobheader flags
+ */
+static uint16_t
+SWTPM_NVRAM_CompressionFlag(enum swtpm_compression comp)
+{
+    switch (comp) {
+    case SWTPM_COMPRESSION_NONE:
+        break;
+    case SWTPM_COMPRESSION_ZLIB:
+        return BLOB_FLAG_COMPRESSED_ZLIB;
+    case SWTPM_COMPRESSION_ZSTD:
+        return BLOB_FLAG_COMPRESSED_ZSTD;
+    }
+    return 0;
+}
 
-    *data = out;
-    *length = out_len;
+static enum swtpm_compression
+SWTPM_NVRAM_CompressionFromFlags(uint16_t flags)
+{
+    switch (flags & BLOB_FLAGS_COMPRESSED) {
+    case BLOB_FLAG_COMPRESSED_ZLIB:
+        return SWTPM_COMPRESSION_ZLIB;
+    case BLOB_FLAG_COMPRESSED_ZSTD:
+        return SWTPM_COMPRESSION_ZSTD;
+    }
+    return SWTPM_COMPRESSION_NONE;
+}
 
-    return res;
+/*
+ * Compress the data with the compression this build was configured
+ * with; the result is a compression frame: a blobheader and the length of
+ * the uncompressed data followed by the compressed data. The compression
+ * flag is added to 'flags'.
+ *
+ * No buffer is returned if compression is not enabled or if the data do
+ * not become smaller.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_CompressData(unsigned char **out, uint32_t *out_length,
+                         uint16_t *flags,
+                         const unsigned char *data, uint32_t length)
+{
+    enum swtpm_compression comp = SWTPM_Compression_Default();
+    uint32_t hdrsize = sizeof(blobheader) + sizeof(blobcompression);
+    blobcompression bc = {
+        .datalen = htonl(length),
+    };
+    uint16_t flag = SWTPM_NVRAM_CompressionFlag(comp);
+    TPM_RESULT rc;
 
- error:
-    TPM_Free(*data);
-    *data = NULL;
-    *length = 0;
+    *out = NULL;
+    *out_length = 0;
 
-    return res;
+    if (comp == SWTPM_COMPRESSION_NONE)
+        return TPM_SUCCESS;
+
+    rc = SWTPM_Compress(comp, hdrsize, out, out_length, data, length);
+    if (rc == TPM_SIZE)
+        /* store the data uncompressed */
+        return TPM_SUCCESS;
+
+    if (rc == TPM_SUCCESS) {
+        SWTPM_NVRAM_WriteHeader(*out, hdrsize, *out_length,
+                                flag | BLOB_FLAG_COMPRESSION_FRAME);
+        memcpy(&(*out)[sizeof(blobheader)], &bc, sizeof(bc));
+        *flags |= flag;
+    }
+
+    return rc;
 }
 
+/*
+ * Wrap the data into a compression frame; they are compressed if that
+ * makes them smaller
+ */
+static TPM_RESULT
+SWTPM_NVRAM_FrameData(unsigned char **out, uint32_t *out_length,
+                      const unsigned char *data, uint32_t length)
+{
+    uint32_t hdrsize = sizeof(blobheader) + sizeof(blobcompression);
+    blobcompression bc = {
+        .datalen = htonl(length),
+    };
+    uint16_t flags = 0;
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_CompressData(out, out_length, &flags, data, length);
+    if (rc != TPM_SUCCESS || *out)
+        return rc;
+
+    if (length > UINT32_MAX - hdrsize)
+        return TPM_SIZE;
 
+    rc = TPM_Malloc(out, hdrsize + length);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    *out_length = hdrsize + length;
+    SWTPM_NVRAM_WriteHeader(*out, hdrsize, *out_length,
+                            BLOB_FLAG_COMPRESSION_FRAME);
+    memcpy(&(*out)[sizeof(blobheader)], &bc, sizeof(bc));
+    memcpy(&(*out)[hdrsize], data, length);
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * Check whether the data start with a valid compression frame
+ */
+static TPM_BOOL
+SWTPM_NVRAM_IsFramed(const unsigned char *data, uint32_t length)
+{
+    uint32_t hdrsize = sizeof(blobheader) + sizeof(blobcompression);
+    blobheader bh;
+    blobcompression bc;
+    uint16_t flags;
+
+    if (length < hdrsize)
+        return FALSE;
+
+    memcpy(&bh, data, sizeof(bh));
+    memcpy(&bc, &data[sizeof(bh)], sizeof(bc));
+    flags = ntohs(bh.flags);
+
+    if (bh.min_version != 4 || bh.version < bh.min_version ||
+        ntohs(bh.hdrsize) != hdrsize || ntohl(bh.totlen) != length ||
+        (flags & ~BLOB_FLAGS_COMPRESSED) != BLOB_FLAG_COMPRESSION_FRAME ||
+        (flags & BLOB_FLAGS_COMPRESSED) == BLOB_FLAGS_COMPRESSED)
+        return FALSE;
+
+    /* data stored uncompressed are just as long as the frame says */
+    if (!(flags & BLOB_FLAGS_COMPRESSED))
+        return ntohl(bc.datalen) == length - hdrsize;
+
+    return ntohl(bc.datalen) <= BLOB_DATALEN_MAX;
+}
+
+/*
+ * Get the data out of a compression frame into a newly allocated buffer;
+ * they are decompressed if the frame says they are compressed
+ */
 static TPM_RESULT
-SWTPM_NVRAM_CheckHeader(unsigned char *data, uint32_t length,
-                        uint32_t *dataoffset, uint16_t *hdrflags)
+SWTPM_NVRAM_DecompressData(unsigned char **out, uint32_t *out_length,
+                           const unsigned char *data, uint32_t length)
 {
-    blobheader *bh = (blobheader *)data;
+    uint32_t hdrsize = sizeof(blobheader) + sizeof(blobcompression);
+    blobheader bh;
+    blobcompression bc;
+    TPM_RESULT rc;
 
-    if (length < sizeof(bh))
-        return TPM_BAD_PARAMETER;
+    *out = NULL;
+    *out_length = 0;
 
-    if (ntohl(bh->totlen) != length)
+    if (!SWTPM_NVRAM_IsFramed(data, length)) {
+        logprintf(STDERR_FILENO,
+                  "The compression frame of the state blob is invalid.\n");
         return TPM_BAD_PARAMETER;
+    }
 
-    if (bh->min_version > BLOB_HEADER_VERSION) {
-        logprintf(STDERR_FILENO, "Minimum required version for the blob is %d, we "
-                  "only support version %d\n", bh->min_version,
-                  BLOB_HEADER_VERSION);
-        return TPM_BAD_VERSION;
+    memcpy(&bh, data, sizeof(bh));
+    memcpy(&bc, &data[sizeof(bh)], sizeof(bc));
+
+    if (!(ntohs(bh.flags) & BLOB_FLAGS_COMPRESSED)) {
+        rc = TPM_Malloc(out, length > hdrsize ? length - hdrsize : 1);
+        if (rc == TPM_SUCCESS) {
+            memcpy(*out, &data[hdrsize], length - hdrsize);
+            *out_length = length - hdrsize;
+        }
+        return rc;
     }
 
-    *dataoffset = ntohs(bh->hdrsize);
-    *hdrflags = ntohs(bh->flags);
+    rc = SWTPM_Decompress(SWTPM_NVRAM_CompressionFromFlags(ntohs(bh.flags)),
+                          out, ntohl(bc.datalen),
+                          &data[hdrsize], length - hdrsize);
+    if (rc == TPM_SUCCESS)
+        *out_length = ntohl(bc.datalen);
 
-    return TPM_SUCCESS;
+    return rc;
 }
 
 /*
- * Get the state blob with the current name; read it from the filesystem.
- * Decrypt it if the caller asks for it and if a key is set. Return
- * whether it's still encrypyted.
+ * SWTPM_NVRAM_GetFraming: find out whether the blobs of the TPM state
+ *                         have compression frames
+ *
+ * With 'create' set, a state that has no permanent state yet is set up
+ * to have compression frames.
  */
-TPM_RESULT SWTPM_NVRAM_GetStateBlob(unsigned char **data,
-                                    uint32_t *length,
-                                    uint32_t tpm_number,
-                                    const char *name,
-                                    TPM_BOOL decrypt,
-                                    TPM_BOOL *is_encrypted)
+static TPM_RESULT
+SWTPM_NVRAM_GetFraming(uint32_t tpm_number, TPM_BOOL create,
+                       TPM_BOOL *framed)
 {
-    TPM_RESULT res;
+    static const char *state_names[] = {
+        TPM_PERMANENT_ALL_NAME,
+        TPM_VOLATILESTATE_NAME,
+        TPM_SAVESTATE_NAME,
+    };
+    unsigned char hdr[sizeof(blobheader)];
+    unsigned char *data = NULL;
+    uint32_t length = 0;
+    blobheader bh;
+    TPM_RESULT rc;
+    size_t i;
+
+    if (framing != NVRAM_FRAMING_UNKNOWN &&
+        framing_tpm_number == tpm_number) {
+        *framed = (framing == NVRAM_FRAMING_COMPRESSION);
+        return TPM_SUCCESS;
+    }
+
+    *framed = FALSE;
+
+    rc = backend_ops->load(&data, &length, tpm_number,
+                           NVRAM_COMPRESSION_NAME);
+    if (rc == TPM_SUCCESS) {
+        memcpy(&bh, data, length < sizeof(bh) ? length : sizeof(bh));
+        if (length != sizeof(bh) || bh.min_version != 4 ||
+            ntohl(bh.totlen) != sizeof(bh) ||
+            !(ntohs(bh.flags) & BLOB_FLAG_COMPRESSION_FRAME)) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_GetFraming: Error (fatal) the "
+                      "compression blob is corrupted.\n");
+            rc = TPM_FAIL;
+        }
+        *framed = (rc == TPM_SUCCESS);
+    } else if (rc == TPM_RETRY) {
+        /* a state that exists keeps its blobs as they are */
+        for (i = 0;
+             rc == TPM_RETRY && i < sizeof(state_names) / sizeof(state_names[0]);
+             i++)
+            rc = backend_ops->load(&data, &length, tpm_number,
+                                   state_names[i]);
+        if (rc == TPM_SUCCESS) {
+            framing = NVRAM_FRAMING_NONE;
+            framing_tpm_number = tpm_number;
+        } else if (rc == TPM_RETRY) {
+            rc = TPM_SUCCESS;
+            if (create) {
+                SWTPM_NVRAM_WriteHeader(hdr, sizeof(hdr), sizeof(hdr),
+                                        BLOB_FLAG_COMPRESSION_FRAME);
+                rc = backend_ops->store(hdr, sizeof(hdr), tpm_number,
+                                        NVRAM_COMPRESSION_NAME);
+                *framed = (rc == TPM_SUCCESS);
+            }
+        }
+    }
+    TPM_Free(data);
+
+    if (*framed) {
+        framing = NVRAM_FRAMING_COMPRESSION;
+        framing_tpm_number = tpm_number;
+    }
+
+    return rc;
+}
+
+/*
+ * Build the nonce for chunk 'idx' of a chunked blob
+ */
+static void
+SWTPM_NVRAM_ChunkNonce(unsigned char *nonce, const blobchunkindex *index,
+                       uint32_t idx, TPM_BOOL last)
+{
+    uint32_t n = htonl(idx);
+
+    memcpy(nonce, index->nonce, BLOB_CHUNK_NONCE_PREFIX_SIZE);
+    memcpy(&nonce[BLOB_CHUNK_NONCE_PREFIX_SIZE], &n, sizeof(n));
+    nonce[BLOB_CHUNK_NONCE_PREFIX_SIZE + sizeof(n)] = last;
+}
+
+/*
+ * The number of chunks needed for 'datalen' bytes; there is always at
+ * least one chunk so that an empty blob is authenticated as well.
+ */
+static uint64_t
+SWTPM_NVRAM_NumChunks(uint32_t datalen, uint32_t chunksize)
+{
+    if (datalen == 0)
+        return 1;
+    return ((uint64_t)datalen + chunksize - 1) / chunksize;
+}
+
+/*
+ * Release the stored blob a reader was created from
+ */
+static void
+SWTPM_NVRAM_StateBlobReader_ReleaseSource(struct stateblob_reader *r)
+{
+    if (r->src_mapped)
+        backend_ops->unmap(r->src, r->src_length);
+    else
+        TPM_Free((unsigned char *)r->src);
+    r->src = NULL;
+    r->src_length = 0;
+    r->src_mapped = FALSE;
+}
+
+/*
+ * Create a reader for the state blob with the given name.
+ *
+ * The blob is exported in the same format as SWTPM_NVRAM_GetStateBlob()
+ * returns it, but the caller reads it piece by piece. If the stored blob
+ * does not need to be decrypted and the backend supports it, the blob is
+ * read from a mapping of the stored blob; if a migration key for AES-GCM
+ * is set, the blob is encrypted one chunk at a time when it is read.
+ * Only a migration key for AES-CBC requires the whole exported blob to be
+ * created up front.
+ *
+ * 'totlength' returns the total number of bytes of the exported blob.
+ */
+TPM_RESULT
+SWTPM_NVRAM_StateBlobReader_Open(struct stateblob_reader **reader,
+                                 uint32_t tpm_number,
+                                 const char *name,
+                                 TPM_BOOL decrypt,
+                                 TPM_BOOL *is_encrypted,
+                                 uint32_t *totlength)
+{
+    struct stateblob_reader *r = NULL;
+    unsigned char *data = NULL;
+    uint32_t length = 0;
     uint16_t flags = 0;
+    TPM_BOOL as_stored, framed = FALSE;
+    uint64_t outlen = 0;
+    blobchunkindex index;
+    TPM_RESULT res;
+
+    *reader = NULL;
+    *totlength = 0;
 
-    res = SWTPM_NVRAM_LoadData_Intern(data, length, tpm_number, name,
-                                      decrypt);
     if (decrypt) {
         /* we asked for a decrypted blob, so it cannot be encrypted */
         *is_encrypted = FALSE;
@@ -815,65 +1820,527 @@ TPM_RESULT SWTPM_NVRAM_GetStateBlob(unsigned char **data,
         *is_encrypted = filekey.symkey.valid;
     }
 
-    if (res == TPM_SUCCESS && migrationkey.symkey.valid) {
+    if (*is_encrypted) {
+        flags |= BLOB_FLAG_ENCRYPTED;
+        if (filekey.data_encmode == ENCRYPTION_MODE_AES_256_GCM)
+            flags |= BLOB_FLAG_ENCRYPTED_AES_GCM;
+    }
+
+    res = TPM_Malloc((unsigned char **)&r, sizeof(*r));
+    if (res != TPM_SUCCESS)
+        return res;
+    memset(r, 0, sizeof(*r));
+
+    if (!(decrypt && filekey.symkey.valid) && backend_ops->map) {
+        /* the blob is exported as stored; read it from the mapping */
+        res = backend_ops->map(&r->src, &r->src_length, tpm_number, name);
+        r->src_mapped = (res == TPM_SUCCESS);
+    } else {
+        res = SWTPM_NVRAM_LoadData_Intern(&data, &length, tpm_number, name,
+                                          decrypt);
+        r->src = data;
+        r->src_length = length;
+    }
+
+    /* only SWTPM_NVRAM_LoadData_Intern() takes the blob out of its frame */
+    as_stored = r->src_mapped || !decrypt;
+    if (res == TPM_SUCCESS && as_stored)
+        res = SWTPM_NVRAM_GetFraming(tpm_number, FALSE, &framed);
+
+    /* the frame of an encrypted blob stays with it */
+    if (res == TPM_SUCCESS && *is_encrypted && as_stored && framed)
+        flags |= BLOB_FLAG_COMPRESSION_FRAME;
+
+    if (res == TPM_SUCCESS && !*is_encrypted) {
         /*
-         * we have to encrypt it now with the migration key
+         * Unencrypted data may still be compressed as stored, so get the
+         * plain data and then compress them for the transfer; data
+         * encrypted with the file key do not compress.
          */
-        unsigned char *out = NULL;
-        uint32_t out_len = 0;
+        if (as_stored && framed) {
+            res = SWTPM_NVRAM_DecompressData(&data, &length,
+                                             r->src, r->src_length);
+            SWTPM_NVRAM_StateBlobReader_ReleaseSource(r);
+            r->src = data;
+            r->src_length = length;
+        }
+        if (res == TPM_SUCCESS) {
+            res = SWTPM_NVRAM_CompressData(&data, &length, &flags,
+                                           r->src, r->src_length);
+            if (res == TPM_SUCCESS && data) {
+                SWTPM_NVRAM_StateBlobReader_ReleaseSource(r);
+                r->src = data;
+                r->src_length = length;
+            }
+        }
+    }
 
+    r->encoding = STATEBLOB_PLAIN;
+    if (res == TPM_SUCCESS && migrationkey.symkey.valid) {
         flags |= BLOB_FLAG_MIGRATION_ENCRYPTED;
-
-        res = SWTPM_NVRAM_EncryptData(&migrationkey, &out, &out_len,
-                                      *data, *length);
-        TPM_Free(*data);
-        if (res == TPM_SUCCESS) {
-            *data = out;
-            *length = out_len;
+        if (migrationkey.data_encmode == ENCRYPTION_MODE_AES_256_GCM) {
+            flags |= BLOB_FLAG_MIGRATION_AES_GCM | BLOB_FLAG_MIGRATION_CHUNKED;
+            r->encoding = STATEBLOB_CHUNKED;
         } else {
-            *data = NULL;
-            *length = 0;
+            r->encoding = STATEBLOB_WHOLE;
         }
     }
 
     if (res == TPM_SUCCESS) {
+        switch (r->encoding) {
+        case STATEBLOB_PLAIN:
+            r->hdr_length = sizeof(blobheader);
+            outlen = (uint64_t)r->hdr_length + r->src_length;
+            break;
+        case STATEBLOB_CHUNKED:
+            r->hdr_length = sizeof(blobheader) + sizeof(blobchunkindex);
+            r->chunksize = BLOB_CHUNK_SIZE;
+            r->numchunks = SWTPM_NVRAM_NumChunks(r->src_length, r->chunksize);
+            outlen = (uint64_t)r->hdr_length + r->src_length +
+                     (uint64_t)r->numchunks * TPM_AES_GCM_TAG_SIZE;
+
+            memset(&index, 0, sizeof(index));
+            index.chunksize = htonl(r->chunksize);
+            index.numchunks = htonl(r->numchunks);
+            index.datalen = htonl(r->src_length);
+            res = SWTPM_Crypto_GetRandom(index.nonce, sizeof(index.nonce));
+            if (res == TPM_SUCCESS) {
+                memcpy(&r->hdr[sizeof(blobheader)], &index, sizeof(index));
+                r->chunk = malloc(r->chunksize + TPM_AES_GCM_TAG_SIZE);
+                if (!r->chunk)
+                    res = TPM_SIZE;
+            }
+            break;
+        case STATEBLOB_WHOLE:
+            /* the encrypted blob leaves room for the header in front */
+            res = SWTPM_NVRAM_EncryptData(&migrationkey, sizeof(blobheader),
+                                          &r->whole, &length,
+                                          r->src, r->src_length, NULL);
+            outlen = length;
+            SWTPM_NVRAM_StateBlobReader_ReleaseSource(r);
+            break;
+        }
+    }
+
+    if (res == TPM_SUCCESS && outlen > UINT32_MAX)
+        res = TPM_SIZE;
+
+    if (res == TPM_SUCCESS) {
+        r->totlength = outlen;
         /* put the header in clear text */
-        if (*is_encrypted)
-            flags |= BLOB_FLAG_ENCRYPTED;
+        SWTPM_NVRAM_WriteHeader(r->whole ? r->whole : r->hdr,
+                                r->whole ? sizeof(blobheader) : r->hdr_length,
+                                r->totlength, flags);
+        *totlength = r->totlength;
+        *reader = r;
+    } else {
+        SWTPM_NVRAM_StateBlobReader_Close(r);
+    }
+
+    return res;
+}
+
+/*
+ * Encrypt chunk 'idx' of the blob unless it is the one encrypted last
+ */
+static TPM_RESULT
+SWTPM_NVRAM_StateBlobReader_Chunk(struct stateblob_reader *r, uint32_t idx)
+{
+    unsigned char nonce[TPM_AES_GCM_NONCE_SIZE];
+    uint32_t start = idx * r->chunksize;
+    uint32_t length;
+    TPM_RESULT res;
+
+    if (r->chunk_length && r->chunk_idx == idx)
+        return TPM_SUCCESS;
+
+    length = r->src_length - start;
+    if (length > r->chunksize)
+        length = r->chunksize;
 
-        res = SWTPM_NVRAM_PrependHeader(data, length, flags);
+    SWTPM_NVRAM_ChunkNonce(nonce,
+                           (const blobchunkindex *)&r->hdr[sizeof(blobheader)],
+                           idx, idx == r->numchunks - 1);
+
+    r->chunk_length = 0;
+    /* an empty blob has no source but still gets a chunk with a tag */
+    res = TPM_SymmetricKeyData_GCM_Crypt(r->chunk,
+                                         r->src ? &r->src[start] : r->chunk,
+                                         length, nonce,
+                                         &migrationkey.symkey, TRUE);
+    if (res == TPM_SUCCESS) {
+        r->chunk_idx = idx;
+        r->chunk_length = length + TPM_AES_GCM_TAG_SIZE;
     }
 
     return res;
 }
 
 /*
- * Set the state blob with the given name; the caller tells us if
- * the blob is encrypted; if it is encrypted, it will be written
- * into the file as-is, otherwise it will be encrypted if a key is set.
+ * Read up to 'bufsize' bytes of the exported blob starting at 'offset';
+ * 'nread' returns the number of bytes read, which is less than 'bufsize'
+ * only at the end of the blob.
  */
-TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
-                                    uint32_t length,
-                                    TPM_BOOL is_encrypted,
+TPM_RESULT
+SWTPM_NVRAM_StateBlobReader_Read(struct stateblob_reader *r,
+                                 uint32_t offset,
+                                 unsigned char *buffer,
+                                 uint32_t bufsize,
+                                 uint32_t *nread)
+{
+    TPM_RESULT res = TPM_SUCCESS;
+    uint32_t stride = r->chunksize + TPM_AES_GCM_TAG_SIZE;
+    uint32_t n, pos;
+
+    *nread = 0;
+
+    while (res == TPM_SUCCESS && bufsize > 0 && offset < r->totlength) {
+        n = r->totlength - offset;
+        if (r->whole) {
+            if (n > bufsize)
+                n = bufsize;
+            memcpy(buffer, &r->whole[offset], n);
+        } else if (offset < r->hdr_length) {
+            n = r->hdr_length - offset;
+            if (n > bufsize)
+                n = bufsize;
+            memcpy(buffer, &r->hdr[offset], n);
+        } else if (r->encoding == STATEBLOB_PLAIN) {
+            if (n > bufsize)
+                n = bufsize;
+            memcpy(buffer, &r->src[offset - r->hdr_length], n);
+        } else {
+            pos = offset - r->hdr_length;
+            res = SWTPM_NVRAM_StateBlobReader_Chunk(r, pos / stride);
+            if (res != TPM_SUCCESS)
+                break;
+            pos %= stride;
+            n = r->chunk_length - pos;
+            if (n > bufsize)
+                n = bufsize;
+            memcpy(buffer, &r->chunk[pos], n);
+        }
+        buffer += n;
+        bufsize -= n;
+        offset += n;
+        *nread += n;
+    }
+
+    return res;
+}
+
+void
+SWTPM_NVRAM_StateBlobReader_Close(struct stateblob_reader *r)
+{
+    if (!r)
+        return;
+
+    SWTPM_NVRAM_StateBlobReader_ReleaseSource(r);
+    TPM_Free(r->whole);
+    free(r->chunk);
+    TPM_Free((unsigned char *)r);
+}
+
+/*
+ * Get the state blob with the current name; read it from the filesystem.
+ * Decrypt it if the caller asks for it and if a key is set. Return
+ * whether it's still encrypyted.
+ */
+TPM_RESULT SWTPM_NVRAM_GetStateBlob(unsigned char **data,
+                                    uint32_t *length,
                                     uint32_t tpm_number,
-                                    const char *name)
+                                    const char *name,
+                                    TPM_BOOL decrypt,
+                                    TPM_BOOL *is_encrypted)
 {
-    TPM_BOOL encrypt = !is_encrypted;
+    struct stateblob_reader *reader;
+    uint32_t nread;
     TPM_RESULT res;
-    uint32_t dataoffset;
+
+    *data = NULL;
+
+    res = SWTPM_NVRAM_StateBlobReader_Open(&reader, tpm_number, name,
+                                           decrypt, is_encrypted, length);
+    if (res != TPM_SUCCESS) {
+        *length = 0;
+        return res;
+    }
+
+    res = TPM_Malloc(data, *length);
+    if (res == TPM_SUCCESS)
+        res = SWTPM_NVRAM_StateBlobReader_Read(reader, 0, *data, *length,
+                                               &nread);
+    if (res != TPM_SUCCESS) {
+        TPM_Free(*data);
+        *data = NULL;
+        *length = 0;
+    }
+
+    SWTPM_NVRAM_StateBlobReader_Close(reader);
+
+    return res;
+}
+
+/*
+ * Create a writer for the state blob with the given name; the caller
+ * tells us if the blob is encrypted; if it is encrypted, it will be
+ * written into the file as-is, otherwise it will be encrypted if a key
+ * is set.
+ *
+ * The blob is passed to SWTPM_NVRAM_StateBlobWriter_Write() piece by
+ * piece. The buffer for the data is allocated once the blobheader is
+ * received and chunks encrypted with the migration key are decrypted into
+ * it as soon as they are complete. The backends store whole blobs, so the
+ * decrypted blob is assembled in memory; only the ciphertext is not held
+ * a second time.
+ *
+ * 'name' must remain valid until the writer is closed.
+ */
+TPM_RESULT
+SWTPM_NVRAM_StateBlobWriter_Open(struct stateblob_writer **writer,
+                                 uint32_t tpm_number,
+                                 const char *name,
+                                 TPM_BOOL is_encrypted)
+{
+    struct stateblob_writer *w = NULL;
+    TPM_RESULT res;
+
+    *writer = NULL;
+
+    res = TPM_Malloc((unsigned char **)&w, sizeof(*w));
+    if (res != TPM_SUCCESS)
+        return res;
+    memset(w, 0, sizeof(*w));
+
+    w->tpm_number = tpm_number;
+    w->name = name;
+    w->is_encrypted = is_encrypted;
+    w->hdr_length = sizeof(blobheader);
+
+    *writer = w;
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * Check the blobheader once it has been received
+ */
+static TPM_RESULT
+SWTPM_NVRAM_StateBlobWriter_Header(struct stateblob_writer *w)
+{
+    blobheader bh;
+    TPM_RESULT res = TPM_SUCCESS;
+
+    memcpy(&bh, w->hdr, sizeof(bh));
+
+    if (bh.min_version > BLOB_HEADER_VERSION) {
+        logprintf(STDERR_FILENO, "Minimum required version for the blob is %d, we "
+                  "only support version %d\n", bh.min_version,
+                  BLOB_HEADER_VERSION);
+        return TPM_BAD_VERSION;
+    }
+
+    w->hdrsize = ntohs(bh.hdrsize);
+    w->totlength = ntohl(bh.totlen);
+    w->flags = ntohs(bh.flags);
+
+    if (w->hdrsize < sizeof(bh) || w->totlength < w->hdrsize)
+        return TPM_BAD_PARAMETER;
+
+    /* encrypted data must have been encrypted using the mode of our key */
+    if (w->is_encrypted && filekey.symkey.valid &&
+        !(w->flags & BLOB_FLAG_ENCRYPTED_AES_GCM) !=
+        !(filekey.data_encmode == ENCRYPTION_MODE_AES_256_GCM)) {
+        logprintf(STDERR_FILENO, "The state blob was encrypted with a "
+                  "different encryption mode than the one of the key.\n");
+        return TPM_BAD_MODE;
+    }
+    if ((w->flags & BLOB_FLAG_MIGRATION_ENCRYPTED) &&
+        migrationkey.symkey.valid &&
+        !(w->flags & BLOB_FLAG_MIGRATION_AES_GCM) !=
+        !(migrationkey.data_encmode == ENCRYPTION_MODE_AES_256_GCM)) {
+        logprintf(STDERR_FILENO, "The state blob was encrypted with a "
+                  "different encryption mode than the one of the migration "
+                  "key.\n");
+        return TPM_BAD_MODE;
+    }
+
+    if (w->flags & BLOB_FLAG_MIGRATION_CHUNKED) {
+        /* chunked blobs can only be read with the migration key */
+        if (!migrationkey.symkey.valid) {
+            logprintf(STDERR_FILENO, "The state blob was encrypted with a "
+                      "migration key but no migration key is set.\n");
+            return TPM_BAD_MODE;
+        }
+        w->hdr_length = sizeof(blobheader) + sizeof(blobchunkindex);
+        if (w->hdrsize < w->hdr_length)
+            return TPM_BAD_PARAMETER;
+    } else {
+        w->data_length = w->totlength - w->hdrsize;
+        res = TPM_Malloc(&w->data, w->data_length ? w->data_length : 1);
+    }
+
+    return res;
+}
+
+/*
+ * Check the chunk index once it has been received
+ */
+static TPM_RESULT
+SWTPM_NVRAM_StateBlobWriter_Index(struct stateblob_writer *w)
+{
+    blobchunkindex index;
+    TPM_RESULT res;
+
+    memcpy(&index, &w->hdr[sizeof(blobheader)], sizeof(index));
+
+    w->chunksize = ntohl(index.chunksize);
+    w->numchunks = ntohl(index.numchunks);
+    w->data_length = ntohl(index.datalen);
+
+    if (w->chunksize == 0 || w->chunksize > BLOB_CHUNK_SIZE_MAX ||
+        w->numchunks != SWTPM_NVRAM_NumChunks(w->data_length, w->chunksize) ||
+        w->totlength != (uint64_t)w->hdrsize + w->data_length +
+                        (uint64_t)w->numchunks * TPM_AES_GCM_TAG_SIZE) {
+        logprintf(STDERR_FILENO, "The chunk index of the state blob is "
+                  "invalid.\n");
+        return TPM_BAD_PARAMETER;
+    }
+
+    res = TPM_Malloc(&w->data, w->data_length ? w->data_length : 1);
+    if (res == TPM_SUCCESS) {
+        /* chunks may be larger than TPM_Malloc() allows */
+        w->chunk = malloc(w->chunksize + TPM_AES_GCM_TAG_SIZE);
+        if (!w->chunk)
+            res = TPM_SIZE;
+    }
+
+    return res;
+}
+
+/*
+ * Append received bytes to the current chunk and decrypt it once it is
+ * complete; returns the number of bytes consumed in 'consumed'
+ */
+static TPM_RESULT
+SWTPM_NVRAM_StateBlobWriter_Chunk(struct stateblob_writer *w,
+                                  const unsigned char *data,
+                                  uint32_t length,
+                                  uint32_t *consumed)
+{
+    unsigned char nonce[TPM_AES_GCM_NONCE_SIZE];
+    uint32_t start = w->chunk_idx * w->chunksize;
+    uint32_t datalen, chunklen;
+    TPM_RESULT res = TPM_SUCCESS;
+
+    datalen = w->data_length - start;
+    if (datalen > w->chunksize)
+        datalen = w->chunksize;
+    chunklen = datalen + TPM_AES_GCM_TAG_SIZE;
+
+    *consumed = chunklen - w->chunk_have;
+    if (*consumed > length)
+        *consumed = length;
+
+    memcpy(&w->chunk[w->chunk_have], data, *consumed);
+    w->chunk_have += *consumed;
+
+    if (w->chunk_have == chunklen) {
+        SWTPM_NVRAM_ChunkNonce(nonce,
+                          (const blobchunkindex *)&w->hdr[sizeof(blobheader)],
+                          w->chunk_idx, w->chunk_idx == w->numchunks - 1);
+        res = TPM_SymmetricKeyData_GCM_Crypt(&w->data[start], w->chunk,
+                                             datalen, nonce,
+                                             &migrationkey.symkey, FALSE);
+        if (res != TPM_SUCCESS)
+            logprintf(STDERR_FILENO, "Chunk %u of the state blob could not "
+                      "be authenticated.\n", w->chunk_idx);
+        w->chunk_idx++;
+        w->chunk_have = 0;
+    }
+
+    return res;
+}
+
+/*
+ * Pass the next 'length' bytes of the state blob to the writer
+ */
+TPM_RESULT
+SWTPM_NVRAM_StateBlobWriter_Write(struct stateblob_writer *w,
+                                  const unsigned char *data,
+                                  uint32_t length)
+{
+    uint32_t n;
+
+    if (w->res != TPM_SUCCESS)
+        return w->res;
+
+    if (w->totlength && length > w->totlength - w->received) {
+        w->res = TPM_BAD_PARAMETER;
+        return w->res;
+    }
+
+    while (w->res == TPM_SUCCESS && length > 0) {
+        if (w->received < w->hdr_length) {
+            n = w->hdr_length - w->received;
+            if (n > length)
+                n = length;
+            memcpy(&w->hdr[w->received], data, n);
+            w->received += n;
+            if (w->received == sizeof(blobheader)) {
+                w->res = SWTPM_NVRAM_StateBlobWriter_Header(w);
+                if (w->res == TPM_SUCCESS &&
+                    length - n > w->totlength - w->received)
+                    w->res = TPM_BAD_PARAMETER;
+            } else if (w->received == w->hdr_length) {
+                w->res = SWTPM_NVRAM_StateBlobWriter_Index(w);
+            }
+        } else if (w->received < w->hdrsize) {
+            /* skip parts of the header we do not know about */
+            n = w->hdrsize - w->received;
+            if (n > length)
+                n = length;
+            w->received += n;
+        } else if (w->chunk) {
+            w->res = SWTPM_NVRAM_StateBlobWriter_Chunk(w, data, length, &n);
+            w->received += n;
+        } else {
+            n = length;
+            memcpy(&w->data[w->received - w->hdrsize], data, n);
+            w->received += n;
+        }
+        data += n;
+        length -= n;
+    }
+
+    return w->res;
+}
+
+/*
+ * Store the received state blob
+ */
+static TPM_RESULT
+SWTPM_NVRAM_StateBlobWriter_Commit(struct stateblob_writer *w)
+{
+    TPM_BOOL encrypt = !w->is_encrypted;
     unsigned char *plain = NULL;
     uint32_t plain_len = 0;
-    uint16_t hdrflags;
+    unsigned char *unpacked = NULL;
+    uint32_t unpacked_len = 0;
+    const unsigned char *data = w->data;
+    uint32_t length = w->data_length;
+    TPM_BOOL framed = FALSE;
+    TPM_BOOL has_frame = (w->flags & BLOB_FLAG_COMPRESSION_FRAME) != 0;
+    TPM_RESULT res = TPM_SUCCESS;
 
-    if (length == 0) {
+    if (w->received == 0) {
         /* with 0 bytes length we delete any existing file */
-        SWTPM_NVRAM_DeleteName(tpm_number, name, FALSE);
+        SWTPM_NVRAM_DeleteName(w->tpm_number, w->name, FALSE);
         return TPM_SUCCESS;
     }
 
-    res = SWTPM_NVRAM_CheckHeader(data, length, &dataoffset, &hdrflags);
-    if (res != TPM_SUCCESS)
-        return res;
+    if (w->totlength == 0 || w->received != w->totlength)
+        return TPM_BAD_PARAMETER;
 
     /*
      * We allow setting of blobs that were not encrypted before;
@@ -881,23 +2348,93 @@ TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
      * set. This allows to 'upgrade' to encryption. 'Downgrading'
      * will not be possible once a migration key was used.
      */
-    if ((hdrflags & BLOB_FLAG_MIGRATION_ENCRYPTED) && migrationkey.symkey.valid) {
-         /*
-          * we first need to decrypt the data with the migration key
-          */
-         res = SWTPM_NVRAM_DecryptData(&migrationkey,
-                                       &plain, &plain_len,
-                                       &data[dataoffset], length - dataoffset);
-         if (res == TPM_SUCCESS) {
-             res = SWTPM_NVRAM_StoreData_Intern(plain, plain_len,
-                                                tpm_number,
-                                                name,
-                                                encrypt);
-             TPM_Free(plain);
-         }
-         return res;
-    }
-
-    return SWTPM_NVRAM_StoreData_Intern(&data[dataoffset], length - dataoffset,
-                                        tpm_number, name, encrypt);
+    if (!(w->flags & BLOB_FLAG_MIGRATION_CHUNKED) &&
+        (w->flags & BLOB_FLAG_MIGRATION_ENCRYPTED) &&
+        migrationkey.symkey.valid) {
+        /*
+         * we first need to decrypt the data with the migration key
+         */
+        res = SWTPM_NVRAM_DecryptData(&migrationkey,
+                                      &plain, &plain_len,
+                                      data, length,
+                                      NULL);
+        data = plain;
+        length = plain_len;
+    }
+
+    if (res == TPM_SUCCESS && (w->flags & BLOB_FLAGS_COMPRESSED)) {
+        res = SWTPM_NVRAM_DecompressData(&unpacked, &unpacked_len,
+                                         data, length);
+        data = unpacked;
+        length = unpacked_len;
+    }
+
+    /* a blob stored as it is must match the framing of the state */
+    if (res == TPM_SUCCESS && !encrypt) {
+        res = SWTPM_NVRAM_GetFraming(w->tpm_number, has_frame, &framed);
+        if (res == TPM_SUCCESS && framed != has_frame) {
+            logprintf(STDERR_FILENO, "The encrypted state blob %s "
+                      "compression frames but the TPM state %s; it cannot "
+                      "be set as it is.\n",
+                      has_frame ? "has" : "has no",
+                      framed ? "has them" : "has none");
+            res = TPM_BAD_MODE;
+        }
+    }
+
+    if (res == TPM_SUCCESS)
+        res = SWTPM_NVRAM_StoreData_Intern(data, length,
+                                           w->tpm_number, w->name, encrypt);
+
+    TPM_Free(plain);
+    TPM_Free(unpacked);
+
+    return res;
+}
+
+/*
+ * Close the writer; if 'commit' is set, the received blob is stored
+ */
+TPM_RESULT
+SWTPM_NVRAM_StateBlobWriter_Close(struct stateblob_writer *w,
+                                  TPM_BOOL commit)
+{
+    TPM_RESULT res;
+
+    if (!w)
+        return TPM_SUCCESS;
+
+    res = w->res;
+    if (res == TPM_SUCCESS && commit)
+        res = SWTPM_NVRAM_StateBlobWriter_Commit(w);
+
+    TPM_Free(w->data);
+    free(w->chunk);
+    TPM_Free((unsigned char *)w);
+
+    return res;
+}
+
+/*
+ * Set the state blob with the given name; the caller tells us if
+ * the blob is encrypted; if it is encrypted, it will be written
+ * into the file as-is, otherwise it will be encrypted if a key is set.
+ */
+TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
+                                    uint32_t length,
+                                    TPM_BOOL is_encrypted,
+                                    uint32_t tpm_number,
+                                    const char *name)
+{
+    struct stateblob_writer *writer;
+    TPM_RESULT res;
+
+    res = SWTPM_NVRAM_StateBlobWriter_Open(&writer, tpm_number, name,
+                                           is_encrypted);
+    if (res == TPM_SUCCESS) {
+        SWTPM_NVRAM_StateBlobWriter_Write(writer, data, length);
+        res = SWTPM_NVRAM_StateBlobWriter_Close(writer, TRUE);
+    }
+
+    return res;
 }
@@ -42,14 +42,7 @@
 #include <libtpms/tpm_types.h>
 
 #include "key.h"
-
-/* characters in the TPM base file name, 14 for file name, slash, NUL terminator, etc.
-
-   This macro is used once during initialization to ensure that the TPM_PATH environment variable
-   length will not cause the rooted file name to overflow file name buffers.
-*/
-
-#define TPM_FILENAME_MAX 20
+#include "swtpm_nvstore.h"
 
 TPM_RESULT SWTPM_NVRAM_Init(void);
 
@@ -70,6 +63,12 @@ TPM_RESULT SWTPM_NVRAM_DeleteName(uint32_t tpm_number,
                                   TPM_BOOL mustExist);
 TPM_RESULT SWTPM_NVRAM_Store_Volatile(void);
 
+TPM_RESULT SWTPM_NVRAM_Snapshot(const char *dir,
+                                uint32_t tpm_number,
+                                TPM_BOOL *reflinked);
+TPM_RESULT SWTPM_NVRAM_Restore(const char *dir,
+                               uint32_t tpm_number);
+
 TPM_RESULT SWTPM_NVRAM_Set_FileKey(const unsigned char *data,
                                    uint32_t length,
                                    enum encryption_mode mode);
@@ -78,6 +77,41 @@ TPM_RESULT SWTPM_NVRAM_Set_MigrationKey(const unsigned char *data,
                                         uint32_t length,
                                         enum encryption_mode mode);
 
+TPM_RESULT SWTPM_NVRAM_Set_NewFileKey(const unsigned char *data,
+                                      uint32_t length,
+                                      enum encryption_mode mode);
+TPM_RESULT SWTPM_NVRAM_Rekey(uint32_t tpm_number,
+                             const char *name,
+                             TPM_BOOL *rekeyed);
+
+/*
+  Integrity check of the state blobs
+*/
+
+enum nvram_check_result {
+    NVRAM_CHECK_OK = 0,
+    NVRAM_CHECK_MISSING,          /* the blob does not exist */
+    NVRAM_CHECK_UNREADABLE,       /* the blob could not be read */
+    NVRAM_CHECK_BAD_HEADER,       /* the compression header is damaged */
+    NVRAM_CHECK_BAD_LENGTH,       /* the length does not fit the encryption */
+    NVRAM_CHECK_BAD_INTEGRITY,    /* decryption or the digest check failed */
+    NVRAM_CHECK_BAD_COMPRESSION,  /* the data could not be decompressed */
+};
+
+/* marks a TPM state whose blobs are wrapped into compression frames */
+#define NVRAM_COMPRESSION_NAME       "compression"
+
+#define NVRAM_CHECK_FLAG_ENCRYPTED   (1 << 0)
+#define NVRAM_CHECK_FLAG_COMPRESSED  (1 << 1)
+#define NVRAM_CHECK_FLAG_VERIFIED    (1 << 2) /* a digest, tag or checksum
+                                                 covers the data */
+
+enum nvram_check_result SWTPM_NVRAM_CheckName(uint32_t tpm_number,
+                                              const char *name,
+                                              uint32_t *flags,
+                                              uint32_t *length);
+const char *SWTPM_NVRAM_CheckResult_String(enum nvram_check_result res);
+
 TPM_RESULT SWTPM_NVRAM_GetStateBlob(unsigned char **data,
                                     uint32_t *length,
                                     uint32_t tpm_number,
@@ -91,8 +125,43 @@ TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
                                     uint32_t tpm_number,
                                     const char *name);
 
+/*
+  Streaming access to the state blobs
+*/
+
+struct stateblob_reader;
+struct stateblob_writer;
+
+TPM_RESULT SWTPM_NVRAM_StateBlobReader_Open(struct stateblob_reader **reader,
+                                            uint32_t tpm_number,
+                                            const char *name,
+                                            TPM_BOOL decrypt,
+                                            TPM_BOOL *is_encrypted,
+                                            uint32_t *totlength);
+TPM_RESULT SWTPM_NVRAM_StateBlobReader_Read(struct stateblob_reader *reader,
+                                            uint32_t offset,
+                                            unsigned char *buffer,
+                                            uint32_t bufsize,
+                                            uint32_t *nread);
+void SWTPM_NVRAM_StateBlobReader_Close(struct stateblob_reader *reader);
+
+TPM_RESULT SWTPM_NVRAM_StateBlobWriter_Open(struct stateblob_writer **writer,
+                                            uint32_t tpm_number,
+                                            const char *name,
+                                            TPM_BOOL is_encrypted);
+TPM_RESULT SWTPM_NVRAM_StateBlobWriter_Write(struct stateblob_writer *writer,
+                                             const unsigned char *data,
+                                             uint32_t length);
+TPM_RESULT SWTPM_NVRAM_StateBlobWriter_Close(struct stateblob_writer *writer,
+                                             TPM_BOOL commit);
+
 TPM_BOOL SWTPM_NVRAM_Has_FileKey(void);
 TPM_BOOL SWTPM_NVRAM_Has_MigrationKey(void);
 
+TPM_RESULT SWTPM_NVRAM_Set_Backend(enum nvram_backend backend);
+void SWTPM_NVRAM_Set_TPMNumber(uint32_t tpm_number);
+TPM_BOOL SWTPM_NVRAM_Is_Ephemeral(void);
+TPM_RESULT SWTPM_NVRAM_Shutdown(void);
+
 #endif /* _SWTPM_NVFILE_H */
 
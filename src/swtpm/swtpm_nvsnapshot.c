@@ -0,0 +1,350 @@
+/*
+ * swtpm_nvsnapshot.c -- Point-in-time copies of the TPM state files
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A snapshot is a copy of all files of a TPM instance, i.e., all files in
+ * the state directory whose names start with 'tpm-<nn>.', independent of
+ * which storage backend wrote them. Temporary files are skipped.
+ *
+ * Each file is first cloned with the FICLONE ioctl, which shares the data
+ * blocks on file systems supporting reflinks (btrfs, xfs) and therefore
+ * takes constant time. If that is not supported, copy_file_range() is
+ * used, which lets the kernel copy the data without moving it through
+ * user space, and finally a plain read/write loop.
+ *
+ * Every file is written to a temporary file that is synced and then
+ * renamed into place, so an interrupted snapshot or restore leaves each
+ * file either with its old or its new content.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+# include <linux/fs.h>
+#endif
+
+#include <libtpms/tpm_error.h>
+
+#include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
+#include "logging.h"
+
+#define SNAPSHOT_TMP_SUFFIX ".tmp"
+
+static TPM_BOOL
+snapshot_is_state_file(const char *name, const char *prefix)
+{
+    size_t len = strlen(name);
+
+    if (strncmp(name, prefix, strlen(prefix)))
+        return FALSE;
+    if (strstr(name, SNAPSHOT_TMP_SUFFIX))
+        return FALSE;
+    return len > strlen(prefix);
+}
+
+/*
+ * snapshot_copy_data: copy the content of 'srcfd' to 'dstfd'; 'reflinked'
+ *                     is set if the data blocks are shared
+ */
+static TPM_RESULT
+snapshot_copy_data(int srcfd, int dstfd, off_t size, TPM_BOOL *reflinked)
+{
+    unsigned char buffer[64 * 1024];
+    ssize_t n, w;
+#ifdef HAVE_COPY_FILE_RANGE
+    off_t done = 0;
+#endif
+
+    *reflinked = FALSE;
+
+#ifdef FICLONE
+    if (ioctl(dstfd, FICLONE, srcfd) == 0) {
+        *reflinked = TRUE;
+        return TPM_SUCCESS;
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while (done < size) {
+        n = copy_file_range(srcfd, NULL, dstfd, NULL, size - done, 0);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (done == size)
+        return TPM_SUCCESS;
+    /* continue where copy_file_range() stopped */
+    if (lseek(srcfd, done, SEEK_SET) < 0 || lseek(dstfd, done, SEEK_SET) < 0)
+        return TPM_FAIL;
+#else
+    (void)size;
+#endif
+
+    while (TRUE) {
+        n = read(srcfd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return TPM_FAIL;
+        if (n == 0)
+            break;
+        for (w = 0; w < n; ) {
+            ssize_t r = write(dstfd, &buffer[w], n - w);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0)
+                return TPM_FAIL;
+            w += r;
+        }
+    }
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * snapshot_copy_file: copy the file 'name' from directory 'srcdirfd' to
+ *                     directory 'dstdirfd'
+ */
+static TPM_RESULT
+snapshot_copy_file(int srcdirfd, int dstdirfd, const char *name,
+                   TPM_BOOL *reflinked)
+{
+    char tmp[FILENAME_MAX];
+    struct stat statbuf;
+    int srcfd = -1, dstfd = -1;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    *reflinked = FALSE;
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s" SNAPSHOT_TMP_SUFFIX,
+                         name) >= sizeof(tmp)) {
+        logprintf(STDERR_FILENO,
+                  "Snapshot: Error (fatal), name %s too long\n", name);
+        return TPM_FAIL;
+    }
+
+    srcfd = openat(srcdirfd, name, O_RDONLY | O_CLOEXEC);
+    if (srcfd < 0 || fstat(srcfd, &statbuf) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Snapshot: Error (fatal) opening %s: %s\n",
+                  name, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS) {
+        dstfd = openat(dstdirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       statbuf.st_mode & 0777);
+        if (dstfd < 0) {
+            logprintf(STDERR_FILENO,
+                      "Snapshot: Error (fatal) creating %s: %s\n",
+                      tmp, strerror(errno));
+            rc = TPM_FAIL;
+        }
+    }
+    if (rc == TPM_SUCCESS) {
+        rc = snapshot_copy_data(srcfd, dstfd, statbuf.st_size, reflinked);
+        if (rc != TPM_SUCCESS)
+            logprintf(STDERR_FILENO,
+                      "Snapshot: Error (fatal) copying %s: %s\n",
+                      name, strerror(errno));
+    }
+    if (rc == TPM_SUCCESS && fsync(dstfd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Snapshot: Error (fatal) syncing %s: %s\n",
+                  tmp, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (dstfd >= 0 && close(dstfd) < 0 && rc == TPM_SUCCESS)
+        rc = TPM_FAIL;
+    if (srcfd >= 0)
+        close(srcfd);
+    if (rc == TPM_SUCCESS && renameat(dstdirfd, tmp, dstdirfd, name) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Snapshot: Error (fatal) renaming %s: %s\n",
+                  tmp, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc != TPM_SUCCESS && dstfd >= 0)
+        unlinkat(dstdirfd, tmp, 0);
+
+    return rc;
+}
+
+/*
+ * snapshot_opendir: open the directory 'dirfd' for reading its entries
+ *                   without affecting other users of 'dirfd'
+ */
+static DIR *
+snapshot_opendir(int dirfd)
+{
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir;
+
+    if (fd < 0)
+        return NULL;
+    dir = fdopendir(fd);
+    if (!dir)
+        close(fd);
+
+    return dir;
+}
+
+/*
+ * snapshot_remove_extra: remove the files of the TPM from 'dstdirfd' that
+ *                        do not exist in 'srcdirfd'
+ */
+static TPM_RESULT
+snapshot_remove_extra(int srcdirfd, int dstdirfd, const char *prefix)
+{
+    struct dirent *de;
+    struct stat statbuf;
+    TPM_RESULT rc = TPM_SUCCESS;
+    DIR *dir;
+
+    dir = snapshot_opendir(dstdirfd);
+    if (!dir)
+        return TPM_SUCCESS;
+
+    while (rc == TPM_SUCCESS && (de = readdir(dir)) != NULL) {
+        if (!snapshot_is_state_file(de->d_name, prefix))
+            continue;
+        if (fstatat(srcdirfd, de->d_name, &statbuf, 0) == 0 ||
+            errno != ENOENT)
+            continue;
+        if (unlinkat(dstdirfd, de->d_name, 0) < 0 && errno != ENOENT) {
+            logprintf(STDERR_FILENO,
+                      "Snapshot: Error (fatal) removing %s: %s\n",
+                      de->d_name, strerror(errno));
+            rc = TPM_FAIL;
+        }
+    }
+    closedir(dir);
+
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_OpenSnapshotDir: open the snapshot directory 'dirname' and
+ *                              optionally create it
+ */
+TPM_RESULT
+SWTPM_NVRAM_OpenSnapshotDir(const char *dirname, TPM_BOOL create, int *fd)
+{
+    if (create && mkdir(dirname, 0750) < 0 && errno != EEXIST) {
+        logprintf(STDERR_FILENO,
+                  "Snapshot: Error (fatal) creating directory %s: %s\n",
+                  dirname, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    *fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (*fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "Snapshot: Error (fatal) opening directory %s: %s\n",
+                  dirname, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * SWTPM_NVRAM_CopyStateFiles: copy all files of the TPM 'tpm_number' from
+ *                             the directory 'srcdirfd' to 'dstdirfd'
+ *
+ * @remove_extra: remove files of the TPM from 'dstdirfd' that do not exist
+ *                in 'srcdirfd'
+ * @reflinked: optional; set to TRUE if all files could be cloned
+ */
+TPM_RESULT
+SWTPM_NVRAM_CopyStateFiles(int srcdirfd, int dstdirfd,
+                           uint32_t tpm_number, TPM_BOOL remove_extra,
+                           TPM_BOOL *reflinked)
+{
+    char prefix[32];
+    struct dirent *de;
+    TPM_BOOL cloned, all_cloned = TRUE;
+    TPM_RESULT rc = TPM_SUCCESS;
+    DIR *dir;
+
+    TPM_DEBUG(" SWTPM_NVRAM_CopyStateFiles: %d -> %d\n", srcdirfd, dstdirfd);
+
+    snprintf(prefix, sizeof(prefix), "tpm-%02lx.",
+             SWTPM_NVRAM_FileNumber(tpm_number));
+
+    dir = snapshot_opendir(srcdirfd);
+    if (!dir) {
+        logprintf(STDERR_FILENO,
+                  "Snapshot: Error (fatal) reading the directory: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+
+    while (rc == TPM_SUCCESS && (de = readdir(dir)) != NULL) {
+        if (!snapshot_is_state_file(de->d_name, prefix))
+            continue;
+        rc = snapshot_copy_file(srcdirfd, dstdirfd, de->d_name, &cloned);
+        if (!cloned)
+            all_cloned = FALSE;
+    }
+    closedir(dir);
+
+    if (rc == TPM_SUCCESS && remove_extra)
+        rc = snapshot_remove_extra(srcdirfd, dstdirfd, prefix);
+    if (rc == TPM_SUCCESS && fsync(dstdirfd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Snapshot: Error (fatal) syncing the directory: %s\n",
+                  strerror(errno));
+        rc = TPM_FAIL;
+    }
+
+    if (reflinked)
+        *reflinked = all_cloned;
+
+    return rc;
+}
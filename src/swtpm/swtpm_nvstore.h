@@ -0,0 +1,158 @@
+/*
+ * swtpm_nvstore.h -- Interface of the NVRAM storage backends
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_NVSTORE_H
+#define _SWTPM_NVSTORE_H
+
+#include <stdio.h>
+
+#include <libtpms/tpm_types.h>
+
+/*
+ * The storage backends only move raw bytes between the NVRAM layer and
+ * the persistent storage; encryption, hashing and the blob headers are
+ * handled by swtpm_nvfile.c.
+ *
+ * A backend may optionally provide map/unmap to give read-only access to
+ * a stored blob without copying it; 'load' is used if they are NULL.
+ *
+ * The optional 'init' is called by SWTPM_NVRAM_Init() once the state
+ * directory is known, for example to recover the state after a crash.
+ */
+/* the backend keeps the blobs in memory and uses no state directory */
+#define NVRAM_BACKEND_FLAG_MEMORY  (1 << 0)
+
+struct nvram_backend_ops {
+    uint32_t flags;
+    TPM_RESULT (*init)(uint32_t tpm_number);
+    TPM_RESULT (*load)(unsigned char **data,
+                       uint32_t *length,
+                       uint32_t tpm_number,
+                       const char *name);
+    TPM_RESULT (*map)(const unsigned char **data,
+                      uint32_t *length,
+                      uint32_t tpm_number,
+                      const char *name);
+    void (*unmap)(const unsigned char *data,
+                  uint32_t length);
+    TPM_RESULT (*store)(const unsigned char *data,
+                        uint32_t length,
+                        uint32_t tpm_number,
+                        const char *name);
+    TPM_RESULT (*delete)(uint32_t tpm_number,
+                         const char *name,
+                         TPM_BOOL mustExist);
+    /* optional: keep the files consistent while they are being copied */
+    void (*suspend)(TPM_BOOL suspend);
+    /* optional: called when the TPM shuts down */
+    TPM_RESULT (*shutdown)(uint32_t tpm_number);
+};
+
+enum nvram_backend {
+    NVRAM_BACKEND_UNKNOWN = 0,
+    NVRAM_BACKEND_DIR = 1,
+    NVRAM_BACKEND_CONTAINER = 2,
+    NVRAM_BACKEND_CAS = 3,
+    NVRAM_BACKEND_JOURNAL = 4,
+    NVRAM_BACKEND_MEMORY = 5,
+};
+
+/* statistics of the journal backend */
+struct swtpm_journal_stats {
+    uint64_t records;          /* records appended */
+    uint64_t bytes_written;    /* bytes appended to the journal */
+    uint64_t replayed;         /* records replayed when loading */
+    uint64_t compactions;      /* number of new base images written */
+    uint64_t base_bytes_written; /* bytes written to base images */
+    uint64_t journal_length;   /* current length of the journal */
+};
+
+/* statistics of the object directory of the cas backend */
+struct swtpm_cas_stats {
+    uint64_t objects;          /* number of objects */
+    uint64_t bytes;            /* bytes used by the objects */
+    uint64_t references;       /* number of references to the objects */
+    uint64_t referenced_bytes; /* bytes the references would use as copies */
+    uint64_t unreferenced;     /* objects without references */
+    uint64_t removed;          /* files removed by the garbage collector */
+    uint64_t removed_bytes;    /* bytes freed by the garbage collector */
+};
+
+extern const struct nvram_backend_ops nvram_dir_ops;
+extern const struct nvram_backend_ops nvram_container_ops;
+extern const struct nvram_backend_ops nvram_cas_ops;
+extern const struct nvram_backend_ops nvram_journal_ops;
+extern const struct nvram_backend_ops nvram_memory_ops;
+
+extern char *state_directory;
+
+enum nvram_backend nvram_backend_from_string(const char *backend);
+const struct nvram_backend_ops *
+SWTPM_NVRAM_GetBackendOps(enum nvram_backend backend);
+
+TPM_RESULT SWTPM_NVRAM_Set_StateDir(const char *dir);
+int SWTPM_NVRAM_GetStateDirFd(void);
+TPM_RESULT SWTPM_NVRAM_SyncStateDir(void);
+unsigned long SWTPM_NVRAM_FileNumber(uint32_t tpm_number);
+TPM_RESULT SWTPM_NVRAM_GetFilenameForName(char *filename,
+                                          size_t bufsize,
+                                          uint32_t tpm_number,
+                                          const char *name);
+
+TPM_RESULT SWTPM_NVRAM_CAS_Set_ObjectDir(const char *dir);
+TPM_RESULT SWTPM_NVRAM_CAS_Clone(const char *srcdir,
+                                 const char *dstdir,
+                                 uint32_t tpm_number);
+TPM_RESULT SWTPM_NVRAM_CAS_Scan(TPM_BOOL collect,
+                                struct swtpm_cas_stats *stats);
+
+TPM_RESULT SWTPM_NVRAM_OpenSnapshotDir(const char *dirname,
+                                       TPM_BOOL create,
+                                       int *fd);
+TPM_RESULT SWTPM_NVRAM_CopyStateFiles(int srcdirfd,
+                                      int dstdirfd,
+                                      uint32_t tpm_number,
+                                      TPM_BOOL remove_extra,
+                                      TPM_BOOL *reflinked);
+
+void SWTPM_NVRAM_Journal_Set_CompactSlack(uint32_t slack);
+void SWTPM_NVRAM_Journal_Get_Stats(struct swtpm_journal_stats *stats);
+
+TPM_RESULT SWTPM_NVRAM_Memory_Set_SeedDir(const char *dir);
+TPM_RESULT SWTPM_NVRAM_Memory_Set_PersistDir(const char *dir);
+TPM_RESULT SWTPM_NVRAM_Memory_Load(const char *dir, uint32_t tpm_number);
+TPM_RESULT SWTPM_NVRAM_Memory_Dump(const char *dir, uint32_t tpm_number);
+
+#endif /* _SWTPM_NVSTORE_H */
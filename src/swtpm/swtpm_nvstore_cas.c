@@ -0,0 +1,936 @@
+/*
+ * swtpm_nvstore_cas.c -- Content-addressed storage backend
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This backend stores each blob once in a content-addressed object
+ * directory that may be shared by many TPM instances, for example by all
+ * VMs of a fleet that were cloned from the same template.
+ *
+ * Layout:
+ *
+ *   objdir/<hh>/<rest of hex digest>     : the objects, named by the
+ *                                          SHA-256 of their content
+ *   state_directory/tpm-<nn>.<name>.ref  : hard link to the object that
+ *                                          holds the blob 'name'
+ *   state_directory/tpm-<nn>.manifest    : lines of '<name> <hex digest>'
+ *
+ * The object directory defaults to state_directory/objects and must be on
+ * the same file system as the state directories referencing it. The files
+ * are accessed relative to the file descriptors of their directories, so
+ * the state directory may be moved while it is in use.
+ *
+ * Reference counting is done by the file system: every .ref file is a
+ * hard link to its object, so the link count of an object minus one is
+ * the number of references to it. Removing an instance's state directory
+ * therefore drops its references and the garbage collector deletes all
+ * objects that are only linked from the object directory. A new instance
+ * is created by reference by linking the .ref files of a template and
+ * copying its manifest.
+ *
+ * Objects are never modified in place. They are written to a temporary
+ * file that is synced and renamed into place, and a .ref file is replaced
+ * by renaming a new link over it. The directory is synced after each
+ * rename, so a crash leaves either the old or the new version of each
+ * file. The manifest is used to verify the content of a blob on load
+ * since a corrupted object affects all instances sharing it.
+ *
+ * A crash between replacing the .ref file and writing the manifest leaves
+ * a .ref file that does not match the manifest. Such a .ref file is still
+ * a link to the object named by the digest of its content, while a
+ * corrupted object does not match its name. On load, a .ref file that is
+ * that object is taken as the result of the interrupted store and the
+ * manifest is updated to it.
+ *
+ * If the file system's link limit is reached for an object, the instance
+ * gets a private copy of the blob instead.
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_crypto.h"
+#include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
+#include "logging.h"
+
+#define CAS_OBJECTS_DEFAULT   "objects"
+#define CAS_MANIFEST_SUFFIX   "manifest"
+#define CAS_REF_SUFFIX        "ref"
+#define CAS_MAX_ENTRIES       16
+#define CAS_NAME_MAX          24
+#define CAS_HEX_SIZE          (2 * SWTPM_CRYPTO_DIGEST_SIZE + 1)
+/* the garbage collector may remove an object between its creation and
+   the link to it; the store is retried in that case */
+#define CAS_STORE_RETRIES     3
+/* temporary files older than this many seconds are left over by crashed
+   writers and removed by the garbage collector */
+#define CAS_TMP_MAX_AGE       600
+
+typedef struct {
+    char name[CAS_NAME_MAX];
+    char digest[CAS_HEX_SIZE];
+} cas_entry;
+
+typedef struct {
+    uint32_t  n_entries;
+    cas_entry entries[CAS_MAX_ENTRIES];
+} cas_manifest;
+
+static char cas_object_dir[FILENAME_MAX];
+
+/*
+ * SWTPM_NVRAM_CAS_Set_ObjectDir: set the object directory; an empty
+ *                                string selects the default
+ */
+TPM_RESULT
+SWTPM_NVRAM_CAS_Set_ObjectDir(const char *dir)
+{
+    if (strlen(dir) >= sizeof(cas_object_dir)) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Object directory path is too long.\n");
+        return TPM_BAD_PARAMETER;
+    }
+    strcpy(cas_object_dir, dir);
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+cas_snprintf(char *buf, size_t bufsize, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static TPM_RESULT
+cas_snprintf(char *buf, size_t bufsize, const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(buf, bufsize, format, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t)n >= bufsize) {
+        logprintf(STDERR_FILENO, "CAS: Error (fatal) path is too long\n");
+        return TPM_FAIL;
+    }
+    return TPM_SUCCESS;
+}
+
+/*
+ * cas_ref_name: get the name of the .ref file of blob 'name'
+ */
+static TPM_RESULT
+cas_ref_name(char *buf, size_t bufsize, uint32_t tpm_number,
+             const char *name)
+{
+    return cas_snprintf(buf, bufsize, "tpm-%02lx.%s.%s",
+                        SWTPM_NVRAM_FileNumber(tpm_number), name,
+                        CAS_REF_SUFFIX);
+}
+
+static TPM_RESULT
+cas_manifest_name(char *buf, size_t bufsize, uint32_t tpm_number)
+{
+    return cas_snprintf(buf, bufsize, "tpm-%02lx.%s",
+                        SWTPM_NVRAM_FileNumber(tpm_number),
+                        CAS_MANIFEST_SUFFIX);
+}
+
+static TPM_RESULT
+cas_tmp_name(char *buf, size_t bufsize, const char *name)
+{
+    return cas_snprintf(buf, bufsize, "%s.tmp.%ld", name, (long)getpid());
+}
+
+/*
+ * cas_sync_dir: make the entries of the directory 'dirfd' durable
+ */
+static TPM_RESULT
+cas_sync_dir(int dirfd)
+{
+    if (fsync(dirfd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) syncing directory: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+    return TPM_SUCCESS;
+}
+
+/*
+ * cas_mkdirat: create the directory 'name' in 'dirfd' unless it exists
+ */
+static int
+cas_mkdirat(int dirfd, const char *name)
+{
+    int fd;
+
+    if (mkdirat(dirfd, name, 0750) < 0) {
+        if (errno == EEXIST)
+            return 0;
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) creating directory %s: %s\n",
+                  name, strerror(errno));
+        return -1;
+    }
+    if (dirfd != AT_FDCWD)
+        return cas_sync_dir(dirfd) == TPM_SUCCESS ? 0 : -1;
+
+    /* sync the parent directory of the path */
+    fd = openat(AT_FDCWD, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        dirfd = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+    }
+    if (fd < 0 || dirfd < 0 || cas_sync_dir(dirfd) != TPM_SUCCESS) {
+        if (dirfd >= 0 && dirfd != AT_FDCWD)
+            close(dirfd);
+        return -1;
+    }
+    close(dirfd);
+
+    return 0;
+}
+
+/*
+ * cas_open_object_dir: open the object directory and optionally create it;
+ *                      the default one is found relative to the state
+ *                      directory
+ *
+ * Returns the file descriptor or -1 with errno set.
+ */
+static int
+cas_open_object_dir(TPM_BOOL create)
+{
+    int dirfd = cas_object_dir[0] ? AT_FDCWD : SWTPM_NVRAM_GetStateDirFd();
+    const char *name = cas_object_dir[0] ? cas_object_dir
+                                         : CAS_OBJECTS_DEFAULT;
+
+    if (create && cas_mkdirat(dirfd, name) < 0)
+        return -1;
+
+    return openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * cas_open_object_subdir: open the subdirectory of the object directory
+ *                         holding the object with the given digest and
+ *                         optionally create the directories leading to it;
+ *                         the object's name in it is &digest[2]
+ *
+ * Returns the file descriptor or -1.
+ */
+static int
+cas_open_object_subdir(const char *digest, TPM_BOOL create)
+{
+    char subdir[3];
+    int objfd, fd = -1;
+
+    snprintf(subdir, sizeof(subdir), "%.2s", digest);
+
+    objfd = cas_open_object_dir(create);
+    if (objfd >= 0 && (!create || cas_mkdirat(objfd, subdir) == 0))
+        fd = openat(objfd, subdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) opening object directory %s: %s\n",
+                  subdir, strerror(errno));
+    if (objfd >= 0)
+        close(objfd);
+
+    return fd;
+}
+
+static TPM_RESULT
+cas_digest_hex(const unsigned char *data, uint32_t length,
+               char digest[CAS_HEX_SIZE])
+{
+    unsigned char md[SWTPM_CRYPTO_DIGEST_SIZE];
+    TPM_RESULT rc;
+    size_t i;
+
+    rc = SWTPM_Crypto_Digest(data, length, md);
+    for (i = 0; rc == TPM_SUCCESS && i < sizeof(md); i++)
+        sprintf(&digest[2 * i], "%02x", md[i]);
+
+    return rc;
+}
+
+/*
+ * cas_read_file: read the whole file 'name' in 'dirfd' into a buffer that
+ *                is NUL-terminated but whose length does not include the NUL
+ *
+ * Returns TPM_RETRY if the file does not exist.
+ */
+static TPM_RESULT
+cas_read_file(int dirfd, const char *name,
+              unsigned char **data, uint32_t *length)
+{
+    TPM_RESULT rc = TPM_SUCCESS;
+    struct stat statbuf;
+    uint32_t offset = 0;
+    ssize_t n;
+    int fd;
+
+    *data = NULL;
+    *length = 0;
+
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return TPM_RETRY;
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) opening %s for read: %s\n",
+                  name, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    if (fstat(fd, &statbuf) < 0 || statbuf.st_size >= (off_t)UINT32_MAX) {
+        logprintf(STDERR_FILENO, "CAS: Error (fatal) stat'ing %s\n", name);
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS) {
+        *length = statbuf.st_size;
+        rc = TPM_Malloc(data, *length + 1);
+    }
+    while (rc == TPM_SUCCESS && offset < *length) {
+        n = pread(fd, &(*data)[offset], *length - offset, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) reading %s\n", name);
+            rc = TPM_FAIL;
+            break;
+        }
+        offset += n;
+    }
+    close(fd);
+
+    if (rc == TPM_SUCCESS) {
+        (*data)[*length] = 0;
+    } else {
+        TPM_Free(*data);
+        *data = NULL;
+        *length = 0;
+    }
+
+    return rc;
+}
+
+/*
+ * cas_write_file: write the data to a temporary file and rename it to
+ *                 'name' in 'dirfd'
+ */
+static TPM_RESULT
+cas_write_file(int dirfd, const char *name,
+               const unsigned char *data, uint32_t length)
+{
+    char tmpname[FILENAME_MAX];
+    TPM_RESULT rc;
+    uint32_t offset = 0;
+    ssize_t n;
+    int fd;
+
+    rc = cas_tmp_name(tmpname, sizeof(tmpname), name);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    fd = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0640);
+    if (fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) opening %s for write: %s\n",
+                  tmpname, strerror(errno));
+        return TPM_FAIL;
+    }
+    while (offset < length) {
+        n = write(fd, &data[offset], length - offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) writing %s: %s\n",
+                      tmpname, strerror(errno));
+            rc = TPM_FAIL;
+            break;
+        }
+        offset += n;
+    }
+    if (rc == TPM_SUCCESS && fsync(fd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) syncing %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (close(fd) < 0 && rc == TPM_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) closing %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS && renameat(dirfd, tmpname, dirfd, name) < 0) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) renaming %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc != TPM_SUCCESS)
+        unlinkat(dirfd, tmpname, 0);
+    else
+        rc = cas_sync_dir(dirfd);
+
+    return rc;
+}
+
+/*
+ * cas_link_file: make 'name' in 'dirfd' a hard link to 'target' in
+ *                'targetfd', replacing 'name' atomically; if the link limit
+ *                of 'target' is reached, 'name' becomes a copy of it
+ *
+ * Returns TPM_RETRY if 'target' does not exist.
+ */
+static TPM_RESULT
+cas_link_file(int targetfd, const char *target, int dirfd, const char *name)
+{
+    char tmpname[FILENAME_MAX];
+    unsigned char *data = NULL;
+    uint32_t length;
+    TPM_RESULT rc;
+
+    rc = cas_tmp_name(tmpname, sizeof(tmpname), name);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    unlinkat(dirfd, tmpname, 0);
+    if (linkat(targetfd, target, dirfd, tmpname, 0) < 0) {
+        if (errno == ENOENT)
+            return TPM_RETRY;
+        if (errno != EMLINK) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) linking %s to %s: %s\n",
+                      name, target, strerror(errno));
+            return TPM_FAIL;
+        }
+        TPM_DEBUG(" CAS: link limit of %s reached; copying it\n", target);
+        rc = cas_read_file(targetfd, target, &data, &length);
+        if (rc == TPM_SUCCESS)
+            rc = cas_write_file(dirfd, name, data, length);
+        TPM_Free(data);
+        return rc;
+    }
+    if (renameat(dirfd, tmpname, dirfd, name) < 0) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) renaming %s: %s\n",
+                  tmpname, strerror(errno));
+        unlinkat(dirfd, tmpname, 0);
+        return TPM_FAIL;
+    }
+
+    return cas_sync_dir(dirfd);
+}
+
+/*
+ * cas_manifest_read: read the manifest of an instance; a missing manifest
+ *                    is an empty one
+ */
+static TPM_RESULT
+cas_manifest_read(cas_manifest *m, int dirfd, uint32_t tpm_number)
+{
+    char path[FILENAME_MAX];
+    unsigned char *data = NULL;
+    uint32_t length;
+    char *line, *saveptr = NULL;
+    TPM_RESULT rc;
+    cas_entry *e;
+
+    m->n_entries = 0;
+
+    rc = cas_manifest_name(path, sizeof(path), tpm_number);
+    if (rc == TPM_SUCCESS)
+        rc = cas_read_file(dirfd, path, &data, &length);
+    if (rc == TPM_RETRY)
+        return TPM_SUCCESS;
+
+    for (line = strtok_r((char *)data, "\n", &saveptr);
+         rc == TPM_SUCCESS && line;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        if (m->n_entries == CAS_MAX_ENTRIES) {
+            rc = TPM_FAIL;
+            break;
+        }
+        e = &m->entries[m->n_entries];
+        if (sscanf(line, "%23s %64s", e->name, e->digest) != 2 ||
+            strlen(e->digest) != CAS_HEX_SIZE - 1) {
+            rc = TPM_FAIL;
+            break;
+        }
+        m->n_entries++;
+    }
+    TPM_Free(data);
+
+    if (rc != TPM_SUCCESS)
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) manifest %s is corrupted\n", path);
+
+    return rc;
+}
+
+static TPM_RESULT
+cas_manifest_write(const cas_manifest *m, int dirfd, uint32_t tpm_number)
+{
+    char path[FILENAME_MAX];
+    char buffer[CAS_MAX_ENTRIES * (CAS_NAME_MAX + CAS_HEX_SIZE + 1)];
+    size_t offset = 0;
+    uint32_t i;
+    TPM_RESULT rc;
+
+    for (i = 0; i < m->n_entries; i++)
+        offset += sprintf(&buffer[offset], "%s %s\n",
+                          m->entries[i].name, m->entries[i].digest);
+
+    rc = cas_manifest_name(path, sizeof(path), tpm_number);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    if (m->n_entries == 0) {
+        if (unlinkat(dirfd, path, 0) < 0 && errno != ENOENT) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) removing %s: %s\n",
+                      path, strerror(errno));
+            rc = TPM_FAIL;
+        }
+        return rc;
+    }
+
+    return cas_write_file(dirfd, path, (unsigned char *)buffer, offset);
+}
+
+static cas_entry *
+cas_manifest_find(cas_manifest *m, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < m->n_entries; i++)
+        if (!strcmp(m->entries[i].name, name))
+            return &m->entries[i];
+    return NULL;
+}
+
+/*
+ * cas_ref_is_object: check whether the .ref file 'path' is a link to the
+ *                    object with the given digest
+ */
+static TPM_BOOL
+cas_ref_is_object(int dirfd, const char *path, const char *digest)
+{
+    char objpath[CAS_HEX_SIZE + 1];
+    struct stat refstat, objstat;
+    TPM_BOOL ret = FALSE;
+    int objfd;
+
+    /* a missing object is not an error here */
+    objfd = cas_open_object_dir(FALSE);
+    if (objfd < 0)
+        return FALSE;
+    snprintf(objpath, sizeof(objpath), "%.2s/%s", digest, &digest[2]);
+
+    if (fstatat(dirfd, path, &refstat, AT_SYMLINK_NOFOLLOW) == 0 &&
+        fstatat(objfd, objpath, &objstat, AT_SYMLINK_NOFOLLOW) == 0 &&
+        refstat.st_dev == objstat.st_dev && refstat.st_ino == objstat.st_ino)
+        ret = TRUE;
+    close(objfd);
+
+    return ret;
+}
+
+/*
+ * cas_manifest_recover: take the .ref file 'path' of blob 'name' with the
+ *                       given digest as the result of a store that was
+ *                       interrupted before it wrote the manifest
+ */
+static TPM_RESULT
+cas_manifest_recover(cas_manifest *m, int dirfd, uint32_t tpm_number,
+                     const char *name, const char *path, const char *digest)
+{
+    cas_entry *e = cas_manifest_find(m, name);
+
+    if (!cas_ref_is_object(dirfd, path, digest)) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) content of %s does not match "
+                  "the manifest\n", path);
+        return TPM_FAIL;
+    }
+    if (!e) {
+        if (m->n_entries == CAS_MAX_ENTRIES) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) too many blobs in manifest\n");
+            return TPM_FAIL;
+        }
+        e = &m->entries[m->n_entries++];
+        strcpy(e->name, name);
+    }
+    logprintf(STDERR_FILENO,
+              "CAS: %s was written by an interrupted store; updating "
+              "the manifest.\n", path);
+    strcpy(e->digest, digest);
+
+    return cas_manifest_write(m, dirfd, tpm_number);
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LoadData_CAS(unsigned char **data,     /* freed by caller */
+                         uint32_t *length,
+                         uint32_t tpm_number,
+                         const char *name)
+{
+    char path[FILENAME_MAX];
+    char digest[CAS_HEX_SIZE];
+    int dirfd = SWTPM_NVRAM_GetStateDirFd();
+    cas_manifest m;
+    cas_entry *e;
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_LoadData_CAS: name %s\n", name);
+
+    rc = cas_ref_name(path, sizeof(path), tpm_number, name);
+    if (rc == TPM_SUCCESS)
+        rc = cas_read_file(dirfd, path, data, length);
+    if (rc == TPM_SUCCESS)
+        rc = cas_manifest_read(&m, dirfd, tpm_number);
+    if (rc == TPM_SUCCESS)
+        rc = cas_digest_hex(*data, *length, digest);
+    if (rc == TPM_SUCCESS) {
+        e = cas_manifest_find(&m, name);
+        if (!e || strcmp(e->digest, digest))
+            rc = cas_manifest_recover(&m, dirfd, tpm_number, name, path,
+                                      digest);
+    }
+    if (rc != TPM_SUCCESS) {
+        TPM_Free(*data);
+        *data = NULL;
+        *length = 0;
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_StoreData_CAS(const unsigned char *data,
+                          uint32_t length,
+                          uint32_t tpm_number,
+                          const char *name)
+{
+    char refpath[FILENAME_MAX];
+    char digest[CAS_HEX_SIZE];
+    const char *objname = &digest[2];
+    int dirfd = SWTPM_NVRAM_GetStateDirFd();
+    int objfd = -1;
+    cas_manifest m;
+    cas_entry *e;
+    unsigned int i;
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_StoreData_CAS: name %s, %u bytes\n",
+              name, length);
+
+    if (strlen(name) >= CAS_NAME_MAX)
+        return TPM_FAIL;
+
+    rc = cas_manifest_read(&m, dirfd, tpm_number);
+    if (rc == TPM_SUCCESS)
+        rc = cas_digest_hex(data, length, digest);
+    if (rc == TPM_SUCCESS) {
+        objfd = cas_open_object_subdir(digest, TRUE);
+        if (objfd < 0)
+            rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS)
+        rc = cas_ref_name(refpath, sizeof(refpath), tpm_number, name);
+
+    /* link to an existing object or create it first */
+    for (i = 0; rc == TPM_SUCCESS; i++) {
+        rc = cas_link_file(objfd, objname, dirfd, refpath);
+        if (rc != TPM_RETRY)
+            break;
+        if (i == CAS_STORE_RETRIES) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) object %s keeps disappearing\n",
+                      digest);
+            rc = TPM_FAIL;
+            break;
+        }
+        rc = cas_write_file(objfd, objname, data, length);
+    }
+    if (objfd >= 0)
+        close(objfd);
+
+    if (rc == TPM_SUCCESS) {
+        e = cas_manifest_find(&m, name);
+        if (!e && m.n_entries < CAS_MAX_ENTRIES) {
+            e = &m.entries[m.n_entries++];
+            strcpy(e->name, name);
+        }
+        if (!e) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) too many blobs in manifest\n");
+            rc = TPM_FAIL;
+        }
+    }
+    if (rc == TPM_SUCCESS) {
+        strcpy(e->digest, digest);
+        rc = cas_manifest_write(&m, dirfd, tpm_number);
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_DeleteName_CAS(uint32_t tpm_number,
+                           const char *name,
+                           TPM_BOOL mustExist)
+{
+    char path[FILENAME_MAX];
+    int dirfd = SWTPM_NVRAM_GetStateDirFd();
+    cas_manifest m;
+    cas_entry *e = NULL;
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_DeleteName_CAS: name %s\n", name);
+
+    rc = cas_manifest_read(&m, dirfd, tpm_number);
+    if (rc == TPM_SUCCESS) {
+        e = cas_manifest_find(&m, name);
+        if (e) {
+            m.n_entries--;
+            memmove(e, e + 1,
+                    (&m.entries[m.n_entries] - e) * sizeof(*e));
+            rc = cas_manifest_write(&m, dirfd, tpm_number);
+        }
+    }
+    if (rc == TPM_SUCCESS)
+        rc = cas_ref_name(path, sizeof(path), tpm_number, name);
+    if (rc == TPM_SUCCESS && unlinkat(dirfd, path, 0) < 0 &&
+        (mustExist || errno != ENOENT)) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_DeleteName_CAS: Error, (fatal) "
+                  "removing %s failed: %s\n", path, strerror(errno));
+        rc = TPM_FAIL;
+    }
+
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_CAS_Clone: create the state of a TPM instance in 'dstdir'
+ *                        by reference to the state in 'srcdir'
+ *
+ * Both directories must be on the same file system as the object
+ * directory. An existing state in 'dstdir' is replaced.
+ */
+TPM_RESULT
+SWTPM_NVRAM_CAS_Clone(const char *srcdir, const char *dstdir,
+                      uint32_t tpm_number)
+{
+    char refname[FILENAME_MAX];
+    int srcfd, dstfd = -1;
+    cas_manifest m;
+    uint32_t i;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    srcfd = open(srcdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (srcfd < 0) {
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) opening %s: %s\n",
+                  srcdir, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    rc = cas_manifest_read(&m, srcfd, tpm_number);
+    if (rc == TPM_SUCCESS && m.n_entries == 0) {
+        logprintf(STDERR_FILENO,
+                  "CAS: No TPM state to clone in %s\n", srcdir);
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS && cas_mkdirat(AT_FDCWD, dstdir) < 0)
+        rc = TPM_FAIL;
+    if (rc == TPM_SUCCESS) {
+        dstfd = open(dstdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dstfd < 0) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) opening %s: %s\n",
+                      dstdir, strerror(errno));
+            rc = TPM_FAIL;
+        }
+    }
+
+    for (i = 0; rc == TPM_SUCCESS && i < m.n_entries; i++) {
+        rc = cas_ref_name(refname, sizeof(refname), tpm_number,
+                          m.entries[i].name);
+        if (rc == TPM_SUCCESS)
+            rc = cas_link_file(srcfd, refname, dstfd, refname);
+        if (rc == TPM_RETRY) {
+            logprintf(STDERR_FILENO,
+                      "CAS: Error (fatal) %s/%s is missing\n",
+                      srcdir, refname);
+            rc = TPM_FAIL;
+        }
+    }
+    /* the manifest is written last so that a partial clone has no state */
+    if (rc == TPM_SUCCESS)
+        rc = cas_manifest_write(&m, dstfd, tpm_number);
+
+    if (dstfd >= 0)
+        close(dstfd);
+    close(srcfd);
+
+    return rc;
+}
+
+static int
+cas_is_digest_name(const char *name)
+{
+    size_t len = strspn(name, "0123456789abcdef");
+
+    return len == CAS_HEX_SIZE - 3 && name[len] == 0;
+}
+
+/*
+ * SWTPM_NVRAM_CAS_Scan: gather statistics about the object directory and
+ *                       optionally collect its garbage
+ *
+ * With 'collect' set, objects without references and stale temporary
+ * files are removed. An object that gets a new reference while it is
+ * being removed stays valid for that reference; its next store simply
+ * creates the object again.
+ */
+TPM_RESULT
+SWTPM_NVRAM_CAS_Scan(TPM_BOOL collect, struct swtpm_cas_stats *stats)
+{
+    DIR *d, *sd;
+    struct dirent *de, *sde;
+    struct stat statbuf;
+    time_t now = time(NULL);
+    int fd;
+
+    memset(stats, 0, sizeof(*stats));
+
+    fd = cas_open_object_dir(FALSE);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return TPM_SUCCESS;
+        logprintf(STDERR_FILENO,
+                  "CAS: Error (fatal) opening the object directory: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+    d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return TPM_FAIL;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        if (strlen(de->d_name) != 2 ||
+            strspn(de->d_name, "0123456789abcdef") != 2)
+            continue;
+        fd = openat(dirfd(d), de->d_name,
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        sd = fdopendir(fd);
+        if (!sd) {
+            close(fd);
+            continue;
+        }
+        while ((sde = readdir(sd)) != NULL) {
+            if (sde->d_name[0] == '.')
+                continue;
+            if (fstatat(fd, sde->d_name, &statbuf,
+                        AT_SYMLINK_NOFOLLOW) < 0 ||
+                !S_ISREG(statbuf.st_mode))
+                continue;
+
+            if (!cas_is_digest_name(sde->d_name)) {
+                /* temporary file of a (crashed) writer */
+                if (collect && now - statbuf.st_mtime > CAS_TMP_MAX_AGE &&
+                    unlinkat(fd, sde->d_name, 0) == 0) {
+                    stats->removed++;
+                    stats->removed_bytes += statbuf.st_size;
+                }
+                continue;
+            }
+            if (statbuf.st_nlink <= 1) {
+                if (collect && unlinkat(fd, sde->d_name, 0) == 0) {
+                    stats->removed++;
+                    stats->removed_bytes += statbuf.st_size;
+                    continue;
+                }
+                stats->unreferenced++;
+            }
+            stats->objects++;
+            stats->bytes += statbuf.st_size;
+            stats->references += statbuf.st_nlink - 1;
+            stats->referenced_bytes += (uint64_t)statbuf.st_size *
+                                       (statbuf.st_nlink - 1);
+        }
+        closedir(sd);
+        if (collect) /* only succeeds if empty */
+            unlinkat(dirfd(d), de->d_name, AT_REMOVEDIR);
+    }
+    closedir(d);
+
+    return TPM_SUCCESS;
+}
+
+const struct nvram_backend_ops nvram_cas_ops = {
+    .load   = SWTPM_NVRAM_LoadData_CAS,
+    .store  = SWTPM_NVRAM_StoreData_CAS,
+    .delete = SWTPM_NVRAM_DeleteName_CAS,
+};
@@ -0,0 +1,656 @@
+/*
+ * swtpm_nvstore_container.c -- Single-file container storage backend
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This backend keeps all named blobs of a TPM instance in a single file,
+ * state_directory/tpm-<tpm_number>.container, rather than in one file per
+ * blob.
+ *
+ * Layout of the container file:
+ *
+ *   offset 0                 : header copy 0
+ *   offset 512               : header copy 1
+ *   offset 1024              : data area holding blobs and slot tables
+ *
+ * Each header points to a slot table that describes where the blobs are
+ * located in the data area. Updates are done copy-on-write: the new blob
+ * and a new slot table are appended behind the used part of the data area
+ * and synced to disk before the older of the two header copies is
+ * overwritten with an incremented generation number. The valid header
+ * with the highest generation number is the active one, so a torn write
+ * of a header leaves the previous state intact. Once the data area holds
+ * too much garbage, the container is compacted into a new file that then
+ * atomically replaces the old one.
+ *
+ * All numbers are stored in big endian format.
+ */
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <arpa/inet.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
+#include "logging.h"
+
+#define CONTAINER_MAGIC           "SWTPMCTR"
+#define CONTAINER_VERSION         1
+#define CONTAINER_HEADER_AREA     512
+#define CONTAINER_NUM_HEADERS     2
+#define CONTAINER_DATA_START      (CONTAINER_NUM_HEADERS * CONTAINER_HEADER_AREA)
+#define CONTAINER_MAX_SLOTS       16
+#define CONTAINER_NAME_MAX        24
+/* compact once the garbage exceeds the live data and this many bytes */
+#define CONTAINER_COMPACT_SLACK   (64 * 1024)
+
+#define CONTAINER_SUFFIX          "container"
+
+typedef struct {
+    char     magic[8];
+    uint8_t  version;
+    uint8_t  min_version; /* min. required version */
+    uint16_t hdrsize;
+    uint32_t generation;
+    uint32_t table_offset;
+    uint32_t table_length; /* number of slots in the table */
+    uint32_t table_checksum;
+    uint32_t data_end;     /* end of the used part of the data area */
+    uint32_t checksum;     /* checksum over the header; must be last */
+} __attribute__((packed)) container_header;
+
+typedef struct {
+    char     name[CONTAINER_NAME_MAX];
+    uint32_t offset;
+    uint32_t length;
+    uint32_t checksum;
+} __attribute__((packed)) container_slot;
+
+typedef struct {
+    int             fd;
+    uint32_t        generation;
+    unsigned int    active;    /* index of the active header */
+    uint32_t        data_end;
+    uint32_t        n_slots;
+    container_slot  slots[CONTAINER_MAX_SLOTS]; /* in host byte order */
+} container;
+
+/*
+ * container_checksum: FNV-1a hash used for detecting torn or corrupted
+ *                     writes; the blobs themselves are protected by the
+ *                     NVRAM layer if encryption is used.
+ */
+static uint32_t
+container_checksum(const unsigned char *data, uint32_t length)
+{
+    uint32_t hash = 2166136261U;
+    uint32_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static TPM_RESULT
+container_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        n = pread(fd, buf, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return TPM_FAIL;
+        buf = (unsigned char *)buf + n;
+        count -= n;
+        offset += n;
+    }
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+container_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        n = pwrite(fd, buf, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            logprintf(STDERR_FILENO,
+                      "Container: Error (fatal) writing %zu bytes: %s\n",
+                      count, strerror(errno));
+            return TPM_FAIL;
+        }
+        buf = (const unsigned char *)buf + n;
+        count -= n;
+        offset += n;
+    }
+    return TPM_SUCCESS;
+}
+
+/*
+ * container_read_table: read and verify the slot table the given header
+ *                       points to
+ */
+static TPM_RESULT
+container_read_table(container *c, const container_header *hdr)
+{
+    uint32_t n_slots = ntohl(hdr->table_length);
+    container_slot slots[CONTAINER_MAX_SLOTS];
+    uint32_t i;
+
+    if (n_slots > CONTAINER_MAX_SLOTS)
+        return TPM_FAIL;
+
+    if (n_slots > 0 &&
+        container_pread(c->fd, slots, n_slots * sizeof(slots[0]),
+                        ntohl(hdr->table_offset)) != TPM_SUCCESS)
+        return TPM_FAIL;
+
+    if (container_checksum((unsigned char *)slots,
+                           n_slots * sizeof(slots[0])) !=
+        ntohl(hdr->table_checksum))
+        return TPM_FAIL;
+
+    for (i = 0; i < n_slots; i++) {
+        memcpy(c->slots[i].name, slots[i].name, sizeof(slots[i].name));
+        c->slots[i].name[CONTAINER_NAME_MAX - 1] = 0;
+        c->slots[i].offset = ntohl(slots[i].offset);
+        c->slots[i].length = ntohl(slots[i].length);
+        c->slots[i].checksum = ntohl(slots[i].checksum);
+    }
+    c->n_slots = n_slots;
+    c->data_end = ntohl(hdr->data_end);
+    c->generation = ntohl(hdr->generation);
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * container_read_header: read one copy of the header and check it
+ */
+static TPM_RESULT
+container_read_header(int fd, unsigned int idx, container_header *hdr)
+{
+    uint32_t checksum;
+
+    if (container_pread(fd, hdr, sizeof(*hdr),
+                        idx * CONTAINER_HEADER_AREA) != TPM_SUCCESS)
+        return TPM_FAIL;
+
+    if (memcmp(hdr->magic, CONTAINER_MAGIC, sizeof(hdr->magic)))
+        return TPM_FAIL;
+
+    checksum = container_checksum((unsigned char *)hdr,
+                                  offsetof(container_header, checksum));
+    if (checksum != ntohl(hdr->checksum))
+        return TPM_FAIL;
+
+    if (hdr->min_version > CONTAINER_VERSION) {
+        logprintf(STDERR_FILENO,
+                  "Container: Minimum required version for the container "
+                  "is %d, we only support version %d\n",
+                  hdr->min_version, CONTAINER_VERSION);
+        return TPM_BAD_VERSION;
+    }
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * container_load_state: determine the active header of the container and
+ *                       read its slot table; an empty file is treated as an
+ *                       empty container
+ */
+static TPM_RESULT
+container_load_state(container *c)
+{
+    container_header hdr[CONTAINER_NUM_HEADERS];
+    TPM_BOOL valid[CONTAINER_NUM_HEADERS];
+    struct stat statbuf;
+    unsigned int i, best;
+    TPM_RESULT rc = TPM_FAIL;
+
+    c->generation = 0;
+    c->active = CONTAINER_NUM_HEADERS - 1;
+    c->data_end = CONTAINER_DATA_START;
+    c->n_slots = 0;
+
+    if (fstat(c->fd, &statbuf) < 0)
+        return TPM_FAIL;
+    if (statbuf.st_size == 0)
+        return TPM_SUCCESS;
+
+    for (i = 0; i < CONTAINER_NUM_HEADERS; i++)
+        valid[i] = (container_read_header(c->fd, i, &hdr[i]) == TPM_SUCCESS);
+
+    /* try the newest header first, fall back to the older one */
+    while (rc != TPM_SUCCESS) {
+        best = CONTAINER_NUM_HEADERS;
+        for (i = 0; i < CONTAINER_NUM_HEADERS; i++) {
+            if (valid[i] &&
+                (best == CONTAINER_NUM_HEADERS ||
+                 ntohl(hdr[i].generation) > ntohl(hdr[best].generation)))
+                best = i;
+        }
+        if (best == CONTAINER_NUM_HEADERS) {
+            logprintf(STDERR_FILENO,
+                      "Container: Error (fatal), no valid header found.\n");
+            return TPM_FAIL;
+        }
+        rc = container_read_table(c, &hdr[best]);
+        if (rc == TPM_SUCCESS)
+            c->active = best;
+        else
+            valid[best] = FALSE;
+    }
+
+    return rc;
+}
+
+/*
+ * container_open: open the container file of the given TPM instance and
+ *                 read its current state
+ */
+static TPM_RESULT
+container_open(container *c, uint32_t tpm_number, int flags)
+{
+    char filename[FILENAME_MAX];
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
+                                        tpm_number, CONTAINER_SUFFIX);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    c->fd = openat(SWTPM_NVRAM_GetStateDirFd(), filename, flags,
+                   S_IRUSR | S_IWUSR);
+    if (c->fd < 0) {
+        if (errno == ENOENT)
+            return TPM_RETRY;
+        logprintf(STDERR_FILENO,
+                  "Container: Error (fatal) opening %s: %s\n",
+                  filename, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    rc = container_load_state(c);
+    if (rc != TPM_SUCCESS) {
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    return rc;
+}
+
+static void
+container_close(container *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+static int
+container_find_slot(const container *c, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->n_slots; i++) {
+        if (!strcmp(c->slots[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * container_commit: write the slot table at the end of the data area and
+ *                   activate it by writing the inactive header copy
+ */
+static TPM_RESULT
+container_commit(container *c)
+{
+    container_slot slots[CONTAINER_MAX_SLOTS];
+    container_header hdr;
+    uint32_t table_size = c->n_slots * sizeof(slots[0]);
+    unsigned int idx = (c->active + 1) % CONTAINER_NUM_HEADERS;
+    uint32_t i;
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < c->n_slots; i++) {
+        memcpy(slots[i].name, c->slots[i].name, sizeof(slots[i].name));
+        slots[i].offset = htonl(c->slots[i].offset);
+        slots[i].length = htonl(c->slots[i].length);
+        slots[i].checksum = htonl(c->slots[i].checksum);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CONTAINER_MAGIC, sizeof(hdr.magic));
+    hdr.version = CONTAINER_VERSION;
+    hdr.min_version = CONTAINER_VERSION;
+    hdr.hdrsize = htons(sizeof(hdr));
+    hdr.generation = htonl(c->generation + 1);
+    hdr.table_offset = htonl(c->data_end);
+    hdr.table_length = htonl(c->n_slots);
+    hdr.table_checksum = htonl(container_checksum((unsigned char *)slots,
+                                                  table_size));
+    hdr.data_end = htonl(c->data_end + table_size);
+    hdr.checksum = htonl(container_checksum((unsigned char *)&hdr,
+                                  offsetof(container_header, checksum)));
+
+    if (table_size > 0 &&
+        container_pwrite(c->fd, slots, table_size,
+                         c->data_end) != TPM_SUCCESS)
+        return TPM_FAIL;
+
+    /* blobs and table must be on disk before the header points to them */
+    if (fdatasync(c->fd) < 0)
+        return TPM_FAIL;
+
+    if (container_pwrite(c->fd, &hdr, sizeof(hdr),
+                         idx * CONTAINER_HEADER_AREA) != TPM_SUCCESS)
+        return TPM_FAIL;
+
+    if (fdatasync(c->fd) < 0)
+        return TPM_FAIL;
+
+    c->active = idx;
+    c->generation++;
+    c->data_end += table_size;
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * container_put_slot: append the data to the data area and make the slot
+ *                     with the given name point to it; the change is not
+ *                     visible before container_commit()
+ */
+static TPM_RESULT
+container_put_slot(container *c, const char *name,
+                   const unsigned char *data, uint32_t length)
+{
+    int idx = container_find_slot(c, name);
+
+    if (idx < 0) {
+        if (c->n_slots == CONTAINER_MAX_SLOTS ||
+            strlen(name) >= CONTAINER_NAME_MAX) {
+            logprintf(STDERR_FILENO,
+                      "Container: Error (fatal), cannot add blob %s\n",
+                      name);
+            return TPM_FAIL;
+        }
+        idx = c->n_slots++;
+        memset(c->slots[idx].name, 0, sizeof(c->slots[idx].name));
+        strcpy(c->slots[idx].name, name);
+    }
+
+    if (length > 0 &&
+        container_pwrite(c->fd, data, length, c->data_end) != TPM_SUCCESS)
+        return TPM_FAIL;
+
+    c->slots[idx].offset = c->data_end;
+    c->slots[idx].length = length;
+    c->slots[idx].checksum = container_checksum(data, length);
+    c->data_end += length;
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+container_read_slot(const container *c, int idx,
+                    unsigned char **data, uint32_t *length)
+{
+    const container_slot *slot = &c->slots[idx];
+    TPM_RESULT rc;
+
+    *data = NULL;
+    *length = slot->length;
+    if (*length == 0)
+        return TPM_SUCCESS;
+
+    rc = TPM_Malloc(data, *length);
+    if (rc == TPM_SUCCESS)
+        rc = container_pread(c->fd, *data, *length, slot->offset);
+    if (rc == TPM_SUCCESS &&
+        container_checksum(*data, *length) != slot->checksum) {
+        logprintf(STDERR_FILENO,
+                  "Container: Error (fatal), checksum of blob %s is bad\n",
+                  slot->name);
+        rc = TPM_FAIL;
+    }
+    if (rc != TPM_SUCCESS) {
+        TPM_Free(*data);
+        *data = NULL;
+        *length = 0;
+    }
+
+    return rc;
+}
+
+/*
+ * container_compact: write all live blobs into a new container file and
+ *                    replace the existing file with it
+ */
+static TPM_RESULT
+container_compact(container *c, uint32_t tpm_number)
+{
+    char filename[FILENAME_MAX];
+    char tmpname[FILENAME_MAX];
+    int dirfd = SWTPM_NVRAM_GetStateDirFd();
+    container n = {
+        .fd = -1,
+        .generation = c->generation,
+        .active = CONTAINER_NUM_HEADERS - 1,
+        .data_end = CONTAINER_DATA_START,
+        .n_slots = 0,
+    };
+    unsigned char *data;
+    uint32_t length;
+    uint32_t i;
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
+                                        tpm_number, CONTAINER_SUFFIX);
+    if (rc == TPM_SUCCESS &&
+        (size_t)snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >=
+        sizeof(tmpname))
+        rc = TPM_FAIL;
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    n.fd = openat(dirfd, tmpname, O_RDWR | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR);
+    if (n.fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "Container: Error (fatal) opening %s: %s\n",
+                  tmpname, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    for (i = 0; rc == TPM_SUCCESS && i < c->n_slots; i++) {
+        rc = container_read_slot(c, i, &data, &length);
+        if (rc == TPM_SUCCESS)
+            rc = container_put_slot(&n, c->slots[i].name, data, length);
+        TPM_Free(data);
+    }
+    if (rc == TPM_SUCCESS)
+        rc = container_commit(&n);
+    /* the new file must be complete on disk before it replaces the old one */
+    if (rc == TPM_SUCCESS && fsync(n.fd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Container: Error (fatal) syncing %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS && renameat(dirfd, tmpname, dirfd, filename) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Container: Error (fatal) renaming %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS)
+        rc = SWTPM_NVRAM_SyncStateDir();
+
+    if (rc == TPM_SUCCESS) {
+        container_close(c);
+        *c = n;
+    } else {
+        container_close(&n);
+        unlinkat(dirfd, tmpname, 0);
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LoadData_Container(unsigned char **data,     /* freed by caller */
+                               uint32_t *length,
+                               uint32_t tpm_number,
+                               const char *name)
+{
+    container c = { .fd = -1 };
+    TPM_RESULT rc;
+    int idx;
+
+    TPM_DEBUG(" SWTPM_NVRAM_LoadData_Container: name %s\n", name);
+    *data = NULL;
+    *length = 0;
+
+    rc = container_open(&c, tpm_number, O_RDONLY);
+    if (rc == TPM_SUCCESS) {
+        idx = container_find_slot(&c, name);
+        if (idx < 0)
+            rc = TPM_RETRY;
+        else
+            rc = container_read_slot(&c, idx, data, length);
+    }
+    container_close(&c);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_StoreData_Container(const unsigned char *data,
+                                uint32_t length,
+                                uint32_t tpm_number,
+                                const char *name)
+{
+    container c = { .fd = -1 };
+    uint64_t live = length;
+    uint32_t i;
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_StoreData_Container: name %s, %u bytes\n",
+              name, length);
+
+    rc = container_open(&c, tpm_number, O_RDWR | O_CREAT);
+
+    if (rc == TPM_SUCCESS) {
+        for (i = 0; i < c.n_slots; i++)
+            live += c.slots[i].length;
+        if (c.data_end - CONTAINER_DATA_START >
+            2 * live + CONTAINER_COMPACT_SLACK)
+            rc = container_compact(&c, tpm_number);
+    }
+    if (rc == TPM_SUCCESS)
+        rc = container_put_slot(&c, name, data, length);
+    if (rc == TPM_SUCCESS)
+        rc = container_commit(&c);
+
+    container_close(&c);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_DeleteName_Container(uint32_t tpm_number,
+                                 const char *name,
+                                 TPM_BOOL mustExist)
+{
+    container c = { .fd = -1 };
+    TPM_RESULT rc;
+    int idx = -1;
+
+    TPM_DEBUG(" SWTPM_NVRAM_DeleteName_Container: name %s\n", name);
+
+    rc = container_open(&c, tpm_number, O_RDWR);
+    if (rc == TPM_SUCCESS) {
+        idx = container_find_slot(&c, name);
+        if (idx >= 0) {
+            c.n_slots--;
+            memmove(&c.slots[idx], &c.slots[idx + 1],
+                    (c.n_slots - idx) * sizeof(c.slots[0]));
+            rc = container_commit(&c);
+        }
+    }
+    container_close(&c);
+
+    if ((rc == TPM_RETRY || (rc == TPM_SUCCESS && idx < 0))) {
+        if (mustExist) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_DeleteName_Container: Error, (fatal) "
+                      "blob %s does not exist\n", name);
+            rc = TPM_FAIL;
+        } else {
+            rc = TPM_SUCCESS;
+        }
+    }
+
+    return rc;
+}
+
+const struct nvram_backend_ops nvram_container_ops = {
+    .load   = SWTPM_NVRAM_LoadData_Container,
+    .store  = SWTPM_NVRAM_StoreData_Container,
+    .delete = SWTPM_NVRAM_DeleteName_Container,
+};
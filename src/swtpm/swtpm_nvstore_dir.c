@@ -0,0 +1,467 @@
+/********************************************************************************/
+/*                                                                              */
+/*                      NVRAM Directory Storage Backend                         */
+/*                           Written by Ken Goldman                             */
+/*                       Adapted to SWTPM by Stefan Berger                      */
+/*                     IBM Thomas J. Watson Research Center                     */
+/*                                                                              */
+/* (c) Copyright IBM Corporation 2006, 2010, 2014, 2015.			*/
+/*										*/
+/* All rights reserved.								*/
+/* 										*/
+/* Redistribution and use in source and binary forms, with or without		*/
+/* modification, are permitted provided that the following conditions are	*/
+/* met:										*/
+/* 										*/
+/* Redistributions of source code must retain the above copyright notice,	*/
+/* this list of conditions and the following disclaimer.			*/
+/* 										*/
+/* Redistributions in binary form must reproduce the above copyright		*/
+/* notice, this list of conditions and the following disclaimer in the		*/
+/* documentation and/or other materials provided with the distribution.		*/
+/* 										*/
+/* Neither the names of the IBM Corporation nor the names of its		*/
+/* contributors may be used to endorse or promote products derived from		*/
+/* this software without specific prior written permission.			*/
+/* 										*/
+/* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS		*/
+/* "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT		*/
+/* LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR	*/
+/* A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT		*/
+/* HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,	*/
+/* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT		*/
+/* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,	*/
+/* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY	*/
+/* THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT		*/
+/* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE	*/
+/* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.		*/
+/********************************************************************************/
+
+/* This backend stores each named blob of a TPM in its own file in the
+   state directory. The file names are of the form:
+
+        state_directory/tpm-<tpm_number>.<name>
+
+   The files are accessed relative to the file descriptor of the state
+   directory.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
+
+/* Open the file for 'name' for reading and determine its size.
+
+   Returns
+        0 on success; 'fd' must be closed after use.
+        TPM_RETRY on non-existent file (non-fatal, first time start up)
+        TPM_FAIL on any other error
+*/
+
+static TPM_RESULT
+SWTPM_NVRAM_Open_Dir(int *fd,
+                     uint32_t *length,
+                     uint32_t tpm_number,
+                     const char *name)
+{
+    TPM_RESULT    rc = 0;
+    struct stat   statbuf;
+    char          filename[FILENAME_MAX]; /* file name from name */
+
+    *fd = -1;
+    *length = 0;
+
+    /* map name to the filename */
+    rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
+                                        tpm_number, name);
+    if (rc == 0) {
+        TPM_DEBUG("  SWTPM_NVRAM_LoadData: Opening file %s\n", filename);
+        *fd = openat(SWTPM_NVRAM_GetStateDirFd(), filename,
+                     O_RDONLY | O_CLOEXEC);
+        if (*fd < 0) {     /* if failure, determine cause */
+            if (errno == ENOENT) {
+                TPM_DEBUG("SWTPM_NVRAM_LoadData: No such file %s\n",
+                         filename);
+                rc = TPM_RETRY;         /* first time start up */
+            }
+            else {
+                fprintf(stderr, "SWTPM_NVRAM_LoadData: Error (fatal) opening "
+                        "%s for read, %s\n", filename, strerror(errno));
+                rc = TPM_FAIL;
+            }
+        }
+    }
+    /* determine the file length */
+    if (rc == 0) {
+        if (fstat(*fd, &statbuf) < 0) {
+            fprintf(stderr,
+                    "SWTPM_NVRAM_LoadData: Error (fatal) fstat'ing %s, %s\n",
+                   filename, strerror(errno));
+            rc = TPM_FAIL;
+        } else if (statbuf.st_size > (off_t)UINT32_MAX) {
+            fprintf(stderr,
+                    "SWTPM_NVRAM_LoadData: Error (fatal) file %s is too "
+                    "big\n", filename);
+            rc = TPM_FAIL;
+        } else {
+            *length = (uint32_t)statbuf.st_size;
+        }
+    }
+    if (rc != 0 && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+
+    return rc;
+}
+
+/* Load 'data' of 'length' from the file for 'name'.
+
+   The file is read with a single fstat() and pread() straight into the
+   returned buffer.
+
+   'data' must be freed after use.
+
+   Returns
+        0 on success.
+        TPM_RETRY and NULL,0 on non-existent file (non-fatal, first time start up)
+        TPM_FAIL on failure to load (fatal), since it should never occur
+*/
+
+static TPM_RESULT
+SWTPM_NVRAM_LoadData_Dir(unsigned char **data,     /* freed by caller */
+                         uint32_t *length,
+                         uint32_t tpm_number,
+                         const char *name)
+{
+    TPM_RESULT    rc = 0;
+    ssize_t       n;
+    uint32_t      offset = 0;
+    int           fd = -1;
+
+    TPM_DEBUG(" SWTPM_NVRAM_LoadData: From file %s\n", name);
+    *data = NULL;
+
+    rc = SWTPM_NVRAM_Open_Dir(&fd, length, tpm_number, name); /* closed @1 */
+
+    /* allocate a buffer for the actual data */
+    if ((rc == 0) && *length != 0) {
+        TPM_DEBUG(" SWTPM_NVRAM_LoadData: Reading %u bytes of data\n", *length);
+        rc = TPM_Malloc(data, *length);
+        if (rc != 0) {
+            fprintf(stderr,
+                    "SWTPM_NVRAM_LoadData: Error (fatal) allocating %u "
+                    "bytes\n", *length);
+            rc = TPM_FAIL;
+        }
+    }
+    /* read the contents of the file into the data buffer */
+    while ((rc == 0) && offset < *length) {
+        n = pread(fd, &(*data)[offset], *length - offset, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr,
+                    "SWTPM_NVRAM_LoadData: Error (fatal), data read of %u "
+                    "only read %u\n", *length, offset);
+            rc = TPM_FAIL;
+            break;
+        }
+        offset += n;
+    }
+    if (fd >= 0)
+        close(fd);              /* @1 */
+
+    if (rc != 0) {
+        TPM_Free(*data);
+        *data = NULL;
+        *length = 0;
+    }
+
+    return rc;
+}
+
+/* Map the file for 'name' read-only into memory.
+
+   This allows the caller to decrypt the blob directly from the page cache
+   without a copy of the ciphertext. An empty file results in NULL,0.
+
+   The mapping must be released with SWTPM_NVRAM_UnmapData_Dir().
+
+   Returns the same as SWTPM_NVRAM_LoadData_Dir()
+*/
+
+static TPM_RESULT
+SWTPM_NVRAM_MapData_Dir(const unsigned char **data,
+                        uint32_t *length,
+                        uint32_t tpm_number,
+                        const char *name)
+{
+    TPM_RESULT    rc = 0;
+    void          *addr;
+    int           fd = -1;
+
+    *data = NULL;
+
+    rc = SWTPM_NVRAM_Open_Dir(&fd, length, tpm_number, name); /* closed @1 */
+
+    if ((rc == 0) && *length != 0) {
+        addr = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr,
+                    "SWTPM_NVRAM_LoadData: Error (fatal) mapping %u bytes, "
+                    "%s\n", *length, strerror(errno));
+            rc = TPM_FAIL;
+            *length = 0;
+        } else {
+            *data = addr;
+        }
+    }
+    if (fd >= 0)
+        close(fd);              /* @1 */
+
+    return rc;
+}
+
+static void
+SWTPM_NVRAM_UnmapData_Dir(const unsigned char *data,
+                          uint32_t length)
+{
+    if (data)
+        munmap((void *)data, length);
+}
+
+#define SELINUX_XATTR "security.selinux"
+
+/* SWTPM_NVRAM_CopyAttributes_Dir gives the file open as 'fd' the mode, the
+   owner and the SELinux label of the existing file 'filename', which it
+   is going to replace. Nothing is done if 'filename' does not exist.
+
+   The owner and the label are only set if they differ, so that storing
+   the state of a TPM does not require the permission to change them.
+
+   Returns
+        0 on success
+        TPM_FAIL if the attributes could not be copied
+*/
+
+static TPM_RESULT
+SWTPM_NVRAM_CopyAttributes_Dir(int dirfd, const char *filename, int fd)
+{
+    TPM_RESULT    rc = 0;
+    struct stat   statbuf, newstatbuf;
+    char          label[256], newlabel[256];
+    ssize_t       labellen, newlabellen;
+    int           oldfd;
+
+    if (fstatat(dirfd, filename, &statbuf, 0) < 0) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) accessing "
+                "%s: %s\n", filename, strerror(errno));
+        return TPM_FAIL;
+    }
+    if (fstat(fd, &newstatbuf) < 0) {
+        fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) accessing "
+                "the new %s: %s\n", filename, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    if (fchmod(fd, statbuf.st_mode & 07777) < 0) {
+        fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) setting the "
+                "mode of %s: %s\n", filename, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc == 0 &&
+        (statbuf.st_uid != newstatbuf.st_uid ||
+         statbuf.st_gid != newstatbuf.st_gid) &&
+        fchown(fd, statbuf.st_uid, statbuf.st_gid) < 0) {
+        fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) setting the "
+                "owner of %s: %s\n", filename, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc != 0)
+        return rc;
+
+    oldfd = openat(dirfd, filename, O_RDONLY | O_CLOEXEC);
+    if (oldfd < 0)
+        return 0;
+    labellen = fgetxattr(oldfd, SELINUX_XATTR, label, sizeof(label));
+    close(oldfd);
+    /* no label, or the filesystem does not support labels */
+    if (labellen < 0)
+        return 0;
+
+    newlabellen = fgetxattr(fd, SELINUX_XATTR, newlabel, sizeof(newlabel));
+    if ((newlabellen != labellen ||
+         memcmp(newlabel, label, labellen) != 0) &&
+        fsetxattr(fd, SELINUX_XATTR, label, labellen, 0) < 0) {
+        fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) setting the "
+                "SELinux label of %s: %s\n", filename, strerror(errno));
+        rc = TPM_FAIL;
+    }
+
+    return rc;
+}
+
+/* SWTPM_NVRAM_StoreData_Dir stores 'data' of 'length' to the file for 'name'
+
+   The data are written to a temporary file that is then renamed, so that
+   an existing mapping of the previous contents remains unchanged. The
+   temporary file gets the attributes of the file it replaces and is synced
+   before the rename, which is synced as well, so that a crash leaves
+   either the previous or the new contents.
+
+   Returns
+        0 on success
+        TPM_FAIL for other fatal errors
+*/
+
+static TPM_RESULT
+SWTPM_NVRAM_StoreData_Dir(const unsigned char *data,
+                          uint32_t length,
+                          uint32_t tpm_number,
+                          const char *name)
+{
+    TPM_RESULT    rc = 0;
+    ssize_t       n;
+    uint32_t      offset = 0;
+    int           fd = -1;
+    int           dirfd = SWTPM_NVRAM_GetStateDirFd();
+    char          filename[FILENAME_MAX]; /* file name from name */
+    char          tmpname[FILENAME_MAX];
+
+    TPM_DEBUG(" SWTPM_NVRAM_StoreData: To name %s\n", name);
+    if (rc == 0) {
+        /* map name to the filename */
+        rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
+                                            tpm_number, name);
+    }
+    if (rc == 0 &&
+        (size_t)snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >=
+        sizeof(tmpname)) {
+        fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) file name "
+                "%s is too long\n", filename);
+        rc = TPM_FAIL;
+    }
+    if (rc == 0) {
+        /* open the file */
+        TPM_DEBUG(" SWTPM_NVRAM_StoreData: Opening file %s\n", tmpname);
+        fd = openat(dirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0640);                                      /* closed @1 */
+        if (fd < 0) {
+            fprintf(stderr,
+                    "SWTPM_NVRAM_StoreData: Error (fatal) opening %s for "
+                    "write failed, %s\n", tmpname, strerror(errno));
+            rc = TPM_FAIL;
+        }
+    }
+
+    if (rc == 0)
+        rc = SWTPM_NVRAM_CopyAttributes_Dir(dirfd, filename, fd);
+
+    /* write the data to the file */
+    if (rc == 0) {
+        TPM_DEBUG("  SWTPM_NVRAM_StoreData: Writing %u bytes of data\n", length);
+    }
+    while (rc == 0 && offset < length) {
+        n = write(fd, &data[offset], length - offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "TPM_NVRAM_StoreData: Error (fatal), data write "
+                    "of %u only wrote %u\n", length, offset);
+            rc = TPM_FAIL;
+            break;
+        }
+        offset += n;
+    }
+    if (rc == 0 && fsync(fd) != 0) {
+        fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) syncing file "
+                "%s, %s\n", tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (fd >= 0) {
+        TPM_DEBUG("  SWTPM_NVRAM_StoreData: Closing file %s\n", tmpname);
+        if (close(fd) != 0) {   /* @1 */
+            fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) closing "
+                    "file\n");
+            rc = TPM_FAIL;
+        }
+        else {
+            TPM_DEBUG("  SWTPM_NVRAM_StoreData: Closed file %s\n", tmpname);
+        }
+    }
+    if (rc == 0 && renameat(dirfd, tmpname, dirfd, filename) != 0) {
+        fprintf(stderr, "SWTPM_NVRAM_StoreData: Error (fatal) renaming %s "
+                "to %s, %s\n", tmpname, filename, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc == 0)
+        rc = SWTPM_NVRAM_SyncStateDir();
+    if (rc != 0 && fd >= 0)
+        unlinkat(dirfd, tmpname, 0);
+
+    TPM_DEBUG(" SWTPM_NVRAM_StoreData: rc=%d\n", rc);
+
+    return rc;
+}
+
+/* SWTPM_NVRAM_DeleteName_Dir() deletes the file for 'name'
+
+   Returns:
+        0 on success, or if the file does not exist and mustExist is FALSE
+        TPM_FAIL if the file could not be removed, since this should never occur and there is
+                no recovery
+
+   NOTE: Not portable code, but supported by Linux and Windows
+*/
+
+static TPM_RESULT
+SWTPM_NVRAM_DeleteName_Dir(uint32_t tpm_number,
+                           const char *name,
+                           TPM_BOOL mustExist)
+{
+    TPM_RESULT  rc = 0;
+    int         irc;
+    char        filename[FILENAME_MAX]; /* file name from name */
+
+    TPM_DEBUG(" SWTPM_NVRAM_DeleteName: Name %s\n", name);
+    /* map name to the filename */
+    rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
+                                        tpm_number, name);
+    if (rc == 0) {
+        irc = unlinkat(SWTPM_NVRAM_GetStateDirFd(), filename, 0);
+        if ((irc != 0) &&               /* if the remove failed */
+            (mustExist ||               /* if any error is a failure, or */
+             (errno != ENOENT))) {      /* if error other than no such file */
+            fprintf(stderr, "SWTPM_NVRAM_DeleteName: Error, (fatal) file "
+                    "remove failed, errno %d\n", errno);
+            rc = TPM_FAIL;
+        }
+    }
+    return rc;
+}
+
+const struct nvram_backend_ops nvram_dir_ops = {
+    .load   = SWTPM_NVRAM_LoadData_Dir,
+    .map    = SWTPM_NVRAM_MapData_Dir,
+    .unmap  = SWTPM_NVRAM_UnmapData_Dir,
+    .store  = SWTPM_NVRAM_StoreData_Dir,
+    .delete = SWTPM_NVRAM_DeleteName_Dir,
+};
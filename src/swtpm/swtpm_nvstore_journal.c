@@ -0,0 +1,1192 @@
+/*
+ * swtpm_nvstore_journal.c -- Journaling storage backend
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This backend makes small updates of large blobs cheap. Rather than
+ * rewriting a blob on every store, a record holding either the full blob
+ * or the byte ranges that changed since the previous version is appended
+ * to a journal. A background thread periodically folds the journal into
+ * a new base image and truncates the journal.
+ *
+ * Files:
+ *
+ *   state_directory/tpm-<tpm_number>.base     : base image with all blobs
+ *   state_directory/tpm-<tpm_number>.journal  : records appended since
+ *
+ * The base image consists of a header, a table with the names and
+ * lengths of the blobs, and the blobs one after the other. It holds the
+ * sequence number of the last record it includes and is replaced
+ * atomically by renaming a temporary file.
+ *
+ * Each journal record consists of a header and a payload:
+ *
+ *   FULL   : the payload is the blob
+ *   DELTA  : the payload is a list of (offset, length, bytes) extents to
+ *            apply to the previous version of the blob
+ *   DELETE : no payload; the blob is removed
+ *
+ * The records carry increasing sequence numbers and a checksum over
+ * header and payload. On startup the base image is read and the records
+ * with a higher sequence number than the base are replayed until the
+ * first incomplete or corrupted record, which is where a crash during an
+ * append left the journal; the journal is truncated there.
+ *
+ * All blobs of the TPM are held in memory. All numbers are stored in big
+ * endian format.
+ */
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <arpa/inet.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
+#include "logging.h"
+
+#define JOURNAL_BASE_MAGIC        "SWTPMJBS"
+#define JOURNAL_RECORD_MAGIC      0x534a524e /* 'SJRN' */
+#define JOURNAL_VERSION           1
+#define JOURNAL_MAX_BLOBS         16
+#define JOURNAL_NAME_MAX          24
+/* compact once the journal grows larger than the base image plus this */
+#define JOURNAL_COMPACT_SLACK     (64 * 1024)
+/* unchanged bytes between two changed ranges that are rather included in
+   a delta extent than starting a new extent */
+#define JOURNAL_DELTA_GAP         16
+
+#define JOURNAL_BASE_SUFFIX       "base"
+#define JOURNAL_SUFFIX            "journal"
+
+enum journal_record_type {
+    JOURNAL_RECORD_FULL = 1,
+    JOURNAL_RECORD_DELTA = 2,
+    JOURNAL_RECORD_DELETE = 3,
+};
+
+typedef struct {
+    char     magic[8];
+    uint8_t  version;
+    uint8_t  min_version;  /* min. required version */
+    uint16_t hdrsize;
+    uint32_t seq_hi;       /* sequence number of the last record included */
+    uint32_t seq_lo;
+    uint32_t n_blobs;
+    uint32_t data_length;  /* length of the blob table and the blobs */
+    uint32_t data_checksum;
+    uint32_t checksum;     /* checksum over the header; must be last */
+} __attribute__((packed)) journal_base_header;
+
+typedef struct {
+    char     name[JOURNAL_NAME_MAX];
+    uint32_t length;
+} __attribute__((packed)) journal_base_entry;
+
+typedef struct {
+    uint32_t magic;
+    uint8_t  type;
+    uint8_t  reserved[3];
+    uint32_t seq_hi;
+    uint32_t seq_lo;
+    char     name[JOURNAL_NAME_MAX];
+    uint32_t length;         /* length of the blob after this record */
+    uint32_t payload_length;
+    uint32_t checksum;       /* over header and payload; must be last */
+} __attribute__((packed)) journal_record;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} __attribute__((packed)) journal_extent;
+
+typedef struct {
+    char           name[JOURNAL_NAME_MAX];
+    unsigned char  *data;
+    uint32_t       length;
+} journal_blob;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    TPM_BOOL        loaded;
+    uint32_t        tpm_number;
+    unsigned int    generation;    /* incremented on every (re)load */
+    int             fd;            /* the journal file */
+    uint64_t        journal_end;   /* end of the last valid record */
+    uint64_t        seq;           /* sequence number of the last record */
+    uint32_t        base_length;
+    uint32_t        n_blobs;
+    journal_blob    blobs[JOURNAL_MAX_BLOBS];
+    uint32_t        compact_slack;
+    TPM_BOOL        compactor_running;
+    TPM_BOOL        compact_requested;
+    TPM_BOOL        compacting;    /* a base image is being written */
+    struct swtpm_journal_stats stats;
+} journal = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+    .compact_slack = JOURNAL_COMPACT_SLACK,
+};
+
+/*
+ * journal_checksum: FNV-1a hash used for detecting torn or corrupted
+ *                   writes; start with a 'hash' of 2166136261
+ */
+static uint32_t
+journal_checksum(uint32_t hash, const unsigned char *data, uint32_t length)
+{
+    uint32_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static TPM_RESULT
+journal_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        n = pread(fd, buf, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return TPM_FAIL;
+        buf = (unsigned char *)buf + n;
+        count -= n;
+        offset += n;
+    }
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+journal_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        n = pwrite(fd, buf, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            logprintf(STDERR_FILENO,
+                      "Journal: Error (fatal) writing %zu bytes: %s\n",
+                      count, strerror(errno));
+            return TPM_FAIL;
+        }
+        buf = (const unsigned char *)buf + n;
+        count -= n;
+        offset += n;
+    }
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+journal_get_filename(char *filename, size_t bufsize, uint32_t tpm_number,
+                     const char *suffix, TPM_BOOL tmp)
+{
+    TPM_RESULT rc;
+    size_t len;
+
+    rc = SWTPM_NVRAM_GetFilenameForName(filename, bufsize, tpm_number,
+                                        suffix);
+    if (rc == TPM_SUCCESS && tmp) {
+        len = strlen(filename);
+        if (len + sizeof(".tmp") > bufsize)
+            rc = TPM_FAIL;
+        else
+            strcpy(&filename[len], ".tmp");
+    }
+
+    return rc;
+}
+
+static journal_blob *
+journal_find_blob(const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < journal.n_blobs; i++)
+        if (!strcmp(journal.blobs[i].name, name))
+            return &journal.blobs[i];
+    return NULL;
+}
+
+/*
+ * journal_set_blob: replace the contents of a blob; takes ownership of
+ *                   'data'
+ */
+static TPM_RESULT
+journal_set_blob(const char *name, unsigned char *data, uint32_t length)
+{
+    journal_blob *blob = journal_find_blob(name);
+
+    if (!blob) {
+        if (journal.n_blobs == JOURNAL_MAX_BLOBS) {
+            logprintf(STDERR_FILENO,
+                      "Journal: Error (fatal) too many blobs\n");
+            TPM_Free(data);
+            return TPM_FAIL;
+        }
+        blob = &journal.blobs[journal.n_blobs++];
+        strcpy(blob->name, name);
+    } else {
+        TPM_Free(blob->data);
+    }
+    blob->data = data;
+    blob->length = length;
+
+    return TPM_SUCCESS;
+}
+
+static void
+journal_remove_blob(const char *name)
+{
+    journal_blob *blob = journal_find_blob(name);
+
+    if (!blob)
+        return;
+
+    TPM_Free(blob->data);
+    journal.n_blobs--;
+    memmove(blob, blob + 1,
+            (&journal.blobs[journal.n_blobs] - blob) * sizeof(*blob));
+}
+
+static void
+journal_free_blobs(journal_blob *blobs, uint32_t n_blobs)
+{
+    uint32_t i;
+
+    for (i = 0; i < n_blobs; i++) {
+        TPM_Free(blobs[i].data);
+        blobs[i].data = NULL;
+    }
+}
+
+/*
+ * journal_read_base: read the base image into memory
+ */
+static TPM_RESULT
+journal_read_base(uint32_t tpm_number, uint64_t *seq)
+{
+    char filename[FILENAME_MAX];
+    journal_base_header hdr;
+    journal_base_entry *entries;
+    unsigned char *data = NULL, *blobdata;
+    uint32_t i, n_blobs, data_length, offset, length;
+    TPM_RESULT rc;
+    int fd;
+
+    *seq = 0;
+
+    rc = journal_get_filename(filename, sizeof(filename), tpm_number,
+                              JOURNAL_BASE_SUFFIX, FALSE);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    fd = openat(SWTPM_NVRAM_GetStateDirFd(), filename,
+                O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return TPM_SUCCESS;
+        logprintf(STDERR_FILENO,
+                  "Journal: Error (fatal) opening %s: %s\n",
+                  filename, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    rc = journal_pread(fd, &hdr, sizeof(hdr), 0);
+    if (rc == TPM_SUCCESS &&
+        (memcmp(hdr.magic, JOURNAL_BASE_MAGIC, sizeof(hdr.magic)) ||
+         journal_checksum(2166136261U, (unsigned char *)&hdr,
+                          offsetof(journal_base_header, checksum)) !=
+         ntohl(hdr.checksum)))
+        rc = TPM_FAIL;
+    if (rc == TPM_SUCCESS && hdr.min_version > JOURNAL_VERSION) {
+        logprintf(STDERR_FILENO,
+                  "Journal: Minimum required version for the base image "
+                  "is %d, we only support version %d\n",
+                  hdr.min_version, JOURNAL_VERSION);
+        close(fd);
+        return TPM_BAD_VERSION;
+    }
+
+    n_blobs = ntohl(hdr.n_blobs);
+    data_length = ntohl(hdr.data_length);
+    if (rc == TPM_SUCCESS &&
+        (n_blobs > JOURNAL_MAX_BLOBS ||
+         data_length < n_blobs * sizeof(journal_base_entry)))
+        rc = TPM_FAIL;
+    if (rc == TPM_SUCCESS)
+        rc = TPM_Malloc(&data, data_length ? data_length : 1);
+    if (rc == TPM_SUCCESS)
+        rc = journal_pread(fd, data, data_length, ntohs(hdr.hdrsize));
+    if (rc == TPM_SUCCESS &&
+        journal_checksum(2166136261U, data, data_length) !=
+        ntohl(hdr.data_checksum))
+        rc = TPM_FAIL;
+    close(fd);
+
+    entries = (journal_base_entry *)data;
+    offset = n_blobs * sizeof(journal_base_entry);
+    for (i = 0; rc == TPM_SUCCESS && i < n_blobs; i++) {
+        length = ntohl(entries[i].length);
+        entries[i].name[JOURNAL_NAME_MAX - 1] = 0;
+        if (length > data_length - offset) {
+            rc = TPM_FAIL;
+            break;
+        }
+        blobdata = NULL;
+        if (length > 0) {
+            rc = TPM_Malloc(&blobdata, length);
+            if (rc != TPM_SUCCESS)
+                break;
+            memcpy(blobdata, &data[offset], length);
+        }
+        rc = journal_set_blob(entries[i].name, blobdata, length);
+        offset += length;
+    }
+    TPM_Free(data);
+
+    if (rc == TPM_SUCCESS) {
+        *seq = ((uint64_t)ntohl(hdr.seq_hi) << 32) | ntohl(hdr.seq_lo);
+        journal.base_length = ntohs(hdr.hdrsize) + data_length;
+    } else if (rc == TPM_FAIL) {
+        logprintf(STDERR_FILENO,
+                  "Journal: Error (fatal) base image %s is corrupted\n",
+                  filename);
+    }
+
+    return rc;
+}
+
+/*
+ * journal_apply_delta: apply the extents in 'payload' to the previous
+ *                      version of the blob
+ */
+static TPM_RESULT
+journal_apply_delta(const char *name, uint32_t length,
+                    const unsigned char *payload, uint32_t payload_length)
+{
+    journal_blob *blob = journal_find_blob(name);
+    unsigned char *data = NULL;
+    journal_extent ext;
+    uint32_t offset = 0, ext_offset, ext_length;
+    TPM_RESULT rc;
+
+    if (!blob)
+        return TPM_FAIL;
+
+    rc = TPM_Malloc(&data, length ? length : 1);
+    if (rc != TPM_SUCCESS)
+        return rc;
+    memcpy(data, blob->data, blob->length < length ? blob->length : length);
+
+    while (offset < payload_length) {
+        if (payload_length - offset < sizeof(ext)) {
+            rc = TPM_FAIL;
+            break;
+        }
+        memcpy(&ext, &payload[offset], sizeof(ext));
+        offset += sizeof(ext);
+        ext_offset = ntohl(ext.offset);
+        ext_length = ntohl(ext.length);
+        if (ext_length > payload_length - offset ||
+            ext_offset > length || ext_length > length - ext_offset) {
+            rc = TPM_FAIL;
+            break;
+        }
+        memcpy(&data[ext_offset], &payload[offset], ext_length);
+        offset += ext_length;
+    }
+
+    if (rc == TPM_SUCCESS)
+        return journal_set_blob(name, data, length);
+
+    TPM_Free(data);
+    return rc;
+}
+
+/*
+ * journal_replay: apply the valid records of the journal with a sequence
+ *                 number above 'base_seq'
+ */
+static TPM_RESULT
+journal_replay(uint64_t base_seq, off_t size)
+{
+    journal_record rec;
+    unsigned char *payload = NULL;
+    uint32_t payload_length, length, checksum;
+    uint64_t seq, offset = 0;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    journal.seq = base_seq;
+
+    while (rc == TPM_SUCCESS && offset + sizeof(rec) <= (uint64_t)size) {
+        if (journal_pread(journal.fd, &rec, sizeof(rec), offset) !=
+            TPM_SUCCESS || ntohl(rec.magic) != JOURNAL_RECORD_MAGIC)
+            break;
+        payload_length = ntohl(rec.payload_length);
+        if (payload_length > size - offset - sizeof(rec))
+            break;
+
+        TPM_Free(payload);
+        payload = NULL;
+        if (payload_length > 0) {
+            rc = TPM_Malloc(&payload, payload_length);
+            if (rc != TPM_SUCCESS)
+                break;
+            if (journal_pread(journal.fd, payload, payload_length,
+                              offset + sizeof(rec)) != TPM_SUCCESS)
+                break;
+        }
+        checksum = journal_checksum(2166136261U, (unsigned char *)&rec,
+                                    offsetof(journal_record, checksum));
+        checksum = journal_checksum(checksum, payload, payload_length);
+        if (checksum != ntohl(rec.checksum))
+            break;
+
+        rec.name[JOURNAL_NAME_MAX - 1] = 0;
+        seq = ((uint64_t)ntohl(rec.seq_hi) << 32) | ntohl(rec.seq_lo);
+        length = ntohl(rec.length);
+
+        if (seq > base_seq) {
+            switch (rec.type) {
+            case JOURNAL_RECORD_FULL:
+                if (length != payload_length) {
+                    rc = TPM_FAIL;
+                    break;
+                }
+                rc = journal_set_blob(rec.name, payload, length);
+                payload = NULL;
+                break;
+            case JOURNAL_RECORD_DELTA:
+                rc = journal_apply_delta(rec.name, length,
+                                         payload, payload_length);
+                break;
+            case JOURNAL_RECORD_DELETE:
+                journal_remove_blob(rec.name);
+                break;
+            default:
+                rc = TPM_FAIL;
+            }
+            if (rc != TPM_SUCCESS) {
+                logprintf(STDERR_FILENO,
+                          "Journal: Error (fatal) replaying record %llu "
+                          "for %s failed\n", (unsigned long long)seq,
+                          rec.name);
+                break;
+            }
+            journal.seq = seq;
+            journal.stats.replayed++;
+        }
+        offset += sizeof(rec) + payload_length;
+    }
+    TPM_Free(payload);
+
+    journal.journal_end = offset;
+
+    /* cut off a torn record */
+    if (rc == TPM_SUCCESS && offset < (uint64_t)size) {
+        logprintf(STDERR_FILENO,
+                  "Journal: Discarding %llu bytes of an incomplete record\n",
+                  (unsigned long long)(size - offset));
+        if (ftruncate(journal.fd, offset) < 0) {
+            logprintf(STDERR_FILENO,
+                      "Journal: Error (fatal) truncating the journal: %s\n",
+                      strerror(errno));
+            rc = TPM_FAIL;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * journal_load: read the base image and replay the journal of the given
+ *               TPM; must be called with the lock held
+ */
+static TPM_RESULT
+journal_load(uint32_t tpm_number)
+{
+    char filename[FILENAME_MAX];
+    struct stat statbuf;
+    uint64_t base_seq = 0;
+    TPM_RESULT rc;
+
+    if (journal.loaded && journal.tpm_number == tpm_number)
+        return TPM_SUCCESS;
+
+    journal_free_blobs(journal.blobs, journal.n_blobs);
+    journal.n_blobs = 0;
+    journal.base_length = 0;
+    journal.journal_end = 0;
+    journal.loaded = FALSE;
+    journal.generation++;
+    if (journal.fd >= 0) {
+        close(journal.fd);
+        journal.fd = -1;
+    }
+
+    /* remove temporary files a crashed compactor may have left behind */
+    if (journal.generation == 1) {
+        if (journal_get_filename(filename, sizeof(filename), tpm_number,
+                                 JOURNAL_BASE_SUFFIX, TRUE) == TPM_SUCCESS)
+            unlinkat(SWTPM_NVRAM_GetStateDirFd(), filename, 0);
+        if (journal_get_filename(filename, sizeof(filename), tpm_number,
+                                 JOURNAL_SUFFIX, TRUE) == TPM_SUCCESS)
+            unlinkat(SWTPM_NVRAM_GetStateDirFd(), filename, 0);
+    }
+
+    rc = journal_read_base(tpm_number, &base_seq);
+    if (rc == TPM_SUCCESS)
+        rc = journal_get_filename(filename, sizeof(filename), tpm_number,
+                                  JOURNAL_SUFFIX, FALSE);
+    if (rc == TPM_SUCCESS) {
+        journal.fd = openat(SWTPM_NVRAM_GetStateDirFd(), filename,
+                            O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+        if (journal.fd < 0 || fstat(journal.fd, &statbuf) < 0) {
+            logprintf(STDERR_FILENO,
+                      "Journal: Error (fatal) opening %s: %s\n",
+                      filename, strerror(errno));
+            rc = TPM_FAIL;
+        }
+    }
+    if (rc == TPM_SUCCESS)
+        rc = journal_replay(base_seq, statbuf.st_size);
+
+    if (rc == TPM_SUCCESS) {
+        journal.tpm_number = tpm_number;
+        journal.loaded = TRUE;
+    } else {
+        journal_free_blobs(journal.blobs, journal.n_blobs);
+        journal.n_blobs = 0;
+        if (journal.fd >= 0) {
+            close(journal.fd);
+            journal.fd = -1;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * journal_write_base: write a new base image with the given blobs
+ */
+static TPM_RESULT
+journal_write_base(uint32_t tpm_number, const journal_blob *blobs,
+                   uint32_t n_blobs, uint64_t seq, uint32_t *base_length)
+{
+    char filename[FILENAME_MAX], tmpname[FILENAME_MAX];
+    journal_base_header hdr;
+    unsigned char *data = NULL;
+    journal_base_entry entry;
+    uint32_t i, data_length = n_blobs * sizeof(entry), offset;
+    TPM_RESULT rc;
+    int dirfd = SWTPM_NVRAM_GetStateDirFd();
+    int fd = -1;
+
+    for (i = 0; i < n_blobs; i++)
+        data_length += blobs[i].length;
+
+    rc = journal_get_filename(filename, sizeof(filename), tpm_number,
+                              JOURNAL_BASE_SUFFIX, FALSE);
+    if (rc == TPM_SUCCESS)
+        rc = journal_get_filename(tmpname, sizeof(tmpname), tpm_number,
+                                  JOURNAL_BASE_SUFFIX, TRUE);
+    if (rc == TPM_SUCCESS)
+        rc = TPM_Malloc(&data, data_length ? data_length : 1);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    offset = n_blobs * sizeof(entry);
+    for (i = 0; i < n_blobs; i++) {
+        memset(&entry, 0, sizeof(entry));
+        strcpy(entry.name, blobs[i].name);
+        entry.length = htonl(blobs[i].length);
+        memcpy(&data[i * sizeof(entry)], &entry, sizeof(entry));
+        memcpy(&data[offset], blobs[i].data, blobs[i].length);
+        offset += blobs[i].length;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_BASE_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.min_version = JOURNAL_VERSION;
+    hdr.hdrsize = htons(sizeof(hdr));
+    hdr.seq_hi = htonl(seq >> 32);
+    hdr.seq_lo = htonl((uint32_t)seq);
+    hdr.n_blobs = htonl(n_blobs);
+    hdr.data_length = htonl(data_length);
+    hdr.data_checksum = htonl(journal_checksum(2166136261U, data,
+                                               data_length));
+    hdr.checksum = htonl(journal_checksum(2166136261U, (unsigned char *)&hdr,
+                             offsetof(journal_base_header, checksum)));
+
+    fd = openat(dirfd, tmpname,
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "Journal: Error (fatal) opening %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS)
+        rc = journal_pwrite(fd, &hdr, sizeof(hdr), 0);
+    if (rc == TPM_SUCCESS)
+        rc = journal_pwrite(fd, data, data_length, sizeof(hdr));
+    if (rc == TPM_SUCCESS && fsync(fd) < 0)
+        rc = TPM_FAIL;
+    if (fd >= 0)
+        close(fd);
+    if (rc == TPM_SUCCESS && renameat(dirfd, tmpname, dirfd, filename) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Journal: Error (fatal) renaming %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    /* the journal is truncated next; the new base must be on disk first */
+    if (rc == TPM_SUCCESS)
+        rc = SWTPM_NVRAM_SyncStateDir();
+    if (rc != TPM_SUCCESS)
+        unlinkat(dirfd, tmpname, 0);
+    TPM_Free(data);
+
+    *base_length = sizeof(hdr) + data_length;
+
+    return rc;
+}
+
+/*
+ * journal_drop_head: remove the first 'head' bytes from the journal after
+ *                    they were folded into the base image; must be called
+ *                    with the lock held
+ */
+static TPM_RESULT
+journal_drop_head(uint64_t head)
+{
+    char filename[FILENAME_MAX], tmpname[FILENAME_MAX];
+    uint64_t tail_length = journal.journal_end - head;
+    unsigned char *tail = NULL;
+    TPM_RESULT rc = TPM_SUCCESS;
+    int dirfd = SWTPM_NVRAM_GetStateDirFd();
+    int fd = -1;
+
+    if (tail_length == 0) {
+        if (ftruncate(journal.fd, 0) < 0 || fsync(journal.fd) < 0) {
+            logprintf(STDERR_FILENO,
+                      "Journal: Error (fatal) truncating the journal: %s\n",
+                      strerror(errno));
+            return TPM_FAIL;
+        }
+        journal.journal_end = 0;
+        return TPM_SUCCESS;
+    }
+
+    /* records were appended while the base image was written */
+    rc = journal_get_filename(filename, sizeof(filename), journal.tpm_number,
+                              JOURNAL_SUFFIX, FALSE);
+    if (rc == TPM_SUCCESS)
+        rc = journal_get_filename(tmpname, sizeof(tmpname),
+                                  journal.tpm_number, JOURNAL_SUFFIX, TRUE);
+    if (rc == TPM_SUCCESS)
+        rc = TPM_Malloc(&tail, tail_length);
+    if (rc == TPM_SUCCESS)
+        rc = journal_pread(journal.fd, tail, tail_length, head);
+    if (rc == TPM_SUCCESS) {
+        fd = openat(dirfd, tmpname,
+                    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+        if (fd < 0)
+            rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS)
+        rc = journal_pwrite(fd, tail, tail_length, 0);
+    if (rc == TPM_SUCCESS && fsync(fd) < 0)
+        rc = TPM_FAIL;
+    if (rc == TPM_SUCCESS && renameat(dirfd, tmpname, dirfd, filename) < 0)
+        rc = TPM_FAIL;
+    TPM_Free(tail);
+
+    if (rc == TPM_SUCCESS) {
+        close(journal.fd);
+        journal.fd = fd;
+        journal.journal_end = tail_length;
+        rc = SWTPM_NVRAM_SyncStateDir();
+    } else {
+        /* the old journal stays valid; its head is skipped on replay */
+        logprintf(STDERR_FILENO,
+                  "Journal: Error shortening the journal: %s\n",
+                  strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlinkat(dirfd, tmpname, 0);
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * journal_compact: fold the journal into a new base image
+ *
+ * The blobs are copied under the lock and written without holding it so
+ * that stores are not blocked while the base image is written.
+ */
+static TPM_RESULT
+journal_compact(void)
+{
+    journal_blob blobs[JOURNAL_MAX_BLOBS];
+    uint32_t i, n_blobs, tpm_number, base_length = 0;
+    unsigned int generation;
+    uint64_t seq, head;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    pthread_mutex_lock(&journal.lock);
+
+    if (!journal.loaded) {
+        pthread_mutex_unlock(&journal.lock);
+        return TPM_SUCCESS;
+    }
+
+    n_blobs = journal.n_blobs;
+    for (i = 0; rc == TPM_SUCCESS && i < n_blobs; i++) {
+        blobs[i] = journal.blobs[i];
+        blobs[i].data = NULL;
+        if (journal.blobs[i].length > 0) {
+            rc = TPM_Malloc(&blobs[i].data, journal.blobs[i].length);
+            if (rc == TPM_SUCCESS)
+                memcpy(blobs[i].data, journal.blobs[i].data,
+                       journal.blobs[i].length);
+        }
+    }
+    seq = journal.seq;
+    head = journal.journal_end;
+    tpm_number = journal.tpm_number;
+    generation = journal.generation;
+    journal.compacting = TRUE;
+
+    pthread_mutex_unlock(&journal.lock);
+
+    if (rc == TPM_SUCCESS)
+        rc = journal_write_base(tpm_number, blobs, n_blobs, seq,
+                                &base_length);
+    journal_free_blobs(blobs, n_blobs);
+
+    pthread_mutex_lock(&journal.lock);
+
+    if (rc == TPM_SUCCESS && journal.loaded &&
+        journal.generation == generation) {
+        journal.base_length = base_length;
+        rc = journal_drop_head(head);
+        journal.stats.compactions++;
+        journal.stats.base_bytes_written += base_length;
+    }
+    journal.compacting = FALSE;
+    pthread_cond_broadcast(&journal.cond);
+
+    pthread_mutex_unlock(&journal.lock);
+
+    return rc;
+}
+
+static void *
+journal_compactor(void *arg)
+{
+    (void)arg;
+
+    while (TRUE) {
+        pthread_mutex_lock(&journal.lock);
+        while (!journal.compact_requested)
+            pthread_cond_wait(&journal.cond, &journal.lock);
+        journal.compact_requested = FALSE;
+        pthread_mutex_unlock(&journal.lock);
+
+        journal_compact();
+    }
+
+    return NULL;
+}
+
+/*
+ * journal_request_compaction: wake up the compactor if the journal has
+ *                             grown too large; must be called with the
+ *                             lock held
+ */
+static void
+journal_request_compaction(void)
+{
+    pthread_t tid;
+
+    if (journal.compact_slack == 0 ||
+        journal.journal_end <= (uint64_t)journal.base_length +
+                               journal.compact_slack)
+        return;
+
+    if (!journal.compactor_running) {
+        if (pthread_create(&tid, NULL, journal_compactor, NULL) != 0) {
+            logprintf(STDERR_FILENO,
+                      "Journal: Could not start the compactor: %s\n",
+                      strerror(errno));
+            return;
+        }
+        pthread_detach(tid);
+        journal.compactor_running = TRUE;
+    }
+    journal.compact_requested = TRUE;
+    pthread_cond_broadcast(&journal.cond);
+}
+
+/*
+ * journal_build_delta: collect the ranges in which 'data' differs from
+ *                      'old' into a delta payload; returns a payload
+ *                      length of 0 if a full record is not larger
+ */
+static TPM_RESULT
+journal_build_delta(const unsigned char *old, uint32_t old_length,
+                    const unsigned char *data, uint32_t length,
+                    unsigned char **payload, uint32_t *payload_length)
+{
+    uint32_t common = old_length < length ? old_length : length;
+    uint32_t i = 0, start, end, gap;
+    journal_extent ext;
+    TPM_RESULT rc;
+
+    *payload_length = 0;
+
+    rc = TPM_Malloc(payload, length + sizeof(ext));
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    while (TRUE) {
+        while (i < common && old[i] == data[i])
+            i++;
+        if (i >= length)
+            break;
+        start = i;
+        /* extend the range until JOURNAL_DELTA_GAP equal bytes follow */
+        end = i;
+        gap = 0;
+        while (i < length && gap < JOURNAL_DELTA_GAP) {
+            if (i < common && old[i] == data[i]) {
+                gap++;
+            } else {
+                gap = 0;
+                end = i + 1;
+            }
+            i++;
+        }
+        if (*payload_length + sizeof(ext) + (end - start) >= length) {
+            /* a full record is smaller */
+            *payload_length = 0;
+            return TPM_SUCCESS;
+        }
+        ext.offset = htonl(start);
+        ext.length = htonl(end - start);
+        memcpy(&(*payload)[*payload_length], &ext, sizeof(ext));
+        *payload_length += sizeof(ext);
+        memcpy(&(*payload)[*payload_length], &data[start], end - start);
+        *payload_length += end - start;
+        i = end;
+    }
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * journal_append: append a record and sync it to disk; must be called
+ *                 with the lock held
+ */
+static TPM_RESULT
+journal_append(enum journal_record_type type, const char *name,
+               uint32_t length, const unsigned char *payload,
+               uint32_t payload_length)
+{
+    journal_record rec;
+    uint32_t checksum;
+    TPM_RESULT rc;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = htonl(JOURNAL_RECORD_MAGIC);
+    rec.type = type;
+    rec.seq_hi = htonl((journal.seq + 1) >> 32);
+    rec.seq_lo = htonl((uint32_t)(journal.seq + 1));
+    strcpy(rec.name, name);
+    rec.length = htonl(length);
+    rec.payload_length = htonl(payload_length);
+    checksum = journal_checksum(2166136261U, (unsigned char *)&rec,
+                                offsetof(journal_record, checksum));
+    rec.checksum = htonl(journal_checksum(checksum, payload, payload_length));
+
+    rc = journal_pwrite(journal.fd, &rec, sizeof(rec), journal.journal_end);
+    if (rc == TPM_SUCCESS && payload_length > 0)
+        rc = journal_pwrite(journal.fd, payload, payload_length,
+                            journal.journal_end + sizeof(rec));
+    if (rc == TPM_SUCCESS && fdatasync(journal.fd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Journal: Error (fatal) syncing the journal: %s\n",
+                  strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS) {
+        journal.seq++;
+        journal.journal_end += sizeof(rec) + payload_length;
+        journal.stats.records++;
+        journal.stats.bytes_written += sizeof(rec) + payload_length;
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_Init_Journal(uint32_t tpm_number)
+{
+    TPM_RESULT rc;
+
+    pthread_mutex_lock(&journal.lock);
+    journal.loaded = FALSE;
+    rc = journal_load(tpm_number);
+    pthread_mutex_unlock(&journal.lock);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LoadData_Journal(unsigned char **data,     /* freed by caller */
+                             uint32_t *length,
+                             uint32_t tpm_number,
+                             const char *name)
+{
+    journal_blob *blob = NULL;
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_LoadData_Journal: name %s\n", name);
+    *data = NULL;
+    *length = 0;
+
+    pthread_mutex_lock(&journal.lock);
+
+    rc = journal_load(tpm_number);
+    if (rc == TPM_SUCCESS) {
+        blob = journal_find_blob(name);
+        if (!blob)
+            rc = TPM_RETRY;
+        else if (blob->length > 0)
+            rc = TPM_Malloc(data, blob->length);
+    }
+    if (rc == TPM_SUCCESS && blob->length > 0) {
+        memcpy(*data, blob->data, blob->length);
+        *length = blob->length;
+    }
+
+    pthread_mutex_unlock(&journal.lock);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_StoreData_Journal(const unsigned char *data,
+                              uint32_t length,
+                              uint32_t tpm_number,
+                              const char *name)
+{
+    unsigned char *payload = NULL, *copy = NULL;
+    uint32_t payload_length = 0;
+    journal_blob *blob;
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_StoreData_Journal: name %s, %u bytes\n",
+              name, length);
+
+    if (strlen(name) >= JOURNAL_NAME_MAX)
+        return TPM_FAIL;
+
+    pthread_mutex_lock(&journal.lock);
+
+    rc = journal_load(tpm_number);
+    if (rc == TPM_SUCCESS) {
+        blob = journal_find_blob(name);
+        if (blob)
+            rc = journal_build_delta(blob->data, blob->length, data, length,
+                                     &payload, &payload_length);
+    }
+    if (rc == TPM_SUCCESS)
+        rc = TPM_Malloc(&copy, length ? length : 1);
+    if (rc == TPM_SUCCESS) {
+        memcpy(copy, data, length);
+        if (payload_length > 0)
+            rc = journal_append(JOURNAL_RECORD_DELTA, name, length,
+                                payload, payload_length);
+        else
+            rc = journal_append(JOURNAL_RECORD_FULL, name, length,
+                                data, length);
+    }
+    if (rc == TPM_SUCCESS) {
+        rc = journal_set_blob(name, copy, length);
+        copy = NULL;
+    }
+    if (rc == TPM_SUCCESS)
+        journal_request_compaction();
+
+    pthread_mutex_unlock(&journal.lock);
+
+    TPM_Free(payload);
+    TPM_Free(copy);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_DeleteName_Journal(uint32_t tpm_number,
+                               const char *name,
+                               TPM_BOOL mustExist)
+{
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_DeleteName_Journal: name %s\n", name);
+
+    pthread_mutex_lock(&journal.lock);
+
+    rc = journal_load(tpm_number);
+    if (rc == TPM_SUCCESS) {
+        if (journal_find_blob(name)) {
+            rc = journal_append(JOURNAL_RECORD_DELETE, name, 0, NULL, 0);
+            if (rc == TPM_SUCCESS)
+                journal_remove_blob(name);
+        } else if (mustExist) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_DeleteName_Journal: Error, (fatal) "
+                      "blob %s does not exist\n", name);
+            rc = TPM_FAIL;
+        }
+    }
+
+    pthread_mutex_unlock(&journal.lock);
+
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_Suspend_Journal: keep the base image and the journal
+ *                              unmodified while the files are copied;
+ *                              waits for a running compaction to finish
+ *
+ * The files may have been replaced when resuming, so they are read again
+ * on the next access and a pending compaction of the old blobs is dropped.
+ */
+static void
+SWTPM_NVRAM_Suspend_Journal(TPM_BOOL suspend)
+{
+    if (suspend) {
+        pthread_mutex_lock(&journal.lock);
+        while (journal.compacting)
+            pthread_cond_wait(&journal.cond, &journal.lock);
+    } else {
+        journal.loaded = FALSE;
+        journal.compact_requested = FALSE;
+        pthread_mutex_unlock(&journal.lock);
+    }
+}
+
+/*
+ * SWTPM_NVRAM_Shutdown_Journal: wait for a running compaction to finish
+ *                               and keep the compactor from starting
+ *                               another one, so that no base image is
+ *                               left half-written when the process exits
+ */
+static TPM_RESULT
+SWTPM_NVRAM_Shutdown_Journal(uint32_t tpm_number)
+{
+    (void)tpm_number;
+
+    pthread_mutex_lock(&journal.lock);
+    while (journal.compacting)
+        pthread_cond_wait(&journal.cond, &journal.lock);
+    journal.loaded = FALSE;
+    journal.compact_requested = FALSE;
+    pthread_mutex_unlock(&journal.lock);
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * SWTPM_NVRAM_Journal_Set_CompactSlack: set by how many bytes the journal
+ *                                       may outgrow the base image before
+ *                                       it is compacted; 0 disables the
+ *                                       compaction
+ */
+void
+SWTPM_NVRAM_Journal_Set_CompactSlack(uint32_t slack)
+{
+    pthread_mutex_lock(&journal.lock);
+    journal.compact_slack = slack;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+void
+SWTPM_NVRAM_Journal_Get_Stats(struct swtpm_journal_stats *stats)
+{
+    pthread_mutex_lock(&journal.lock);
+    *stats = journal.stats;
+    stats->journal_length = journal.journal_end;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+const struct nvram_backend_ops nvram_journal_ops = {
+    .init   = SWTPM_NVRAM_Init_Journal,
+    .load   = SWTPM_NVRAM_LoadData_Journal,
+    .store  = SWTPM_NVRAM_StoreData_Journal,
+    .delete = SWTPM_NVRAM_DeleteName_Journal,
+    .suspend = SWTPM_NVRAM_Suspend_Journal,
+    .shutdown = SWTPM_NVRAM_Shutdown_Journal,
+};
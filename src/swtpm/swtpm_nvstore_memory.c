@@ -0,0 +1,538 @@
+/*
+ * swtpm_nvstore_memory.c -- In-memory storage backend for ephemeral TPMs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This backend keeps the blobs of the TPM in process memory and never
+ * touches the file system while the TPM is running. It is meant for
+ * short-lived TPMs, for example in CI, whose state is discarded.
+ *
+ * Optionally the blobs are read from a seed directory when the backend is
+ * initialized and written to a persist directory when the TPM shuts down.
+ * Both directories use the layout of the dir backend:
+ *
+ *   dir/tpm-<nn>.<name>
+ *
+ * so a state directory of the dir backend can serve as seed and the
+ * persisted state can be used by the dir backend. The blobs are kept in
+ * the form in which they are written to files, so they are only encrypted
+ * if a file key was given.
+ *
+ * Since a store costs no more than comparing the blob to the stored one,
+ * the digest cache of swtpm_nvfile.c is not used with this backend.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
+#include "logging.h"
+
+#define MEMORY_MAX_BLOBS 64
+#define MEMORY_NAME_MAX  32
+
+typedef struct {
+    TPM_BOOL       used;
+    uint32_t       tpm_number;
+    char           name[MEMORY_NAME_MAX];
+    unsigned char  *data;
+    uint32_t       length;
+} memory_blob;
+
+static struct {
+    memory_blob blobs[MEMORY_MAX_BLOBS];
+    char        *seed_dir;
+    char        *persist_dir;
+    TPM_BOOL    seeded;
+} memory;
+
+static memory_blob *
+memory_find_blob(uint32_t tpm_number, const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < MEMORY_MAX_BLOBS; i++) {
+        if (memory.blobs[i].used &&
+            memory.blobs[i].tpm_number == tpm_number &&
+            !strcmp(memory.blobs[i].name, name))
+            return &memory.blobs[i];
+    }
+    return NULL;
+}
+
+static void
+memory_free_blob(memory_blob *blob)
+{
+    TPM_Free(blob->data);
+    memset(blob, 0, sizeof(*blob));
+}
+
+/*
+ * memory_set_blob: set the blob 'name' to 'data', which the backend takes
+ *                  ownership of
+ */
+static TPM_RESULT
+memory_set_blob(uint32_t tpm_number, const char *name,
+                unsigned char *data, uint32_t length)
+{
+    memory_blob *blob = memory_find_blob(tpm_number, name);
+    unsigned int i;
+
+    if (strlen(name) >= MEMORY_NAME_MAX) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal), blob name %s is too long\n", name);
+        return TPM_FAIL;
+    }
+
+    for (i = 0; !blob && i < MEMORY_MAX_BLOBS; i++) {
+        if (!memory.blobs[i].used) {
+            blob = &memory.blobs[i];
+            blob->used = TRUE;
+            blob->tpm_number = tpm_number;
+            strcpy(blob->name, name);
+        }
+    }
+    if (!blob) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal), too many blobs\n");
+        return TPM_SIZE;
+    }
+
+    TPM_Free(blob->data);
+    blob->data = data;
+    blob->length = length;
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+memory_read_file(const char *filename, unsigned char **data,
+                 uint32_t *length)
+{
+    struct stat statbuf;
+    TPM_RESULT rc = TPM_SUCCESS;
+    size_t done = 0;
+    ssize_t n;
+    int fd;
+
+    *data = NULL;
+    *length = 0;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &statbuf) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal) opening %s: %s\n",
+                  filename, strerror(errno));
+        rc = TPM_FAIL;
+    } else if (statbuf.st_size > (off_t)UINT32_MAX) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal), file %s is too big\n", filename);
+        rc = TPM_FAIL;
+    }
+    if (rc == TPM_SUCCESS)
+        rc = TPM_Malloc(data, statbuf.st_size ? statbuf.st_size : 1);
+    while (rc == TPM_SUCCESS && done < (size_t)statbuf.st_size) {
+        n = read(fd, &(*data)[done], statbuf.st_size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            logprintf(STDERR_FILENO,
+                      "Memory: Error (fatal) reading %s: %s\n",
+                      filename, n < 0 ? strerror(errno) : "short read");
+            rc = TPM_FAIL;
+            break;
+        }
+        done += n;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (rc == TPM_SUCCESS) {
+        *length = statbuf.st_size;
+    } else {
+        TPM_Free(*data);
+        *data = NULL;
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+memory_write_file(const char *filename, const unsigned char *data,
+                  uint32_t length)
+{
+    char tmpname[FILENAME_MAX];
+    TPM_RESULT rc = TPM_SUCCESS;
+    size_t done = 0;
+    ssize_t n;
+    int fd;
+
+    if ((size_t)snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >=
+        sizeof(tmpname)) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal), file name %s is too long\n",
+                  filename);
+        return TPM_FAIL;
+    }
+
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal) creating %s: %s\n",
+                  tmpname, strerror(errno));
+        return TPM_FAIL;
+    }
+    while (rc == TPM_SUCCESS && done < length) {
+        n = write(fd, &data[done], length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            logprintf(STDERR_FILENO,
+                      "Memory: Error (fatal) writing %s: %s\n",
+                      tmpname, strerror(errno));
+            rc = TPM_FAIL;
+            break;
+        }
+        done += n;
+    }
+    if (rc == TPM_SUCCESS && fsync(fd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal) syncing %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (close(fd) < 0 && rc == TPM_SUCCESS)
+        rc = TPM_FAIL;
+    if (rc == TPM_SUCCESS && rename(tmpname, filename) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal) renaming %s: %s\n",
+                  tmpname, strerror(errno));
+        rc = TPM_FAIL;
+    }
+    if (rc != TPM_SUCCESS)
+        unlink(tmpname);
+
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_Memory_Load: replace the blobs of the TPM with those found in
+ *                          the directory 'dir'
+ */
+TPM_RESULT
+SWTPM_NVRAM_Memory_Load(const char *dir, uint32_t tpm_number)
+{
+    char prefix[32], filename[FILENAME_MAX];
+    const char *name;
+    unsigned char *data;
+    uint32_t length;
+    struct dirent *de;
+    TPM_RESULT rc = TPM_SUCCESS;
+    unsigned int i;
+    DIR *d;
+
+    TPM_DEBUG(" SWTPM_NVRAM_Memory_Load: %s\n", dir);
+
+    d = opendir(dir);
+    if (!d) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal) opening directory %s: %s\n",
+                  dir, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    for (i = 0; i < MEMORY_MAX_BLOBS; i++) {
+        if (memory.blobs[i].used && memory.blobs[i].tpm_number == tpm_number)
+            memory_free_blob(&memory.blobs[i]);
+    }
+
+    snprintf(prefix, sizeof(prefix), "tpm-%02lx.",
+             SWTPM_NVRAM_FileNumber(tpm_number));
+
+    while (rc == TPM_SUCCESS && (de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, prefix, strlen(prefix)))
+            continue;
+        name = &de->d_name[strlen(prefix)];
+        /* skip leftovers of interrupted writes and other backends' files */
+        if (name[0] == '\0' || strchr(name, '.'))
+            continue;
+        if ((size_t)snprintf(filename, sizeof(filename), "%s/%s", dir,
+                             de->d_name) >= sizeof(filename))
+            continue;
+        rc = memory_read_file(filename, &data, &length);
+        if (rc == TPM_SUCCESS) {
+            rc = memory_set_blob(tpm_number, name, data, length);
+            if (rc != TPM_SUCCESS)
+                TPM_Free(data);
+        }
+    }
+    closedir(d);
+
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_Memory_Dump: write the blobs of the TPM into the directory
+ *                          'dir' and remove the files of blobs that no
+ *                          longer exist
+ */
+TPM_RESULT
+SWTPM_NVRAM_Memory_Dump(const char *dir, uint32_t tpm_number)
+{
+    char prefix[32], filename[FILENAME_MAX];
+    const char *name;
+    struct dirent *de;
+    TPM_RESULT rc = TPM_SUCCESS;
+    unsigned int i;
+    DIR *d;
+    int fd;
+
+    TPM_DEBUG(" SWTPM_NVRAM_Memory_Dump: %s\n", dir);
+
+    if (mkdir(dir, 0750) < 0 && errno != EEXIST) {
+        logprintf(STDERR_FILENO,
+                  "Memory: Error (fatal) creating directory %s: %s\n",
+                  dir, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    snprintf(prefix, sizeof(prefix), "tpm-%02lx.",
+             SWTPM_NVRAM_FileNumber(tpm_number));
+
+    for (i = 0; rc == TPM_SUCCESS && i < MEMORY_MAX_BLOBS; i++) {
+        if (!memory.blobs[i].used || memory.blobs[i].tpm_number != tpm_number)
+            continue;
+        if ((size_t)snprintf(filename, sizeof(filename), "%s/%s%s", dir,
+                             prefix, memory.blobs[i].name) >=
+            sizeof(filename)) {
+            logprintf(STDERR_FILENO,
+                      "Memory: Error (fatal), path %s is too long\n", dir);
+            rc = TPM_FAIL;
+            break;
+        }
+        rc = memory_write_file(filename, memory.blobs[i].data,
+                               memory.blobs[i].length);
+    }
+
+    d = opendir(dir);
+    while (rc == TPM_SUCCESS && d && (de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, prefix, strlen(prefix)))
+            continue;
+        name = &de->d_name[strlen(prefix)];
+        if (name[0] == '\0' || strchr(name, '.') ||
+            memory_find_blob(tpm_number, name))
+            continue;
+        if ((size_t)snprintf(filename, sizeof(filename), "%s/%s", dir,
+                             de->d_name) < sizeof(filename))
+            unlink(filename);
+    }
+    if (d)
+        closedir(d);
+
+    if (rc == TPM_SUCCESS) {
+        fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+memory_set_dir(char **dest, const char *dir)
+{
+    char *copy = NULL;
+
+    if (dir) {
+        copy = strdup(dir);
+        if (!copy) {
+            logprintf(STDERR_FILENO,
+                      "Memory: Out of memory.\n");
+            return TPM_SIZE;
+        }
+    }
+    free(*dest);
+    *dest = copy;
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * SWTPM_NVRAM_Memory_Set_SeedDir: set the directory the blobs are read from
+ *                                 when the backend is initialized
+ */
+TPM_RESULT
+SWTPM_NVRAM_Memory_Set_SeedDir(const char *dir)
+{
+    memory.seeded = FALSE;
+    return memory_set_dir(&memory.seed_dir, dir);
+}
+
+/*
+ * SWTPM_NVRAM_Memory_Set_PersistDir: set the directory the blobs are
+ *                                    written to when the TPM shuts down
+ */
+TPM_RESULT
+SWTPM_NVRAM_Memory_Set_PersistDir(const char *dir)
+{
+    return memory_set_dir(&memory.persist_dir, dir);
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_Init_Memory(uint32_t tpm_number)
+{
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    /* the blobs are only seeded once; later calls must not reset them */
+    if (memory.seed_dir && !memory.seeded) {
+        rc = SWTPM_NVRAM_Memory_Load(memory.seed_dir, tpm_number);
+        memory.seeded = (rc == TPM_SUCCESS);
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LoadData_Memory(unsigned char **data,     /* freed by caller */
+                            uint32_t *length,
+                            uint32_t tpm_number,
+                            const char *name)
+{
+    memory_blob *blob = memory_find_blob(tpm_number, name);
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_LoadData_Memory: name %s\n", name);
+    *data = NULL;
+    *length = 0;
+
+    if (!blob)
+        return TPM_RETRY;
+
+    rc = TPM_Malloc(data, blob->length ? blob->length : 1);
+    if (rc == TPM_SUCCESS) {
+        memcpy(*data, blob->data, blob->length);
+        *length = blob->length;
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_StoreData_Memory(const unsigned char *data,
+                             uint32_t length,
+                             uint32_t tpm_number,
+                             const char *name)
+{
+    memory_blob *blob = memory_find_blob(tpm_number, name);
+    unsigned char *copy = NULL;
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_StoreData_Memory: name %s, %u bytes\n",
+              name, length);
+
+    if (blob && blob->length == length &&
+        !memcmp(blob->data, data, length))
+        return TPM_SUCCESS;
+
+    if (blob && blob->length == length) {
+        /* same size; overwrite in place */
+        memcpy(blob->data, data, length);
+        return TPM_SUCCESS;
+    }
+
+    rc = TPM_Malloc(&copy, length ? length : 1);
+    if (rc == TPM_SUCCESS) {
+        memcpy(copy, data, length);
+        rc = memory_set_blob(tpm_number, name, copy, length);
+        if (rc != TPM_SUCCESS)
+            TPM_Free(copy);
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_DeleteName_Memory(uint32_t tpm_number,
+                              const char *name,
+                              TPM_BOOL mustExist)
+{
+    memory_blob *blob = memory_find_blob(tpm_number, name);
+
+    TPM_DEBUG(" SWTPM_NVRAM_DeleteName_Memory: name %s\n", name);
+
+    if (blob) {
+        memory_free_blob(blob);
+    } else if (mustExist) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_DeleteName_Memory: Error, (fatal) "
+                  "blob %s does not exist\n", name);
+        return TPM_FAIL;
+    }
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_Shutdown_Memory(uint32_t tpm_number)
+{
+    if (!memory.persist_dir)
+        return TPM_SUCCESS;
+
+    return SWTPM_NVRAM_Memory_Dump(memory.persist_dir, tpm_number);
+}
+
+const struct nvram_backend_ops nvram_memory_ops = {
+    .flags    = NVRAM_BACKEND_FLAG_MEMORY,
+    .init     = SWTPM_NVRAM_Init_Memory,
+    .load     = SWTPM_NVRAM_LoadData_Memory,
+    .store    = SWTPM_NVRAM_StoreData_Memory,
+    .delete   = SWTPM_NVRAM_DeleteName_Memory,
+    .shutdown = SWTPM_NVRAM_Shutdown_Memory,
+};
@@ -0,0 +1,338 @@
+/*
+ * swtpm_rekey.c -- Re-encrypt the TPM state of many TPMs with a new key
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_nvfilename.h>
+
+#include "common.h"
+#include "logging.h"
+#include "swtpm_fleet.h"
+#include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
+#include "swtpm_time.h"
+
+static const char *blobnames[] = {
+    TPM_PERMANENT_ALL_NAME,
+    TPM_VOLATILESTATE_NAME,
+    TPM_SAVESTATE_NAME,
+};
+
+enum rekey_status {
+    REKEY_DONE = 0,   /* the blobs were re-encrypted */
+    REKEY_UNCHANGED,  /* the blobs were encrypted with the new key already */
+    REKEY_FAILED,
+};
+
+static void usage(FILE *file, const char *prgname)
+{
+    fprintf(file,
+    "Usage: %s [options] [<dir> ...]\n"
+    "\n"
+    "Re-encrypt the state of TPMs that are not running with a new key.\n"
+    "The state directories are processed by several worker processes in\n"
+    "parallel.\n"
+    "\n"
+    "The following options are supported:\n"
+    "\n"
+    "--key file=<path>[,mode=aes-cbc|aes-256-gcm][,format=hex|binary]\n"
+    "      pwdfile=<path>[,mode=aes-cbc|aes-256-gcm]\n"
+    "                      : the key the state is currently encrypted with;\n"
+    "                        omit it if the state is not encrypted\n"
+    "--new-key file=<path>[,mode=aes-cbc|aes-256-gcm][,format=hex|binary]\n"
+    "          pwdfile=<path>[,mode=aes-cbc|aes-256-gcm]\n"
+    "                      : the key to encrypt the state with\n"
+    "--tpmstate backend=dir|container|cas|journal[,objects=<dir>]\n"
+    "           [,number=<n>]\n"
+    "                      : how the state is stored; defaults to dir\n"
+    "--dirs-from <file>    : read further state directories from the file,\n"
+    "                        one per line; '-' reads them from stdin\n"
+    "--workers <n>         : the number of worker processes; defaults to\n"
+    "                        the number of online CPUs\n"
+    "--progress <file>     : append the directories whose state has been\n"
+    "                        re-encrypted to the file and skip those that\n"
+    "                        are listed in it already\n"
+    "-h|--help             : display this help screen and terminate\n"
+    "\n",
+    prgname);
+}
+
+/*
+ * rekey_dir: re-encrypt the state blobs in the given state directory
+ */
+static enum rekey_status rekey_dir(const char *dir)
+{
+    TPM_BOOL rekeyed, any_rekeyed = FALSE, found = FALSE;
+    TPM_RESULT rc = TPM_SUCCESS;
+    size_t i;
+
+    if (setenv("TPM_PATH", dir, 1) != 0 ||
+        SWTPM_NVRAM_Init() != TPM_SUCCESS)
+        return REKEY_FAILED;
+
+    for (i = 0; i < sizeof(blobnames) / sizeof(blobnames[0]); i++) {
+        rc = SWTPM_NVRAM_Rekey(0, blobnames[i], &rekeyed);
+        if (rc == TPM_RETRY)
+            continue;
+        if (rc != TPM_SUCCESS)
+            return REKEY_FAILED;
+        found = TRUE;
+        any_rekeyed |= rekeyed;
+    }
+
+    if (!found)
+        return REKEY_FAILED;
+
+    return any_rekeyed ? REKEY_DONE : REKEY_UNCHANGED;
+}
+
+/*
+ * rekey_worker_init: silence a worker process; the parent reports the result
+ *                    of each directory, and decrypting with the wrong key
+ *                    would also print errors on stdout
+ */
+static void rekey_worker_init(void)
+{
+    int fd;
+
+    log_init("-");
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+        _exit(EXIT_FAILURE);
+    close(fd);
+}
+
+static void rekey_worker_exit(void)
+{
+    SWTPM_NVRAM_Shutdown();
+}
+
+/*
+ * rekey_work: re-encrypt the state in a directory in a worker process and
+ *             report the rekey_status
+ */
+static void rekey_work(size_t idx, const char *dir, char *result,
+                       size_t resultlen)
+{
+    snprintf(result, resultlen, "%d", (int)rekey_dir(dir));
+}
+
+struct rekey_results {
+    const struct dirlist *work;
+    FILE *progress;
+    unsigned int n_done;
+    unsigned int n_unchanged;
+    unsigned int n_failed;
+};
+
+/*
+ * rekey_result: count the result of a directory and record it in the
+ *               progress file
+ */
+static void rekey_result(size_t idx, const char *result, void *opaque)
+{
+    struct rekey_results *res = opaque;
+
+    switch (result ? atoi(result) : REKEY_FAILED) {
+    case REKEY_DONE:
+        res->n_done++;
+        break;
+    case REKEY_UNCHANGED:
+        res->n_unchanged++;
+        break;
+    default:
+        res->n_failed++;
+        fprintf(stderr, "Could not re-encrypt the TPM state in %s.\n",
+                res->work->dirs[idx]);
+        return;
+    }
+    if (res->progress) {
+        fprintf(res->progress, "%s\n", res->work->dirs[idx]);
+        fflush(res->progress);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, longindex;
+    char *keydata = NULL, *newkeydata = NULL, *tpmstatedata = NULL;
+    const char *progressfile = NULL;
+    struct dirlist dirs = { NULL, 0, 0 };
+    struct dirlist done = { NULL, 0, 0 };
+    struct dirlist work = { NULL, 0, 0 };
+    struct fleet_options fopts = {
+        .worker_init = rekey_worker_init,
+        .worker_exit = rekey_worker_exit,
+    };
+    struct rekey_results res = { &work, NULL, 0, 0, 0 };
+    struct timespec start;
+    unsigned long started;
+    int ret = EXIT_FAILURE;
+    double elapsed;
+    size_t i;
+    static struct option longopts[] = {
+        {"key"       , required_argument, 0, 'k'},
+        {"new-key"   , required_argument, 0, 'n'},
+        {"tpmstate"  , required_argument, 0, 's'},
+        {"dirs-from" , required_argument, 0, 'd'},
+        {"workers"   , required_argument, 0, 'w'},
+        {"progress"  , required_argument, 0, 'p'},
+        {"help"      ,       no_argument, 0, 'h'},
+        {NULL        , 0                , 0, 0  },
+    };
+
+    while (TRUE) {
+        opt = getopt_long(argc, argv, "h", longopts, &longindex);
+
+        if (opt == -1)
+            break;
+
+        switch (opt) {
+        case 'k':
+            keydata = optarg;
+            break;
+
+        case 'n':
+            newkeydata = optarg;
+            break;
+
+        case 's':
+            tpmstatedata = optarg;
+            break;
+
+        case 'd':
+            if (SWTPM_DirList_Read(&dirs, optarg, FALSE) < 0)
+                exit(EXIT_FAILURE);
+            break;
+
+        case 'w':
+            if (SWTPM_Fleet_Parse_Workers(optarg, &fopts.workers) < 0)
+                exit(EXIT_FAILURE);
+            break;
+
+        case 'p':
+            progressfile = optarg;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            exit(EXIT_SUCCESS);
+
+        default:
+            usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = optind; i < (size_t)argc; i++)
+        if (SWTPM_DirList_Add(&dirs, argv[i]) < 0)
+            exit(EXIT_FAILURE);
+
+    if (!newkeydata) {
+        fprintf(stderr, "Missing --new-key option.\n");
+        usage(stderr, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (handle_key_options(keydata) < 0 ||
+        handle_new_key_options(newkeydata) < 0 ||
+        handle_tpmstate_options(tpmstatedata) < 0)
+        exit(EXIT_FAILURE);
+
+    if (SWTPM_NVRAM_Is_Ephemeral()) {
+        fprintf(stderr, "The memory backend keeps no state to re-encrypt.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* skip the directories that were done in an earlier run */
+    if (progressfile &&
+        SWTPM_DirList_Read(&done, progressfile, TRUE) < 0)
+        exit(EXIT_FAILURE);
+    if (SWTPM_DirList_Skip(&work, &dirs, &done) < 0)
+        exit(EXIT_FAILURE);
+
+    if (work.n == 0) {
+        printf("Nothing to re-encrypt.\n");
+        exit(EXIT_SUCCESS);
+    }
+
+    if (progressfile) {
+        res.progress = fopen(progressfile, "a");
+        if (!res.progress) {
+            fprintf(stderr, "Could not open %s: %s\n",
+                    progressfile, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (SWTPM_Fleet_Run(&work, &fopts, rekey_work, rekey_result, &res,
+                        &started) < 0)
+        exit(EXIT_FAILURE);
+
+    elapsed = SWTPM_Time_Elapsed_Ns(&start) / 1E9;
+
+    printf("Re-encrypted the TPM state in %u directories, %u were "
+           "re-encrypted already, %u failed.\n"
+           "%lu worker(s) took %.2f s, %.0f directories per second.\n",
+           res.n_done, res.n_unchanged, res.n_failed,
+           started, elapsed, elapsed > 0 ? work.n / elapsed : 0);
+
+    if (res.progress && fclose(res.progress) != 0) {
+        fprintf(stderr, "Could not write %s: %s\n",
+                progressfile, strerror(errno));
+        res.n_failed++;
+    }
+
+    if (res.n_failed == 0)
+        ret = EXIT_SUCCESS;
+
+    SWTPM_DirList_Free(&dirs);
+    SWTPM_DirList_Free(&done);
+    SWTPM_DirList_Free(&work);
+
+    return ret;
+}
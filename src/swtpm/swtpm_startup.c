@@ -0,0 +1,206 @@
+/*
+ * swtpm_startup.c -- Startup sequence run by swtpm at launch
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_library.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_startup.h"
+#include "swtpm_time.h"
+#include "logging.h"
+
+struct startup_command {
+    const char *name;
+    unsigned char buf[12];
+    uint32_t count;
+    /* whether an error code returned by the TPM is logged */
+    TPM_BOOL report_error;
+};
+
+static const struct startup_command tsc_pp_cmd_enable = {
+    .name = "TSC_PhysicalPresence",
+    .buf = {
+        0x00, 0xc1, 0x00, 0x00, 0x00, 0x0c, 0x40, 0x00, 0x00, 0x0a,
+        0x00, 0x20
+    },
+    .count = 12,
+    /* fails once physicalPresenceLifetimeLock is set */
+    .report_error = FALSE,
+};
+
+static const struct startup_command tsc_pp_present = {
+    .name = "TSC_PhysicalPresence",
+    .buf = {
+        0x00, 0xc1, 0x00, 0x00, 0x00, 0x0c, 0x40, 0x00, 0x00, 0x0a,
+        0x00, 0x08
+    },
+    .count = 12,
+    .report_error = TRUE,
+};
+
+static const struct startup_command physical_enable = {
+    .name = "TPM_PhysicalEnable",
+    .buf = {
+        0x00, 0xc1, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x6f
+    },
+    .count = 10,
+    .report_error = TRUE,
+};
+
+static const struct startup_command physical_set_activated = {
+    .name = "TPM_PhysicalSetDeactivated",
+    .buf = {
+        0x00, 0xc1, 0x00, 0x00, 0x00, 0x0b, 0x00, 0x00, 0x00, 0x72,
+        0x00
+    },
+    .count = 11,
+    .report_error = TRUE,
+};
+
+static const struct startup_command continue_selftest = {
+    .name = "TPM_ContinueSelfTest",
+    .buf = {
+        0x00, 0xc1, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x53
+    },
+    .count = 10,
+    .report_error = TRUE,
+};
+
+/*
+ * Process a single command; the response buffer is reused across
+ * the commands of the startup sequence.
+ */
+static TPM_RESULT
+startup_process(const struct startup_command *cmd,
+                unsigned char **rbuffer, uint32_t *rtotal)
+{
+    unsigned char command[sizeof(cmd->buf)];
+    uint32_t rlength = 0;
+    uint32_t returncode;
+    TPM_RESULT rc;
+
+    memcpy(command, cmd->buf, cmd->count);
+
+    rc = TPMLIB_Process(rbuffer, &rlength, rtotal, command, cmd->count);
+    if (rc != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not process %s: 0x%08x\n", cmd->name, rc);
+        return rc;
+    }
+    if (rlength < 10) {
+        logprintf(STDERR_FILENO,
+                  "Error: Short response to %s.\n", cmd->name);
+        return TPM_FAIL;
+    }
+
+    returncode = ((uint32_t)(*rbuffer)[6] << 24) |
+                 ((uint32_t)(*rbuffer)[7] << 16) |
+                 ((uint32_t)(*rbuffer)[8] << 8) |
+                 (uint32_t)(*rbuffer)[9];
+    if (returncode != TPM_SUCCESS && cmd->report_error)
+        logprintf(STDERR_FILENO,
+                  "%s returned error code 0x%08x\n", cmd->name, returncode);
+
+    return TPM_SUCCESS;
+}
+
+TPM_RESULT
+SWTPM_Startup_Run(unsigned int flags, const struct timespec *init_start)
+{
+    struct startup_command startup = {
+        .name = "TPM_Startup",
+        .buf = {
+            0x00, 0xc1, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x99,
+            0x00, 0x01
+        },
+        .count = 12,
+        .report_error = TRUE,
+    };
+    const struct startup_command *cmds[6];
+    unsigned char *rbuffer = NULL;
+    uint32_t rtotal = 0;
+    struct timespec seq_start, end;
+    size_t ncmds = 0, i;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    if (flags == 0)
+        return TPM_SUCCESS;
+
+    clock_gettime(CLOCK_MONOTONIC, &seq_start);
+
+    if (flags & (STARTUP_FLAG_CLEAR | STARTUP_FLAG_STATE |
+                 STARTUP_FLAG_DEACTIVATED)) {
+        if (flags & STARTUP_FLAG_STATE)
+            startup.buf[11] = 0x02;
+        else if (flags & STARTUP_FLAG_DEACTIVATED)
+            startup.buf[11] = 0x03;
+        cmds[ncmds++] = &startup;
+    }
+    if (flags & (STARTUP_FLAG_ENABLE | STARTUP_FLAG_ACTIVATE)) {
+        /* both need physical presence */
+        cmds[ncmds++] = &tsc_pp_cmd_enable;
+        cmds[ncmds++] = &tsc_pp_present;
+    }
+    if (flags & STARTUP_FLAG_ENABLE)
+        cmds[ncmds++] = &physical_enable;
+    if (flags & STARTUP_FLAG_ACTIVATE)
+        cmds[ncmds++] = &physical_set_activated;
+    if (flags & STARTUP_FLAG_SELFTEST)
+        cmds[ncmds++] = &continue_selftest;
+
+    for (i = 0; rc == TPM_SUCCESS && i < ncmds; i++)
+        rc = startup_process(cmds[i], &rbuffer, &rtotal);
+
+    TPM_Free(rbuffer);
+
+    if (rc == TPM_SUCCESS) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        logprintf(STDOUT_FILENO,
+                  "TPM is usable %" PRIu64 " us after the start of its "
+                  "initialization; the startup sequence took %" PRIu64
+                  " us.\n",
+                  SWTPM_Time_Diff_Ns(init_start, &end) / 1000,
+                  SWTPM_Time_Diff_Ns(&seq_start, &end) / 1000);
+    }
+
+    return rc;
+}
@@ -0,0 +1,59 @@
+/*
+ * swtpm_startup.h -- Startup sequence run by swtpm at launch
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_STARTUP_H_
+#define _SWTPM_STARTUP_H_
+
+#include <time.h>
+
+#include <libtpms/tpm_types.h>
+
+/* the commands of the --startup option */
+#define STARTUP_FLAG_CLEAR        (1 << 0)
+#define STARTUP_FLAG_STATE        (1 << 1)
+#define STARTUP_FLAG_DEACTIVATED  (1 << 2)
+#define STARTUP_FLAG_ENABLE       (1 << 3)
+#define STARTUP_FLAG_ACTIVATE     (1 << 4)
+#define STARTUP_FLAG_SELFTEST     (1 << 5)
+
+/*
+ * Run the TPM commands selected by 'flags' through TPMLIB_Process(), the
+ * same ones swtpm_bios would send, and log the time since 'init_start',
+ * which was taken before TPMLIB_MainInit().
+ */
+TPM_RESULT SWTPM_Startup_Run(unsigned int flags,
+                             const struct timespec *init_start);
+
+#endif /* _SWTPM_STARTUP_H_ */
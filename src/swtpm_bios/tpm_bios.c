@@ -37,120 +37,332 @@
  */
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <stdlib.h>
 #include <netdb.h>
 #include <sys/un.h>
 
-static int open_connection(void)
+#define TPM_HEADER_SIZE 10
+
+/* the maximum number of commands in the startup sequence */
+#define MAX_COMMANDS 8
+
+/*
+ * A connection to the TPM. All commands are sent over one connection. On a
+ * socket the commands following the first one are sent at once and the
+ * responses are read as they arrive; a character device takes one command
+ * at a time.
+ */
+struct tpm_connection {
+	int fd;
+	bool is_socket;
+	bool is_tcp;
+	/* the number of responses received over this connection */
+	unsigned int answered;
+	/* responses received but not consumed yet */
+	unsigned char buffer[4096];
+	size_t buffered;
+};
+
+/* a command of the startup sequence */
+struct tpm_command {
+	const char *name;
+	unsigned char buf[12];
+	size_t count;
+	/* whether to report an error code returned by the TPM */
+	bool report_error;
+};
+
+/* the address of the TCP or Unix socket, resolved once */
+static struct sockaddr_storage sock_addr;
+static socklen_t sock_addrlen;
+
+static int resolve_address(void)
 {
-	int fd = -1, tcp_device_port;
-	char *tcp_device_hostname = NULL;
-	char *tcp_device_port_string = NULL;
+	struct addrinfo hints, *ai;
+	struct sockaddr_un *sun;
+	const char *hostname, *port, *path;
+	int err;
 
 	if (getenv("TCSD_USE_TCP_DEVICE")) {
-		if ((tcp_device_hostname = getenv("TCSD_TCP_DEVICE_HOSTNAME")) == NULL)
-			tcp_device_hostname = "localhost";
-		if ((tcp_device_port_string = getenv("TCSD_TCP_DEVICE_PORT")) != NULL)
-			tcp_device_port = atoi(tcp_device_port_string);
-		else
-			tcp_device_port = 6545;
-
-		fd = socket(AF_INET, SOCK_STREAM, 0);
-		if (fd >= 0) {
-			struct hostent *host = gethostbyname(tcp_device_hostname);
-			if (host != NULL) {
-				struct sockaddr_in addr;
-				memset(&addr, 0x0, sizeof(addr));
-				addr.sin_family = host->h_addrtype;
-				addr.sin_port   = htons(tcp_device_port);
-				memcpy(&addr.sin_addr,
-						host->h_addr,
-						host->h_length);
-				if (connect(fd,	(struct sockaddr *)&addr,
-					    sizeof(addr)) < 0) {
-					close(fd);
-					fd = -1;
-				}
-			} else {
-				close (fd);
-				fd = -1;
-			}
+		if ((hostname = getenv("TCSD_TCP_DEVICE_HOSTNAME")) == NULL)
+			hostname = "localhost";
+		if ((port = getenv("TCSD_TCP_DEVICE_PORT")) == NULL)
+			port = "6545";
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		err = getaddrinfo(hostname, port, &hints, &ai);
+		if (err) {
+			printf("Could not resolve %s: %s\n", hostname,
+			       gai_strerror(err));
+			return -1;
+		}
+		memcpy(&sock_addr, ai->ai_addr, ai->ai_addrlen);
+		sock_addrlen = ai->ai_addrlen;
+		freeaddrinfo(ai);
+	} else if ((path = getenv("TPM_UNIX_SOCKET")) != NULL) {
+		sun = (struct sockaddr_un *)&sock_addr;
+		if (strlen(path) >= sizeof(sun->sun_path)) {
+			printf("Unix socket path '%s' is too long.\n", path);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, path);
+		sock_addrlen = sizeof(*sun);
+	}
+
+	return 0;
+}
+
+static int open_connection(struct tpm_connection *conn)
+{
+	int fd = -1;
+
+	conn->answered = 0;
+	conn->buffered = 0;
+
+	if (sock_addrlen) {
+		conn->is_socket = true;
+		conn->is_tcp = (sock_addr.ss_family != AF_UNIX);
+
+		fd = socket(sock_addr.ss_family, SOCK_STREAM, 0);
+		if (fd >= 0 &&
+		    connect(fd, (struct sockaddr *)&sock_addr,
+			    sock_addrlen) < 0) {
+			close(fd);
+			fd = -1;
 		}
 
 		if (fd < 0) {
-			printf("Could not connect using TCP socket.\n");
+			printf("Could not connect using %s socket.\n",
+			       sock_addr.ss_family == AF_UNIX ? "Unix" : "TCP");
 		}
 	} else {
 	        char *devname = getenv("TPM_DEVICE");
 	        if (!devname)
 	                devname = "/dev/tpm0";
 
+		conn->is_socket = false;
+		conn->is_tcp = false;
+
 		fd = open(devname, O_RDWR );
 		if ( fd < 0 ) {
 			printf( "Unable to open device '%s'.\n", devname );
 		}
 	}
 
+	conn->fd = fd;
+
 	return fd;
 }
 
+static void close_connection(struct tpm_connection *conn)
+{
+	if (conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+}
+
+static uint32_t get_uint32(const unsigned char *buf)
+{
+	uint32_t val;
+
+	memcpy(&val, buf, sizeof(val));
 
-static int talk(const unsigned char *buf, size_t count, int *tpm_errcode)
+	return ntohl(val);
+}
+
+/*
+ * Write the given commands in one go.
+ *
+ * Returns 0 on success, 1 if the server closed the connection, -1 on error.
+ */
+static int write_commands(struct tpm_connection *conn,
+			  const struct tpm_command *cmds, size_t ncmds)
 {
+	unsigned char buffer[sizeof(cmds[0].buf) * MAX_COMMANDS];
+	size_t count = 0, written = 0, i;
 	ssize_t len;
-	unsigned int pkt_len;
-	int rc = -1;
-	int fd;
-	unsigned char buffer[1024];
 
-	fd = open_connection();
-	if (fd < 0) {
-		goto err_exit;
+	for (i = 0; i < ncmds; i++) {
+		memcpy(&buffer[count], cmds[i].buf, cmds[i].count);
+		count += cmds[i].count;
 	}
 
-	len = write(fd, buf, count);
-	if (len < 0 || (size_t)len != count) {
-		printf("Write to file descriptor failed.\n");
-		goto err_close_fd;
+	while (written < count) {
+		len = write(conn->fd, &buffer[written], count - written);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (conn->is_socket &&
+			    (errno == EPIPE || errno == ECONNRESET))
+				return 1;
+			printf("Write to file descriptor failed.\n");
+			return -1;
+		}
+		/* a device takes a command in one write() */
+		if (!conn->is_socket && (size_t)len != count) {
+			printf("Write to file descriptor failed.\n");
+			return -1;
+		}
+		written += len;
 	}
 
-	len = read(fd, buffer, sizeof(buffer));
-	if (len < 0) {
-		printf("Read from file descriptor failed.\n");
-		goto err_close_fd;
-	}
+	return 0;
+}
+
+/*
+ * Read the next response; responses may arrive in pieces and, if commands
+ * were pipelined, several of them may arrive at once.
+ *
+ * Returns 0 on success, 1 if the server closed the connection, -1 on error.
+ */
+static int read_response(struct tpm_connection *conn, int *tpm_errcode)
+{
+	uint32_t pkt_len;
+	ssize_t len;
 
-	if (len < 10) {
-		printf("Returned packet is too short.\n");
-		goto err_close_fd;
+	while (true) {
+		if (conn->buffered >= TPM_HEADER_SIZE) {
+			pkt_len = get_uint32(&conn->buffer[2]);
+			if (pkt_len < TPM_HEADER_SIZE ||
+			    pkt_len > sizeof(conn->buffer) ||
+			    (!conn->is_socket && conn->buffered != pkt_len)) {
+				printf("Malformed response.\n");
+				return -1;
+			}
+			if (conn->buffered >= pkt_len)
+				break;
+		}
+
+#ifdef TCP_QUICKACK
+		/*
+		 * acknowledge each response right away; a server that has
+		 * not disabled Nagle's algorithm otherwise holds back the
+		 * responses to pipelined commands until our delayed ACK
+		 */
+		if (conn->is_tcp) {
+			int one = 1;
+
+			setsockopt(conn->fd, IPPROTO_TCP, TCP_QUICKACK,
+				   &one, sizeof(one));
+		}
+#endif
+		len = read(conn->fd, &conn->buffer[conn->buffered],
+			   sizeof(conn->buffer) - conn->buffered);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (conn->is_socket && errno == ECONNRESET)
+				return 1;
+			printf("Read from file descriptor failed.\n");
+			return -1;
+		}
+		if (len == 0) {
+			if (conn->is_socket && conn->buffered == 0)
+				return 1;
+			printf("Returned packet is too short.\n");
+			return -1;
+		}
+		conn->buffered += len;
 	}
 
-	pkt_len = ntohl( *((uint32_t *)(buffer + 2)));
-	if ((unsigned int)len != pkt_len) {
-		printf("Malformed response.\n");
-		goto err_close_fd;
+	*tpm_errcode = get_uint32(&conn->buffer[6]);
+
+	conn->buffered -= pkt_len;
+	memmove(conn->buffer, &conn->buffer[pkt_len], conn->buffered);
+	conn->answered++;
+
+	return 0;
+}
+
+/*
+ * Send the commands to the TPM and read the responses.
+ *
+ * The first command is sent by itself; once the server has answered over a
+ * socket, the remaining ones are sent together. A server that closes the
+ * connection after each command gets one connection per command instead.
+ *
+ * Returns 0 if all commands were sent and answered, -1 otherwise.
+ */
+static int talk(const struct tpm_command *cmds, size_t ncmds)
+{
+	struct tpm_connection conn = {
+		.fd = -1,
+	};
+	bool one_per_connection = false;
+	size_t next = 0, tosend, i;
+	int rc = 0, tpm_errcode;
+
+	while (next < ncmds) {
+		if (conn.fd < 0 && open_connection(&conn) < 0)
+			return -1;
+
+		tosend = 1;
+		if (conn.is_socket && conn.answered > 0)
+			tosend = ncmds - next;
+
+		rc = write_commands(&conn, &cmds[next], tosend);
+		for (i = 0; rc == 0 && i < tosend; i++) {
+			rc = read_response(&conn, &tpm_errcode);
+			if (rc == 0) {
+				if (tpm_errcode != 0 && cmds[next].report_error)
+					printf("%s returned error code "
+					       "0x%08x\n", cmds[next].name,
+					       tpm_errcode);
+				next++;
+			}
+		}
+
+		if (rc > 0 && conn.answered > 0) {
+			/* the server closed the connection after a command */
+			one_per_connection = true;
+			rc = 0;
+		}
+		if (rc != 0) {
+			if (rc > 0)
+				printf("The TPM closed the connection.\n");
+			close_connection(&conn);
+			return -1;
+		}
+		if (one_per_connection)
+			close_connection(&conn);
 	}
 
-	*tpm_errcode = ntohl( *((uint32_t *)(buffer + 6)));
+	close_connection(&conn);
 
-	rc = 0;
+	return 0;
+}
 
-err_close_fd:
-	close(fd);
-	fd = -1;
 
-err_exit:
-	return rc;
+static void add_command(struct tpm_command *cmds, size_t *ncmds,
+			const char *name, const unsigned char *buf,
+			size_t count, bool report_error)
+{
+	cmds[*ncmds].name = name;
+	memcpy(cmds[*ncmds].buf, buf, count);
+	cmds[*ncmds].count = count;
+	cmds[*ncmds].report_error = report_error;
+	(*ncmds)++;
 }
 
 
-static int TPM_Startup(unsigned char parm, int *tpm_errcode)
+static void TPM_Startup(struct tpm_command *cmds, size_t *ncmds,
+			unsigned char parm)
 {
 	unsigned char tpm_startup[] = {
 		0x00, 0xc1, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x99,
@@ -158,11 +370,13 @@ static int TPM_Startup(unsigned char parm, int *tpm_errcode)
 	};
 	tpm_startup[11] = parm;
 
-	return talk(tpm_startup, sizeof(tpm_startup), tpm_errcode);
+	add_command(cmds, ncmds, "TPM_Startup",
+		    tpm_startup, sizeof(tpm_startup), true);
 }
 
 
-static int TSC_PhysicalPresence(unsigned short parm, int *tpm_errcode)
+static void TSC_PhysicalPresence(struct tpm_command *cmds, size_t *ncmds,
+				 unsigned short parm, bool report_error)
 {
 	unsigned char tsc_pp[] = {
 		0x00, 0xc1, 0x00, 0x00, 0x00, 0x0c, 0x40, 0x00, 0x00, 0x0a,
@@ -171,19 +385,22 @@ static int TSC_PhysicalPresence(unsigned short parm, int *tpm_errcode)
 	tsc_pp[10] = parm >> 8;
 	tsc_pp[11] = parm;
 
-	return talk(tsc_pp, sizeof(tsc_pp), tpm_errcode);
+	add_command(cmds, ncmds, "TSC_PhysicalPresence",
+		    tsc_pp, sizeof(tsc_pp), report_error);
 }
 
-static int TPM_PhysicalEnable(int *tpm_errcode)
+static void TPM_PhysicalEnable(struct tpm_command *cmds, size_t *ncmds)
 {
 	unsigned char tpm_pe[] = {
 		0x00, 0xc1, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x6f
 	};
 
-	return talk(tpm_pe, sizeof(tpm_pe), tpm_errcode);
+	add_command(cmds, ncmds, "TPM_PhysicalEnable",
+		    tpm_pe, sizeof(tpm_pe), true);
 }
 
-static int TPM_PhysicalSetDeactivated(unsigned char parm, int *tpm_errcode)
+static void TPM_PhysicalSetDeactivated(struct tpm_command *cmds,
+				       size_t *ncmds, unsigned char parm)
 {
 	unsigned char tpm_psd[] = {
 		0x00, 0xc1, 0x00, 0x00, 0x00, 0x0b, 0x00, 0x00, 0x00, 0x72,
@@ -191,16 +408,18 @@ static int TPM_PhysicalSetDeactivated(unsigned char parm, int *tpm_errcode)
 	};
 	tpm_psd[10] = parm;
 
-	return talk(tpm_psd, sizeof(tpm_psd), tpm_errcode);
+	add_command(cmds, ncmds, "TPM_PhysicalSetDeactivated",
+		    tpm_psd, sizeof(tpm_psd), true);
 }
 
-static int TPM_ContinueSelfTest(int *tpm_errcode)
+static void TPM_ContinueSelfTest(struct tpm_command *cmds, size_t *ncmds)
 {
 	unsigned char tpm_cst[] = {
 		0x00, 0xc1, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x53
 	};
 
-	return talk(tpm_cst, sizeof(tpm_cst), tpm_errcode);
+	add_command(cmds, ncmds, "TPM_ContinueSelfTest",
+		    tpm_cst, sizeof(tpm_cst), true);
 }
 
 static void print_usage(const char *prgname)
@@ -229,7 +448,8 @@ int main(int argc, char *argv[])
 	int   do_more = 1;
 	int   contselftest = 0;
 	unsigned char  startupparm = 0x1;      /* parameter for TPM_Startup(); */
-	int   tpm_errcode = 0;
+	struct tpm_command cmds[MAX_COMMANDS];
+	size_t ncmds = 0;
 
 	/* command line argument defaults */
 
@@ -259,52 +479,30 @@ int main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (ret == 0) {
-		if (0xff != startupparm) {
-			ret = TPM_Startup(startupparm, &tpm_errcode);
-			if (tpm_errcode != 0) {
-				printf("TPM_Startup returned error code "
-				       "0x%08x\n", ret);
-			}
-		}
+	if (0xff != startupparm)
+		TPM_Startup(cmds, &ncmds, startupparm);
+
+	if (do_more) {
+		/* turn on physicalPresenceCMDEnable */
+		TSC_PhysicalPresence(cmds, &ncmds, 0x20, false);
+		/* turn on physicalPresence */
+		TSC_PhysicalPresence(cmds, &ncmds, 0x08, true);
+		/* clear disabled */
+		TPM_PhysicalEnable(cmds, &ncmds);
+		/* clear deactivated */
+		TPM_PhysicalSetDeactivated(cmds, &ncmds, 0);
 	}
 
-	/* Sends the TSC_PhysicalPresence command to turn on physicalPresenceCMDEnable */
-	if ((ret == 0) && do_more) {
-		TSC_PhysicalPresence(0x20, &tpm_errcode);
-	}
+	if (contselftest)
+		TPM_ContinueSelfTest(cmds, &ncmds);
 
-	/* Sends the TSC_PhysicalPresence command to turn on physicalPresence */
-	if ((ret == 0) && do_more) {
-		ret = TSC_PhysicalPresence(0x08, &tpm_errcode);
-		if (tpm_errcode != 0) {
-			printf("TSC_PhysicalPresence returned error code "
-			       "0x%08x\n", tpm_errcode);
-		}
-	}
-	/* Sends the TPM_Process_PhysicalEnable command to clear disabled */
-	if ((ret == 0) && do_more) {
-		ret = TPM_PhysicalEnable(&tpm_errcode);
-		if (tpm_errcode != 0) {
-			printf("TPM_PhysicalEnable returned error "
-			       "code 0x%08x\n", tpm_errcode);
-		}
-	}
-	/* Sends the TPM_Process_PhysicalSetDeactivated command to clear deactivated */
-	if ((ret == 0) && do_more) {
-		ret = TPM_PhysicalSetDeactivated(0, &tpm_errcode);
-		if (tpm_errcode != 0) {
-			printf("TPM_PhysicalSetDeactivated returned error "
-			       "code 0x%08x\n", tpm_errcode);
-		}
-	}
+	/* a server closing the connection must not kill us */
+	signal(SIGPIPE, SIG_IGN);
 
-	if ((ret == 0) && contselftest) {
-		ret = TPM_ContinueSelfTest(&tpm_errcode);
-		if (tpm_errcode != 0) {
-			printf("TPM_ContinueSelfTest returned error "
-			       "code 0x%08x\n", tpm_errcode);
-		}
+	if (ncmds > 0) {
+		ret = resolve_address();
+		if (ret == 0)
+			ret = talk(cmds, ncmds);
 	}
 
 	return ret;
@@ -0,0 +1,679 @@
+/*
+ * localca.c -- Local CA issuing the certificates of TPMs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <gnutls/crypto.h>
+
+#include "localca.h"
+#include "swtpm_time.h"
+
+/* the validity of the TPMs' certificates */
+#define LOCALCA_CERT_DAYS (10 * 365)
+
+static const char *logfile;
+
+void
+localca_set_logfile(const char *filename)
+{
+    logfile = filename;
+}
+
+void
+localca_logit(const char *format, ...)
+{
+    FILE *f = stdout;
+    va_list ap;
+
+    if (logfile) {
+        f = fopen(logfile, "a");
+        if (!f)
+            return;
+    }
+    va_start(ap, format);
+    vfprintf(f, format, ap);
+    va_end(ap);
+    /* one write per message since the batch workers share the output */
+    if (f != stdout)
+        fclose(f);
+    else
+        fflush(f);
+}
+
+void
+localca_logerr(const char *format, ...)
+{
+    FILE *f = stderr;
+    va_list ap;
+
+    if (logfile) {
+        f = fopen(logfile, "a");
+        if (!f)
+            return;
+    }
+    fprintf(f, "Error: ");
+    va_start(ap, format);
+    vfprintf(f, format, ap);
+    va_end(ap);
+    /* one write per message since the batch workers share the output */
+    if (f != stderr)
+        fclose(f);
+    else
+        fflush(f);
+}
+
+/* read a whole file into a NUL-terminated buffer */
+char *
+localca_read_file(const char *filename)
+{
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (!f)
+        return NULL;
+    if (getdelim(&buffer, &size, '\0', f) < 0) {
+        free(buffer);
+        buffer = strdup("");
+    }
+    fclose(f);
+
+    return buffer;
+}
+
+/*
+ * Get the value of 'name' from the config file's lines of the format
+ * 'name = value'; the value ends at the first whitespace or at a '#'
+ * starting a comment.
+ */
+char *
+localca_get_config_value(const char *config, const char *name,
+                         const char *def)
+{
+    const char *line = config, *p;
+    size_t len = strlen(name);
+
+    while (line && *line) {
+        if (!strncmp(line, name, len)) {
+            p = line + len;
+            p += strspn(p, " \t");
+            if (*p == '=') {
+                p++;
+                p += strspn(p, " \t");
+                if (*p && *p != '\n' && *p != '#')
+                    return strndup(p, strcspn(p, " \t\n#"));
+            }
+        }
+        line = strchr(line, '\n');
+        if (line)
+            line++;
+    }
+
+    return def ? strdup(def) : NULL;
+}
+
+static int
+mkdir_p(const char *path)
+{
+    char *copy = strdup(path), *p;
+    int ret = 0;
+
+    if (!copy)
+        return -1;
+    for (p = copy + 1; ret == 0; p++) {
+        if (*p != '/' && *p != '\0')
+            continue;
+        if (*p == '\0') {
+            if (mkdir(copy, 0750) < 0 && errno != EEXIST)
+                ret = -1;
+            break;
+        }
+        *p = '\0';
+        if (mkdir(copy, 0750) < 0 && errno != EEXIST)
+            ret = -1;
+        *p = '/';
+    }
+    free(copy);
+
+    return ret;
+}
+
+static int
+localca_lock(struct localca *ca)
+{
+    if (ca->lockfd < 0) {
+        ca->lockfd = open(ca->lockfile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (ca->lockfd < 0) {
+            localca_logerr("Could not create lock file %s.\n", ca->lockfile);
+            return -1;
+        }
+    }
+    if (flock(ca->lockfd, LOCK_EX) < 0) {
+        localca_logerr("Could not lock %s: %s\n", ca->lockfile, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+localca_unlock(struct localca *ca)
+{
+    flock(ca->lockfd, LOCK_UN);
+}
+
+/*
+ * Reserve 'count' serial numbers. Like the swtpm-localca script, the
+ * counter file holds the last serial number that was handed out, so both
+ * can be used on the same state directory. The lock is only held while the
+ * counter is read and advanced by 'count'.
+ *
+ * Returns the first reserved serial number, or 0 on error.
+ */
+unsigned long
+localca_reserve_serials(struct localca *ca, unsigned int count,
+                        unsigned long *lock_ns)
+{
+    struct timespec start;
+    unsigned long serial = 0;
+    char buffer[32], *endptr;
+    ssize_t n;
+    int fd;
+
+    if (localca_lock(ca) < 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fd = open(ca->certserial, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        localca_logerr("Could not open serial number file %s: %s\n",
+               ca->certserial, strerror(errno));
+        goto unlock;
+    }
+    n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (n < 0) {
+        localca_logerr("Could not read serial number file %s: %s\n",
+               ca->certserial, strerror(errno));
+        goto close_fd;
+    }
+    buffer[n] = '\0';
+    serial = strtoul(buffer, &endptr, 10);
+    if (buffer[0] < '0' || buffer[0] > '9' ||
+        endptr[strspn(endptr, " \t\r\n")] != '\0')
+        serial = 0;
+
+    n = snprintf(buffer, sizeof(buffer), "%lu", serial + count);
+    if (pwrite(fd, buffer, n, 0) != n || ftruncate(fd, n) < 0) {
+        localca_logerr("Could not write serial number file %s: %s\n",
+               ca->certserial, strerror(errno));
+        serial = 0;
+        goto close_fd;
+    }
+    serial++;
+
+close_fd:
+    close(fd);
+
+unlock:
+    if (lock_ns)
+        *lock_ns = SWTPM_Time_Elapsed_Ns(&start);
+    localca_unlock(ca);
+
+    return serial;
+}
+
+static int
+write_file_atomic(const char *filename, const void *data, size_t len,
+                  mode_t mode)
+{
+    char *tmp = NULL;
+    int fd, ret = -1;
+
+    if (asprintf(&tmp, "%s.XXXXXX", filename) < 0)
+        return -1;
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        goto err_free;
+    if (fchmod(fd, mode) < 0 ||
+        write(fd, data, len) != (ssize_t)len ||
+        fsync(fd) < 0) {
+        close(fd);
+        unlink(tmp);
+        goto err_free;
+    }
+    close(fd);
+    if (rename(tmp, filename) < 0) {
+        unlink(tmp);
+        goto err_free;
+    }
+    ret = 0;
+
+err_free:
+    if (ret < 0)
+        localca_logerr("Could not write %s: %s\n", filename, strerror(errno));
+    free(tmp);
+
+    return ret;
+}
+
+/*
+ * Create the local CA's signing key and its self signed certificate like
+ * the swtpm-localca script does with certtool.
+ */
+static int
+create_localca_cert(struct localca *ca)
+{
+    gnutls_x509_privkey_t key = NULL;
+    gnutls_x509_crt_t crt = NULL;
+    gnutls_datum_t keypem = { NULL, 0 }, crtpem = { NULL, 0 };
+    unsigned char serial[8], id[64];
+    size_t id_size = sizeof(id);
+    time_t now = time(NULL);
+    int err, ret = -1;
+
+    if (localca_lock(ca) < 0)
+        return -1;
+
+    /* another process may have created them meanwhile */
+    if (access(ca->signkey, R_OK) == 0) {
+        ret = 0;
+        goto unlock;
+    }
+
+    localca_logit("Creating local CA's signing key and self signed issuer cert.\n");
+
+    err = gnutls_x509_privkey_init(&key);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA,
+                  gnutls_sec_param_to_pk_bits(GNUTLS_PK_RSA,
+                                              GNUTLS_SEC_PARAM_MEDIUM), 0);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_init(&crt);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_rnd(GNUTLS_RND_NONCE, serial, sizeof(serial));
+    if (err == GNUTLS_E_SUCCESS) {
+        /* a positive serial number */
+        serial[0] &= 0x7f;
+        err = gnutls_x509_crt_set_serial(crt, serial, sizeof(serial));
+    }
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_set_version(crt, 3);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_set_dn(crt, "CN=swtpm-localca", NULL);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_set_activation_time(crt, now);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_set_expiration_time(crt,
+                  now + (time_t)LOCALCA_CERT_DAYS * 24 * 60 * 60);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_set_key(crt, key);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_set_basic_constraints(crt, 1, -1);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_set_key_usage(crt, GNUTLS_KEY_KEY_CERT_SIGN);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_privkey_get_key_id(key, 0, id, &id_size);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_set_subject_key_id(crt, id, id_size);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_crt_export2(crt, GNUTLS_X509_FMT_PEM, &crtpem);
+    if (err == GNUTLS_E_SUCCESS)
+        err = gnutls_x509_privkey_export2(key, GNUTLS_X509_FMT_PEM, &keypem);
+    if (err != GNUTLS_E_SUCCESS) {
+        localca_logerr("Could not create the local CA's certificate: %s\n",
+               gnutls_strerror(err));
+        goto cleanup;
+    }
+
+    if (mkdir_p(ca->statedir) < 0) {
+        localca_logerr("Could not create directory '%s'.\n", ca->statedir);
+        goto cleanup;
+    }
+
+    /* the signing key is written last since its presence is checked */
+    if (write_file_atomic(ca->issuercert, crtpem.data, crtpem.size,
+                          0644) < 0 ||
+        write_file_atomic(ca->signkey, keypem.data, keypem.size,
+                          0640) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    gnutls_free(crtpem.data);
+    gnutls_free(keypem.data);
+    gnutls_x509_crt_deinit(crt);
+    gnutls_x509_privkey_deinit(key);
+
+unlock:
+    localca_unlock(ca);
+
+    return ret;
+}
+
+/*
+ * Apply the options from the options file, which holds command line
+ * options of swtpm_cert separated by whitespace; the file's content is
+ * kept since the parameters point into it.
+ */
+static int
+apply_options(struct cert_params *cp, char **sigkeypass, char *options)
+{
+    char *p = options, *token, *name = NULL, quote;
+
+    while (true) {
+        p += strspn(p, " \t\r\n");
+        if (*p == '\0')
+            break;
+
+        token = p;
+        if (*p == '"' || *p == '\'') {
+            quote = *p;
+            token = ++p;
+            p = strchr(p, quote);
+            if (!p) {
+                localca_logerr("Missing closing quote in options file.\n");
+                return -1;
+            }
+        } else {
+            p += strcspn(p, " \t\r\n");
+        }
+        if (*p != '\0')
+            *p++ = '\0';
+
+        if (name) {
+            if (!strcmp(name, "signkey-password"))
+                *sigkeypass = token;
+            else if (cert_params_set(cp, name, token) < 0)
+                return -1;
+            name = NULL;
+        } else if (!strcmp(token, "--pem")) {
+            cp->write_pem = true;
+        } else if (!strncmp(token, "--", 2) &&
+                   (is_cert_param(&token[2]) ||
+                    !strcmp(&token[2], "signkey-password"))) {
+            name = &token[2];
+        } else {
+            localca_logerr("Unsupported option '%s' in options file.\n", token);
+            return -1;
+        }
+    }
+    if (name) {
+        localca_logerr("Missing argument for --%s in options file.\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+cert_type_from_string(const char *type, enum cert_type_t *certtype)
+{
+    if (!strcmp(type, "ek"))
+        *certtype = CERT_TYPE_EK;
+    else if (!strcmp(type, "platform"))
+        *certtype = CERT_TYPE_PLATFORM;
+    else
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Create the certificates of the given comma-separated types in 'dir'
+ * using the serial numbers starting at '*serial', which is advanced.
+ */
+int
+localca_create_certs(const struct localca *ca,
+                     const struct localca_request *req,
+                     unsigned long *serial)
+{
+    const char *types = req->types, *name;
+    struct cert_params cp;
+    char type[16], *filename;
+    size_t len;
+    int ret = 0;
+
+    while (*types) {
+        len = strcspn(types, ",");
+        snprintf(type, sizeof(type), "%.*s", (int)len, types);
+        types += len;
+        if (*types == ',')
+            types++;
+
+        cp = ca->defaults;
+        if (cert_type_from_string(type, &cp.certtype) < 0) {
+            localca_logerr("Unknown certificate type '%s'.\n", type);
+            ret = -1;
+            continue;
+        }
+        name = cp.certtype == CERT_TYPE_EK ? "EK" : "platform";
+
+        if (asprintf(&filename, "%s/%s.cert", req->dir, type) < 0) {
+            ret = -1;
+            continue;
+        }
+        cp.modulus_str = req->ek;
+        cp.cert_filename = filename;
+        cp.serial = (*serial)++;
+        cp.days = LOCALCA_CERT_DAYS;
+
+        if (cert_params_check(&cp) < 0 || create_cert(&cp, &ca->signer) != 0) {
+            localca_logerr("Could not create %s certificate locally.\n", name);
+            ret = -1;
+        } else {
+            localca_logit("Successfully created %s certificate locally.\n", name);
+        }
+        free(filename);
+    }
+
+    return ret;
+}
+
+unsigned int
+localca_count_types(const char *types)
+{
+    unsigned int n = 1;
+
+    for (; *types; types++)
+        if (*types == ',')
+            n++;
+
+    return n;
+}
+
+/*
+ * Issue the certificates of a single request with serial numbers that are
+ * reserved at once for all of them.
+ */
+int
+localca_issue(struct localca *ca, const struct localca_request *req)
+{
+    unsigned long serial;
+
+    serial = localca_reserve_serials(ca, localca_count_types(req->types),
+                                     NULL);
+    if (serial == 0)
+        return -1;
+
+    return localca_create_certs(ca, req, &serial);
+}
+
+/*
+ * Set up the local CA from its configuration and options files like the
+ * swtpm-localca script does; the CA's signing key and certificate are
+ * created if they do not exist and are loaded for signing.
+ */
+int
+localca_init(struct localca *ca, const char *configfile,
+             const char *optsfile)
+{
+    char *sigkeypass = NULL, *certserial;
+
+    memset(ca, 0, sizeof(*ca));
+    ca->lockfd = -1;
+    ca->defaults.exponent = 0x10001;
+    ca->defaults.days = LOCALCA_CERT_DAYS;
+    ca->defaults.serial = 1;
+    ca->defaults.certtype = CERT_TYPE_EK;
+
+    ca->options = localca_read_file(optsfile);
+    if (!ca->options) {
+        localca_logerr("Cannot access options file %s.\n", optsfile);
+        goto err_exit;
+    }
+    ca->config = localca_read_file(configfile);
+    if (!ca->config) {
+        localca_logerr("Cannot access config file %s.\n", configfile);
+        goto err_exit;
+    }
+
+    ca->statedir = localca_get_config_value(ca->config, "statedir", NULL);
+    if (!ca->statedir) {
+        localca_logerr("Missing 'statedir' config value in config file %s\n",
+                       configfile);
+        goto err_exit;
+    }
+    if (access(ca->statedir, F_OK) < 0) {
+        localca_logit("Creating swtpm-local state dir.\n");
+        if (mkdir_p(ca->statedir) < 0) {
+            localca_logerr("Could not create directory '%s.\n",
+                           ca->statedir);
+            goto err_exit;
+        }
+    }
+    if (asprintf(&ca->lockfile, "%s/.lock", ca->statedir) < 0) {
+        ca->lockfile = NULL;
+        goto err_exit;
+    }
+
+    ca->signkey = localca_get_config_value(ca->config, "signingkey", NULL);
+    if (!ca->signkey) {
+        localca_logerr("Missing signingkey variable in config file %s.\n",
+                       configfile);
+        goto err_exit;
+    }
+    ca->issuercert = localca_get_config_value(ca->config, "issuercert",
+                                              NULL);
+    if (!ca->issuercert) {
+        localca_logerr("Missing issuercert variable in config file %s.\n",
+                       configfile);
+        goto err_exit;
+    }
+    if (asprintf(&certserial, "%s/certserial", ca->statedir) < 0)
+        goto err_exit;
+    ca->certserial = localca_get_config_value(ca->config, "certserial",
+                                              certserial);
+    free(certserial);
+
+    if (apply_options(&ca->defaults, &sigkeypass, ca->options) < 0)
+        goto err_exit;
+
+    if (tpm_cert_init() != 0)
+        goto err_exit;
+
+    if (access(ca->signkey, R_OK) < 0 && create_localca_cert(ca) < 0)
+        goto err_exit;
+
+    if (access(ca->signkey, R_OK) < 0) {
+        localca_logerr("Cannot access signing key %s.\n", ca->signkey);
+        goto err_exit;
+    }
+    if (access(ca->issuercert, R_OK) < 0) {
+        localca_logerr("Cannot access issuer certificate %s.\n",
+                       ca->issuercert);
+        goto err_exit;
+    }
+
+    if (signer_load(&ca->signer, ca->signkey, sigkeypass,
+                    ca->issuercert) < 0)
+        goto err_exit;
+    ca->signer_loaded = true;
+
+    return 0;
+
+err_exit:
+    localca_fini(ca);
+
+    return -1;
+}
+
+/* a forked worker must not share the lock's file descriptor */
+void
+localca_drop_lock(struct localca *ca)
+{
+    if (ca->lockfd >= 0) {
+        close(ca->lockfd);
+        ca->lockfd = -1;
+    }
+}
+
+void
+localca_fini(struct localca *ca)
+{
+    if (ca->signer_loaded)
+        signer_free(&ca->signer);
+    ca->signer_loaded = false;
+    localca_drop_lock(ca);
+    free(ca->statedir);
+    free(ca->lockfile);
+    free(ca->signkey);
+    free(ca->issuercert);
+    free(ca->certserial);
+    free(ca->config);
+    free(ca->options);
+    ca->statedir = ca->lockfile = ca->signkey = NULL;
+    ca->issuercert = ca->certserial = NULL;
+    ca->config = ca->options = NULL;
+}
@@ -0,0 +1,89 @@
+/*
+ * localca.h -- Local CA issuing the certificates of TPMs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_LOCALCA_H_
+#define _SWTPM_LOCALCA_H_
+
+#include <stdbool.h>
+
+#include "tpm_cert.h"
+
+#define LOCALCA_OPTIONS "/etc/swtpm-localca.options"
+#define LOCALCA_CONFIG  "/etc/swtpm-localca.conf"
+
+struct localca {
+    char *statedir;
+    char *lockfile;
+    char *signkey;
+    char *issuercert;
+    char *certserial;
+    int lockfd;
+    /* the parameters from the options file; they point into 'options' */
+    struct cert_params defaults;
+    struct signer signer;
+    bool signer_loaded;
+    char *config;
+    char *options;
+};
+
+/* a request for the certificates of one TPM */
+struct localca_request {
+    char *types;
+    char *ek;
+    char *dir;
+};
+
+void localca_set_logfile(const char *filename);
+void localca_logit(const char *format, ...);
+void localca_logerr(const char *format, ...);
+
+char *localca_read_file(const char *filename);
+char *localca_get_config_value(const char *config, const char *name,
+                               const char *def);
+
+int localca_init(struct localca *ca, const char *configfile,
+                 const char *optsfile);
+void localca_fini(struct localca *ca);
+void localca_drop_lock(struct localca *ca);
+
+unsigned int localca_count_types(const char *types);
+unsigned long localca_reserve_serials(struct localca *ca, unsigned int count,
+                                      unsigned long *lock_ns);
+int localca_create_certs(const struct localca *ca,
+                         const struct localca_request *req,
+                         unsigned long *serial);
+int localca_issue(struct localca *ca, const struct localca_request *req);
+
+#endif /* _SWTPM_LOCALCA_H_ */
@@ -0,0 +1,410 @@
+/*
+ * swtpm_localca.c -- Local CA issuing the certificates of TPMs
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * swtpm_localca is a native replacement of the samples/swtpm-localca
+ * script with the same command line and configuration files. Serial
+ * numbers are reserved in blocks from the counter file while holding the
+ * lock of the state directory only for reading and writing that file;
+ * the certificates are signed outside the lock, in batch mode by several
+ * worker processes.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <gnutls/gnutls.h>
+
+#include "localca.h"
+#include "swtpm_fleet.h"
+#include "swtpm_time.h"
+
+/* the serial numbers a worker reserves at once in batch mode */
+#define SERIAL_BLOCK 32
+
+#define BATCH_MAX_MEMBERS 8
+
+/* statistics of a batch, collected from the results of the workers */
+struct localca_stats {
+    unsigned long failed;
+    unsigned long lost;           /* requests whose worker died */
+    unsigned long reservations;
+    unsigned long lock_max_ns;
+};
+
+static void
+usage(const char *prg)
+{
+    fprintf(stdout,
+        "Usage: %s [options]\n"
+        "\n"
+        "Create the EK and platform certificates of TPMs with a local CA.\n"
+        "\n"
+        "The following options are supported:\n"
+        "--type <ek|platform>[,...] : The types of certificates to create\n"
+        "--ek <hex string>          : The modulus of the EK\n"
+        "--dir <directory>          : Directory to write the certificates into\n"
+        "--vmid <id>                : The ID of the VM; currently not used\n"
+        "--optsfile <filename>      : Options to pass on for the certificates;\n"
+        "                             default is " LOCALCA_OPTIONS "\n"
+        "--configfile <filename>    : Configuration of the local CA;\n"
+        "                             default is " LOCALCA_CONFIG "\n"
+        "--logfile <filename>       : Log into the given file rather than to\n"
+        "                             stdout and stderr\n"
+        "--batch <filename>         : Handle one request per line of the file,\n"
+        "                             which holds a JSON object with the members\n"
+        "                             type, ek and dir; '-' for stdin\n"
+        "--workers <n>              : The number of processes signing the\n"
+        "                             certificates of a batch; default is the\n"
+        "                             number of online CPUs\n"
+        "--help                     : Display this help screen and exit\n"
+        "\n"
+        ,prg);
+}
+
+static int
+read_batch(const char *batch_filename, struct localca_request **reqs,
+           size_t *n_reqs)
+{
+    struct json_member members[BATCH_MAX_MEMBERS];
+    struct localca_request *r;
+    char *line = NULL;
+    size_t linesize = 0;
+    unsigned int lineno = 0;
+    FILE *file;
+    int n, i, ret = -1;
+
+    *reqs = NULL;
+    *n_reqs = 0;
+
+    if (!strcmp(batch_filename, "-")) {
+        file = stdin;
+    } else {
+        file = fopen(batch_filename, "r");
+        if (file == NULL) {
+            localca_logerr("Could not open batch file %s: %s\n",
+                   batch_filename, strerror(errno));
+            return -1;
+        }
+    }
+
+    while (getline(&line, &linesize, file) >= 0) {
+        lineno++;
+        if (json_skip_ws(line)[0] == '\0')
+            continue;
+
+        n = json_parse_object(line, members, BATCH_MAX_MEMBERS);
+        if (n < 0) {
+            localca_logerr("Line %u: Invalid JSON object.\n", lineno);
+            goto err_exit;
+        }
+
+        r = realloc(*reqs, (*n_reqs + 1) * sizeof(**reqs));
+        if (!r) {
+            localca_logerr("Out of memory.\n");
+            goto err_exit;
+        }
+        *reqs = r;
+        r = &(*reqs)[(*n_reqs)++];
+        memset(r, 0, sizeof(*r));
+
+        for (i = 0; i < n; i++) {
+            if (!strcmp(members[i].name, "type")) {
+                r->types = strdup(members[i].value);
+            } else if (!strcmp(members[i].name, "ek")) {
+                r->ek = strdup(members[i].value);
+            } else if (!strcmp(members[i].name, "dir")) {
+                r->dir = strdup(members[i].value);
+            } else if (strcmp(members[i].name, "vmid")) {
+                localca_logerr("Line %u: Unknown member '%s'.\n", lineno,
+                       members[i].name);
+                goto err_exit;
+            }
+        }
+        if (!r->types || !r->ek || !r->dir) {
+            localca_logerr("Line %u: type, ek and dir are required.\n", lineno);
+            goto err_exit;
+        }
+    }
+    ret = 0;
+
+err_exit:
+    free(line);
+    if (file != stdin)
+        fclose(file);
+
+    return ret;
+}
+
+/* the CA and the requests of a batch, which the workers inherit */
+static struct localca *batch_ca;
+static const struct localca_request *batch_reqs;
+
+static void
+batch_worker_init(void)
+{
+    localca_drop_lock(batch_ca);
+}
+
+/*
+ * Create the certificates of request 'idx' in a worker process. Serial
+ * numbers are reserved in blocks that last for several requests of the
+ * worker. The result is '<failed> <reserved> <lock_ns>', where 'reserved'
+ * tells whether a block was reserved for the request.
+ */
+static void
+batch_work(size_t idx, const char *dir, char *result, size_t resultlen)
+{
+    static unsigned long serial, reserved;
+    unsigned long lock_ns = 0;
+    unsigned int needed;
+    bool reserving = false;
+    int failed = 0;
+
+    (void)dir;
+
+    needed = localca_count_types(batch_reqs[idx].types);
+    if (reserved < needed) {
+        /* the rest of the block is not used */
+        reserved = needed > SERIAL_BLOCK ? needed : SERIAL_BLOCK;
+        serial = localca_reserve_serials(batch_ca, reserved, &lock_ns);
+        if (serial == 0) {
+            reserved = 0;
+            snprintf(result, resultlen, "1 0 0");
+            return;
+        }
+        reserving = true;
+    }
+    reserved -= needed;
+
+    if (localca_create_certs(batch_ca, &batch_reqs[idx], &serial) < 0)
+        failed = 1;
+
+    snprintf(result, resultlen, "%d %d %lu", failed, reserving, lock_ns);
+}
+
+/*
+ * Add the result of a request to the statistics; a request whose worker
+ * died failed.
+ */
+static void
+batch_result(size_t idx, const char *result, void *opaque)
+{
+    struct localca_stats *stats = opaque;
+    unsigned long lock_ns;
+    int failed, reserving;
+
+    (void)idx;
+
+    if (!result) {
+        stats->lost++;
+        stats->failed++;
+        return;
+    }
+    if (sscanf(result, "%d %d %lu", &failed, &reserving, &lock_ns) != 3) {
+        stats->failed++;
+        return;
+    }
+    if (failed)
+        stats->failed++;
+    if (reserving) {
+        stats->reservations++;
+        if (lock_ns > stats->lock_max_ns)
+            stats->lock_max_ns = lock_ns;
+    }
+}
+
+static int
+run_batch(struct localca *ca, const char *batch_filename,
+          unsigned long workers)
+{
+    struct localca_request *reqs;
+    struct localca_stats stats = {
+        .failed = 0,
+    };
+    struct fleet_options fopts = {
+        .workers = workers,
+        .worker_init = batch_worker_init,
+    };
+    struct dirlist dirs = { NULL, 0, 0 };
+    struct timespec start;
+    unsigned long started = 0;
+    size_t n_reqs, i;
+    int ret = -1;
+
+    if (read_batch(batch_filename, &reqs, &n_reqs) < 0)
+        goto cleanup;
+
+    for (i = 0; i < n_reqs; i++) {
+        if (SWTPM_DirList_Add(&dirs, reqs[i].dir) < 0)
+            goto cleanup;
+    }
+
+    batch_ca = ca;
+    batch_reqs = reqs;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* requests that no worker finished are reported as lost */
+    SWTPM_Fleet_Run(&dirs, &fopts, batch_work, batch_result, &stats,
+                    &started);
+
+    if (stats.lost)
+        localca_logerr("%lu requests were not finished by a worker.\n",
+                       stats.lost);
+
+    localca_logit("Handled %zu requests in %lu ms with %lu workers; %lu failed. "
+          "Serial numbers were reserved %lu times holding the lock for "
+          "at most %lu us.\n",
+          n_reqs, (unsigned long)(SWTPM_Time_Elapsed_Ns(&start) / 1000000),
+          started, stats.failed, stats.reservations,
+          stats.lock_max_ns / 1000);
+
+    ret = stats.failed ? -1 : 0;
+
+cleanup:
+    SWTPM_DirList_Free(&dirs);
+    for (i = 0; i < n_reqs; i++) {
+        free(reqs[i].types);
+        free(reqs[i].ek);
+        free(reqs[i].dir);
+    }
+    free(reqs);
+
+    return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ret = 1;
+    int i;
+    struct localca ca;
+    struct localca_request req = {
+        .types = NULL,
+    };
+    const char *optsfile = LOCALCA_OPTIONS;
+    const char *configfile = LOCALCA_CONFIG;
+    const char *batch_filename = NULL;
+    const char *logfile = NULL;
+    unsigned long workers = 0;
+    int fd;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+            exit(0);
+        }
+        if (i + 1 == argc) {
+            fprintf(stderr, "Unknown command line parameter or missing "
+                    "argument '%s'.\n", argv[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+        if (!strcmp(argv[i], "--type")) {
+            req.types = argv[++i];
+        } else if (!strcmp(argv[i], "--ek")) {
+            req.ek = argv[++i];
+        } else if (!strcmp(argv[i], "--dir")) {
+            req.dir = argv[++i];
+        } else if (!strcmp(argv[i], "--vmid")) {
+            i++;
+        } else if (!strcmp(argv[i], "--optsfile")) {
+            optsfile = argv[++i];
+        } else if (!strcmp(argv[i], "--configfile")) {
+            configfile = argv[++i];
+        } else if (!strcmp(argv[i], "--logfile")) {
+            logfile = argv[++i];
+        } else if (!strcmp(argv[i], "--batch")) {
+            batch_filename = argv[++i];
+        } else if (!strcmp(argv[i], "--workers")) {
+            if (SWTPM_Fleet_Parse_Workers(argv[++i], &workers) < 0)
+                exit(1);
+        } else {
+            fprintf(stderr, "Unknown command line parameter '%s'.\n",
+                    argv[i]);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (logfile) {
+        fd = open(logfile, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Cannot write to logfile %s.\n", logfile);
+            exit(1);
+        }
+        close(fd);
+        localca_set_logfile(logfile);
+    }
+
+    if (!batch_filename && (!req.types || !req.ek || !req.dir)) {
+        localca_logerr("--type, --ek and --dir are required.\n");
+        exit(1);
+    }
+
+    if (gnutls_global_init() < 0) {
+        localca_logerr("gnutls_global_init failed.\n");
+        exit(1);
+    }
+
+    if (localca_init(&ca, configfile, optsfile) < 0)
+        goto deinit;
+
+    if (batch_filename) {
+        if (run_batch(&ca, batch_filename, workers) == 0)
+            ret = 0;
+    } else {
+        if (localca_issue(&ca, &req) == 0)
+            ret = 0;
+    }
+
+    localca_fini(&ca);
+
+deinit:
+    gnutls_global_deinit();
+
+    return ret;
+}
@@ -0,0 +1,1000 @@
+/*
+ * tpm_cert.c -- Creation of TPM certificates
+ *
+ * Authors: Stefan Berger <stefanb@us.ibm.com>
+ *
+ * (c) Copyright IBM Corporation 2014, 2015.
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Note: The construction of the certificate follows the TCG Credential
+ *       Profile for TPM Family 1.2; Level 2 Unified Trust Certificate
+ *       in section 3.5
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <arpa/inet.h>
+
+#include <gnutls/abstract.h>
+#include <gnutls/gnutls.h>
+
+#include "tpm_asn1.h"
+#include "tpm_cert.h"
+
+extern const ASN1_ARRAY_TYPE tpm_asn1_tab[];
+
+ASN1_TYPE _tpm_asn;
+
+static char
+hex_to_str(char digit) {
+    char value = -1;
+
+    if (digit >= '0' && digit <= '9') {
+        value = digit - '0';
+    } else if (digit >= 'a' && digit <= 'f') {
+        value = digit - 'a' + 10;
+    } else if (digit >= 'A' && digit <= 'F') {
+        value = digit - 'A' + 10;
+    }
+
+    return value;
+}
+
+static unsigned char *
+hex_str_to_bin(const char *hexstr, int *modulus_len)
+{
+    int len;
+    unsigned char *result;
+    int i = 0, j = 0;
+    char val1, val2;
+
+    len = strlen(hexstr);
+
+    if ((len & 1) != 0) {
+        fprintf(stderr, "Got an odd number of hex digits (%d).\n", len);
+        return NULL;
+    }
+
+    result = malloc(len / 2);
+    i = 0;
+    j = 0;
+
+    while (i < len) {
+        val1 = hex_to_str(hexstr[i]);
+        if (val1 < 0) {
+            fprintf(stderr, "Illegal hex character '%c'.", hexstr[i]);
+            free(result);
+            return NULL;
+        }
+        i++;
+        val2 = hex_to_str(hexstr[i]);
+        if (val2 < 0) {
+            fprintf(stderr, "Illegal hex character '%c'.", hexstr[i]);
+            free(result);
+            return NULL;
+        }
+        i++;
+        result[j++] = (val1 << 4) | val2;
+    }
+    *modulus_len = j;
+
+    return result;
+}
+
+static gnutls_pubkey_t
+create_rsa_from_modulus(unsigned char *modulus, unsigned int modulus_len,
+                        uint32_t exponent)
+{
+    unsigned char exp_array[4];
+    uint32_t exponent_no = htonl(exponent);
+    gnutls_pubkey_t rsa = NULL;
+    gnutls_datum_t mod;
+    gnutls_datum_t exp = {
+        .data = exp_array,
+        .size = sizeof(exp_array),
+    };
+    int err;
+
+    memcpy(exp_array, &exponent_no, sizeof(exp_array));
+
+    err = gnutls_pubkey_init(&rsa);
+    if (err < 0) {
+        fprintf(stderr, "Could not initialized public key structure : %s\n",
+                gnutls_strerror(err));
+        return NULL;
+    }
+
+    mod.data = modulus;
+    mod.size = modulus_len;
+
+    err = gnutls_pubkey_import_rsa_raw(rsa, &mod, &exp);
+    if (err < 0) {
+        fprintf(stderr, "Could not set modulus and exponent on RSA key : %s\n",
+                gnutls_strerror(err));
+        gnutls_pubkey_deinit(rsa);
+        rsa = NULL;
+    }
+
+    return rsa;
+}
+
+static int
+asn_init()
+{
+    static bool inited;
+    int err;
+
+    if (inited)
+        return ASN1_SUCCESS;
+
+    err = asn1_array2tree(tpm_asn1_tab, &_tpm_asn, NULL);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "array2tree error: %d", err);
+        goto cleanup;
+    }
+
+    inited = true;
+
+cleanup:
+
+    return err;
+}
+
+static int
+create_tpm_manufacturer_info(const char *manufacturer,
+                             const char *tpm_model,
+                             const char *tpm_version,
+                             gnutls_datum_t *asn1)
+{
+    ASN1_TYPE at = ASN1_TYPE_EMPTY;
+    int err;
+
+    err = asn_init();
+    if (err != ASN1_SUCCESS) {
+        goto cleanup;
+    }
+
+    err = asn1_create_element(_tpm_asn, "TPM.TPMManufacturerInfo", &at);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "asn1_create_element error: %d\n", err);
+        goto cleanup;
+    }
+
+    err = asn1_write_value(at, "tpmManufacturer.id", "2.23.133.2.1", 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "1. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+
+    err = asn1_write_value(at, "tpmManufacturer.manufacturer",
+                           manufacturer, 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "2. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+    
+    err = asn1_write_value(at, "tpmModel.id", "2.23.133.2.2", 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "3. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+
+    err = asn1_write_value(at, "tpmModel.model", manufacturer, 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "4. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+    
+    err = asn1_write_value(at, "tpmVersion.id", "2.23.133.2.3", 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "5. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+
+    err = asn1_write_value(at, "tpmVersion.version", manufacturer, 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "6. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+    
+    /* determine needed size of byte array */
+    asn1->size = 0;
+    err = asn1_der_coding(at, "", NULL, (int *)&asn1->size, NULL);
+    if (err != ASN1_MEM_ERROR) {
+        fprintf(stderr, "1. asn1_der_coding error: %d\n", err);
+        goto cleanup;
+    }
+    //fprintf(stderr, "size=%d\n", asn1->size);
+    asn1->data = gnutls_malloc(asn1->size + 16);
+    err = asn1_der_coding(at, "", asn1->data, (int *)&asn1->size, NULL);
+
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "2. asn1_der_coding error: %d\n", err);
+        gnutls_free(asn1->data);
+        asn1->data = NULL;
+        goto cleanup;
+    }
+
+#if 0
+    fprintf(stderr, "size=%d\n", asn1->size);
+    unsigned int i = 0;
+    for (i = 0; i < asn1->size; i++) {
+        fprintf(stderr, "%02x ", asn1->data[i]);
+    }
+    fprintf(stderr, "\n");
+#endif
+
+ cleanup:    
+    asn1_delete_structure(&at);
+    
+    return err;
+}
+
+static int
+create_platf_manufacturer_info(const char *manufacturer,
+                               const char *platf_model,
+                               const char *platf_version,
+                               gnutls_datum_t *asn1)
+{
+    ASN1_TYPE at = ASN1_TYPE_EMPTY;
+    int err;
+
+    err = asn_init();
+    if (err != ASN1_SUCCESS) {
+        goto cleanup;
+    }
+
+    err = asn1_create_element(_tpm_asn, "TPM.PlatformManufacturerInfo", &at);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "asn1_create_element error: %d\n", err);
+        goto cleanup;
+    }
+
+    err = asn1_write_value(at, "platformManufacturer.id", "2.23.133.2.4", 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "b1. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+
+    err = asn1_write_value(at, "platformManufacturer.manufacturer",
+                           manufacturer, 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "b2. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+    
+    err = asn1_write_value(at, "platformModel.id", "2.23.133.2.5", 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "b3. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+
+    err = asn1_write_value(at, "platformModel.model", manufacturer, 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "b4. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+    
+    err = asn1_write_value(at, "platformVersion.id", "2.23.133.2.6", 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "b5. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+
+    err = asn1_write_value(at, "platformVersion.version", manufacturer, 0);
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "b6. asn1_write_value error: %d\n", err);
+        goto cleanup;
+    }
+    
+    /* determine needed size of byte array */
+    asn1->size = 0;
+    err = asn1_der_coding(at, "", NULL, (int *)&asn1->size, NULL);
+    if (err != ASN1_MEM_ERROR) {
+        fprintf(stderr, "b1. asn1_der_coding error: %d\n", err);
+        goto cleanup;
+    }
+    //fprintf(stderr, "size=%d\n", asn1->size);
+    asn1->data = gnutls_malloc(asn1->size + 16);
+    err = asn1_der_coding(at, "", asn1->data, (int *)&asn1->size, NULL);
+
+    if (err != ASN1_SUCCESS) {
+        fprintf(stderr, "b2. asn1_der_coding error: %d\n", err);
+        gnutls_free(asn1->data);
+        asn1->data = NULL;
+        goto cleanup;
+    }
+
+#if 0
+    fprintf(stderr, "size=%d\n", asn1->size);
+    unsigned int i = 0;
+    for (i = 0; i < asn1->size; i++) {
+        fprintf(stderr, "%02x ", asn1->data[i]);
+    }
+    fprintf(stderr, "\n");
+#endif
+
+ cleanup:    
+    asn1_delete_structure(&at);
+    
+    return err;
+}
+
+/* write a DER tag and length; returns the number of bytes written */
+static size_t
+der_write_header(unsigned char *buf, unsigned char tag, size_t len)
+{
+    size_t n = 0, i;
+
+    buf[n++] = tag;
+    if (len < 0x80) {
+        buf[n++] = len;
+        return n;
+    }
+    for (i = sizeof(len); i > 0 && ((len >> ((i - 1) * 8)) & 0xff) == 0; i--)
+        ;
+    buf[n++] = 0x80 | i;
+    for (; i > 0; i--)
+        buf[n++] = len >> ((i - 1) * 8);
+
+    return n;
+}
+
+/*
+ * Set the Subject Alternative Name extension holding the given manufacturer
+ * infos as uniformResourceIdentifier entries. The extension is encoded here
+ * since newer versions of GNUTLS refuse to take the DER encoded infos as
+ * a GNUTLS_SAN_URI.
+ */
+static int
+set_subject_alt_name(gnutls_x509_crt_t crt, const gnutls_datum_t *names,
+                     size_t num_names)
+{
+    /* room for a tag and a length */
+    const size_t hdrlen = 2 + sizeof(size_t);
+    gnutls_datum_t ext;
+    size_t i, len = 0, off;
+    unsigned char *p;
+    int err;
+
+    for (i = 0; i < num_names; i++)
+        len += hdrlen + names[i].size;
+
+    ext.data = p = gnutls_malloc(hdrlen + len);
+    if (!p)
+        return GNUTLS_E_MEMORY_ERROR;
+
+    /* GeneralNames ::= SEQUENCE SIZE (1..MAX) OF GeneralName */
+    len = 0;
+    for (i = 0; i < num_names; i++)
+        len += der_write_header(p, 0x86, names[i].size) + names[i].size;
+    off = der_write_header(p, 0x30, len);
+    /* uniformResourceIdentifier [6] IA5String */
+    for (i = 0; i < num_names; i++) {
+        off += der_write_header(&p[off], 0x86, names[i].size);
+        memcpy(&p[off], names[i].data, names[i].size);
+        off += names[i].size;
+    }
+    ext.size = off;
+
+    err = gnutls_x509_crt_set_extension_by_oid(crt, "2.5.29.17", ext.data,
+                                               ext.size, 0);
+    gnutls_free(ext.data);
+
+    return err;
+}
+
+/* the options that set a parameter of a certificate and take an argument */
+static const char *const cert_param_names[] = {
+    "pubkey", "modulus", "exponent", "out-cert", "subject", "days", "serial",
+    "type", "tpm-manufacturer", "tpm-model", "tpm-version",
+    "platform-manufacturer", "platform-model", "platform-version",
+    NULL
+};
+
+bool
+is_cert_param(const char *name)
+{
+    size_t i;
+
+    for (i = 0; cert_param_names[i]; i++)
+        if (!strcmp(cert_param_names[i], name))
+            return true;
+
+    return false;
+}
+
+/*
+ * Set the parameter of a certificate that the option --<name> sets.
+ *
+ * Returns 0 on success, -1 on an invalid value, and 1 if there is no such
+ * option.
+ */
+int
+cert_params_set(struct cert_params *cp, const char *name, const char *value)
+{
+    if (!strcmp(name, "pubkey")) {
+        cp->pubkey_filename = value;
+    } else if (!strcmp(name, "modulus")) {
+        cp->modulus_str = value;
+    } else if (!strcmp(name, "exponent")) {
+        cp->exponent = strtol(value, NULL, 0);
+        if (cp->exponent == 0) {
+            fprintf(stderr, "Exponent is wrong and cannot be 0.\n");
+            return -1;
+        }
+        if (cp->exponent > UINT_MAX) {
+            fprintf(stderr, "Exponent must fit into 32bits.\n");
+            return -1;
+        }
+    } else if (!strcmp(name, "out-cert")) {
+        cp->cert_filename = value;
+    } else if (!strcmp(name, "subject")) {
+        cp->subject = value;
+    } else if (!strcmp(name, "days")) {
+        cp->days = atoi(value);
+    } else if (!strcmp(name, "serial")) {
+        cp->serial = atoi(value);
+    } else if (!strcmp(name, "pem")) {
+        cp->write_pem = !strcmp(value, "true");
+    } else if (!strcmp(name, "type")) {
+        if (!strcasecmp(value, "ek")) {
+            cp->certtype = CERT_TYPE_EK;
+        } else if (!strcasecmp(value, "platform")) {
+            cp->certtype = CERT_TYPE_PLATFORM;
+//        } else if (!strcasecmp(value, "aik")) {
+//            /* AIK cert needs EK cert as input */
+//            cp->certtype = CERT_TYPE_AIK;
+        } else {
+            fprintf(stderr, "Unknown certificate type '%s'.\n", value);
+            return -1;
+        }
+    } else if (!strcmp(name, "tpm-manufacturer")) {
+        cp->tpm_manufacturer = value;
+    } else if (!strcmp(name, "tpm-model")) {
+        cp->tpm_model = value;
+    } else if (!strcmp(name, "tpm-version")) {
+        cp->tpm_version = value;
+    } else if (!strcmp(name, "platform-manufacturer")) {
+        cp->platf_manufacturer = value;
+    } else if (!strcmp(name, "platform-model")) {
+        cp->platf_model = value;
+    } else if (!strcmp(name, "platform-version")) {
+        cp->platf_version = value;
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+int
+cert_params_check(const struct cert_params *cp)
+{
+    if (cp->pubkey_filename == NULL && cp->modulus_str == NULL) {
+        fprintf(stderr, "Missing public EK file and modulus.\n");
+        return -1;
+    }
+
+    switch (cp->certtype) {
+    case CERT_TYPE_EK:
+    case CERT_TYPE_PLATFORM:
+        if (cp->tpm_manufacturer == NULL ||
+            cp->tpm_model == NULL ||
+            cp->tpm_version == NULL) {
+            fprintf(stderr, "--tpm-manufacturer and --tpm-model and "
+                            "--tpm version "
+                            "must all be provided\n");
+            return -1;
+        }
+        break;
+    case CERT_TYPE_AIK:
+        break;
+    }
+
+    switch (cp->certtype) {
+    case CERT_TYPE_PLATFORM:
+        if (cp->platf_manufacturer == NULL ||
+            cp->platf_model == NULL ||
+            cp->platf_version == NULL) {
+            fprintf(stderr, "--platform-manufacturer and --platform-model and "
+                            "--platform version "
+                            "must all be provided\n");
+            return -1;
+        }
+        break;
+    case CERT_TYPE_EK:
+    case CERT_TYPE_AIK:
+        break;
+    }
+
+    return 0;
+}
+
+#define CHECK_GNUTLS_ERROR(_err, _msg, ...) \
+if (_err != GNUTLS_E_SUCCESS) {             \
+    fprintf(stderr, _msg, __VA_ARGS__);     \
+    goto cleanup;                           \
+}
+
+int
+signer_load(struct signer *signer, const char *sigkey_filename,
+            const char *sigkeypass, const char *issuercert_filename)
+{
+    gnutls_datum_t datum = { NULL, 0};
+    int err;
+
+    gnutls_x509_privkey_init(&signer->sigkey);
+
+    err = gnutls_load_file(sigkey_filename, &datum);
+    CHECK_GNUTLS_ERROR(err, "Could not read signing key from file %s: %s\n",
+                       sigkey_filename, gnutls_strerror(err));
+
+    if (sigkeypass) {
+        err = gnutls_x509_privkey_import2(signer->sigkey, &datum,
+                                          GNUTLS_X509_FMT_PEM,
+                                          sigkeypass, 0);
+    } else {
+        err = gnutls_x509_privkey_import(signer->sigkey, &datum,
+                                         GNUTLS_X509_FMT_PEM);
+    }
+    gnutls_free(datum.data);
+    datum.data = NULL;
+    CHECK_GNUTLS_ERROR(err, "Could not import signing key : %s\n",
+                       gnutls_strerror(err));
+
+    err = gnutls_load_file(issuercert_filename, &datum);
+    CHECK_GNUTLS_ERROR(err, "Could not read certificate from file %s : %s\n",
+                       issuercert_filename, gnutls_strerror(err));
+
+    gnutls_x509_crt_init(&signer->sigcert);
+
+    err = gnutls_x509_crt_import(signer->sigcert, &datum, GNUTLS_X509_FMT_PEM);
+    gnutls_free(datum.data);
+    datum.data = NULL;
+    CHECK_GNUTLS_ERROR(err, "Could not import issuer certificate: %s\n",
+                       gnutls_strerror(err));
+
+    signer->id_size = sizeof(signer->id);
+    err = gnutls_x509_crt_get_key_id(signer->sigcert, 0, signer->id,
+                                     &signer->id_size);
+    if (err != GNUTLS_E_SUCCESS)
+        signer->id_size = 0;
+
+    return 0;
+
+cleanup:
+    return -1;
+}
+
+void
+signer_free(struct signer *signer)
+{
+    gnutls_x509_crt_deinit(signer->sigcert);
+    gnutls_x509_privkey_deinit(signer->sigkey);
+}
+
+/*
+ * Create, sign and write the certificate with the given parameters.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int
+create_cert(const struct cert_params *cp, const struct signer *signer)
+{
+    int ret = 1;
+    gnutls_pubkey_t pubkey = NULL;
+    gnutls_x509_crt_t crt = NULL;
+    unsigned char *modulus_bin = NULL;
+    int modulus_len = 0;
+    gnutls_datum_t datum = { NULL, 0},  out = { NULL, 0};
+    gnutls_datum_t san[2] = { { NULL, 0 }, { NULL, 0 } };
+    size_t num_san = 0;
+    time_t now;
+    int err;
+    FILE *cert_file;
+    const char *error = NULL;
+    uint32_t ser_number;
+    const char *oid;
+    unsigned int key_usage;
+
+    ser_number = htonl(cp->serial);
+
+    if (cp->pubkey_filename) {
+        gnutls_pubkey_init(&pubkey);
+
+        err = gnutls_load_file(cp->pubkey_filename, &datum);
+        if (err != GNUTLS_E_SUCCESS) {
+            fprintf(stderr, "Could not open file for EK public key: %s\n",
+                strerror(errno));
+            goto cleanup;
+        }
+
+        err = gnutls_pubkey_import(pubkey, &datum, GNUTLS_X509_FMT_PEM);
+        gnutls_free(datum.data);
+        datum.data = NULL;
+        if (err != GNUTLS_E_SUCCESS) {
+            fprintf(stderr, "Could not import EK.\n");
+            goto cleanup;
+        }
+    } else {
+        if (!(modulus_bin = hex_str_to_bin(cp->modulus_str, &modulus_len))) {
+            goto cleanup;
+        }
+        pubkey = create_rsa_from_modulus(modulus_bin, modulus_len,
+                                         cp->exponent);
+        free(modulus_bin);
+        modulus_bin = NULL;
+
+        if (pubkey == NULL)
+            goto cleanup;
+    }
+
+    /* all types of keys must have pubkey set now otherwise the signing
+       will not work */
+
+    err = gnutls_x509_crt_init(&crt);
+    CHECK_GNUTLS_ERROR(err, "CRT init failed: %s\n", gnutls_strerror(err))
+
+    /* 3.5.1 Version */
+    err = gnutls_x509_crt_set_version(crt, 3);
+    CHECK_GNUTLS_ERROR(err, "Could not set version on CRT: %s\n",
+                       gnutls_strerror(err))
+
+    /* 3.5.2 Serial Number */
+    err = gnutls_x509_crt_set_serial(crt, &ser_number, sizeof(ser_number));
+    CHECK_GNUTLS_ERROR(err, "Could not set serial on CRT: %s\n",
+                       gnutls_strerror(err))
+
+    /* 3.5.5 Validity */
+    now = time(NULL);
+    err = gnutls_x509_crt_set_activation_time(crt, now);
+    CHECK_GNUTLS_ERROR(err, "Could not set activation time on CRT: %s\n",
+                       gnutls_strerror(err))
+
+    err = gnutls_x509_crt_set_expiration_time(crt,
+             now + (time_t)cp->days * 24 * 60 * 60);
+    CHECK_GNUTLS_ERROR(err, "Could not set expiration time on CRT: %s\n",
+                       gnutls_strerror(err))
+
+    /* 3.5.6 Subject -- should be empty, but we allow it anyway */
+    if (cp->subject) {
+        err = gnutls_x509_crt_set_dn(crt, cp->subject, &error);
+        CHECK_GNUTLS_ERROR(err,
+                           "Could not set DN on CRT: %s\n"
+                           "DN '%s must be fault after %s\n.'",
+                           gnutls_strerror(err),
+                           cp->subject, error)
+    }
+
+    /* 3.5.7 Public Key Info */
+    switch (cp->certtype) {
+    case CERT_TYPE_EK:
+        oid = "1.2.840.113549.1.1.7";
+        break;
+    case CERT_TYPE_PLATFORM:
+        oid = NULL;
+        break;
+    case CERT_TYPE_AIK:
+        oid = "1.2.840.113549.1.1.1";
+        break;
+    default:
+        fprintf(stderr, "Internal error: unhandle case in line %d\n",
+                __LINE__);
+        goto cleanup;
+    }
+    if (oid) {
+        err = gnutls_x509_crt_set_key_purpose_oid(crt, oid, 0);
+        CHECK_GNUTLS_ERROR(err, "Could not set key purpose on CRT: %s\n",
+                           gnutls_strerror(err))
+    }
+
+    /* 3.5.8 Certificate Policies -- skip since not mandated */
+    /* 3.5.9 Subject Alternative Names */
+    err = create_tpm_manufacturer_info(cp->tpm_manufacturer, cp->tpm_model,
+                                       cp->tpm_version, &san[num_san]);
+    if (!err && san[num_san].size > 0)
+        num_san++;
+
+    switch (cp->certtype) {
+    case CERT_TYPE_PLATFORM:
+        err = create_platf_manufacturer_info(cp->platf_manufacturer,
+                                             cp->platf_model,
+                                             cp->platf_version,
+                                             &san[num_san]);
+        if (!err && san[num_san].size > 0)
+            num_san++;
+        break;
+    case CERT_TYPE_AIK:
+    case CERT_TYPE_EK:
+        break;
+    default:
+        fprintf(stderr, "Internal error: unhandle case in line %d\n",
+                __LINE__);
+        goto cleanup;
+    }
+
+    if (num_san > 0) {
+        err = set_subject_alt_name(crt, san, num_san);
+        CHECK_GNUTLS_ERROR(err, "Could not set subject alt name: %s\n",
+                           gnutls_strerror(err))
+    }
+
+    /* 3.5.10 Basic Constraints */
+    err = gnutls_x509_crt_set_basic_constraints(crt, 0, -1);
+    CHECK_GNUTLS_ERROR(err, "Could not set key usage id: %s\n",
+                       gnutls_strerror(err))
+    /* 3.5.11 Subject Directory Attributes -- missing */
+
+    /* 3.5.12 Authority Key Id */
+    if (signer->id_size > 0) {
+        err = gnutls_x509_crt_set_authority_key_id(crt, signer->id,
+                                                   signer->id_size);
+        CHECK_GNUTLS_ERROR(err, "Could not set the authority key id: %s\n",
+                           gnutls_strerror(err))
+    }
+    /* 3.5.13 Authority Info Access -- may be omitted */
+    /* 3.5.14 CRL Distribution -- missing  */
+
+    /* 3.5.15 Key Usage */
+    switch (cp->certtype) {
+    case CERT_TYPE_EK:
+    case CERT_TYPE_PLATFORM:
+        key_usage = GNUTLS_KEY_KEY_ENCIPHERMENT;
+        break;
+    case CERT_TYPE_AIK:
+        key_usage = GNUTLS_KEY_DIGITAL_SIGNATURE;
+        break;
+    default:
+        fprintf(stderr, "Internal error: unhandle case in line %d\n",
+                __LINE__);
+        goto cleanup;
+    }
+    err = gnutls_x509_crt_set_key_usage(crt, key_usage);
+    CHECK_GNUTLS_ERROR(err, "Could not set key usage id: %s\n",
+                       gnutls_strerror(err))
+
+    /* 3.5.16 Extended Key Usage -- missing */
+    /* 3.5.17 Subject Key Id -- should not be included */
+    /* 3.5.18 Issuer Alt. Name -- should not be included */
+    /* 3.5.19 FreshestCRL -- should not be included */
+    /* 3.5.20 Subject Info. Access -- should not be included */
+    /* 3.5.21 Subject and Issued Unique Ids -- must be omitted */
+    /* 3.5.22 Virtualized Platform Attestation Service -- missing */
+    /* 3.5.23 Migration Controller Attestation Service -- missing */
+    /* 3.5.24 Migration Controller Registration Service -- missing */
+    /* 3.5.25 Virtual Platform Backup Service -- missing */
+
+    /* set public key */
+    err = gnutls_x509_crt_set_pubkey(crt, pubkey);
+    CHECK_GNUTLS_ERROR(err, "Could not set public EK on CRT: %s\n",
+                       gnutls_strerror(err))
+
+    /* sign cert */
+    err = gnutls_x509_crt_sign(crt, signer->sigcert, signer->sigkey);
+    CHECK_GNUTLS_ERROR(err, "Could not sign the CRT: %s\n",
+                       gnutls_strerror(err))
+
+    /* write cert to file; either PEM or DER */
+    gnutls_x509_crt_export2(crt,
+                            (cp->write_pem)
+                            ? GNUTLS_X509_FMT_PEM
+                            : GNUTLS_X509_FMT_DER, &out);
+    if (cp->cert_filename) {
+        cert_file = fopen(cp->cert_filename, "wb");
+        if (cert_file == NULL) {
+            fprintf(stderr, "Could not open %s for writing the certificate: %s\n",
+                    cp->cert_filename,
+                    strerror(errno));
+            goto cleanup;
+        }
+        if (out.size != fwrite(out.data, 1, out.size, cert_file)) {
+            fprintf(stderr, "Could not write certificate into file: %s\n",
+                    strerror(errno));
+            fclose(cert_file);
+            goto cleanup;
+        }
+        fclose(cert_file);
+    } else {
+        fprintf(stdout, "%s\n", out.data);
+    }
+
+    ret = 0;
+
+cleanup:
+    gnutls_free(datum.data);
+    gnutls_free(out.data);
+
+    gnutls_x509_crt_deinit(crt);
+    gnutls_pubkey_deinit(pubkey);
+
+    return ret;
+}
+
+char *
+json_skip_ws(char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
+}
+
+/*
+ * Parse a JSON string starting at the opening quote and unescape it in
+ * place. *end is set to the character following the closing quote.
+ */
+static char *
+json_parse_string(char *p, char **end)
+{
+    char *start = ++p, *out = p;
+    unsigned int c;
+    int i;
+
+    while (*p != '"') {
+        if (*p == '\0')
+            return NULL;
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        p++;
+        switch (*p) {
+        case '"':
+        case '\\':
+        case '/':
+            *out++ = *p;
+            break;
+        case 'b':
+            *out++ = '\b';
+            break;
+        case 'f':
+            *out++ = '\f';
+            break;
+        case 'n':
+            *out++ = '\n';
+            break;
+        case 'r':
+            *out++ = '\r';
+            break;
+        case 't':
+            *out++ = '\t';
+            break;
+        case 'u':
+            /* only characters of the ASCII range are needed */
+            c = 0;
+            for (i = 1; i <= 4; i++) {
+                if (hex_to_str(p[i]) < 0)
+                    return NULL;
+                c = (c << 4) | hex_to_str(p[i]);
+            }
+            if (c == 0 || c > 0x7f)
+                return NULL;
+            *out++ = c;
+            p += 4;
+            break;
+        default:
+            return NULL;
+        }
+        p++;
+    }
+    /* the string may end where the closing quote is */
+    *out = '\0';
+    *end = p + 1;
+
+    return start;
+}
+
+/*
+ * Parse a line holding a JSON object whose members have strings, numbers,
+ * true, false or null as values. Numbers, true and false are returned as
+ * their text; members with null value are left out.
+ *
+ * Returns the number of members or -1 on a syntax error.
+ */
+int
+json_parse_object(char *line, struct json_member *members, size_t max)
+{
+    char *p = json_skip_ws(line), *end, *value, c;
+    size_t n = 0;
+
+    if (*p != '{')
+        return -1;
+    p = json_skip_ws(p + 1);
+    if (*p == '}')
+        return json_skip_ws(p + 1)[0] == '\0' ? 0 : -1;
+
+    while (true) {
+        if (*p != '"' || n == max)
+            return -1;
+        members[n].name = json_parse_string(p, &end);
+        if (!members[n].name)
+            return -1;
+        p = json_skip_ws(end);
+        if (*p != ':')
+            return -1;
+        p = json_skip_ws(p + 1);
+
+        if (*p == '"') {
+            value = json_parse_string(p, &end);
+            if (!value)
+                return -1;
+        } else {
+            value = p;
+            end = p;
+            while (*end == '-' || *end == '+' || *end == '.' ||
+                   (*end >= '0' && *end <= '9') ||
+                   (*end >= 'a' && *end <= 'z') ||
+                   (*end >= 'A' && *end <= 'Z'))
+                end++;
+            if (end == value)
+                return -1;
+        }
+        p = json_skip_ws(end);
+        c = *p;
+        /* terminates an unquoted value */
+        *end = '\0';
+
+        if (strcmp(value, "null")) {
+            members[n].value = value;
+            n++;
+        }
+
+        if (c == '}')
+            break;
+        if (c != ',')
+            return -1;
+        p = json_skip_ws(p + 1);
+    }
+
+    if (json_skip_ws(p + 1)[0] != '\0')
+        return -1;
+
+    return n;
+}
+
+/*
+ * Initialize what all certificates share; to be called before
+ * certificates are created on several threads.
+ */
+int
+tpm_cert_init(void)
+{
+    return asn_init();
+}
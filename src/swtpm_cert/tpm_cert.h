@@ -0,0 +1,101 @@
+/*
+ * tpm_cert.h -- Creation of TPM certificates
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_TPM_CERT_H_
+#define _SWTPM_TPM_CERT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+enum cert_type_t {
+    CERT_TYPE_EK = 1,
+    CERT_TYPE_PLATFORM,
+    CERT_TYPE_AIK,
+};
+
+/* the parameters of a single certificate */
+struct cert_params {
+    const char *pubkey_filename;
+    const char *modulus_str;
+    long int exponent;
+    const char *cert_filename;
+    const char *subject;
+    int days;
+    int serial;
+    bool write_pem;
+    enum cert_type_t certtype;
+    const char *tpm_manufacturer;
+    const char *tpm_model;
+    const char *tpm_version;
+    const char *platf_manufacturer;
+    const char *platf_model;
+    const char *platf_version;
+};
+
+/* the CA's signing key and certificate, loaded once for all certificates */
+struct signer {
+    gnutls_x509_privkey_t sigkey;
+    gnutls_x509_crt_t sigcert;
+    uint8_t id[512];
+    size_t id_size;
+};
+
+/* a member of a flat JSON object; both strings point into the parsed line */
+struct json_member {
+    const char *name;
+    const char *value;
+};
+
+int tpm_cert_init(void);
+
+bool is_cert_param(const char *name);
+int cert_params_set(struct cert_params *cp, const char *name,
+                    const char *value);
+int cert_params_check(const struct cert_params *cp);
+
+int signer_load(struct signer *signer, const char *sigkey_filename,
+                const char *sigkeypass, const char *issuercert_filename);
+void signer_free(struct signer *signer);
+
+int create_cert(const struct cert_params *cp, const struct signer *signer);
+
+char *json_skip_ws(char *p);
+int json_parse_object(char *line, struct json_member *members, size_t max);
+
+#endif /* _SWTPM_TPM_CERT_H_ */
@@ -47,6 +47,9 @@
  *     -h hash the given data
  *     -v store volatile data to file
  *     -C cancel an ongoing TPM command
+ *
+ * cuse_tpm_ioctl --batch file [ devicepath | --devices pattern ]
+ *     run the commands in the file over one open device
  */
 
 #include <stdio.h>
@@ -55,90 +58,302 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <arpa/inet.h>
 
 #include <swtpm/tpm_ioctl.h>
 
 #include <libtpms/tpm_error.h>
 
+#include "swtpm_fleet.h"
+#include "swtpm_time.h"
+
+/* the size of the buffer for the read() and write() interfaces */
+#define DEFAULT_BUFFERSIZE (64 * 1024)
+
+static uint32_t get_blobtype(const char *blobname)
+{
+    if (!strcmp(blobname, "permanent"))
+        return PTM_BLOB_TYPE_PERMANENT;
+    if (!strcmp(blobname, "volatile"))
+        return PTM_BLOB_TYPE_VOLATILE;
+    if (!strcmp(blobname, "savestate"))
+        return PTM_BLOB_TYPE_SAVESTATE;
+    return 0;
+}
 
 /*
- * Do PTM_HASH_START, PTM_HASH_DATA, PTM_HASH_END on the
- * data.
+ * The state blobs of --save-all are written as a stream of frames, each one
+ * a stream_frame followed by the blob; a frame with type 0 and length 0
+ * ends the stream. The numbers are in network byte order.
  */
-static int do_hash_start_data_end(int fd, const char *input)
+#define STREAM_FRAME_MAGIC 0x53575453 /* 'SWTS' */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;     /* PTM_BLOB_TYPE_*; 0 ends the stream */
+    uint32_t length;   /* the number of bytes of the blob that follow */
+} __attribute__((packed)) stream_frame;
+
+static const uint32_t stream_blobtypes[] = {
+    PTM_BLOB_TYPE_PERMANENT,
+    PTM_BLOB_TYPE_VOLATILE,
+    PTM_BLOB_TYPE_SAVESTATE,
+};
+
+/*
+ * read_full: read 'count' bytes unless the end of the file is reached first;
+ *            pipes may return less than requested
+ *
+ * Returns the number of bytes read or -1 on error.
+ */
+static ssize_t read_full(int fd, void *buffer, size_t count)
 {
-    ptm_res res;
-    int n;
-    size_t idx;
-    ptm_hdata hdata;
+    size_t got = 0;
+    ssize_t n;
 
-    /* hash string given on command line */
-    n = ioctl(fd, PTM_HASH_START, &res);
-    if (n < 0) {
-        fprintf(stderr,
-                "Could not execute ioctl PTM_HASH_START: "
-                "%s\n", strerror(errno));
-        return 1;
+    while (got < count) {
+        n = read(fd, (unsigned char *)buffer + got, count - got);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        got += n;
     }
-    if (res != 0) {
-        fprintf(stderr,
-                "TPM result from PTM_HASH_START: 0x%x\n", res);
-        return 1;
+
+    return got;
+}
+
+/*
+ * write_full: write all 'count' bytes
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int write_full(int fd, const void *buffer, size_t count)
+{
+    size_t written = 0;
+    ssize_t n;
+
+    while (written < count) {
+        n = write(fd, (const unsigned char *)buffer + written,
+                  count - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
     }
-    if (strlen(input) == 1 && input[0] == '-') {
-        /* read data from stdin */
-        while (1) {
-            idx = 0;
-            int c = 0;
 
-            while (idx < sizeof(hdata.u.req.data)) {
-                c = fgetc(stdin);
-                if (c == EOF)
-                    break;
+    return 0;
+}
 
-                hdata.u.req.data[idx] = (char)c;
-                idx++;
-            }
-            hdata.u.req.length = idx;
+/*
+ * open_stream: open the file to stream the state blobs to or from; '-'
+ *              stands for stdout or stdin
+ */
+static int open_stream(const char *filename, bool for_writing)
+{
+    int file_fd;
 
-            n = ioctl(fd, PTM_HASH_DATA, &hdata);
+    if (!strcmp(filename, "-"))
+        return for_writing ? STDOUT_FILENO : STDIN_FILENO;
 
-            res = hdata.u.resp.tpm_result;
-            if (n != 0 || res != 0 || c == EOF)
-                break;
-        }
-    } else {
-        idx = 0;
-        while (idx < strlen(input)) {
-            size_t tocopy = strlen(input) - idx;
+    if (for_writing)
+        file_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    else
+        file_fd = open(filename, O_RDONLY);
+    if (file_fd < 0)
+        fprintf(stderr,
+                "Could not open file '%s' for %s: %s\n",
+                filename, for_writing ? "writing" : "reading",
+                strerror(errno));
+
+    return file_fd;
+}
+
+static void close_stream(int file_fd)
+{
+    if (file_fd != STDIN_FILENO && file_fd != STDOUT_FILENO)
+        close(file_fd);
+}
+
+/*
+ * hash_data: pass data to the TPM to hash
+ * @fd: file descriptor to talk to the CUSE TPM
+ * @data: the data
+ * @length: the number of bytes of data
+ * @buffersize: the number of bytes to write() to the TPM at once; 0 to use
+ *              PTM_HASH_DATA ioctls with up to 4 KiB each
+ */
+static int hash_data(int fd, const unsigned char *data, size_t length,
+                     size_t buffersize)
+{
+    ptm_hdata hdata;
+    size_t idx = 0, tocopy;
+    int n;
+
+    while (idx < length) {
+        tocopy = length - idx;
 
+        if (buffersize) {
+            if (tocopy > buffersize)
+                tocopy = buffersize;
+            if (write_full(fd, &data[idx], tocopy) < 0) {
+                fprintf(stderr,
+                        "Could not write data to hash to the TPM: %s\n",
+                        strerror(errno));
+                return 1;
+            }
+        } else {
             if (tocopy > sizeof(hdata.u.req.data))
                 tocopy = sizeof(hdata.u.req.data);
 
             hdata.u.req.length = tocopy;
-            memcpy(hdata.u.req.data, &input[idx], tocopy);
-            idx += tocopy;
+            memcpy(hdata.u.req.data, &data[idx], tocopy);
 
             n = ioctl(fd, PTM_HASH_DATA, &hdata);
+            if (n != 0) {
+                fprintf(stderr,
+                        "Could not execute ioctl PTM_HASH_DATA: "
+                        "%s\n", strerror(errno));
+                return 1;
+            }
+            if (hdata.u.resp.tpm_result != 0) {
+                fprintf(stderr,
+                       "TPM result from PTM_HASH_DATA: 0x%x\n",
+                       hdata.u.resp.tpm_result);
+                return 1;
+            }
+        }
+        idx += tocopy;
+    }
 
-            res = hdata.u.resp.tpm_result;
-            if (n != 0 || res != 0)
-                break;
+    return 0;
+}
+
+/*
+ * hash_stdin: pass the data from stdin to the TPM to hash; a regular file
+ *             is mapped into memory, anything else is read in large blocks
+ */
+static int hash_stdin(int fd, size_t buffersize)
+{
+    struct stat statbuf;
+    unsigned char *buffer;
+    size_t blocksize;
+    ssize_t n;
+    int ret = 0;
+
+    if (fstat(STDIN_FILENO, &statbuf) == 0 && S_ISREG(statbuf.st_mode) &&
+        statbuf.st_size > 0 && lseek(STDIN_FILENO, 0, SEEK_CUR) == 0) {
+        buffer = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE,
+                      STDIN_FILENO, 0);
+        if (buffer != MAP_FAILED) {
+            madvise(buffer, statbuf.st_size, MADV_SEQUENTIAL);
+            ret = hash_data(fd, buffer, statbuf.st_size, buffersize);
+            munmap(buffer, statbuf.st_size);
+            return ret;
+        }
+    }
+
+    blocksize = buffersize ? buffersize : DEFAULT_BUFFERSIZE;
+    buffer = malloc(blocksize);
+    if (!buffer) {
+        fprintf(stderr,
+                "Could not allocate buffer with %zu bytes.", blocksize);
+        return 1;
+    }
+
+    while (ret == 0) {
+        n = read_full(STDIN_FILENO, buffer, blocksize);
+        if (n < 0) {
+            fprintf(stderr, "Could not read from stdin: %s\n",
+                    strerror(errno));
+            ret = 1;
+            break;
         }
+        if (n == 0)
+            break;
+        ret = hash_data(fd, buffer, n, buffersize);
+        if ((size_t)n < blocksize)
+            break;
+    }
+
+    free(buffer);
+
+    return ret;
+}
+
+/*
+ * Do PTM_HASH_START, PTM_HASH_DATA, PTM_HASH_END on the
+ * data.
+ *
+ * If the CUSE TPM supports it, PTM_HASH_WRITE is used and the data are
+ * written to it using the write() interface with the given buffer size;
+ * otherwise, or if the buffer size is 0, PTM_HASH_DATA ioctls are used.
+ */
+static int do_hash_start_data_end(int fd, const char *input,
+                                  size_t buffersize)
+{
+    ptm_res res;
+    ptm_cap cap;
+    int n;
+
+    if (buffersize) {
+        n = ioctl(fd, PTM_GET_CAPABILITY, &cap);
+        if (n < 0 || !(cap & PTM_CAP_HASH_WRITE))
+            buffersize = 0;
     }
-    if (n != 0) {
+
+    n = ioctl(fd, PTM_HASH_START, &res);
+    if (n < 0) {
         fprintf(stderr,
-                "Could not execute ioctl PTM_HASH_DATA: "
+                "Could not execute ioctl PTM_HASH_START: "
                 "%s\n", strerror(errno));
         return 1;
     }
     if (res != 0) {
         fprintf(stderr,
-               "TPM result from PTM_HASH_DATA: 0x%x\n", res);
+                "TPM result from PTM_HASH_START: 0x%x\n", res);
         return 1;
     }
+
+    if (buffersize) {
+        /* switch the write() interface to hashing */
+        n = ioctl(fd, PTM_HASH_WRITE, &res);
+        if (n < 0) {
+            fprintf(stderr,
+                    "Could not execute ioctl PTM_HASH_WRITE: "
+                    "%s\n", strerror(errno));
+            return 1;
+        }
+        if (res != 0) {
+            fprintf(stderr,
+                    "TPM result from PTM_HASH_WRITE: 0x%x\n", res);
+            return 1;
+        }
+    }
+
+    if (strlen(input) == 1 && input[0] == '-') {
+        /* read data from stdin */
+        if (hash_stdin(fd, buffersize))
+            return 1;
+    } else {
+        if (hash_data(fd, (const unsigned char *)input, strlen(input),
+                      buffersize))
+            return 1;
+    }
+
     n = ioctl(fd, PTM_HASH_END, &res);
     if (n < 0) {
         fprintf(stderr,
@@ -155,53 +370,29 @@ static int do_hash_start_data_end(int fd, const char *input)
     return 0;
 }
 
-static uint32_t get_blobtype(const char *blobname)
-{
-    if (!strcmp(blobname, "permanent"))
-        return PTM_BLOB_TYPE_PERMANENT;
-    if (!strcmp(blobname, "volatile"))
-        return PTM_BLOB_TYPE_VOLATILE;
-    if (!strcmp(blobname, "savestate"))
-        return PTM_BLOB_TYPE_SAVESTATE;
-    return 0;
-}
-
 /*
- * do_save_state_blob: Get a state blob from the TPM and store it into the
- *                     given file
+ * save_state_blob: Get a state blob from the TPM and write it to a file
  * @fd: file descriptor to talk to the CUSE TPM
- * @blobtype: the name of the blobtype
- * @filename: name of the file to store the blob into
- *
+ * @bt: the type of the blob
+ * @file_fd: the file descriptor to write the blob to
+ * @filename: the name of the file for error messages
+ * @buffersize: the size of the buffer to use via read() interface; 0 to
+ *              only use the ioctl() interface
+ * @framed: whether to write a stream_frame in front of the blob; a blob that
+ *          does not exist is skipped then
  */
-static int do_save_state_blob(int fd, const char *blobtype,
-                              const char *filename, size_t buffersize)
+static int save_state_blob(int fd, uint32_t bt, int file_fd,
+                           const char *filename, size_t buffersize,
+                           bool framed)
 {
-    int file_fd;
     ptm_res res;
     ptm_getstate pgs;
-    uint16_t offset;
-    ssize_t numbytes;
+    stream_frame frame;
+    uint32_t offset, totlength = 0, written = 0;
     bool had_error;
-    int n;
-    uint32_t bt;
+    ssize_t n;
     unsigned char *buffer =  NULL;
 
-    bt = get_blobtype(blobtype);
-    if (!bt) {
-        fprintf(stderr,
-                "Unknown TPM state type '%s'", blobtype);
-        return 1;
-    }
-
-    file_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
-    if (file_fd < 0) {
-        fprintf(stderr,
-                "Could not open file '%s' for writing: %s\n",
-                filename, strerror(errno));
-        return 1;
-    }
-
     had_error = false;
     offset = 0;
 
@@ -227,15 +418,33 @@ static int do_save_state_blob(int fd, const char *blobtype,
             had_error = true;
             break;
         }
-        numbytes = write(file_fd, pgs.u.resp.data, pgs.u.resp.length);
+        if (offset == 0) {
+            totlength = pgs.u.resp.totlength;
+            if (framed) {
+                if (totlength == 0)
+                    break;
+                frame.magic = htonl(STREAM_FRAME_MAGIC);
+                frame.type = htonl(bt);
+                frame.length = htonl(totlength);
+                if (write_full(file_fd, &frame, sizeof(frame)) < 0) {
+                    fprintf(stderr,
+                            "Could not write to file '%s': %s\n",
+                            filename, strerror(errno));
+                    had_error = true;
+                    break;
+                }
+            }
+        }
 
-        if (numbytes != pgs.u.resp.length) {
+        if (write_full(file_fd, pgs.u.resp.data, pgs.u.resp.length) < 0) {
             fprintf(stderr,
                     "Could not write to file '%s': %s\n",
                     filename, strerror(errno));
             had_error = true;
             break;
         }
+        written += pgs.u.resp.length;
+
         /* done when the last byte was received */
         if (offset + pgs.u.resp.length >= pgs.u.resp.totlength)
             break;
@@ -261,14 +470,14 @@ static int do_save_state_blob(int fd, const char *blobtype,
                     had_error = true;
                     break;
                 }
-                numbytes = write(file_fd, buffer, n);
-                if (numbytes < 0) {
+                if (write_full(file_fd, buffer, n) < 0) {
                     fprintf(stderr,
                             "Could not write to file '%s': %s\n",
                             filename, strerror(errno));
                     had_error = true;
                     break;
                 }
+                written += n;
                 if ((size_t)n < buffersize)
                     break;
             }
@@ -279,10 +488,16 @@ static int do_save_state_blob(int fd, const char *blobtype,
         }
     }
 
-    close(file_fd);
-
     free(buffer);
 
+    /* the reader of a stream relies on the length in the frame */
+    if (!had_error && framed && written != totlength) {
+        fprintf(stderr,
+                "Received %u bytes of a state blob with %u bytes.\n",
+                written, totlength);
+        had_error = true;
+    }
+
     if (had_error)
         return 1;
 
@@ -290,25 +505,18 @@ static int do_save_state_blob(int fd, const char *blobtype,
 }
 
 /*
- * do_load_state_blob: Load a TPM state blob from a file and load it into the
- *                     TPM
+ * do_save_state_blob: Get a state blob from the TPM and store it into the
+ *                     given file
  * @fd: file descriptor to talk to the CUSE TPM
  * @blobtype: the name of the blobtype
  * @filename: name of the file to store the blob into
- * @buffersize: the size of the buffer to use via write() interface
+ * @buffersize: the size of the buffer to use via read() interface
  */
-static int do_load_state_blob(int fd, const char *blobtype,
-                              const char *filename,
-                              size_t buffersize)
+static int do_save_state_blob(int fd, const char *blobtype,
+                              const char *filename, size_t buffersize)
 {
-    int file_fd;
-    ptm_res res;
-    ptm_setstate pss;
-    ssize_t numbytes;
-    bool had_error;
-    int n;
+    int file_fd, ret;
     uint32_t bt;
-    unsigned char *buffer = NULL;
 
     bt = get_blobtype(blobtype);
     if (!bt) {
@@ -317,14 +525,86 @@ static int do_load_state_blob(int fd, const char *blobtype,
         return 1;
     }
 
-    file_fd = open(filename, O_RDONLY);
+    file_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
     if (file_fd < 0) {
         fprintf(stderr,
-                "Could not open file '%s' for reading: %s\n",
+                "Could not open file '%s' for writing: %s\n",
                 filename, strerror(errno));
         return 1;
     }
 
+    ret = save_state_blob(fd, bt, file_fd, filename, buffersize, false);
+
+    close(file_fd);
+
+    return ret;
+}
+
+/*
+ * do_save_all: Get all state blobs from the TPM and write them as a stream
+ *              of frames into the given file or to stdout
+ * @fd: file descriptor to talk to the CUSE TPM
+ * @filename: name of the file to store the blobs into; '-' for stdout
+ * @buffersize: the size of the buffer to use via read() interface
+ */
+static int do_save_all(int fd, const char *filename, size_t buffersize)
+{
+    stream_frame frame = {
+        .magic = htonl(STREAM_FRAME_MAGIC),
+        .type = 0,
+        .length = 0,
+    };
+    int file_fd, ret = 0;
+    size_t i;
+
+    file_fd = open_stream(filename, true);
+    if (file_fd < 0)
+        return 1;
+
+    for (i = 0; i < sizeof(stream_blobtypes) / sizeof(stream_blobtypes[0]);
+         i++) {
+        ret = save_state_blob(fd, stream_blobtypes[i], file_fd, filename,
+                              buffersize, true);
+        if (ret)
+            break;
+    }
+
+    if (ret == 0 && write_full(file_fd, &frame, sizeof(frame)) < 0) {
+        fprintf(stderr,
+                "Could not write to file '%s': %s\n",
+                filename, strerror(errno));
+        ret = 1;
+    }
+
+    close_stream(file_fd);
+
+    return ret;
+}
+
+/*
+ * load_state_blob: Read a state blob from a file and load it into the TPM
+ * @fd: file descriptor to talk to the CUSE TPM
+ * @bt: the type of the blob
+ * @file_fd: the file descriptor to read the blob from
+ * @filename: the name of the file for error messages
+ * @buffersize: the size of the buffer to use via write() interface; 0 to
+ *              only use the ioctl() interface
+ * @length: the length of the blob if it is framed in a stream; 0 to read
+ *          the blob up to the end of the file
+ */
+static int load_state_blob(int fd, uint32_t bt, int file_fd,
+                           const char *filename, size_t buffersize,
+                           uint32_t length)
+{
+    ptm_res res;
+    ptm_setstate pss;
+    ssize_t numbytes;
+    size_t toread;
+    uint32_t remaining = length;
+    bool had_error;
+    int n;
+    unsigned char *buffer = NULL;
+
     had_error = false;
 
     if (!buffersize) {
@@ -334,7 +614,11 @@ static int do_load_state_blob(int fd, const char *blobtype,
             pss.u.req.state_flags = 0;
             pss.u.req.type = bt;
 
-            numbytes = read(file_fd, pss.u.req.data, sizeof(pss.u.req.data));
+            toread = sizeof(pss.u.req.data);
+            if (length && remaining < toread)
+                toread = remaining;
+
+            numbytes = read_full(file_fd, pss.u.req.data, toread);
             if (numbytes < 0) {
                 fprintf(stderr,
                         "Could not read from file '%s': %s\n",
@@ -342,9 +626,16 @@ static int do_load_state_blob(int fd, const char *blobtype,
                had_error = true;
                break;
             }
-            pss.u.req.length = numbytes;
-
-            n = ioctl(fd, PTM_SET_STATEBLOB, &pss);
+            if (length && (size_t)numbytes < toread) {
+                fprintf(stderr,
+                        "The state blob in '%s' is truncated.\n", filename);
+                had_error = true;
+                break;
+            }
+            remaining -= numbytes;
+            pss.u.req.length = numbytes;
+
+            n = ioctl(fd, PTM_SET_STATEBLOB, &pss);
             if (n < 0) {
                 fprintf(stderr,
                         "Could not execute ioctl PTM_SET_STATEBLOB: "
@@ -395,20 +686,31 @@ static int do_load_state_blob(int fd, const char *blobtype,
         }
 
         while (true) {
-            n = read(file_fd, buffer, buffersize);
-            if (n < 0) {
+            toread = buffersize;
+            if (length && remaining < toread)
+                toread = remaining;
+
+            numbytes = read_full(file_fd, buffer, toread);
+            if (numbytes < 0) {
                 fprintf(stderr, "Could not read from file: %s\n",
                         strerror(errno));
                 had_error = 1;
                 goto cleanup;
             }
-            if (n != write(fd, buffer, n)) {
+            if (length && (size_t)numbytes < toread) {
+                fprintf(stderr,
+                        "The state blob in '%s' is truncated.\n", filename);
+                had_error = 1;
+                goto cleanup;
+            }
+            remaining -= numbytes;
+            if (numbytes > 0 && write_full(fd, buffer, numbytes) < 0) {
                 fprintf(stderr, "Could not write to file: %s\n",
                         strerror(errno));
                 had_error = 1;
                 goto cleanup;
             }
-            if ((size_t)n < buffersize) {
+            if ((size_t)numbytes < buffersize) {
                 /* close transfer with the ioctl() */
                 pss.u.req.state_flags = 0;
                 pss.u.req.type = bt;
@@ -436,8 +738,6 @@ static int do_load_state_blob(int fd, const char *blobtype,
     }
 
  cleanup:
-    close(file_fd);
-
     free(buffer);
 
     if (had_error)
@@ -446,85 +746,209 @@ static int do_load_state_blob(int fd, const char *blobtype,
     return 0;
 }
 
-static void usage(const char *prgname)
+/*
+ * do_load_state_blob: Load a TPM state blob from a file and load it into the
+ *                     TPM
+ * @fd: file descriptor to talk to the CUSE TPM
+ * @blobtype: the name of the blobtype
+ * @filename: name of the file to store the blob into
+ * @buffersize: the size of the buffer to use via write() interface
+ */
+static int do_load_state_blob(int fd, const char *blobtype,
+                              const char *filename,
+                              size_t buffersize)
 {
-    fprintf(stdout,
-"Usage: %s command <device path>\n"
-"\n"
-"The following commands are supported:\n"
-"-c       : get ptm capabilities\n"
-"-i       : do a hardware TPM_Init; if volatile state is found, it will\n"
-"           resume the TPM with it and delete it afterwards\n"
-"--stop   : stop the CUSE tpm without exiting\n"
-"-s       : shutdown the CUSE tpm; stops and exists\n"
-"-e       : get the tpmEstablished bit\n"
-"-r <loc> : reset the tpmEstablished bit; use the given locality\n"
-"-v       : store the TPM's volatile data\n"
-"-C       : cancel an ongoing TPM command\n"
-"-l <num> : set the locality to the given number; valid numbers are 0-4\n"
-"-h <data>: hash the given data; if data is '-' then data are read from\n"
-"           stdin\n"
-"--save <type> <file> : store the TPM state blob of given type in a file;\n"
-"                       type may be one of volatile, permanent, or savestate\n"
-"--load <type> <file> : load the TPM state blob of given type from a file;\n"
-"                       type may be one of volatile, permanent, or savestate\n"
-"-g       : get configuration flags indicating which keys are in use\n"
-"\n"
-    ,prgname);
+    int file_fd, ret;
+    uint32_t bt;
+
+    bt = get_blobtype(blobtype);
+    if (!bt) {
+        fprintf(stderr,
+                "Unknown TPM state type '%s'", blobtype);
+        return 1;
+    }
+
+    file_fd = open(filename, O_RDONLY);
+    if (file_fd < 0) {
+        fprintf(stderr,
+                "Could not open file '%s' for reading: %s\n",
+                filename, strerror(errno));
+        return 1;
+    }
+
+    ret = load_state_blob(fd, bt, file_fd, filename, buffersize, 0);
+
+    close(file_fd);
+
+    return ret;
 }
 
-int main(int argc, char *argv[])
+/*
+ * do_load_all: Load the state blobs from a stream written by --save-all
+ *              into the TPM
+ * @fd: file descriptor to talk to the CUSE TPM
+ * @filename: name of the file to read the blobs from; '-' for stdin
+ * @buffersize: the size of the buffer to use via write() interface
+ */
+static int do_load_all(int fd, const char *filename, size_t buffersize)
 {
-    int fd;
-    int devindex, n;
-    ptm_est est;
-    ptm_reset_est reset_est;
-    ptm_loc loc;
-    ptm_cap cap;
-    ptm_res res;
-    ptm_init init;
-    ptm_getconfig cfg;
-    char *tmp;
-    size_t buffersize = 0;
+    stream_frame frame;
+    uint32_t bt, length;
+    ssize_t n;
+    int file_fd, ret = 0;
 
-    if (argc < 2) {
-        fprintf(stderr, "Error: Missing command.\n\n");
-        usage(argv[0]);
+    file_fd = open_stream(filename, false);
+    if (file_fd < 0)
         return 1;
+
+    while (true) {
+        n = read_full(file_fd, &frame, sizeof(frame));
+        if (n < 0) {
+            fprintf(stderr,
+                    "Could not read from file '%s': %s\n",
+                    filename, strerror(errno));
+            ret = 1;
+            break;
+        }
+        if ((size_t)n < sizeof(frame) ||
+            ntohl(frame.magic) != STREAM_FRAME_MAGIC) {
+            fprintf(stderr,
+                    "'%s' is not a complete stream of TPM state blobs.\n",
+                    filename);
+            ret = 1;
+            break;
+        }
+        bt = ntohl(frame.type);
+        length = ntohl(frame.length);
+        if (bt == 0)
+            break;
+        if (length == 0 || (bt != PTM_BLOB_TYPE_PERMANENT &&
+                            bt != PTM_BLOB_TYPE_VOLATILE &&
+                            bt != PTM_BLOB_TYPE_SAVESTATE)) {
+            fprintf(stderr,
+                    "Invalid state blob of type %u with %u bytes in '%s'.\n",
+                    bt, length, filename);
+            ret = 1;
+            break;
+        }
+
+        ret = load_state_blob(fd, bt, file_fd, filename, buffersize, length);
+        if (ret)
+            break;
     }
 
-    if (!strcmp(argv[1], "--save") ||
-        !strcmp(argv[1], "--load")) {
-        devindex = 4;
-    } else if (!strcmp(argv[1], "-l") ||
-        !strcmp(argv[1], "-h") ||
-        !strcmp(argv[1], "-r")) {
-        devindex = 3;
+    close_stream(file_fd);
+
+    return ret;
+}
+
+/*
+ * do_snapshot: create a snapshot of the TPM state in the given directory
+ *              or restore the TPM state from it
+ *
+ * The CUSE TPM needs an absolute path since its working directory is not
+ * ours.
+ */
+static int do_snapshot(int fd, bool restore, const char *dir)
+{
+    ptm_snapshot snap;
+    const char *cmd = restore ? "PTM_RESTORE" : "PTM_SNAPSHOT";
+    char cwd[SNAPSHOT_PATH_MAX];
+    int n;
+
+    memset(&snap, 0, sizeof(snap));
+
+    if (dir[0] == '/') {
+        n = snprintf(snap.u.req.path, sizeof(snap.u.req.path), "%s", dir);
     } else {
-        devindex = 2;
+        if (!getcwd(cwd, sizeof(cwd))) {
+            fprintf(stderr,
+                    "Could not get the current working directory: %s\n",
+                    strerror(errno));
+            return 1;
+        }
+        n = snprintf(snap.u.req.path, sizeof(snap.u.req.path), "%s/%s",
+                     cwd, dir);
     }
-
-    if (devindex >= argc) {
-        fprintf(stderr, "Error: Not enough parameters.\n\n");
-        usage(argv[0]);
+    if (n < 0 || (size_t)n >= sizeof(snap.u.req.path)) {
+        fprintf(stderr, "Snapshot directory path is too long.\n");
         return 1;
     }
 
-    tmp = getenv("SWTPM_IOCTL_BUFFERSIZE");
-    if (tmp) {
-        if (sscanf(tmp, "%zu", &buffersize) != 1 || buffersize < 1)
-            buffersize = 1;
+    n = ioctl(fd, restore ? PTM_RESTORE : PTM_SNAPSHOT, &snap);
+    if (n < 0) {
+        fprintf(stderr,
+                "Could not execute ioctl %s: %s\n", cmd, strerror(errno));
+        return 1;
     }
-
-    fd = open(argv[devindex], O_RDWR);
-    if (fd < 0) {
+    if (snap.u.resp.tpm_result != 0) {
         fprintf(stderr,
-                "Could not open CUSE TPM device %s: %s\n",
-                argv[devindex], strerror(errno));
-        return -1;
+                "TPM result from %s: 0x%x\n", cmd, snap.u.resp.tpm_result);
+        return 1;
     }
+    if (!restore && (snap.u.resp.flags & SNAPSHOT_FLAG_REFLINKED))
+        printf("snapshot files were cloned\n");
+
+    return 0;
+}
+
+/*
+ * command_nargs: get the number of parameters the given command takes
+ *
+ * Returns -1 if the command is not known.
+ */
+static int command_nargs(const char *cmd)
+{
+    static const struct {
+        const char *name;
+        int nargs;
+    } commands[] = {
+        { "-c", 0 },
+        { "-i", 0 },
+        { "--stop", 0 },
+        { "-s", 0 },
+        { "-e", 0 },
+        { "-r", 1 },
+        { "-v", 0 },
+        { "-C", 0 },
+        { "-l", 1 },
+        { "-h", 1 },
+        { "--save", 2 },
+        { "--load", 2 },
+        { "--save-all", 1 },
+        { "--load-all", 1 },
+        { "-g", 0 },
+        { "--snapshot", 1 },
+        { "--restore", 1 },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (!strcmp(cmd, commands[i].name))
+            return commands[i].nargs;
+    }
+    return -1;
+}
 
-    if (!strcmp(argv[1], "-c")) {
+/*
+ * do_command: execute a command on the CUSE TPM
+ * @fd: file descriptor to talk to the CUSE TPM
+ * @args: the command followed by its parameters
+ * @buffersize: the size of the buffer to use via read() and write()
+ *              interfaces
+ */
+static int do_command(int fd, char *const args[], size_t buffersize)
+{
+    int n;
+    ptm_est est;
+    ptm_reset_est reset_est;
+    ptm_loc loc;
+    ptm_cap cap;
+    ptm_res res;
+    ptm_init init;
+    ptm_getconfig cfg;
+
+    if (!strcmp(args[0], "-c")) {
         n = ioctl(fd, PTM_GET_CAPABILITY, &cap);
         if (n < 0) {
             fprintf(stderr,
@@ -535,7 +959,7 @@ int main(int argc, char *argv[])
         /* no tpm_result here */
         printf("ptm capability is 0x%lx\n",cap);
 
-    } else if (!strcmp(argv[1], "-i")) {
+    } else if (!strcmp(args[0], "-i")) {
         init.u.req.init_flags = INIT_FLAG_DELETE_VOLATILE;
         n = ioctl(fd, PTM_INIT, &init);
         if (n < 0) {
@@ -551,7 +975,7 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-    } else if (!strcmp(argv[1], "-e")) {
+    } else if (!strcmp(args[0], "-e")) {
         n = ioctl(fd, PTM_GET_TPMESTABLISHED, &est);
         if (n < 0) {
             fprintf(stderr,
@@ -567,8 +991,8 @@ int main(int argc, char *argv[])
         }
         printf("tpmEstablished is %d\n",est.bit);
 
-    } else if (!strcmp(argv[1], "-r")) {
-        reset_est.u.req.loc = atoi(argv[2]);
+    } else if (!strcmp(args[0], "-r")) {
+        reset_est.u.req.loc = atoi(args[1]);
         if (reset_est.u.req.loc > 4) {
             fprintf(stderr,
                     "Locality must be a number from 0 to 4.\n");
@@ -588,7 +1012,7 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-    } else if (!strcmp(argv[1], "-s")) {
+    } else if (!strcmp(args[0], "-s")) {
         n = ioctl(fd, PTM_SHUTDOWN, &res);
         if (n < 0) {
             fprintf(stderr,
@@ -602,7 +1026,7 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-    } else if (!strcmp(argv[1], "--stop")) {
+    } else if (!strcmp(args[0], "--stop")) {
         n = ioctl(fd, PTM_STOP, &res);
         if (n < 0) {
             fprintf(stderr,
@@ -616,8 +1040,8 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-    } else if (!strcmp(argv[1], "-l")) {
-        loc.u.req.loc = atoi(argv[2]);
+    } else if (!strcmp(args[0], "-l")) {
+        loc.u.req.loc = atoi(args[1]);
         if (loc.u.req.loc > 4) {
             fprintf(stderr,
                     "Locality must be a number from 0 to 4.\n");
@@ -637,12 +1061,12 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-    } else if (!strcmp(argv[1], "-h")) {
-        if (do_hash_start_data_end(fd, argv[2])) {
+    } else if (!strcmp(args[0], "-h")) {
+        if (do_hash_start_data_end(fd, args[1], buffersize)) {
             return 1;
         }
 
-    } else if (!strcmp(argv[1], "-C")) {
+    } else if (!strcmp(args[0], "-C")) {
         n = ioctl(fd, PTM_CANCEL_TPM_CMD, &res);
         if (n < 0) {
             fprintf(stderr,
@@ -657,7 +1081,7 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-    } else if (!strcmp(argv[1], "-v")) {
+    } else if (!strcmp(args[0], "-v")) {
         n = ioctl(fd, PTM_STORE_VOLATILE, &res);
         if (n < 0) {
             fprintf(stderr,
@@ -672,15 +1096,31 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-    } else if (!strcmp(argv[1], "--save")) {
-        if (do_save_state_blob(fd, argv[2], argv[3], buffersize))
+    } else if (!strcmp(args[0], "--save")) {
+        if (do_save_state_blob(fd, args[1], args[2], buffersize))
+            return 1;
+
+    } else if (!strcmp(args[0], "--load")) {
+        if (do_load_state_blob(fd, args[1], args[2], buffersize))
+            return 1;
+
+    } else if (!strcmp(args[0], "--save-all")) {
+        if (do_save_all(fd, args[1], buffersize))
             return 1;
 
-    } else if (!strcmp(argv[1], "--load")) {
-        if (do_load_state_blob(fd, argv[2], argv[3], buffersize))
+    } else if (!strcmp(args[0], "--load-all")) {
+        if (do_load_all(fd, args[1], buffersize))
             return 1;
 
-    } else if (!strcmp(argv[1], "-g")) {
+    } else if (!strcmp(args[0], "--snapshot")) {
+        if (do_snapshot(fd, false, args[1]))
+            return 1;
+
+    } else if (!strcmp(args[0], "--restore")) {
+        if (do_snapshot(fd, true, args[1]))
+            return 1;
+
+    } else if (!strcmp(args[0], "-g")) {
         n = ioctl(fd, PTM_GET_CONFIG, &cfg);
         if (n < 0) {
             fprintf(stderr,
@@ -696,8 +1136,566 @@ int main(int argc, char *argv[])
         }
         printf("ptm configuration flags: 0x%x\n",cfg.u.resp.flags);
     } else {
-        usage(argv[0]);
+        fprintf(stderr, "Unknown command '%s'.\n", args[0]);
         return 1;
     }
     return 0;
 }
+
+/* the number of devices a batch is run on at the same time */
+#define BATCH_MAX_PARALLEL 64
+
+struct batch_step {
+    unsigned int line;     /* the line in the batch file */
+    char *text;            /* the command as given in the batch file */
+    char *args[4];         /* the command followed by its parameters */
+};
+
+struct batch {
+    struct batch_step *steps;
+    size_t n;
+};
+
+static void batch_free(struct batch *batch)
+{
+    size_t i;
+
+    for (i = 0; i < batch->n; i++) {
+        free(batch->steps[i].text);
+        free(batch->steps[i].args[0]);
+    }
+    free(batch->steps);
+    batch->steps = NULL;
+    batch->n = 0;
+}
+
+/*
+ * batch_read: read the commands of a batch from a file, one per line
+ * @batch: the batch to fill
+ * @filename: the name of the file; '-' for stdin
+ *
+ * Empty lines and lines starting with '#' are ignored. All commands are
+ * checked before the batch is run on any device.
+ */
+static int batch_read(struct batch *batch, const char *filename)
+{
+    FILE *file;
+    char *line = NULL, *start, *end, *copy, *saveptr, *tok;
+    size_t linesize = 0, size = 0;
+    unsigned int lineno = 0;
+    struct batch_step *step, *tmp;
+    int nargs, i, ret = 0;
+
+    if (!strcmp(filename, "-")) {
+        file = stdin;
+    } else {
+        file = fopen(filename, "r");
+        if (!file) {
+            fprintf(stderr, "Could not open batch file '%s': %s\n",
+                    filename, strerror(errno));
+            return 1;
+        }
+    }
+
+    while (getline(&line, &linesize, file) >= 0) {
+        lineno++;
+
+        start = line + strspn(line, " \t");
+        end = start + strlen(start);
+        while (end > start && strchr(" \t\r\n", end[-1]))
+            *--end = 0;
+        if (*start == 0 || *start == '#')
+            continue;
+
+        if (batch->n == size) {
+            size = size ? 2 * size : 16;
+            tmp = realloc(batch->steps, size * sizeof(*batch->steps));
+            if (!tmp) {
+                fprintf(stderr, "Out of memory.\n");
+                ret = 1;
+                break;
+            }
+            batch->steps = tmp;
+        }
+
+        step = &batch->steps[batch->n];
+        memset(step, 0, sizeof(*step));
+        step->line = lineno;
+        step->text = strdup(start);
+        copy = strdup(start);
+        if (!step->text || !copy) {
+            free(step->text);
+            free(copy);
+            fprintf(stderr, "Out of memory.\n");
+            ret = 1;
+            break;
+        }
+        batch->n++;
+
+        /* the first token is at the start of the copy, which args[0] owns */
+        i = 0;
+        for (tok = strtok_r(copy, " \t", &saveptr); tok;
+             tok = strtok_r(NULL, " \t", &saveptr)) {
+            if (i == 3) {
+                i++;
+                break;
+            }
+            step->args[i++] = tok;
+        }
+
+        nargs = command_nargs(step->args[0]);
+        if (nargs < 0) {
+            fprintf(stderr, "%s:%u: Unknown command '%s'.\n",
+                    filename, lineno, step->args[0]);
+            ret = 1;
+            break;
+        }
+        if (i != nargs + 1) {
+            fprintf(stderr, "%s:%u: '%s' takes %d parameter(s).\n",
+                    filename, lineno, step->args[0], nargs);
+            ret = 1;
+            break;
+        }
+        /* stdin and stdout are not ours to use in a batch */
+        if ((!strcmp(step->args[0], "-h") ||
+             !strcmp(step->args[0], "--save-all") ||
+             !strcmp(step->args[0], "--load-all")) &&
+            !strcmp(step->args[1], "-")) {
+            fprintf(stderr, "%s:%u: '-' cannot be used in a batch.\n",
+                    filename, lineno);
+            ret = 1;
+            break;
+        }
+    }
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+
+    if (ret == 0 && batch->n == 0) {
+        fprintf(stderr, "The batch file '%s' holds no commands.\n", filename);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+static void json_print_string(FILE *out, const char *s, size_t len)
+{
+    size_t i;
+    unsigned char c;
+
+    fputc('"', out);
+    for (i = 0; i < len; i++) {
+        c = s[i];
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", out);
+        else if (c < 0x20 || c == 0x7f)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+/*
+ * capture_print: print what a command wrote into a capture file as a JSON
+ *                field and empty the file
+ */
+static void capture_print(FILE *out, const char *field, int cap_fd)
+{
+    char buffer[4096];
+    off_t len;
+    ssize_t n;
+
+    len = lseek(cap_fd, 0, SEEK_END);
+    if (len <= 0)
+        return;
+    lseek(cap_fd, 0, SEEK_SET);
+
+    /* messages are short; the rest of a long one is dropped */
+    n = read_full(cap_fd, buffer, sizeof(buffer));
+    while (n > 0 && buffer[n - 1] == '\n')
+        n--;
+    if (n > 0) {
+        fprintf(out, ", \"%s\": ", field);
+        json_print_string(out, buffer, n);
+    }
+
+    if (ftruncate(cap_fd, 0) < 0)
+        fprintf(out, ", \"%s\": \"could not reset the capture\"", field);
+    lseek(cap_fd, 0, SEEK_SET);
+}
+
+/*
+ * batch_run_device: run the commands of a batch on one device over one open
+ *                   file descriptor and report the result as a JSON object
+ * @batch: the commands to run
+ * @device: the path of the device
+ * @buffersize: the size of the buffer to use via read() and write()
+ *              interfaces
+ * @out: the stream to write the JSON object to
+ *
+ * The messages the commands print are captured and become part of the JSON
+ * object. The batch stops at the first command that fails; the remaining
+ * ones are reported as skipped.
+ */
+static int batch_run_device(const struct batch *batch, const char *device,
+                            size_t buffersize, FILE *out)
+{
+    FILE *cap_out = NULL, *cap_err = NULL;
+    int fd, saved_out = -1, saved_err = -1, ret = 0;
+    struct timespec start, begin;
+    uint64_t took;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    fprintf(out, "{\"device\": ");
+    json_print_string(out, device, strlen(device));
+
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        fprintf(out, ", \"result\": \"error\", \"error\": ");
+        json_print_string(out, strerror(errno), strlen(strerror(errno)));
+        fprintf(out, ", \"steps\": []}");
+        return 1;
+    }
+
+    cap_out = tmpfile();
+    cap_err = tmpfile();
+    saved_out = dup(STDOUT_FILENO);
+    saved_err = dup(STDERR_FILENO);
+    if (!cap_out || !cap_err || saved_out < 0 || saved_err < 0) {
+        fprintf(out, ", \"result\": \"error\", "
+                "\"error\": \"could not capture the output\", \"steps\": []}");
+        ret = 1;
+        goto cleanup;
+    }
+
+    fprintf(out, ", \"steps\": [");
+    for (i = 0; i < batch->n; i++) {
+        fprintf(out, "%s{\"line\": %u, \"command\": ", i ? ", " : "",
+                batch->steps[i].line);
+        json_print_string(out, batch->steps[i].text,
+                          strlen(batch->steps[i].text));
+
+        if (ret) {
+            fprintf(out, ", \"result\": \"skipped\"}");
+            continue;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(fileno(cap_out), STDOUT_FILENO);
+        dup2(fileno(cap_err), STDERR_FILENO);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ret = do_command(fd, batch->steps[i].args, buffersize);
+        took = SWTPM_Time_Elapsed_Ns(&start) / 1000;
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+
+        fprintf(out, ", \"result\": \"%s\", \"time_us\": %" PRIu64,
+                ret ? "error" : "ok", took);
+        capture_print(out, "output", fileno(cap_out));
+        capture_print(out, "error", fileno(cap_err));
+        fprintf(out, "}");
+    }
+    fprintf(out, "], \"result\": \"%s\", \"time_us\": %" PRIu64 "}",
+            ret ? "error" : "ok", SWTPM_Time_Elapsed_Ns(&begin) / 1000);
+
+cleanup:
+    if (saved_out >= 0)
+        close(saved_out);
+    if (saved_err >= 0)
+        close(saved_err);
+    if (cap_out)
+        fclose(cap_out);
+    if (cap_err)
+        fclose(cap_err);
+    close(fd);
+
+    return ret;
+}
+
+/* what the workers running a batch on several devices inherit */
+static const struct batch *fleet_batch;
+static size_t fleet_buffersize;
+static char fleet_resultdir[] = "/tmp/swtpm_ioctl-XXXXXX";
+
+static void batch_result_path(char *path, size_t pathlen, size_t idx)
+{
+    snprintf(path, pathlen, "%s/%zu", fleet_resultdir, idx);
+}
+
+/*
+ * batch_work: run the batch on device 'idx' in a worker process; its JSON
+ *             object is too long for the result, so it goes into a file
+ */
+static void batch_work(size_t idx, const char *device, char *result,
+                       size_t resultlen)
+{
+    char path[sizeof(fleet_resultdir) + 32];
+    FILE *out;
+    int fd, ret;
+
+    batch_result_path(path, sizeof(path), idx);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!out) {
+        if (fd >= 0)
+            close(fd);
+        snprintf(result, resultlen, "1");
+        return;
+    }
+    ret = batch_run_device(fleet_batch, device, fleet_buffersize, out);
+    if (fclose(out) != 0)
+        ret = 1;
+
+    snprintf(result, resultlen, "%d", ret ? 1 : 0);
+}
+
+struct batch_results {
+    const struct dirlist *devices;
+    size_t ok;
+    size_t failed;
+};
+
+/*
+ * batch_result: print the JSON object of a device that finished its batch;
+ *               'result' is NULL if its worker died
+ */
+static void batch_result(size_t idx, const char *result, void *opaque)
+{
+    struct batch_results *br = opaque;
+    const char *device = br->devices->dirs[idx];
+    char path[sizeof(fleet_resultdir) + 32];
+    char buffer[4096];
+    bool empty = true;
+    ssize_t n;
+    int fd;
+
+    if (br->ok + br->failed > 0)
+        printf(", ");
+    fflush(stdout);
+
+    batch_result_path(path, sizeof(path), idx);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            write_full(STDOUT_FILENO, buffer, n);
+            empty = false;
+        }
+        close(fd);
+        unlink(path);
+    }
+    if (empty) {
+        /* the worker died before it could report anything */
+        printf("{\"device\": ");
+        json_print_string(stdout, device, strlen(device));
+        printf(", \"result\": \"error\", "
+               "\"error\": \"terminated abnormally\", \"steps\": []}");
+    }
+
+    if (!empty && result && !strcmp(result, "0"))
+        br->ok++;
+    else
+        br->failed++;
+}
+
+/*
+ * do_batch: run the commands in a batch file on one device or concurrently
+ *           on all devices matching a pattern
+ * @filename: the name of the batch file; '-' for stdin
+ * @device: the path of the device; NULL if a pattern is given
+ * @pattern: the pattern for glob(3) matching the devices
+ * @buffersize: the size of the buffer to use via read() and write()
+ *              interfaces
+ *
+ * With a single device the result is one JSON object, otherwise it is a
+ * JSON object with an array of them, in the order in which the devices
+ * finished, and a summary.
+ */
+static int do_batch(const char *filename, const char *device,
+                    const char *pattern, size_t buffersize)
+{
+    struct batch batch = {
+        .steps = NULL,
+        .n = 0,
+    };
+    struct fleet_options fopts = {
+        .workers = BATCH_MAX_PARALLEL,
+    };
+    struct dirlist devices = { NULL, 0, 0 };
+    struct batch_results br = {
+        .devices = &devices,
+    };
+    unsigned long started;
+    struct timespec begin;
+    glob_t matches;
+    size_t i;
+    int ret;
+
+    if (batch_read(&batch, filename)) {
+        batch_free(&batch);
+        return 1;
+    }
+
+    if (device) {
+        ret = batch_run_device(&batch, device, buffersize, stdout);
+        printf("\n");
+        batch_free(&batch);
+        return ret;
+    }
+
+    ret = glob(pattern, 0, NULL, &matches);
+    if (ret) {
+        fprintf(stderr, "%s '%s'.\n",
+                ret == GLOB_NOMATCH ? "No device matches"
+                                    : "Could not search for devices matching",
+                pattern);
+        batch_free(&batch);
+        return 1;
+    }
+    for (i = 0, ret = 0; i < matches.gl_pathc && ret == 0; i++)
+        ret = SWTPM_DirList_Add(&devices, matches.gl_pathv[i]);
+    globfree(&matches);
+
+    if (ret == 0 && !mkdtemp(fleet_resultdir)) {
+        fprintf(stderr, "Could not create a temporary directory: %s\n",
+                strerror(errno));
+        ret = -1;
+    }
+    if (ret < 0) {
+        SWTPM_DirList_Free(&devices);
+        batch_free(&batch);
+        return 1;
+    }
+    fleet_batch = &batch;
+    fleet_buffersize = buffersize;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    printf("{\"devices\": [");
+
+    /* devices that could not be handed to a worker show up as errors */
+    SWTPM_Fleet_Run(&devices, &fopts, batch_work, batch_result, &br,
+                    &started);
+
+    printf("], \"summary\": {\"devices\": %zu, \"ok\": %zu, \"failed\": %zu, "
+           "\"time_us\": %" PRIu64 "}}\n",
+           devices.n, br.ok, br.failed, SWTPM_Time_Elapsed_Ns(&begin) / 1000);
+
+    rmdir(fleet_resultdir);
+    ret = (br.ok == devices.n) ? 0 : 1;
+    SWTPM_DirList_Free(&devices);
+    batch_free(&batch);
+
+    return ret;
+}
+
+static void usage(const char *prgname)
+{
+    fprintf(stdout,
+"Usage: %s command <device path>\n"
+"       %s --batch <file> <device path>\n"
+"       %s --batch <file> --devices <pattern>\n"
+"\n"
+"The following commands are supported:\n"
+"-c       : get ptm capabilities\n"
+"-i       : do a hardware TPM_Init; if volatile state is found, it will\n"
+"           resume the TPM with it and delete it afterwards\n"
+"--stop   : stop the CUSE tpm without exiting\n"
+"-s       : shutdown the CUSE tpm; stops and exists\n"
+"-e       : get the tpmEstablished bit\n"
+"-r <loc> : reset the tpmEstablished bit; use the given locality\n"
+"-v       : store the TPM's volatile data\n"
+"-C       : cancel an ongoing TPM command\n"
+"-l <num> : set the locality to the given number; valid numbers are 0-4\n"
+"-h <data>: hash the given data; if data is '-' then data are read from\n"
+"           stdin\n"
+"--save <type> <file> : store the TPM state blob of given type in a file;\n"
+"                       type may be one of volatile, permanent, or savestate\n"
+"--load <type> <file> : load the TPM state blob of given type from a file;\n"
+"                       type may be one of volatile, permanent, or savestate\n"
+"--save-all <file> : store all TPM state blobs in a file; if file is '-'\n"
+"                    they are written to stdout\n"
+"--load-all <file> : load all TPM state blobs stored with --save-all from\n"
+"                    a file; if file is '-' they are read from stdin\n"
+"-g       : get configuration flags indicating which keys are in use\n"
+"--snapshot <dir> : create a point-in-time copy of the TPM state in the\n"
+"                   given directory; the volatile state of a running TPM\n"
+"                   is part of it\n"
+"--restore <dir>  : replace the TPM state with the one of a snapshot; the\n"
+"                   TPM must not be running\n"
+"\n"
+"--batch <file> : run the commands in the file, one per line, over one open\n"
+"                 device and report their results and timing as JSON; if\n"
+"                 file is '-' the commands are read from stdin\n"
+"--devices <pattern> : run the batch concurrently on all devices matching\n"
+"                      the pattern, e.g., '/dev/vtpm*'\n"
+"\n"
+    ,prgname, prgname, prgname);
+}
+
+int main(int argc, char *argv[])
+{
+    int fd, nargs, ret;
+    size_t buffersize = DEFAULT_BUFFERSIZE;
+    char *tmp;
+
+    if (argc < 2) {
+        fprintf(stderr, "Error: Missing command.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* a buffer size of 0 selects the ioctl() interface */
+    tmp = getenv("SWTPM_IOCTL_BUFFERSIZE");
+    if (tmp) {
+        if (sscanf(tmp, "%zu", &buffersize) != 1)
+            buffersize = 1;
+    }
+
+    if (!strcmp(argv[1], "--batch")) {
+        if (argc == 4)
+            return do_batch(argv[2], argv[3], NULL, buffersize);
+        if (argc == 5 && !strcmp(argv[3], "--devices"))
+            return do_batch(argv[2], NULL, argv[4], buffersize);
+        fprintf(stderr, "Error: Wrong parameters for --batch.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    nargs = command_nargs(argv[1]);
+    if (nargs < 0) {
+        fprintf(stderr, "Error: Unknown command '%s'.\n\n", argv[1]);
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (2 + nargs >= argc) {
+        fprintf(stderr, "Error: Not enough parameters.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[2 + nargs], O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr,
+                "Could not open CUSE TPM device %s: %s\n",
+                argv[2 + nargs], strerror(errno));
+        return -1;
+    }
+
+    ret = do_command(fd, &argv[1], buffersize);
+
+    close(fd);
+
+    return ret;
+}
@@ -35,6 +35,10 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -42,10 +46,34 @@
 #include <errno.h>
 #include <limits.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <pwd.h>
 #include <grp.h>
 
+#ifdef WITH_GNUTLS
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include <libtpms/tpm_library.h>
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+
+#include "common.h"
+#include "logging.h"
+#include "swtpm_nvfile.h"
+#include "swtpm_startup.h"
+#include "swtpm_time.h"
+#include "localca.h"
+#include "swtpm_fleet.h"
+#include "swtpm_setup_tpm.h"
+#include "swtpm_setup_pool.h"
+#endif
+
 #define E_USER_GROUP "tss"
 
 /*
@@ -62,9 +90,917 @@ const char *one_arg_params[] = {
     "--logfile",
     "--keyfile",
     "--pwdfile",
+    "--pool",
+    "--pool-size",
     NULL
 };
 
+#ifdef WITH_GNUTLS
+
+/* the flags of swtpm_setup.sh */
+#define SETUP_CREATE_EK_F        (1 << 0)
+#define SETUP_TAKEOWN_F          (1 << 1)
+#define SETUP_EK_CERT_F          (1 << 2)
+#define SETUP_PLATFORM_CERT_F    (1 << 3)
+#define SETUP_LOCK_NVRAM_F       (1 << 4)
+#define SETUP_SRKPASS_ZEROS_F    (1 << 5)
+#define SETUP_OWNERPASS_ZEROS_F  (1 << 6)
+#define SETUP_DISPLAY_RESULTS_F  (1 << 12)
+
+#define DEFAULT_OWNER_PASSWORD "ooo"
+#define DEFAULT_SRK_PASSWORD   "sss"
+#define DEFAULT_CONFIG_FILE    "/etc/swtpm_setup.conf"
+
+struct setup_params {
+    unsigned int flags;
+    char *tpm_state_path;
+    const char *config_file;
+    const char *ownerpass;
+    const char *srkpass;
+    const char *vmid;
+    const char *logfile;
+    int builtin_localca;  /* create certificates with the local CA here */
+};
+
+/* an NVRAM area holding a certificate */
+struct nvram_area {
+    uint32_t nvindex;
+    uint32_t size;
+};
+
+static struct libtpms_callbacks callbacks = {
+    .sizeOfStruct            = sizeof(struct libtpms_callbacks),
+    .tpm_nvram_init          = SWTPM_NVRAM_Init,
+    .tpm_nvram_loaddata      = SWTPM_NVRAM_LoadData,
+    .tpm_nvram_storedata     = SWTPM_NVRAM_StoreData,
+    .tpm_nvram_deletename    = SWTPM_NVRAM_DeleteName,
+};
+
+static void usage(const char *prg)
+{
+    printf(
+"Usage: %s [options]\n"
+"\n"
+"The following options are supported:\n"
+"\n"
+"--runas <user>   : Use the given user id to switch to and run this program;\n"
+"                   defaults to 'tss'\n"
+"\n"
+"--tpm-state <dir>: Path to a directory where the TPM's state will be written into;\n"
+"                   this is a mandatory argument\n"
+"--native         : Set up the TPM in this process rather than by\n"
+"                   swtpm_setup.sh using swtpm, tcsd and the tpm-tools;\n"
+"                   --builtin-localca, --pool and --pool-size require it\n"
+"\n"
+"--createek       : Create the EK\n"
+"--take-ownership : Take ownership; this option implies --createek\n"
+"  --ownerpass  <password>\n"
+"                 : Provide custom owner password; default is %s\n"
+"  --owner-well-known:\n"
+"                 : Use an owner password of 20 zero bytes\n"
+"  --srkpass <password>\n"
+"                 : Provide custom SRK password; default is %s\n"
+"  --srk-well-known:\n"
+"                 : Use an SRK password of 20 zero bytes\n"
+"--create-ek-cert : Create an EK certificate; this implies --createek\n"
+"--create-platform-cert\n"
+"                 : Create a platform certificate; this implies --create-ek-cert\n"
+"--lock-nvram     : Lock NVRAM access\n"
+"\n"
+"--display        : At the end display as much info as possible about the\n"
+"                   configuration of the TPM\n"
+"\n"
+"--config <config file>\n"
+"                 : Path to configuration file; default is %s\n"
+"\n"
+"--vmid <vm id>   : The ID of the VM that is passed to the certificate tool\n"
+"\n"
+"--builtin-localca: If the certificate tool is swtpm-localca or swtpm_localca,\n"
+"                   create the certificates in this process rather than by\n"
+"                   running the tool\n"
+"\n"
+"--pool <dir>     : Take a TPM state that was prepared ahead of time with the\n"
+"                   same options from this pool directory into the\n"
+"                   --tpm-state directory; if there is none, the TPM state is\n"
+"                   prepared as usual; cannot be used with --keyfile,\n"
+"                   --pwdfile, --ownerpass or --srkpass\n"
+"--pool-size <n>  : The number of prepared TPM states to keep in the pool;\n"
+"                   without --tpm-state the pool is filled up to this number,\n"
+"                   otherwise it is refilled in the background\n"
+"\n"
+"--logfile <logfile>\n"
+"                 : Path to log file; default is logging to stderr\n"
+"\n"
+"--keyfile <keyfile>\n"
+"                 : Path to a key file containing the encryption key for the\n"
+"                   TPM to encrypt its persistent state with. The content\n"
+"                   must be a 32 hex digit number representing a 128bit AES key.\n"
+"--pwdfile <pwdfile>\n"
+"                 : Path to a file containing a passphrase from which the\n"
+"                   TPM will derive the 128bit AES key. The passphrase can be\n"
+"                   32 bytes long.\n"
+"\n"
+"--help,-h,-?     : Display this help screen\n",
+        prg, DEFAULT_OWNER_PASSWORD, DEFAULT_SRK_PASSWORD,
+        DEFAULT_CONFIG_FILE);
+}
+
+static const char *
+date_string(char *buf, size_t size)
+{
+    time_t now = time(NULL);
+
+    strftime(buf, size, "%c", localtime(&now));
+
+    return buf;
+}
+
+/*
+ * The authorization data of a password as the TSS derives it; a well-known
+ * secret consists of 20 zero bytes.
+ */
+static int
+password_auth(unsigned char *auth, const char *password, int well_known)
+{
+    if (well_known) {
+        memset(auth, 0, TPM12_DIGEST_SIZE);
+        return 0;
+    }
+
+    if (gnutls_hash_fast(GNUTLS_DIG_SHA1, password, strlen(password),
+                         auth) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void
+bin_to_hex(char *hex, const unsigned char *bin, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        sprintf(&hex[2 * i], "%02x", bin[i]);
+}
+
+static int
+remove_state_files(const char *dir)
+{
+    static const char *patterns[] = {
+        "*permall", "*volatilestate", "*savestate"
+    };
+    char *pattern;
+    glob_t g;
+    size_t i, j;
+    int ret = 0;
+
+    for (i = 0; ret == 0 && i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        if (asprintf(&pattern, "%s/%s", dir, patterns[i]) < 0)
+            return -1;
+        if (glob(pattern, 0, NULL, &g) == 0) {
+            for (j = 0; j < g.gl_pathc; j++) {
+                if (unlink(g.gl_pathv[j]) < 0 && errno != ENOENT)
+                    ret = -1;
+            }
+            globfree(&g);
+        }
+        free(pattern);
+    }
+
+    return ret;
+}
+
+static int
+check_state_dir(const char *dir)
+{
+    struct passwd *pw = getpwuid(getuid());
+    const char *user = pw ? pw->pw_name : "?";
+    struct stat st;
+
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        logprintf(STDERR_FILENO,
+                  "Error: %s is not a directory that user %s could "
+                  "access.\n", dir, user);
+        return -1;
+    }
+    if (access(dir, R_OK) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Error: Need read rights on directory %s for user %s.\n",
+                  dir, user);
+        return -1;
+    }
+    if (access(dir, W_OK) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Error: Need write rights on directory %s for user %s.\n",
+                  dir, user);
+        return -1;
+    }
+
+    if (remove_state_files(dir) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not remove previous state files. Need "
+                  "execute access rights on the directory.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Run an external certificate tool for one type of certificate; like
+ * swtpm_setup.sh we only show its output if it fails.
+ */
+static int
+run_create_certs_tool(const struct setup_params *p, const char *tool,
+                      const char *type, const char *ek,
+                      const char *tool_config, const char *tool_options)
+{
+    const char *args[16];
+    char cmd[4096], output[4096];
+    size_t len = 0, cmdlen = 0;
+    int argc = 0, pipefd[2], status, i;
+    ssize_t n;
+    pid_t pid;
+
+    args[argc++] = tool;
+    args[argc++] = "--type";
+    args[argc++] = type;
+    args[argc++] = "--ek";
+    args[argc++] = ek;
+    args[argc++] = "--dir";
+    args[argc++] = p->tpm_state_path;
+    if (p->vmid) {
+        args[argc++] = "--vmid";
+        args[argc++] = p->vmid;
+    }
+    if (p->logfile) {
+        args[argc++] = "--logfile";
+        args[argc++] = p->logfile;
+    }
+    if (tool_config) {
+        args[argc++] = "--configfile";
+        args[argc++] = tool_config;
+    }
+    if (tool_options) {
+        args[argc++] = "--optsfile";
+        args[argc++] = tool_options;
+    }
+    args[argc] = NULL;
+
+    cmd[0] = '\0';
+    for (i = 0; i < argc && cmdlen < sizeof(cmd); i++)
+        cmdlen += snprintf(&cmd[cmdlen], sizeof(cmd) - cmdlen, "%s%s",
+                           i ? " " : "", args[i]);
+    logprintf(STDOUT_FILENO, "  Invoking: %s\n", cmd);
+
+    if (pipe(pipefd) < 0) {
+        logprintf(STDERR_FILENO, "Error: Could not create a pipe: %s\n",
+                  strerror(errno));
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        logprintf(STDERR_FILENO, "Error: Could not fork: %s\n",
+                  strerror(errno));
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        execvp(tool, (char * const *)args);
+        fprintf(stderr, "Could not execute '%s' : %s\n",
+                tool, strerror(errno));
+        _exit(1);
+    }
+
+    close(pipefd[1]);
+    while ((n = read(pipefd[0], &output[len],
+                     sizeof(output) - 1 - len)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        len += n;
+        if (len == sizeof(output) - 1) {
+            /* drain the rest so that the tool does not block */
+            char discard[256];
+
+            while (read(pipefd[0], discard, sizeof(discard)) > 0)
+                ;
+            break;
+        }
+    }
+    output[len] = '\0';
+    close(pipefd[0]);
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        logprintf(STDERR_FILENO, "Error: Error running '%s' : %s\n",
+                  cmd, output);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * With --builtin-localca the local CA does not need to run as a separate
+ * program; the swtpm-localca script and swtpm_localca share its
+ * configuration and state.
+ */
+static int
+is_localca(const char *tool)
+{
+    const char *name = strrchr(tool, '/');
+
+    name = name ? name + 1 : tool;
+
+    return !strcmp(name, "swtpm_localca") || !strcmp(name, "swtpm-localca");
+}
+
+static int
+call_create_certs(const struct setup_params *p, char *ek)
+{
+    char *config, *tool, *tool_config, *tool_options;
+    char types[sizeof("ek,platform")] = "";
+    struct localca_request req;
+    struct localca ca;
+    int ret = 0;
+
+    if (!(p->flags & (SETUP_EK_CERT_F | SETUP_PLATFORM_CERT_F)))
+        return 0;
+
+    /*
+     * The config file contains lines in the format:
+     * key = value
+     * or with a comment at the end started by #:
+     * key = value # comment
+     */
+    config = localca_read_file(p->config_file);
+    if (!config) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not access config file '%s' to get name of "
+                  "certificate tool to invoke.\n", p->config_file);
+        return -1;
+    }
+    tool = localca_get_config_value(config, "create_certs_tool", NULL);
+    tool_config = localca_get_config_value(config,
+                                           "create_certs_tool_config", NULL);
+    tool_options = localca_get_config_value(config,
+                                            "create_certs_tool_options",
+                                            NULL);
+    free(config);
+
+    if (!tool)
+        goto cleanup;
+
+    if (p->flags & SETUP_EK_CERT_F)
+        strcat(types, "ek");
+    if (p->flags & SETUP_PLATFORM_CERT_F)
+        strcat(types, types[0] ? ",platform" : "platform");
+
+    if (p->builtin_localca && !is_localca(tool))
+        logprintf(STDOUT_FILENO, "  %s is not the local CA; running it to "
+                  "create the certificates.\n", tool);
+
+    if (p->builtin_localca && is_localca(tool)) {
+        logprintf(STDOUT_FILENO,
+                  "  Creating the certificates with the local CA in this "
+                  "process instead of running %s.\n", tool);
+        req.types = types;
+        req.ek = ek;
+        req.dir = p->tpm_state_path;
+        ret = localca_init(&ca, tool_config ? tool_config : LOCALCA_CONFIG,
+                           tool_options ? tool_options : LOCALCA_OPTIONS);
+        if (ret == 0) {
+            ret = localca_issue(&ca, &req);
+            localca_fini(&ca);
+        }
+    } else {
+        if (p->flags & SETUP_EK_CERT_F)
+            ret = run_create_certs_tool(p, tool, "ek", ek,
+                                        tool_config, tool_options);
+        if (ret == 0 && (p->flags & SETUP_PLATFORM_CERT_F))
+            ret = run_create_certs_tool(p, tool, "platform", ek,
+                                        tool_config, tool_options);
+    }
+
+cleanup:
+    free(tool);
+    free(tool_config);
+    free(tool_options);
+
+    return ret;
+}
+
+static unsigned char *
+read_cert_file(const char *filename, uint32_t *size)
+{
+    unsigned char *data;
+    struct stat st;
+    ssize_t n;
+    size_t len = 0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > 0x10000) {
+        close(fd);
+        return NULL;
+    }
+    data = malloc(st.st_size);
+    while (data && len < (size_t)st.st_size) {
+        n = read(fd, &data[len], st.st_size - len);
+        if (n <= 0) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    *size = len;
+
+    return data;
+}
+
+/*
+ * Move a certificate that the certificate tool wrote into the state
+ * directory into the TPM's NVRAM; a missing certificate is skipped.
+ */
+static int
+store_cert(const struct setup_params *p, const unsigned char *ownerauth,
+           const char *name, const char *filename, uint32_t nvindex,
+           struct nvram_area *area)
+{
+    unsigned char *data;
+    char *path;
+    uint32_t size;
+    int ret = -1;
+
+    area->size = 0;
+
+    if (asprintf(&path, "%s/%s", p->tpm_state_path, filename) < 0)
+        return -1;
+    if (access(path, R_OK) < 0) {
+        free(path);
+        return 0;
+    }
+
+    data = read_cert_file(path, &size);
+    if (!data) {
+        logprintf(STDERR_FILENO, "Error: Could not read %s.\n", path);
+        goto cleanup;
+    }
+
+    if (SWTPM_Setup_NVDefineSpace(ownerauth, nvindex,
+                                  TPM12_NV_PER_OWNERREAD |
+                                  TPM12_NV_PER_OWNERWRITE,
+                                  size) != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not create NVRAM area for %s certificate.\n",
+                  name);
+        goto cleanup;
+    }
+    if (SWTPM_Setup_NVWrite(ownerauth, nvindex, data, size) != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not write %s certificate into NVRAM.\n",
+                  name);
+        goto cleanup;
+    }
+    logprintf(STDOUT_FILENO,
+              "Successfully created NVRAM area for %s certificate.\n", name);
+    unlink(path);
+
+    area->nvindex = nvindex;
+    area->size = size;
+    ret = 0;
+
+cleanup:
+    free(data);
+    free(path);
+
+    return ret;
+}
+
+static int
+display_nvram(const unsigned char *ownerauth, const struct nvram_area *area)
+{
+    unsigned char *data;
+    uint32_t i;
+
+    data = malloc(area->size);
+    if (!data)
+        return -1;
+    if (SWTPM_Setup_NVRead(ownerauth, area->nvindex, data, area->size) !=
+            TPM_SUCCESS) {
+        free(data);
+        return -1;
+    }
+
+    logprintf(STDOUT_FILENO, "Content of NVRAM area 0x%08x:\n",
+              area->nvindex);
+    for (i = 0; i < area->size; i++)
+        logprintf(STDOUT_FILENO, "%s%02x%s",
+                  i % 16 == 0 ? "  " : "", data[i],
+                  i % 16 == 15 || i + 1 == area->size ? "\n" : " ");
+    free(data);
+
+    return 0;
+}
+
+/*
+ * Manufacture the TPM in the state directory with the TPM running in this
+ * process; the steps are those of init_tpm() of swtpm_setup.sh.
+ */
+static int
+init_tpm(const struct setup_params *p)
+{
+    unsigned char ek[TPM12_EK_MODULUS_SIZE];
+    char ekhex[2 * TPM12_EK_MODULUS_SIZE + 1] = "";
+    unsigned char ownerauth[TPM12_DIGEST_SIZE], srkauth[TPM12_DIGEST_SIZE];
+    const unsigned int startup_flags = STARTUP_FLAG_CLEAR |
+                                       STARTUP_FLAG_ENABLE |
+                                       STARTUP_FLAG_ACTIVATE;
+    struct nvram_area areas[2];
+    struct timespec init_start;
+    unsigned int i;
+    int running = 0;
+    int ret = -1;
+
+    memset(areas, 0, sizeof(areas));
+
+    if (password_auth(ownerauth, p->ownerpass,
+                      p->flags & SETUP_OWNERPASS_ZEROS_F) < 0 ||
+        password_auth(srkauth, p->srkpass,
+                      p->flags & SETUP_SRKPASS_ZEROS_F) < 0)
+        return -1;
+
+    if (setenv("TPM_PATH", p->tpm_state_path, 1) < 0 ||
+        TPMLIB_RegisterCallbacks(&callbacks) != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO, "Error: Could not start TPM.\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &init_start);
+    if (TPMLIB_MainInit() != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO, "Error: Could not start TPM.\n");
+        goto shutdown;
+    }
+    running = 1;
+
+    /* TPM is enabled and activated upon first start */
+    if (SWTPM_Startup_Run(startup_flags, &init_start) != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO, "Error: Could not start up the TPM.\n");
+        goto shutdown;
+    }
+
+    if (p->flags & SETUP_CREATE_EK_F) {
+        if (SWTPM_Setup_CreateEK(ek) != TPM_SUCCESS) {
+            logprintf(STDERR_FILENO, "Error: Could not create the EK.\n");
+            goto shutdown;
+        }
+        logprintf(STDOUT_FILENO, "Successfully created EK.\n");
+        bin_to_hex(ekhex, ek, sizeof(ek));
+
+        /* temporarily take ownership if an EK was created */
+        if (SWTPM_Setup_TakeOwnership(ek, ownerauth, srkauth) !=
+                TPM_SUCCESS) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not take ownership of TPM.\n");
+            goto shutdown;
+        }
+        logprintf(STDOUT_FILENO, "Successfully took ownership of the TPM.\n");
+    }
+
+    /* have the certificate tool create the certificates now */
+    if (call_create_certs(p, ekhex) < 0)
+        goto shutdown;
+
+    if ((p->flags & SETUP_EK_CERT_F) &&
+        store_cert(p, ownerauth, "EK", "ek.cert",
+                   TPM12_NV_INDEX_EKCERT | TPM12_NV_INDEX_D_BIT,
+                   &areas[0]) < 0)
+        goto shutdown;
+
+    if ((p->flags & SETUP_PLATFORM_CERT_F) &&
+        store_cert(p, ownerauth, "platform", "platform.cert",
+                   TPM12_NV_INDEX_PLATFORMCERT | TPM12_NV_INDEX_D_BIT,
+                   &areas[1]) < 0)
+        goto shutdown;
+
+    if (p->flags & SETUP_DISPLAY_RESULTS_F) {
+        for (i = 0; i < sizeof(areas) / sizeof(areas[0]); i++) {
+            if (areas[i].size && display_nvram(ownerauth, &areas[i]) < 0)
+                logprintf(STDERR_FILENO,
+                          "Error: Could not read NVRAM area 0x%08x.\n",
+                          areas[i].nvindex);
+        }
+    }
+
+    /* Last thing is to lock the NVRAM area */
+    if (p->flags & SETUP_LOCK_NVRAM_F) {
+        if (SWTPM_Setup_NVLock() != TPM_SUCCESS) {
+            logprintf(STDERR_FILENO, "Error: Could not lock NVRAM access.\n");
+            goto shutdown;
+        }
+        logprintf(STDOUT_FILENO, "Successfully locked NVRAM access.\n");
+    }
+
+    /* give up ownership if not wanted */
+    if (!(p->flags & SETUP_TAKEOWN_F) && (p->flags & SETUP_CREATE_EK_F)) {
+        if (SWTPM_Setup_OwnerClear(ownerauth) != TPM_SUCCESS) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not give up ownership of TPM.\n");
+            goto shutdown;
+        }
+        logprintf(STDOUT_FILENO,
+                  "Successfully gave up ownership of the TPM.\n");
+
+        /* TPM is now disabled and deactivated; enable and activate it */
+        TPMLIB_Terminate();
+        running = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &init_start);
+        if (TPMLIB_MainInit() != TPM_SUCCESS) {
+            logprintf(STDERR_FILENO, "Error: Could not re-start TPM.\n");
+            goto shutdown;
+        }
+        running = 1;
+
+        if (SWTPM_Startup_Run(startup_flags, &init_start) != TPM_SUCCESS) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not enable and activate the TPM.\n");
+            goto shutdown;
+        }
+        logprintf(STDOUT_FILENO,
+                  "Successfully enabled and activated the TPM\n");
+    }
+
+    ret = 0;
+
+shutdown:
+    if (running)
+        TPMLIB_Terminate();
+    if (SWTPM_NVRAM_Shutdown() != TPM_SUCCESS)
+        ret = -1;
+
+    return ret;
+}
+
+/*
+ * Prepare a TPM state for the pool; the VM that will use it is not known
+ * yet.
+ */
+static int
+provision_pool_entry(char *dir, void *opaque)
+{
+    struct setup_params p = *(const struct setup_params *)opaque;
+
+    p.tpm_state_path = dir;
+    p.vmid = NULL;
+
+    return init_tpm(&p);
+}
+
+/*
+ * The parameters that pool entries are prepared with; entries are only
+ * handed to callers that would prepare the state in the same way.
+ */
+static char *
+pool_params(const struct setup_params *p)
+{
+    char *params;
+
+    if (asprintf(&params, "flags=%u\nconfig=%s\n",
+                 p->flags & ~SETUP_DISPLAY_RESULTS_F, p->config_file) < 0)
+        return NULL;
+
+    return params;
+}
+
+static int
+setup_native(int argc, char *argv[])
+{
+    struct setup_params p = {
+        .config_file = DEFAULT_CONFIG_FILE,
+    };
+    const char *keyfile = NULL, *pwdfile = NULL, *pooldir = NULL;
+    char *keyopts = NULL, *params = NULL, date[64], *end_ptr;
+    unsigned long pool_size = 0;
+    struct timespec start;
+    struct passwd *pw;
+    struct group *gr;
+    int i, claimed = 0, ret = 1;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h") ||
+            !strcmp(argv[i], "-?")) {
+            usage(argv[0]);
+            return 0;
+        } else if (!strcmp(argv[i], "--createek")) {
+            p.flags |= SETUP_CREATE_EK_F;
+        } else if (!strcmp(argv[i], "--take-ownership")) {
+            p.flags |= SETUP_CREATE_EK_F | SETUP_TAKEOWN_F;
+        } else if (!strcmp(argv[i], "--owner-well-known")) {
+            p.flags |= SETUP_OWNERPASS_ZEROS_F;
+        } else if (!strcmp(argv[i], "--srk-well-known")) {
+            p.flags |= SETUP_SRKPASS_ZEROS_F;
+        } else if (!strcmp(argv[i], "--create-ek-cert")) {
+            p.flags |= SETUP_CREATE_EK_F | SETUP_EK_CERT_F;
+        } else if (!strcmp(argv[i], "--create-platform-cert")) {
+            p.flags |= SETUP_CREATE_EK_F | SETUP_PLATFORM_CERT_F;
+        } else if (!strcmp(argv[i], "--lock-nvram")) {
+            p.flags |= SETUP_LOCK_NVRAM_F;
+        } else if (!strcmp(argv[i], "--display")) {
+            p.flags |= SETUP_DISPLAY_RESULTS_F;
+        } else if (!strcmp(argv[i], "--builtin-localca")) {
+            p.builtin_localca = 1;
+        } else if (!strcmp(argv[i], "--native")) {
+            /* handled by main() */
+        } else if (i + 1 == argc) {
+            fprintf(stderr, "Unknown option or missing argument %s\n",
+                    argv[i]);
+            usage(argv[0]);
+            return 1;
+        } else if (!strcmp(argv[i], "--tpm-state")) {
+            p.tpm_state_path = argv[++i];
+        } else if (!strcmp(argv[i], "--ownerpass")) {
+            p.ownerpass = argv[++i];
+        } else if (!strcmp(argv[i], "--srkpass")) {
+            p.srkpass = argv[++i];
+        } else if (!strcmp(argv[i], "--config")) {
+            p.config_file = argv[++i];
+        } else if (!strcmp(argv[i], "--vmid")) {
+            p.vmid = argv[++i];
+        } else if (!strcmp(argv[i], "--keyfile")) {
+            keyfile = argv[++i];
+        } else if (!strcmp(argv[i], "--pwdfile")) {
+            pwdfile = argv[++i];
+        } else if (!strcmp(argv[i], "--logfile")) {
+            p.logfile = argv[++i];
+        } else if (!strcmp(argv[i], "--pool")) {
+            pooldir = argv[++i];
+        } else if (!strcmp(argv[i], "--pool-size")) {
+            errno = 0;
+            pool_size = strtoul(argv[++i], &end_ptr, 10);
+            if (*end_ptr != '\0' || errno != 0 || pool_size == 0 ||
+                pool_size > UINT_MAX) {
+                fprintf(stderr, "Invalid pool size '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--runas")) {
+            /* handled by main() */
+            i++;
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* pool entries are shared by all VMs; they must not hold secrets */
+    if (pooldir && (keyfile || pwdfile || p.ownerpass || p.srkpass)) {
+        fprintf(stderr, "Error: --pool cannot be used with --keyfile, "
+                "--pwdfile, --ownerpass or --srkpass.\n");
+        return 1;
+    }
+
+    if (!p.ownerpass)
+        p.ownerpass = DEFAULT_OWNER_PASSWORD;
+    if (!p.srkpass)
+        p.srkpass = DEFAULT_SRK_PASSWORD;
+
+    if (p.logfile) {
+        if (log_init(p.logfile) < 0) {
+            fprintf(stderr, "Cannot write to logfile %s.\n", p.logfile);
+            return 1;
+        }
+        localca_set_logfile(p.logfile);
+    }
+
+    pw = getpwuid(getuid());
+    gr = getgrgid(getgid());
+
+    if (pool_size && !pooldir) {
+        logprintf(STDERR_FILENO, "Error: --pool-size requires --pool\n");
+        return 1;
+    }
+    if (!p.tpm_state_path && !pool_size) {
+        logprintf(STDERR_FILENO, "Error: --tpm-state must be provided\n");
+        return 1;
+    }
+    if (p.tpm_state_path && check_state_dir(p.tpm_state_path) < 0)
+        return 1;
+
+    if (access(p.config_file, R_OK) < 0) {
+        logprintf(STDERR_FILENO, "Error: Cannot access config file %s.\n",
+                  p.config_file);
+        return 1;
+    }
+
+    if (keyfile) {
+        if (access(keyfile, R_OK) < 0) {
+            logprintf(STDERR_FILENO, "Error: Cannot access keyfile %s.\n",
+                      keyfile);
+            return 1;
+        }
+        if (asprintf(&keyopts, "file=%s", keyfile) < 0)
+            return 1;
+        logprintf(STDOUT_FILENO, "  The TPM's state will be encrypted with "
+                  "a provided key.\n");
+    } else if (pwdfile) {
+        if (access(pwdfile, R_OK) < 0) {
+            logprintf(STDERR_FILENO,
+                      "Error: Cannot access passphrase file %s.\n", pwdfile);
+            return 1;
+        }
+        if (asprintf(&keyopts, "pwdfile=%s", pwdfile) < 0)
+            return 1;
+        logprintf(STDOUT_FILENO, "  The TPM's state will be encrypted using "
+                  "a key derived from a passphrase.\n");
+    }
+    if (keyopts) {
+        i = handle_key_options(keyopts);
+        free(keyopts);
+        if (i < 0)
+            return 1;
+    }
+
+    if (pooldir) {
+        params = pool_params(&p);
+        if (!params)
+            return 1;
+    }
+
+    if (gnutls_global_init() < 0) {
+        logprintf(STDERR_FILENO, "Error: gnutls_global_init failed.\n");
+        free(params);
+        return 1;
+    }
+
+    if (!p.tpm_state_path) {
+        /* only fill the pool */
+        SWTPM_Fleet_Set_Low_Priority();
+        if (SWTPM_Setup_Pool_Fill(pooldir, params, pool_size,
+                                  provision_pool_entry, &p) == 0)
+            ret = 0;
+        goto deinit;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (pooldir) {
+        claimed = SWTPM_Setup_Pool_Claim(pooldir, params, p.tpm_state_path);
+        if (claimed < 0)
+            goto deinit;
+        if (claimed == 0)
+            logprintf(STDOUT_FILENO, "The pool %s has no TPM state for %s; "
+                      "preparing it now.\n", pooldir, p.tpm_state_path);
+    }
+
+    if (claimed) {
+        ret = 0;
+    } else {
+        logprintf(STDOUT_FILENO,
+                  "Starting vTPM manufacturing as %s:%s @ %s\n",
+                  pw ? pw->pw_name : "?", gr ? gr->gr_name : "?",
+                  date_string(date, sizeof(date)));
+
+        if (init_tpm(&p) == 0) {
+            logprintf(STDOUT_FILENO, "Successfully authored TPM state.\n");
+            ret = 0;
+        } else {
+            logprintf(STDERR_FILENO, "Error: An error occurred. Authoring "
+                      "the TPM state failed.\n");
+        }
+        logprintf(STDOUT_FILENO, "Authoring the TPM state took %lu ms.\n",
+                  (unsigned long)(SWTPM_Time_Elapsed_Ns(&start) / 1000000));
+
+        logprintf(STDOUT_FILENO, "Ending vTPM manufacturing @ %s\n",
+                  date_string(date, sizeof(date)));
+    }
+
+    /* replace the claimed state while the VM starts */
+    if (pool_size)
+        SWTPM_Setup_Pool_Refill(pooldir, params, pool_size,
+                                provision_pool_entry, &p);
+
+deinit:
+    gnutls_global_deinit();
+    free(params);
+
+    return ret;
+}
+#endif /* WITH_GNUTLS */
+
 int main(int argc, char *argv[])
 {
     const char *program = "swtpm_setup.sh";
@@ -75,6 +1011,8 @@ int main(int argc, char *argv[])
     struct passwd *passwd;
     int i = 1, j;
     const char *userid = E_USER_GROUP;
+    int use_native = 0, use_tpm = 0;
+    const char *native_opt = NULL;
 
     while (i < argc) {
         if (!strcmp("--runas", argv[i])) {
@@ -84,7 +1022,15 @@ int main(int argc, char *argv[])
                 exit(1);
             }
             userid = argv[i];
-            break;
+        }
+        else if (!strcmp("--native", argv[i])) {
+            use_native = 1;
+        } else if (!strcmp("--tpm", argv[i])) {
+            use_tpm = 1;
+        } else if (!strcmp("--builtin-localca", argv[i]) ||
+                   !strcmp("--pool", argv[i]) ||
+                   !strcmp("--pool-size", argv[i])) {
+            native_opt = argv[i];
         }
         for (j = 0; one_arg_params[j] != NULL; j++) {
             if (!strcmp(one_arg_params[j], argv[i])) {
@@ -94,7 +1040,24 @@ int main(int argc, char *argv[])
         }
         i++;
     }
-    
+
+    /* swtpm_setup.sh drives an external TPM; only --native runs it here */
+    if (use_native && use_tpm) {
+        fprintf(stderr, "--native cannot be used with --tpm.\n");
+        return EXIT_FAILURE;
+    }
+    if (!use_native && native_opt) {
+        fprintf(stderr, "%s requires --native.\n", native_opt);
+        return EXIT_FAILURE;
+    }
+#ifndef WITH_GNUTLS
+    if (use_native) {
+        fprintf(stderr, "This swtpm_setup was built without support for "
+                "--native.\n");
+        return EXIT_FAILURE;
+    }
+#endif
+
     if (!realpath("/proc/self/exe", resolved_path)) {
         fprintf(stderr, "Could not resolve path to executable : %s\n",
                 strerror(errno));
@@ -145,6 +1108,11 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+#ifdef WITH_GNUTLS
+    if (use_native)
+        return setup_native(argc, argv);
+#endif
+
     /*
      * need to pass unmodified argv to swtpm_setup.sh
      */
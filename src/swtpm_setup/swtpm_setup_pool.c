@@ -0,0 +1,488 @@
+/*
+ * swtpm_setup_pool.c -- a pool of prepared TPM states
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A pool directory holds TPM states that have been prepared ahead of time,
+ * each in a directory of its own. An entry is prepared in a directory whose
+ * name starts with '.' and is only renamed to its final name once it is
+ * complete, so an entry that can be seen is ready to be used.
+ *
+ * Each entry records the parameters it was prepared with in a file of its
+ * own, and only callers passing the same parameters take it or count it
+ * when filling the pool. The parameters do not hold any secrets; the
+ * caller must not prepare pool entries with a per-VM key or password.
+ *
+ * A VM claims an entry by renaming it to a name of its own in the pool;
+ * since rename() is atomic, an entry cannot be handed out twice. The state
+ * files are then copied into the VM's existing state directory, so that
+ * they get the owner and security label of files created there, and the
+ * claimed entry is removed.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <libtpms/tpm_error.h>
+
+#include "logging.h"
+#include "swtpm_fleet.h"
+#include "swtpm_nvstore.h"
+#include "swtpm_time.h"
+#include "swtpm_setup_pool.h"
+
+#define POOL_TMP_PREFIX   ".tmp."
+#define POOL_CLAIM_PREFIX ".claim."
+#define POOL_ENTRY_PREFIX "tpm."
+#define POOL_PARAMS_FILE  "pool.params"
+
+/* remove a directory with the files of a TPM state */
+static int
+pool_remove_dir(const char *dir)
+{
+    struct dirent *de;
+    char *path;
+    DIR *d;
+    int ret = 0;
+
+    d = opendir(dir);
+    if (!d)
+        return -1;
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (asprintf(&path, "%s/%s", dir, de->d_name) < 0) {
+            ret = -1;
+            break;
+        }
+        if (unlink(path) < 0)
+            ret = -1;
+        free(path);
+    }
+    closedir(d);
+
+    if (ret == 0 && rmdir(dir) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+/* record the parameters an entry was prepared with */
+static int
+pool_write_params(const char *dir, const char *params)
+{
+    size_t len = strlen(params);
+    char *path;
+    int fd, ret = -1;
+
+    if (asprintf(&path, "%s/" POOL_PARAMS_FILE, dir) < 0)
+        return -1;
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        if (write(fd, params, len) == (ssize_t)len && fsync(fd) == 0)
+            ret = 0;
+        if (close(fd) < 0)
+            ret = -1;
+    }
+    if (ret < 0)
+        logprintf(STDERR_FILENO, "Error: Could not write %s: %s\n",
+                  path, strerror(errno));
+    free(path);
+
+    return ret;
+}
+
+/* check whether the entry 'name' was prepared with the parameters 'params' */
+static int
+pool_params_match(const char *pooldir, const char *name, const char *params)
+{
+    size_t len = strlen(params);
+    char *path, *buffer;
+    int fd, match = 0;
+
+    if (asprintf(&path, "%s/%s/" POOL_PARAMS_FILE, pooldir, name) < 0)
+        return 0;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0)
+        return 0;
+
+    buffer = malloc(len + 1);
+    /* read one more byte to notice a longer file */
+    if (buffer && read(fd, buffer, len + 1) == (ssize_t)len)
+        match = !memcmp(buffer, params, len);
+    free(buffer);
+    close(fd);
+
+    return match;
+}
+
+/* check whether the process that claimed the entry 'name' has ended */
+static int
+pool_claim_is_stale(const char *name)
+{
+    long pid = strtol(&name[strlen(POOL_CLAIM_PREFIX)], NULL, 10);
+
+    return pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/*
+ * Count the ready entries of the pool that were prepared with 'params' and
+ * remove the entries that a filler did not finish or whose claimer ended;
+ * the caller must hold the pool's lock.
+ */
+static int
+pool_scan(const char *pooldir, const char *params, unsigned int *count)
+{
+    struct dirent *de;
+    char *path;
+    DIR *d;
+
+    *count = 0;
+
+    d = opendir(pooldir);
+    if (!d) {
+        logprintf(STDERR_FILENO, "Error: Could not open the pool %s: %s\n",
+                  pooldir, strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (!strncmp(de->d_name, POOL_ENTRY_PREFIX,
+                     strlen(POOL_ENTRY_PREFIX))) {
+            if (pool_params_match(pooldir, de->d_name, params))
+                (*count)++;
+        } else if (!strncmp(de->d_name, POOL_TMP_PREFIX,
+                            strlen(POOL_TMP_PREFIX)) ||
+                   (!strncmp(de->d_name, POOL_CLAIM_PREFIX,
+                             strlen(POOL_CLAIM_PREFIX)) &&
+                    pool_claim_is_stale(de->d_name))) {
+            if (asprintf(&path, "%s/%s", pooldir, de->d_name) < 0)
+                continue;
+            if (pool_remove_dir(path) < 0)
+                logprintf(STDERR_FILENO,
+                          "Could not remove the unfinished entry %s.\n",
+                          path);
+            free(path);
+        }
+    }
+    closedir(d);
+
+    return 0;
+}
+
+/*
+ * Prepare one entry; the TPM runs in a child process since libtpms holds
+ * the state of a single TPM.
+ */
+static int
+pool_add_entry(const char *pooldir, const char *params,
+               SWTPM_Setup_Pool_Provision provision, void *opaque)
+{
+    char *tmpdir, *entry;
+    struct timespec start;
+    int status, ret = -1;
+    pid_t pid;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (asprintf(&tmpdir, "%s/" POOL_TMP_PREFIX "XXXXXX", pooldir) < 0)
+        return -1;
+    if (!mkdtemp(tmpdir)) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not create a directory in the pool %s: %s\n",
+                  pooldir, strerror(errno));
+        free(tmpdir);
+        return -1;
+    }
+    if (asprintf(&entry, "%s/" POOL_ENTRY_PREFIX "%s", pooldir,
+                 &tmpdir[strlen(pooldir) + 1 + strlen(POOL_TMP_PREFIX)]) < 0) {
+        entry = NULL;
+        goto err_remove;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        logprintf(STDERR_FILENO, "Error: Could not fork: %s\n",
+                  strerror(errno));
+        goto err_remove;
+    }
+    if (pid == 0)
+        _exit(provision(tmpdir, opaque) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not prepare a TPM state for the pool.\n");
+        goto err_remove;
+    }
+
+    if (pool_write_params(tmpdir, params) < 0)
+        goto err_remove;
+
+    if (rename(tmpdir, entry) < 0) {
+        logprintf(STDERR_FILENO, "Error: Could not rename %s to %s: %s\n",
+                  tmpdir, entry, strerror(errno));
+        goto err_remove;
+    }
+    logprintf(STDOUT_FILENO, "Added %s to the pool in %lu ms.\n", entry,
+              (unsigned long)(SWTPM_Time_Elapsed_Ns(&start) / 1000000));
+    ret = 0;
+    goto out;
+
+err_remove:
+    pool_remove_dir(tmpdir);
+
+out:
+    free(entry);
+    free(tmpdir);
+
+    return ret;
+}
+
+/* copy the state files of the claimed entry 'claimdir' into 'statedir' */
+static int
+pool_copy_state(const char *claimdir, const char *statedir)
+{
+    int srcfd, dstfd = -1, ret = -1;
+
+    srcfd = open(claimdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (srcfd >= 0)
+        dstfd = open(statedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (srcfd < 0 || dstfd < 0)
+        logprintf(STDERR_FILENO, "Error: Could not open %s: %s\n",
+                  srcfd < 0 ? claimdir : statedir, strerror(errno));
+    else if (SWTPM_NVRAM_CopyStateFiles(srcfd, dstfd, 0, FALSE,
+                                        NULL) == TPM_SUCCESS)
+        ret = 0;
+    else
+        logprintf(STDERR_FILENO, "Error: Could not copy the TPM state from "
+                  "the pool into %s.\n", statedir);
+
+    if (dstfd >= 0)
+        close(dstfd);
+    if (srcfd >= 0)
+        close(srcfd);
+
+    return ret;
+}
+
+/*
+ * SWTPM_Setup_Pool_Claim: take a TPM state that was prepared with 'params'
+ *                         from the pool and copy it into 'statedir'
+ *
+ * Returns 1 if a state was claimed, 0 if the pool has no state prepared
+ * with 'params', -1 on error.
+ */
+int
+SWTPM_Setup_Pool_Claim(const char *pooldir, const char *params,
+                       const char *statedir)
+{
+    struct timespec start;
+    struct dirent *de;
+    char *entry, *claimdir;
+    DIR *d;
+    int ret = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    d = opendir(pooldir);
+    if (!d) {
+        logprintf(STDERR_FILENO, "Error: Could not open the pool %s: %s\n",
+                  pooldir, strerror(errno));
+        return -1;
+    }
+
+    while (ret == 0 && (de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, POOL_ENTRY_PREFIX,
+                    strlen(POOL_ENTRY_PREFIX)) ||
+            !pool_params_match(pooldir, de->d_name, params))
+            continue;
+        if (asprintf(&entry, "%s/%s", pooldir, de->d_name) < 0) {
+            ret = -1;
+            break;
+        }
+        if (asprintf(&claimdir, "%s/" POOL_CLAIM_PREFIX "%ld.%s", pooldir,
+                     (long)getpid(), de->d_name) < 0) {
+            free(entry);
+            ret = -1;
+            break;
+        }
+        if (rename(entry, claimdir) == 0) {
+            ret = pool_copy_state(claimdir, statedir) == 0 ? 1 : -1;
+            if (pool_remove_dir(claimdir) < 0)
+                logprintf(STDERR_FILENO,
+                          "Could not remove the claimed entry %s.\n",
+                          claimdir);
+            if (ret == 1)
+                logprintf(STDOUT_FILENO,
+                          "Claimed the TPM state %s from the pool in "
+                          "%lu us.\n", entry,
+                          (unsigned long)(SWTPM_Time_Elapsed_Ns(&start) /
+                                          1000));
+        } else if (errno != ENOENT) {
+            /* ENOENT: another VM claimed the entry first */
+            logprintf(STDERR_FILENO,
+                      "Could not claim %s: %s\n", entry, strerror(errno));
+            ret = -1;
+        }
+        free(claimdir);
+        free(entry);
+    }
+    closedir(d);
+
+    return ret;
+}
+
+/*
+ * SWTPM_Setup_Pool_Fill: add entries prepared with 'params' to the pool
+ *                        until it holds 'size' of them
+ *
+ * Only one process fills a pool at a time; if another one is filling it
+ * already, nothing is done.
+ */
+int
+SWTPM_Setup_Pool_Fill(const char *pooldir, const char *params,
+                      unsigned int size,
+                      SWTPM_Setup_Pool_Provision provision, void *opaque)
+{
+    unsigned int count;
+    char *lockfile;
+    int fd, ret = 0;
+
+    if (asprintf(&lockfile, "%s/.lock", pooldir) < 0)
+        return -1;
+    fd = open(lockfile, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        logprintf(STDERR_FILENO, "Error: Could not open %s: %s\n",
+                  lockfile, strerror(errno));
+        free(lockfile);
+        return -1;
+    }
+    free(lockfile);
+
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) {
+            logprintf(STDOUT_FILENO,
+                      "The pool %s is being filled already.\n", pooldir);
+        } else {
+            logprintf(STDERR_FILENO, "Error: Could not lock the pool %s: "
+                      "%s\n", pooldir, strerror(errno));
+            ret = -1;
+        }
+        close(fd);
+        return ret;
+    }
+
+    ret = pool_scan(pooldir, params, &count);
+    /* entries claimed meanwhile are made up for in the next round */
+    while (ret == 0 && count < size) {
+        ret = pool_add_entry(pooldir, params, provision, opaque);
+        if (ret == 0)
+            ret = pool_scan(pooldir, params, &count);
+    }
+
+    close(fd);
+
+    return ret;
+}
+
+/*
+ * SWTPM_Setup_Pool_Refill: fill the pool in the background with a process
+ *                          that runs with idle CPU and I/O priority
+ *
+ * The process is detached from the caller's terminal and output, so that
+ * the caller does not wait for it.
+ */
+int
+SWTPM_Setup_Pool_Refill(const char *pooldir, const char *params,
+                        unsigned int size,
+                        SWTPM_Setup_Pool_Provision provision, void *opaque)
+{
+    pid_t pid;
+    int fd, status;
+
+    pid = fork();
+    if (pid < 0) {
+        logprintf(STDERR_FILENO, "Could not start refilling the pool: %s\n",
+                  strerror(errno));
+        return -1;
+    }
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            logprintf(STDERR_FILENO, "Could not start refilling the pool.\n");
+            return -1;
+        }
+        logprintf(STDOUT_FILENO, "Refilling the pool %s in the background.\n",
+                  pooldir);
+        return 0;
+    }
+
+    /* the double fork has init reap the filler */
+    pid = fork();
+    if (pid != 0)
+        _exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+    setsid();
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+
+    SWTPM_Fleet_Set_Low_Priority();
+
+    _exit(SWTPM_Setup_Pool_Fill(pooldir, params, size, provision,
+                                opaque) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,57 @@
+/*
+ * swtpm_setup_pool.h -- a pool of prepared TPM states
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_SETUP_POOL_H_
+#define _SWTPM_SETUP_POOL_H_
+
+/* prepare the TPM state in the empty directory 'dir' */
+typedef int (*SWTPM_Setup_Pool_Provision)(char *dir, void *opaque);
+
+/*
+ * 'params' describes how the entries are prepared; only entries prepared
+ * with the same 'params' are claimed or counted when filling the pool
+ */
+int SWTPM_Setup_Pool_Claim(const char *pooldir, const char *params,
+                           const char *statedir);
+int SWTPM_Setup_Pool_Fill(const char *pooldir, const char *params,
+                          unsigned int size,
+                          SWTPM_Setup_Pool_Provision provision,
+                          void *opaque);
+int SWTPM_Setup_Pool_Refill(const char *pooldir, const char *params,
+                            unsigned int size,
+                            SWTPM_Setup_Pool_Provision provision,
+                            void *opaque);
+
+#endif /* _SWTPM_SETUP_POOL_H_ */
@@ -0,0 +1,806 @@
+/*
+ * swtpm_setup_tpm.c -- TPM 1.2 commands for manufacturing a TPM
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The TPM 1.2 commands that swtpm_setup.sh ran through tcsd and the
+ * tpm-tools. Each command that needs authorization runs in its own OIAP or
+ * OSAP session; the HMACs and the encryption of the authorization data
+ * follow part 1 of the TPM 1.2 main specification.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#  include <openssl/param_build.h>
+#endif
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_library.h>
+#include <libtpms/tpm_memory.h>
+
+#include "swtpm_setup_tpm.h"
+#include "logging.h"
+
+#define TPM_TAG_RQU_COMMAND       0x00c1
+#define TPM_TAG_RQU_AUTH1_COMMAND 0x00c2
+#define TPM_TAG_RSP_AUTH1_COMMAND 0x00c5
+
+#define TPM_ORD_OIAP                      0x0000000a
+#define TPM_ORD_OSAP                      0x0000000b
+#define TPM_ORD_TakeOwnership             0x0000000d
+#define TPM_ORD_OwnerClear                0x0000005b
+#define TPM_ORD_CreateEndorsementKeyPair  0x00000078
+#define TPM_ORD_NV_DefineSpace            0x000000cc
+#define TPM_ORD_NV_WriteValue             0x000000cd
+#define TPM_ORD_NV_ReadValue              0x000000cf
+
+#define TPM_PID_OWNER             0x0005
+#define TPM_ET_OWNER              0x0002
+#define TPM_KH_OWNER              0x40000001
+
+#define TPM_ALG_RSA               0x00000001
+#define TPM_ES_RSAESOAEP_SHA1_MGF1 0x0003
+#define TPM_SS_NONE               0x0001
+#define TPM_KEY_STORAGE           0x0011
+#define TPM_AUTH_ALWAYS           0x01
+
+#define TPM_TAG_NV_ATTRIBUTES     0x0017
+#define TPM_TAG_NV_DATA_PUBLIC    0x0018
+#define TPM_LOC_ALL               0x1f
+
+#define TPM12_HEADER_SIZE         10
+#define TPM12_NONCE_SIZE          TPM12_DIGEST_SIZE
+/* authHandle, nonceOdd, continueAuthSession and the HMAC of a command */
+#define TPM12_AUTH1_SIZE          (4 + TPM12_NONCE_SIZE + 1 + TPM12_DIGEST_SIZE)
+/* nonceEven, continueAuthSession and the HMAC of a response */
+#define TPM12_RESP_AUTH1_SIZE     (TPM12_NONCE_SIZE + 1 + TPM12_DIGEST_SIZE)
+
+/* certificates are written into the NVRAM in chunks of this size */
+#define TPM12_NV_CHUNK_SIZE       1024
+
+struct tpm12_buffer {
+    unsigned char data[4096];
+    uint32_t size;
+};
+
+struct tpm12_session {
+    uint32_t handle;
+    unsigned char nonce_even[TPM12_NONCE_SIZE];
+    unsigned char nonce_odd[TPM12_NONCE_SIZE];
+    /* the owner's secret for OIAP, the shared secret for OSAP */
+    unsigned char key[TPM12_DIGEST_SIZE];
+};
+
+static void
+put_bytes(struct tpm12_buffer *buf, const void *data, uint32_t len)
+{
+    /* the commands built here are all far smaller than the buffer */
+    memcpy(&buf->data[buf->size], data, len);
+    buf->size += len;
+}
+
+static void
+put_u8(struct tpm12_buffer *buf, uint8_t value)
+{
+    buf->data[buf->size++] = value;
+}
+
+static void
+put_u16(struct tpm12_buffer *buf, uint16_t value)
+{
+    put_u8(buf, value >> 8);
+    put_u8(buf, value);
+}
+
+static void
+put_u32(struct tpm12_buffer *buf, uint32_t value)
+{
+    put_u16(buf, value >> 16);
+    put_u16(buf, value);
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void
+command_start(struct tpm12_buffer *buf, uint16_t tag, uint32_t ordinal)
+{
+    buf->size = 0;
+    put_u16(buf, tag);
+    put_u32(buf, 0); /* the size is set by command_finish */
+    put_u32(buf, ordinal);
+}
+
+static void
+command_finish(struct tpm12_buffer *buf)
+{
+    buf->data[2] = buf->size >> 24;
+    buf->data[3] = buf->size >> 16;
+    buf->data[4] = buf->size >> 8;
+    buf->data[5] = buf->size;
+}
+
+/*
+ * Send a command to the TPM and copy its response into 'resp'. A response
+ * carrying an error code is not an error of this function; the TPM's
+ * return code is returned in 'returncode'.
+ */
+static TPM_RESULT
+tpm12_transfer(const char *name, struct tpm12_buffer *cmd,
+               struct tpm12_buffer *resp, uint32_t *returncode)
+{
+    unsigned char *rbuffer = NULL;
+    uint32_t rlength = 0, rtotal = 0;
+    TPM_RESULT rc;
+
+    command_finish(cmd);
+
+    rc = TPMLIB_Process(&rbuffer, &rlength, &rtotal, cmd->data, cmd->size);
+    if (rc != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not process %s: 0x%08x\n", name, rc);
+        goto cleanup;
+    }
+    if (rlength < TPM12_HEADER_SIZE || rlength > sizeof(resp->data) ||
+        get_u32(&rbuffer[2]) != rlength) {
+        logprintf(STDERR_FILENO,
+                  "Error: Malformed response to %s.\n", name);
+        rc = TPM_FAIL;
+        goto cleanup;
+    }
+    memcpy(resp->data, rbuffer, rlength);
+    resp->size = rlength;
+
+    *returncode = get_u32(&resp->data[6]);
+    if (*returncode != TPM_SUCCESS)
+        logprintf(STDERR_FILENO,
+                  "%s returned error code 0x%08x\n", name, *returncode);
+
+cleanup:
+    TPM_Free(rbuffer);
+
+    return rc;
+}
+
+/* like tpm12_transfer, but an error code returned by the TPM is returned */
+static TPM_RESULT
+tpm12_command(const char *name, struct tpm12_buffer *cmd,
+              struct tpm12_buffer *resp, uint32_t min_size)
+{
+    uint32_t returncode;
+    TPM_RESULT rc;
+
+    rc = tpm12_transfer(name, cmd, resp, &returncode);
+    if (rc != TPM_SUCCESS)
+        return rc;
+    if (returncode != TPM_SUCCESS)
+        return returncode;
+    if (resp->size < min_size) {
+        logprintf(STDERR_FILENO, "Error: Short response to %s.\n", name);
+        return TPM_FAIL;
+    }
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+tpm12_random(unsigned char *buffer, size_t len)
+{
+    if (gnutls_rnd(GNUTLS_RND_NONCE, buffer, len) < 0) {
+        logprintf(STDERR_FILENO, "Error: Could not get random bytes.\n");
+        return TPM_FAIL;
+    }
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+tpm12_sha1(unsigned char *digest, const void *data1, size_t len1,
+           const void *data2, size_t len2)
+{
+    gnutls_hash_hd_t hd;
+
+    if (gnutls_hash_init(&hd, GNUTLS_DIG_SHA1) < 0)
+        return TPM_FAIL;
+    gnutls_hash(hd, data1, len1);
+    if (data2)
+        gnutls_hash(hd, data2, len2);
+    gnutls_hash_deinit(hd, digest);
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * The HMAC authorizing a command or a response:
+ * HMAC(key, paramdigest || nonceEven || nonceOdd || continueAuthSession)
+ */
+static TPM_RESULT
+tpm12_auth_hmac(unsigned char *hmac, const struct tpm12_session *session,
+                const unsigned char *paramdigest,
+                const unsigned char *nonce_even, uint8_t cont)
+{
+    gnutls_hmac_hd_t hd;
+
+    if (gnutls_hmac_init(&hd, GNUTLS_MAC_SHA1, session->key,
+                         sizeof(session->key)) < 0)
+        return TPM_FAIL;
+    gnutls_hmac(hd, paramdigest, TPM12_DIGEST_SIZE);
+    gnutls_hmac(hd, nonce_even, TPM12_NONCE_SIZE);
+    gnutls_hmac(hd, session->nonce_odd, TPM12_NONCE_SIZE);
+    gnutls_hmac(hd, &cont, 1);
+    gnutls_hmac_deinit(hd, hmac);
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+tpm12_oiap(struct tpm12_session *session, const unsigned char *secret)
+{
+    struct tpm12_buffer cmd, resp;
+    TPM_RESULT rc;
+
+    command_start(&cmd, TPM_TAG_RQU_COMMAND, TPM_ORD_OIAP);
+
+    rc = tpm12_command("TPM_OIAP", &cmd, &resp,
+                       TPM12_HEADER_SIZE + 4 + TPM12_NONCE_SIZE);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    session->handle = get_u32(&resp.data[10]);
+    memcpy(session->nonce_even, &resp.data[14], TPM12_NONCE_SIZE);
+    memcpy(session->key, secret, sizeof(session->key));
+
+    return TPM_SUCCESS;
+}
+
+/* an OSAP session for the owner; the shared secret is derived from 'secret' */
+static TPM_RESULT
+tpm12_osap_owner(struct tpm12_session *session, const unsigned char *secret)
+{
+    struct tpm12_buffer cmd, resp;
+    unsigned char nonce_odd_osap[TPM12_NONCE_SIZE];
+    const unsigned char *nonce_even_osap;
+    gnutls_hmac_hd_t hd;
+    TPM_RESULT rc;
+
+    rc = tpm12_random(nonce_odd_osap, sizeof(nonce_odd_osap));
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    command_start(&cmd, TPM_TAG_RQU_COMMAND, TPM_ORD_OSAP);
+    put_u16(&cmd, TPM_ET_OWNER);
+    put_u32(&cmd, TPM_KH_OWNER);
+    put_bytes(&cmd, nonce_odd_osap, sizeof(nonce_odd_osap));
+
+    rc = tpm12_command("TPM_OSAP", &cmd, &resp,
+                       TPM12_HEADER_SIZE + 4 + 2 * TPM12_NONCE_SIZE);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    session->handle = get_u32(&resp.data[10]);
+    memcpy(session->nonce_even, &resp.data[14], TPM12_NONCE_SIZE);
+    nonce_even_osap = &resp.data[14 + TPM12_NONCE_SIZE];
+
+    /* sharedSecret = HMAC(secret, nonceEvenOSAP || nonceOddOSAP) */
+    if (gnutls_hmac_init(&hd, GNUTLS_MAC_SHA1, secret,
+                         TPM12_DIGEST_SIZE) < 0)
+        return TPM_FAIL;
+    gnutls_hmac(hd, nonce_even_osap, TPM12_NONCE_SIZE);
+    gnutls_hmac(hd, nonce_odd_osap, TPM12_NONCE_SIZE);
+    gnutls_hmac_deinit(hd, session->key);
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * Authorize the command in 'cmd', which holds the command up to its last
+ * parameter, with 'session', send it and verify the HMAC of the response.
+ * All the parameters following the ordinal are part of the parameter
+ * digest since none of the commands sent here has handles. The session is
+ * not continued. 'min_size' is the minimum size of the response's
+ * parameters.
+ */
+static TPM_RESULT
+tpm12_auth1_command(const char *name, struct tpm12_buffer *cmd,
+                    struct tpm12_session *session,
+                    struct tpm12_buffer *resp, uint32_t min_size)
+{
+    unsigned char digest[TPM12_DIGEST_SIZE], hmac[TPM12_DIGEST_SIZE];
+    const unsigned char *rauth;
+    const uint8_t cont = 0;
+    gnutls_hash_hd_t hd;
+    TPM_RESULT rc;
+
+    rc = tpm12_random(session->nonce_odd, sizeof(session->nonce_odd));
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    /* inParamDigest = SHA1(ordinal || parameters) */
+    rc = tpm12_sha1(digest, &cmd->data[6], cmd->size - 6, NULL, 0);
+    if (rc == TPM_SUCCESS)
+        rc = tpm12_auth_hmac(hmac, session, digest, session->nonce_even,
+                             cont);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    put_u32(cmd, session->handle);
+    put_bytes(cmd, session->nonce_odd, sizeof(session->nonce_odd));
+    put_u8(cmd, cont);
+    put_bytes(cmd, hmac, sizeof(hmac));
+
+    rc = tpm12_command(name, cmd, resp,
+                       TPM12_HEADER_SIZE + min_size + TPM12_RESP_AUTH1_SIZE);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    /* outParamDigest = SHA1(returnCode || ordinal || parameters) */
+    if (gnutls_hash_init(&hd, GNUTLS_DIG_SHA1) < 0)
+        return TPM_FAIL;
+    gnutls_hash(hd, &resp->data[6], 4);
+    gnutls_hash(hd, &cmd->data[6], 4);
+    gnutls_hash(hd, &resp->data[TPM12_HEADER_SIZE],
+                resp->size - TPM12_HEADER_SIZE - TPM12_RESP_AUTH1_SIZE);
+    gnutls_hash_deinit(hd, digest);
+
+    rauth = &resp->data[resp->size - TPM12_RESP_AUTH1_SIZE];
+    rc = tpm12_auth_hmac(hmac, session, digest, rauth,
+                         rauth[TPM12_NONCE_SIZE]);
+    if (rc != TPM_SUCCESS)
+        return rc;
+    if (memcmp(hmac, &rauth[TPM12_NONCE_SIZE + 1], sizeof(hmac))) {
+        logprintf(STDERR_FILENO,
+                  "Error: The response to %s could not be authenticated.\n",
+                  name);
+        return TPM_AUTHFAIL;
+    }
+
+    return TPM_SUCCESS;
+}
+
+/* the public EK with the default exponent as an OpenSSL key */
+static EVP_PKEY *
+tpm12_ek_pkey(const unsigned char *modulus)
+{
+    EVP_PKEY *pkey = NULL;
+    BIGNUM *n, *e;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM_BLD *bld = NULL;
+    OSSL_PARAM *params = NULL;
+    EVP_PKEY_CTX *ctx = NULL;
+#else
+    RSA *rsa = NULL;
+#endif
+
+    n = BN_bin2bn(modulus, TPM12_EK_MODULUS_SIZE, NULL);
+    e = BN_new();
+    if (!n || !e || !BN_set_word(e, 65537))
+        goto error;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    bld = OSSL_PARAM_BLD_new();
+    if (!bld ||
+        !OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, n) ||
+        !OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, e))
+        goto error;
+    params = OSSL_PARAM_BLD_to_param(bld);
+    ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL);
+    if (!params || !ctx ||
+        EVP_PKEY_fromdata_init(ctx) <= 0 ||
+        EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params) <= 0)
+        pkey = NULL;
+#else
+    rsa = RSA_new();
+    if (!rsa || !RSA_set0_key(rsa, n, e, NULL))
+        goto error;
+    /* the key owns n and e now */
+    n = e = NULL;
+    pkey = EVP_PKEY_new();
+    if (pkey && !EVP_PKEY_assign_RSA(pkey, rsa)) {
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    }
+    if (pkey)
+        rsa = NULL;
+#endif
+
+error:
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_PKEY_CTX_free(ctx);
+    OSSL_PARAM_free(params);
+    OSSL_PARAM_BLD_free(bld);
+#else
+    RSA_free(rsa);
+#endif
+    BN_free(n);
+    BN_free(e);
+
+    return pkey;
+}
+
+/*
+ * Encrypt authorization data with the public EK using RSAES-OAEP with
+ * SHA-1, MGF1 and the label 'TCPA' as TPM_TakeOwnership requires; the EK
+ * has the default public exponent.
+ */
+static TPM_RESULT
+tpm12_ek_encrypt(unsigned char *out, const unsigned char *modulus,
+                 const unsigned char *data, size_t len)
+{
+    TPM_RESULT rc = TPM_FAIL;
+    size_t outlen = TPM12_EK_MODULUS_SIZE;
+    EVP_PKEY_CTX *ctx = NULL;
+    unsigned char *label;
+    EVP_PKEY *pkey;
+
+    pkey = tpm12_ek_pkey(modulus);
+    if (pkey)
+        ctx = EVP_PKEY_CTX_new(pkey, NULL);
+    if (!ctx ||
+        EVP_PKEY_encrypt_init(ctx) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_oaep_md(ctx, EVP_sha1()) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, EVP_sha1()) <= 0)
+        goto error;
+
+    /* the context takes over the label */
+    label = OPENSSL_malloc(4);
+    if (!label)
+        goto error;
+    memcpy(label, "TCPA", 4);
+    if (EVP_PKEY_CTX_set0_rsa_oaep_label(ctx, label, 4) <= 0) {
+        OPENSSL_free(label);
+        goto error;
+    }
+
+    if (EVP_PKEY_encrypt(ctx, out, &outlen, data, len) > 0 &&
+        outlen == TPM12_EK_MODULUS_SIZE)
+        rc = TPM_SUCCESS;
+
+error:
+    if (rc != TPM_SUCCESS)
+        logprintf(STDERR_FILENO,
+                  "Error: Could not encrypt with the EK.\n");
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+
+    return rc;
+}
+
+/* TPM_KEY_PARMS of a 2048 bit RSA key with the default exponent */
+static void
+put_rsa_key_parms(struct tpm12_buffer *buf)
+{
+    put_u32(buf, TPM_ALG_RSA);
+    put_u16(buf, TPM_ES_RSAESOAEP_SHA1_MGF1);
+    put_u16(buf, TPM_SS_NONE);
+    put_u32(buf, 12);                           /* parmSize */
+    put_u32(buf, TPM12_EK_MODULUS_SIZE * 8);    /* keyLength */
+    put_u32(buf, 2);                            /* numPrimes */
+    put_u32(buf, 0);                            /* exponentSize */
+}
+
+/* TPM_PCR_INFO_SHORT selecting no PCRs */
+static void
+put_pcr_info_short(struct tpm12_buffer *buf)
+{
+    static const unsigned char zeroes[TPM12_DIGEST_SIZE];
+
+    put_u16(buf, 3);                            /* sizeOfSelect */
+    put_bytes(buf, zeroes, 3);                  /* pcrSelect */
+    put_u8(buf, TPM_LOC_ALL);                   /* localityAtRelease */
+    put_bytes(buf, zeroes, sizeof(zeroes));     /* digestAtRelease */
+}
+
+/* TPM_NV_DATA_PUBLIC */
+static void
+put_nv_data_public(struct tpm12_buffer *buf, uint32_t nvindex,
+                   uint32_t attributes, uint32_t size)
+{
+    put_u16(buf, TPM_TAG_NV_DATA_PUBLIC);
+    put_u32(buf, nvindex);
+    put_pcr_info_short(buf);                    /* pcrInfoRead */
+    put_pcr_info_short(buf);                    /* pcrInfoWrite */
+    put_u16(buf, TPM_TAG_NV_ATTRIBUTES);
+    put_u32(buf, attributes);
+    put_u8(buf, 0);                             /* bReadSTClear */
+    put_u8(buf, 0);                             /* bWriteSTClear */
+    put_u8(buf, 0);                             /* bWriteDefine */
+    put_u32(buf, size);
+}
+
+/*
+ * Have the TPM create a 2048 bit RSA EK and return its modulus, which
+ * must have room for TPM12_EK_MODULUS_SIZE bytes.
+ */
+TPM_RESULT
+SWTPM_Setup_CreateEK(unsigned char *modulus)
+{
+    static const unsigned char exponent[] = { 0x01, 0x00, 0x01 };
+    unsigned char antireplay[TPM12_NONCE_SIZE], digest[TPM12_DIGEST_SIZE];
+    struct tpm12_buffer cmd, resp;
+    uint32_t parmsize, expsize, keyoff, pubkeysize;
+    const unsigned char *p;
+    TPM_RESULT rc;
+
+    rc = tpm12_random(antireplay, sizeof(antireplay));
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    command_start(&cmd, TPM_TAG_RQU_COMMAND,
+                  TPM_ORD_CreateEndorsementKeyPair);
+    put_bytes(&cmd, antireplay, sizeof(antireplay));
+    put_rsa_key_parms(&cmd);
+
+    rc = tpm12_command("TPM_CreateEndorsementKeyPair", &cmd, &resp,
+                       TPM12_HEADER_SIZE + 24 + 4 + TPM12_EK_MODULUS_SIZE +
+                       TPM12_DIGEST_SIZE);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    /* TPM_PUBKEY: TPM_KEY_PARMS followed by TPM_STORE_PUBKEY */
+    p = &resp.data[TPM12_HEADER_SIZE];
+    parmsize = get_u32(&p[8]);
+    expsize = parmsize >= 12 ? get_u32(&p[12 + 8]) : 0;
+    keyoff = 12 + parmsize;
+    if (parmsize < 12 || parmsize != 12 + expsize ||
+        (expsize != 0 && (expsize != sizeof(exponent) ||
+                          memcmp(&p[12 + 12], exponent, expsize))) ||
+        TPM12_HEADER_SIZE + keyoff + 4 + TPM12_EK_MODULUS_SIZE +
+            TPM12_DIGEST_SIZE != resp.size ||
+        get_u32(&p[keyoff]) != TPM12_EK_MODULUS_SIZE) {
+        logprintf(STDERR_FILENO,
+                  "Error: The TPM returned an unexpected EK.\n");
+        return TPM_FAIL;
+    }
+    pubkeysize = keyoff + 4 + TPM12_EK_MODULUS_SIZE;
+
+    /* checksum = SHA1(pubEndorsementKey || antiReplay) */
+    rc = tpm12_sha1(digest, p, pubkeysize, antireplay, sizeof(antireplay));
+    if (rc != TPM_SUCCESS)
+        return rc;
+    if (memcmp(digest, &p[pubkeysize], sizeof(digest))) {
+        logprintf(STDERR_FILENO,
+                  "Error: The checksum of the EK is wrong.\n");
+        return TPM_FAIL;
+    }
+
+    memcpy(modulus, &p[keyoff + 4], TPM12_EK_MODULUS_SIZE);
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * Take ownership of the TPM with the given owner and SRK authorization
+ * data of TPM12_DIGEST_SIZE bytes each.
+ */
+TPM_RESULT
+SWTPM_Setup_TakeOwnership(const unsigned char *ek_modulus,
+                          const unsigned char *ownerauth,
+                          const unsigned char *srkauth)
+{
+    unsigned char encownerauth[TPM12_EK_MODULUS_SIZE];
+    unsigned char encsrkauth[TPM12_EK_MODULUS_SIZE];
+    struct tpm12_session session;
+    struct tpm12_buffer cmd, resp;
+    TPM_RESULT rc;
+
+    rc = tpm12_ek_encrypt(encownerauth, ek_modulus, ownerauth,
+                          TPM12_DIGEST_SIZE);
+    if (rc == TPM_SUCCESS)
+        rc = tpm12_ek_encrypt(encsrkauth, ek_modulus, srkauth,
+                              TPM12_DIGEST_SIZE);
+    if (rc == TPM_SUCCESS)
+        rc = tpm12_oiap(&session, ownerauth);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    command_start(&cmd, TPM_TAG_RQU_AUTH1_COMMAND, TPM_ORD_TakeOwnership);
+    put_u16(&cmd, TPM_PID_OWNER);
+    put_u32(&cmd, sizeof(encownerauth));
+    put_bytes(&cmd, encownerauth, sizeof(encownerauth));
+    put_u32(&cmd, sizeof(encsrkauth));
+    put_bytes(&cmd, encsrkauth, sizeof(encsrkauth));
+
+    /* srkParams: a TPM_KEY of version 1.1 */
+    put_u32(&cmd, 0x01010000);                  /* ver */
+    put_u16(&cmd, TPM_KEY_STORAGE);             /* keyUsage */
+    put_u32(&cmd, 0);                           /* keyFlags */
+    put_u8(&cmd, TPM_AUTH_ALWAYS);              /* authDataUsage */
+    put_rsa_key_parms(&cmd);
+    put_u32(&cmd, 0);                           /* PCRInfoSize */
+    put_u32(&cmd, 0);                           /* pubKey.keyLength */
+    put_u32(&cmd, 0);                           /* encSize */
+
+    return tpm12_auth1_command("TPM_TakeOwnership", &cmd, &session, &resp,
+                               0);
+}
+
+/*
+ * Define an NVRAM area with the owner's authorization; the area has no
+ * authorization data of its own.
+ */
+TPM_RESULT
+SWTPM_Setup_NVDefineSpace(const unsigned char *ownerauth, uint32_t nvindex,
+                          uint32_t attributes, uint32_t size)
+{
+    unsigned char encauth[TPM12_DIGEST_SIZE];
+    struct tpm12_session session;
+    struct tpm12_buffer cmd, resp;
+    TPM_RESULT rc;
+
+    rc = tpm12_osap_owner(&session, ownerauth);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    /*
+     * encAuth = areaAuth XOR SHA1(sharedSecret || nonceEven) where
+     * areaAuth is all zeroes
+     */
+    rc = tpm12_sha1(encauth, session.key, sizeof(session.key),
+                    session.nonce_even, sizeof(session.nonce_even));
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    command_start(&cmd, TPM_TAG_RQU_AUTH1_COMMAND, TPM_ORD_NV_DefineSpace);
+    put_nv_data_public(&cmd, nvindex, attributes, size);
+    put_bytes(&cmd, encauth, sizeof(encauth));
+
+    return tpm12_auth1_command("TPM_NV_DefineSpace", &cmd, &session, &resp,
+                               0);
+}
+
+/* Write 'data' into an NVRAM area with the owner's authorization. */
+TPM_RESULT
+SWTPM_Setup_NVWrite(const unsigned char *ownerauth, uint32_t nvindex,
+                    const unsigned char *data, uint32_t size)
+{
+    struct tpm12_session session;
+    struct tpm12_buffer cmd, resp;
+    uint32_t offset, len;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    for (offset = 0; rc == TPM_SUCCESS && offset < size; offset += len) {
+        len = size - offset;
+        if (len > TPM12_NV_CHUNK_SIZE)
+            len = TPM12_NV_CHUNK_SIZE;
+
+        rc = tpm12_oiap(&session, ownerauth);
+        if (rc != TPM_SUCCESS)
+            break;
+
+        command_start(&cmd, TPM_TAG_RQU_AUTH1_COMMAND,
+                      TPM_ORD_NV_WriteValue);
+        put_u32(&cmd, nvindex);
+        put_u32(&cmd, offset);
+        put_u32(&cmd, len);
+        put_bytes(&cmd, &data[offset], len);
+
+        rc = tpm12_auth1_command("TPM_NV_WriteValue", &cmd, &session,
+                                 &resp, 0);
+    }
+
+    return rc;
+}
+
+/* Read 'size' bytes of an NVRAM area with the owner's authorization. */
+TPM_RESULT
+SWTPM_Setup_NVRead(const unsigned char *ownerauth, uint32_t nvindex,
+                   unsigned char *data, uint32_t size)
+{
+    struct tpm12_session session;
+    struct tpm12_buffer cmd, resp;
+    uint32_t offset, len;
+    TPM_RESULT rc = TPM_SUCCESS;
+
+    for (offset = 0; rc == TPM_SUCCESS && offset < size; offset += len) {
+        len = size - offset;
+        if (len > TPM12_NV_CHUNK_SIZE)
+            len = TPM12_NV_CHUNK_SIZE;
+
+        rc = tpm12_oiap(&session, ownerauth);
+        if (rc != TPM_SUCCESS)
+            break;
+
+        command_start(&cmd, TPM_TAG_RQU_AUTH1_COMMAND,
+                      TPM_ORD_NV_ReadValue);
+        put_u32(&cmd, nvindex);
+        put_u32(&cmd, offset);
+        put_u32(&cmd, len);
+
+        rc = tpm12_auth1_command("TPM_NV_ReadValue", &cmd, &session,
+                                 &resp, 4 + len);
+        if (rc != TPM_SUCCESS)
+            break;
+        if (get_u32(&resp.data[TPM12_HEADER_SIZE]) != len) {
+            logprintf(STDERR_FILENO,
+                      "Error: TPM_NV_ReadValue returned too few bytes.\n");
+            rc = TPM_FAIL;
+            break;
+        }
+        memcpy(&data[offset], &resp.data[TPM12_HEADER_SIZE + 4], len);
+    }
+
+    return rc;
+}
+
+/* Lock the NVRAM so that access to NVRAM areas requires authorization. */
+TPM_RESULT
+SWTPM_Setup_NVLock(void)
+{
+    static const unsigned char encauth[TPM12_DIGEST_SIZE];
+    struct tpm12_buffer cmd, resp;
+
+    command_start(&cmd, TPM_TAG_RQU_COMMAND, TPM_ORD_NV_DefineSpace);
+    put_nv_data_public(&cmd, TPM12_NV_INDEX_LOCK, 0, 0);
+    put_bytes(&cmd, encauth, sizeof(encauth));
+
+    return tpm12_command("TPM_NV_DefineSpace", &cmd, &resp,
+                         TPM12_HEADER_SIZE);
+}
+
+/*
+ * Give up the ownership of the TPM; the TPM is disabled and deactivated
+ * afterwards.
+ */
+TPM_RESULT
+SWTPM_Setup_OwnerClear(const unsigned char *ownerauth)
+{
+    struct tpm12_session session;
+    struct tpm12_buffer cmd, resp;
+    TPM_RESULT rc;
+
+    rc = tpm12_oiap(&session, ownerauth);
+    if (rc != TPM_SUCCESS)
+        return rc;
+
+    command_start(&cmd, TPM_TAG_RQU_AUTH1_COMMAND, TPM_ORD_OwnerClear);
+
+    return tpm12_auth1_command("TPM_OwnerClear", &cmd, &session, &resp, 0);
+}
@@ -0,0 +1,80 @@
+/*
+ * swtpm_setup_tpm.h -- TPM 1.2 commands for manufacturing a TPM
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SWTPM_SETUP_TPM_H_
+#define _SWTPM_SETUP_TPM_H_
+
+#include <stdint.h>
+
+#include <libtpms/tpm_types.h>
+
+#define TPM12_DIGEST_SIZE 20
+
+/* the size of the modulus of the EK created by SWTPM_Setup_CreateEK */
+#define TPM12_EK_MODULUS_SIZE (2048 / 8)
+
+/* NVRAM indices and attributes */
+#define TPM12_NV_INDEX_D_BIT        0x10000000
+#define TPM12_NV_INDEX_EKCERT       0x0000f000
+#define TPM12_NV_INDEX_PLATFORMCERT 0x0000f002
+#define TPM12_NV_INDEX_LOCK         0xffffffff
+
+#define TPM12_NV_PER_OWNERREAD      0x00020000
+#define TPM12_NV_PER_OWNERWRITE     0x00000002
+
+/*
+ * The TPM's commands are sent to the TPM that libtpms runs in this
+ * process; an error code returned by the TPM is returned as it is.
+ */
+TPM_RESULT SWTPM_Setup_CreateEK(unsigned char *modulus);
+TPM_RESULT SWTPM_Setup_TakeOwnership(const unsigned char *ek_modulus,
+                                     const unsigned char *ownerauth,
+                                     const unsigned char *srkauth);
+TPM_RESULT SWTPM_Setup_NVDefineSpace(const unsigned char *ownerauth,
+                                     uint32_t nvindex,
+                                     uint32_t attributes,
+                                     uint32_t size);
+TPM_RESULT SWTPM_Setup_NVWrite(const unsigned char *ownerauth,
+                               uint32_t nvindex,
+                               const unsigned char *data,
+                               uint32_t size);
+TPM_RESULT SWTPM_Setup_NVRead(const unsigned char *ownerauth,
+                              uint32_t nvindex,
+                              unsigned char *data,
+                              uint32_t size);
+TPM_RESULT SWTPM_Setup_NVLock(void);
+TPM_RESULT SWTPM_Setup_OwnerClear(const unsigned char *ownerauth);
+
+#endif /* _SWTPM_SETUP_TPM_H_ */
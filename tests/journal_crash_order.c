@@ -0,0 +1,284 @@
+/*
+ * journal_crash_order.c -- Check the order in which the journal backend
+ *                          makes its compaction durable
+ *
+ * (c) Copyright the swtpm contributors 2026.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * Neither the names of the IBM Corporation nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A rename is only durable once the directory holding the file was synced.
+ * If the journal is truncated or replaced before the rename of the new base
+ * image is durable, a crash can leave the old base image next to the
+ * shortened journal and the records in between are lost.
+ *
+ * This program wraps renameat(), fsync() and ftruncate() as they are called
+ * by the journal backend and fails if
+ *  - the journal is truncated or replaced while the rename of the base
+ *    image is not yet followed by a sync of the state directory, or
+ *  - a rename is not followed by a sync of the state directory at all.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_memory.h>
+#include <libtpms/tpm_nvfilename.h>
+
+#include "swtpm_nvfile.h"
+#include "swtpm_nvstore.h"
+
+#define BLOB_SIZE       (16 * 1024)
+#define COMPACT_SLACK   (4 * 1024)
+/* how long to wait for the compactor, in 10ms steps */
+#define WAIT_STEPS      1000
+/* records to append at most until the compactor runs */
+#define MAX_STORES      100000
+
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+/* serializes the modifications of the blob with its stores */
+static pthread_mutex_t blob_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int renames_unsynced;
+static int base_unsynced;
+static unsigned int truncations, replacements, violations;
+/* store a record while the base image is being written */
+static int store_during_compaction;
+static unsigned char blob[BLOB_SIZE];
+
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), slen = strlen(suffix);
+
+    return len >= slen && !strcmp(&name[len - slen], suffix);
+}
+
+static void violation(const char *msg)
+{
+    fprintf(stderr, "Crash ordering violated: %s\n", msg);
+    violations++;
+}
+
+static TPM_RESULT store_blob(uint32_t offset)
+{
+    TPM_RESULT rc;
+
+    pthread_mutex_lock(&blob_lock);
+    blob[offset % sizeof(blob)]++;
+    rc = nvram_journal_ops.store(blob, sizeof(blob), 0,
+                                 TPM_PERMANENT_ALL_NAME);
+    pthread_mutex_unlock(&blob_lock);
+
+    return rc;
+}
+
+int renameat(int olddirfd, const char *oldpath,
+             int newdirfd, const char *newpath)
+{
+    int ret, inject = 0;
+
+#ifdef SYS_renameat
+    ret = syscall(SYS_renameat, olddirfd, oldpath, newdirfd, newpath);
+#else
+    ret = syscall(SYS_renameat2, olddirfd, oldpath, newdirfd, newpath, 0);
+#endif
+    if (ret < 0)
+        return ret;
+
+    pthread_mutex_lock(&order_lock);
+    renames_unsynced++;
+    if (has_suffix(newpath, ".base")) {
+        base_unsynced = 1;
+        inject = store_during_compaction;
+        store_during_compaction = 0;
+    } else if (has_suffix(newpath, ".journal")) {
+        replacements++;
+        if (base_unsynced)
+            violation("journal replaced before the base image was synced");
+    }
+    pthread_mutex_unlock(&order_lock);
+
+    /* the journal now has a tail that compaction must keep */
+    if (inject && store_blob(0) != TPM_SUCCESS) {
+        pthread_mutex_lock(&order_lock);
+        violation("store during compaction failed");
+        pthread_mutex_unlock(&order_lock);
+    }
+
+    return ret;
+}
+
+int fsync(int fd)
+{
+    struct stat st;
+    int ret = syscall(SYS_fsync, fd);
+
+    if (ret == 0 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        pthread_mutex_lock(&order_lock);
+        renames_unsynced = 0;
+        base_unsynced = 0;
+        pthread_mutex_unlock(&order_lock);
+    }
+    return ret;
+}
+
+int ftruncate(int fd, off_t length)
+{
+    pthread_mutex_lock(&order_lock);
+    truncations++;
+    if (base_unsynced)
+        violation("journal truncated before the base image was synced");
+    pthread_mutex_unlock(&order_lock);
+
+    return syscall(SYS_ftruncate, fd, length);
+}
+
+static int rm_visit(const char *fpath, const struct stat *sb,
+                    int typeflag, struct FTW *ftwbuf)
+{
+    (void)sb;
+    (void)typeflag;
+    (void)ftwbuf;
+
+    return remove(fpath);
+}
+
+/*
+ * wait_compaction: wait until the compactor finished after 'compactions'
+ *                  compactions; with 'store' set records are appended
+ *                  until it ran
+ */
+static int wait_compaction(uint64_t compactions, int store)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+    struct swtpm_journal_stats stats;
+    unsigned int i;
+
+    SWTPM_NVRAM_Journal_Get_Stats(&stats);
+    for (i = 0; store && i < MAX_STORES &&
+                stats.compactions == compactions; i++) {
+        if (store_blob(i) != TPM_SUCCESS)
+            return -1;
+        SWTPM_NVRAM_Journal_Get_Stats(&stats);
+    }
+
+    for (i = 0; i < WAIT_STEPS && stats.compactions == compactions; i++) {
+        nanosleep(&ts, NULL);
+        SWTPM_NVRAM_Journal_Get_Stats(&stats);
+    }
+    if (stats.compactions == compactions) {
+        fprintf(stderr, "The journal was not compacted.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    char basedir[] = "/tmp/swtpm-journal-XXXXXX";
+    unsigned char *data = NULL;
+    uint32_t length = 0;
+    struct swtpm_journal_stats stats;
+    int ret = EXIT_FAILURE;
+
+    if (!mkdtemp(basedir)) {
+        fprintf(stderr, "Could not create directory: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    SWTPM_NVRAM_Journal_Set_CompactSlack(COMPACT_SLACK);
+    if (SWTPM_NVRAM_Set_StateDir(basedir) != TPM_SUCCESS ||
+        nvram_journal_ops.init(0) != TPM_SUCCESS ||
+        store_blob(0) != TPM_SUCCESS)
+        goto cleanup;
+
+    /*
+     * The first record exceeds the slack of the empty base image; without
+     * further stores the whole journal is folded into the base image and
+     * truncated.
+     */
+    if (wait_compaction(0, 0) < 0)
+        goto cleanup;
+
+    /* a record arrives while the base image is written */
+    pthread_mutex_lock(&order_lock);
+    store_during_compaction = 1;
+    pthread_mutex_unlock(&order_lock);
+    SWTPM_NVRAM_Journal_Get_Stats(&stats);
+    if (wait_compaction(stats.compactions, 1) < 0)
+        goto cleanup;
+
+    if (nvram_journal_ops.shutdown(0) != TPM_SUCCESS)
+        goto cleanup;
+
+    pthread_mutex_lock(&order_lock);
+    if (renames_unsynced)
+        violation("a rename was not followed by a sync of the directory");
+    if (truncations == 0 || replacements == 0)
+        fprintf(stderr, "The journal was truncated %u and replaced %u "
+                "times; both paths must be taken.\n",
+                truncations, replacements);
+    else if (violations == 0)
+        ret = EXIT_SUCCESS;
+    pthread_mutex_unlock(&order_lock);
+
+    /* the state must have survived the compactions */
+    if (ret == EXIT_SUCCESS &&
+        (nvram_journal_ops.init(0) != TPM_SUCCESS ||
+         nvram_journal_ops.load(&data, &length, 0,
+                                TPM_PERMANENT_ALL_NAME) != TPM_SUCCESS ||
+         length != sizeof(blob) || memcmp(data, blob, length))) {
+        fprintf(stderr, "The state was not restored after compaction.\n");
+        ret = EXIT_FAILURE;
+    }
+    TPM_Free(data);
+
+cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, "Test failed.\n");
+    nftw(basedir, rm_visit, 16, FTW_DEPTH | FTW_PHYS);
+
+    return ret;
+}